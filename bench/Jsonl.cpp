@@ -0,0 +1,196 @@
+#include "Jsonl.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+struct Reader {
+    const std::string& text;
+    size_t pos;
+    std::string error;
+
+    Reader(const std::string& _text) : text(_text), pos(0) {}
+
+    void skipSpace() {
+        while (pos < text.length() && (text[pos] == ' ' || text[pos] == '\t' ||
+                                       text[pos] == '\r' || text[pos] == '\n'))
+            pos++;
+    }
+
+    bool expect(char c) {
+        skipSpace();
+        if (pos < text.length() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        char message[64];
+        std::snprintf(message, sizeof(message), "expected '%c' at column %lu", c,
+                      static_cast<unsigned long>(pos + 1));
+        error = message;
+        return false;
+    }
+
+    static void appendUtf8(std::string& out, unsigned long code) {
+        if (code < 0x80)
+            out += static_cast<char>(code);
+        else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool string(std::string& out) {
+        if (!expect('"'))
+            return false;
+        out.clear();
+        while (pos < text.length() && text[pos] != '"') {
+            char c = text[pos++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.length())
+                break;
+            char escaped = text[pos++];
+            switch (escaped) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (pos + 4 > text.length()) {
+                        error = "truncated \\u escape";
+                        return false;
+                    }
+                    appendUtf8(out, std::strtoul(text.substr(pos, 4).c_str(), NULL, 16));
+                    pos += 4;
+                    break;
+                }
+                default: out += escaped; break;
+            }
+        }
+        if (pos >= text.length()) {
+            error = "unterminated string";
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    // A number, true, false or null, as written.
+    bool scalar(std::string& out) {
+        skipSpace();
+        size_t start = pos;
+        while (pos < text.length() && text[pos] != ',' && text[pos] != '}' &&
+               text[pos] != ' ' && text[pos] != '\t')
+            pos++;
+        out = text.substr(start, pos - start);
+        if (out.empty()) {
+            error = "missing value";
+            return false;
+        }
+        if (out == "null")
+            out.clear();
+        return true;
+    }
+
+    bool object(Jsonl::Fields& fields, const std::string& prefix, bool nested) {
+        if (!expect('{'))
+            return false;
+        skipSpace();
+        if (pos < text.length() && text[pos] == '}') {
+            pos++;
+            return true;
+        }
+        while (true) {
+            std::string key;
+            if (!string(key) || !expect(':'))
+                return false;
+            skipSpace();
+            if (pos >= text.length()) {
+                error = "missing value for " + key;
+                return false;
+            }
+            if (text[pos] == '{') {
+                if (nested) {
+                    error = "objects nest one level deep at most";
+                    return false;
+                }
+                if (!object(fields, prefix + key + ".", true))
+                    return false;
+            }
+            else if (text[pos] == '"') {
+                if (!string(fields[prefix + key]))
+                    return false;
+            }
+            else if (text[pos] == '[') {
+                error = "arrays are not supported (" + key + ")";
+                return false;
+            }
+            else if (!scalar(fields[prefix + key]))
+                return false;
+            skipSpace();
+            if (pos < text.length() && text[pos] == ',') {
+                pos++;
+                continue;
+            }
+            return expect('}');
+        }
+    }
+};
+
+}
+
+bool Jsonl::parse(const std::string& line, Fields& fields, std::string& error) {
+    Reader reader(line);
+    fields.clear();
+    if (!reader.object(fields, "", false)) {
+        error = reader.error;
+        return false;
+    }
+    reader.skipSpace();
+    if (reader.pos != line.length()) {
+        error = "trailing characters after the object";
+        return false;
+    }
+    return true;
+}
+
+std::string Jsonl::quote(const std::string& text) {
+    std::string out = "\"";
+    for (size_t i = 0; i < text.length(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+            out += "\\n";
+        else if (c == '\r')
+            out += "\\r";
+        else if (c == '\t')
+            out += "\\t";
+        else if (c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+Jsonl::Fields Jsonl::section(const Fields& fields, const std::string& prefix) {
+    Fields out;
+    for (Fields::const_iterator it = fields.lower_bound(prefix);
+         it != fields.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it)
+        out[it->first.substr(prefix.length())] = it->second;
+    return out;
+}
@@ -0,0 +1,21 @@
+#ifndef JSONL_HPP
+#define JSONL_HPP
+
+#include <map>
+#include <string>
+
+// Just enough JSON for the bench tools' JSONL files: one object per line
+// whose values are strings, numbers, booleans or null, or objects of those
+// one level deep, flattened to "outer.inner" keys. Values are kept as text
+// (strings unescaped, null as empty).
+class Jsonl {
+public:
+    typedef std::map<std::string, std::string> Fields;
+
+    static bool parse(const std::string& line, Fields& fields, std::string& error);
+    static std::string quote(const std::string& text);
+    // Fields starting with prefix ("headers."), with the prefix removed.
+    static Fields section(const Fields& fields, const std::string& prefix);
+};
+
+#endif
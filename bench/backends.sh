@@ -0,0 +1,25 @@
+#!/bin/sh
+# Compares the event backends on the static-file and small-response
+# workloads: for each backend, a server on bench/bench.conf, then
+# webserv-bench on a 257k file and on a 354-byte page, with the event loop's
+# syscalls per request from the server's metrics.
+#
+# usage: bench/backends.sh [duration] (10s), from the repository root after
+# make webserv webserv-bench
+duration=${1:-10s}
+config=$(mktemp /tmp/webserv-backends.XXXXXX)
+trap 'rm -f "$config"' EXIT
+
+for backend in epoll io_uring; do
+    sed "s/^event_backend .*;/event_backend $backend;/" bench/bench.conf > "$config"
+    ./webserv "$config" > /dev/null 2>&1 &
+    server=$!
+    sleep 1
+    for path in /static/media/audio.mp3 /form.html; do
+        echo "== $backend $path"
+        ./webserv-bench -c 64 -t 2 -d "$duration" --metrics /metrics "http://127.0.0.1:8090$path" |
+            grep -E '^  (requests|errors|server)|p50'
+    done
+    kill "$server"
+    wait "$server"
+done
@@ -0,0 +1,15 @@
+import os
+import sys
+
+# Reads the whole body in pieces and drops it, for upload stress runs.
+remaining = int(os.environ.get('CONTENT_LENGTH') or 0)
+received = 0
+while remaining > 0:
+    chunk = sys.stdin.buffer.read(min(remaining, 65536))
+    if not chunk:
+        break
+    received += len(chunk)
+    remaining -= len(chunk)
+print("Content-Type: text/plain")
+print()
+print(received)
@@ -0,0 +1,7 @@
+import time
+
+# Outlives the server's 30 second CGI timeout.
+time.sleep(40)
+print("Content-Type: text/plain")
+print()
+print("late")
@@ -0,0 +1,142 @@
+// Spawn-to-first-byte for a Python CGI: posix_spawn of the interpreter (the
+// executeCGI path) against a fork from the warm zygote (cgi_zygote). Timed
+// from just before the launch until the first byte of output is read from
+// the script's stdout pipe, which is what a client waits for.
+//
+// usage: ./cgi_first_byte_bench [iterations] [script] [interpreter] [zygote]
+
+#include "../server/Zygote.hpp"
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+static double nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static std::vector<std::string> makeEnv(const std::string& script) {
+    std::vector<std::string> env;
+    env.push_back("GATEWAY_INTERFACE=CGI/1.0");
+    env.push_back("SERVER_PROTOCOL=HTTP/1.1");
+    env.push_back("SCRIPT_NAME=" + script);
+    env.push_back("REQUEST_METHOD=GET");
+    env.push_back("QUERY_STRING=name=bench");
+    env.push_back("SERVER_NAME=localhost");
+    return env;
+}
+
+// Reads the child's output until EOF, returns the time of the first byte.
+static double drain(int fd, double start) {
+    double first = -1;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        if (first < 0)
+            first = nowUs() - start;
+    return first;
+}
+
+static double launchSpawn(const std::string& interpreter, const std::string& script) {
+    std::vector<std::string> env = makeEnv(script);
+    std::vector<char*> envp;
+    for (size_t i = 0; i < env.size(); i++)
+        envp.push_back(const_cast<char*>(env[i].c_str()));
+    envp.push_back(NULL);
+    char* argv[] = { const_cast<char*>(interpreter.c_str()), const_cast<char*>(script.c_str()), NULL };
+
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+        return -1;
+    double start = nowUs();
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], &actions, NULL, argv, &envp[0]);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(in[1]);
+    close(out[1]);
+    double first = (err == 0) ? drain(out[0], start) : -1;
+    close(out[0]);
+    if (err == 0)
+        waitpid(pid, NULL, 0);
+    return first;
+}
+
+static double launchZygote(Zygote& zygote, const std::string& script) {
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+        return -1;
+    double start = nowUs();
+    pid_t pid = -1;
+    if (zygote.send(script, makeEnv(script), in[0], out[1])) {
+        struct pollfd pfd;
+        pfd.fd = zygote.getFd();
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 2000) != 1 || !zygote.receive(pid))
+            pid = -1;
+    }
+    close(in[0]);
+    close(in[1]);
+    close(out[1]);
+    double first = (pid > 0) ? drain(out[0], start) : -1;
+    close(out[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return first;
+}
+
+static void report(const char* name, std::vector<double>& samples) {
+    std::sort(samples.begin(), samples.end());
+    if (samples.empty() || samples[0] < 0) {
+        std::printf("%-12s failed\n", name);
+        return;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+        sum += samples[i];
+    std::printf("%-12s mean=%8.1fus  p50=%8.1fus  p99=%8.1fus\n", name, sum / samples.size(),
+                samples[samples.size() / 2], samples[samples.size() * 99 / 100]);
+}
+
+int main(int argc, char** argv) {
+    int iterations = (argc > 1) ? std::atoi(argv[1]) : 100;
+    std::string script = (argc > 2) ? argv[2] : "www/cgi-bin/hello-cgi.py";
+    std::string interpreter = (argc > 3) ? argv[3] : "/usr/bin/python3";
+    std::string zygote_script = (argc > 4) ? argv[4] : "cgi/zygote.py";
+
+    if (iterations < 1)
+        iterations = 1;
+    Zygote zygote(interpreter, zygote_script);
+    if (!zygote.start()) {
+        std::perror("zygote");
+        return 1;
+    }
+    // The first spawn also waits for the zygote's own start-up.
+    launchZygote(zygote, script);
+
+    std::vector<double> spawn_samples;
+    std::vector<double> zygote_samples;
+    for (int i = 0; i < iterations; i++) {
+        spawn_samples.push_back(launchSpawn(interpreter, script));
+        zygote_samples.push_back(launchZygote(zygote, script));
+    }
+    report("posix_spawn", spawn_samples);
+    report("zygote", zygote_samples);
+    return 0;
+}
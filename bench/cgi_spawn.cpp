@@ -0,0 +1,128 @@
+// CGI launch latency: fork+execve (the old executeCGI path, env built in the
+// child) against posix_spawn with argv/envp prepared in the parent, measured
+// while the process holds an increasing amount of touched memory.
+//
+// usage: ./cgi_spawn_bench [iterations] [program]
+
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+extern char** environ;
+
+static double nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static std::vector<std::string> makeEnv() {
+    std::vector<std::string> env;
+    env.push_back("GATEWAY_INTERFACE=CGI/1.0");
+    env.push_back("SERVER_PROTOCOL=HTTP/1.1");
+    env.push_back("SCRIPT_NAME=/cgi-bin/hello-cgi.py");
+    env.push_back("REQUEST_METHOD=GET");
+    env.push_back("QUERY_STRING=name=bench");
+    env.push_back("SERVER_NAME=localhost");
+    return env;
+}
+
+static char** toCharArray(const std::vector<std::string>& vec) {
+    char** arr = new char*[vec.size() + 1];
+    for (size_t i = 0; i < vec.size(); ++i) {
+        arr[i] = new char[vec[i].length() + 1];
+        std::strcpy(arr[i], vec[i].c_str());
+    }
+    arr[vec.size()] = NULL;
+    return arr;
+}
+
+static void freeCharArray(char** arr) {
+    for (size_t i = 0; arr[i] != NULL; ++i)
+        delete[] arr[i];
+    delete[] arr;
+}
+
+// Time until the child has been created and exec'd, which is what the event
+// loop pays for; the wait for the child to finish is not counted.
+static double launchFork(const char* program) {
+    double start = nowUs();
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<std::string> env = makeEnv();
+        char** envp = toCharArray(env);
+        char* argv[] = { const_cast<char*>(program), NULL };
+        execve(program, argv, envp);
+        _exit(127);
+    }
+    double elapsed = nowUs() - start;
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+static double launchSpawn(const char* program) {
+    double start = nowUs();
+    std::vector<std::string> env = makeEnv();
+    char** envp = toCharArray(env);
+    char* argv[] = { const_cast<char*>(program), NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, program, NULL, NULL, argv, envp);
+    freeCharArray(envp);
+    double elapsed = nowUs() - start;
+    if (err == 0)
+        waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+static void report(const char* name, size_t rss_mb, std::vector<double>& samples) {
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+        sum += samples[i];
+    std::printf("%-12s rss=%5luMB  mean=%8.1fus  p50=%8.1fus  p99=%8.1fus\n",
+                name, (unsigned long)rss_mb, sum / samples.size(),
+                samples[samples.size() / 2], samples[samples.size() * 99 / 100]);
+}
+
+int main(int argc, char** argv) {
+    int iterations = (argc > 1) ? std::atoi(argv[1]) : 200;
+    const char* program = (argc > 2) ? argv[2] : "/bin/true";
+    const size_t sizes[] = { 0, 64, 256, 1024 };
+    std::vector<char*> ballast;
+
+    if (iterations < 1)
+        iterations = 1;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        // Grow the touched heap to the next size so fork has page tables to copy.
+        size_t have = ballast.size();
+        for (size_t mb = have; mb < sizes[s]; mb++) {
+            char* block = static_cast<char*>(std::malloc(1024 * 1024));
+            if (!block) {
+                std::fprintf(stderr, "out of memory at %luMB\n", (unsigned long)mb);
+                return 1;
+            }
+            std::memset(block, 1, 1024 * 1024);
+            ballast.push_back(block);
+        }
+
+        std::vector<double> fork_samples;
+        std::vector<double> spawn_samples;
+        for (int i = 0; i < iterations; i++) {
+            fork_samples.push_back(launchFork(program));
+            spawn_samples.push_back(launchSpawn(program));
+        }
+        report("fork+execve", sizes[s], fork_samples);
+        report("posix_spawn", sizes[s], spawn_samples);
+    }
+
+    for (size_t i = 0; i < ballast.size(); i++)
+        std::free(ballast[i]);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# Minimal FastCGI responder for trying out fastcgi_pass locally:
+#   python3 bench/fcgi_responder.py 127.0.0.1:9000   (or unix:/tmp/fcgi.sock)
+# Keeps connections open when asked to (FCGI_KEEP_CONN) and serves one
+# request per connection at a time, one thread per connection.
+import os
+import socket
+import struct
+import sys
+import threading
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+
+
+def read_exact(conn, n):
+    data = b""
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    header = read_exact(conn, 8)
+    if header is None:
+        return None
+    _, rtype, rid, length, padding, _ = struct.unpack("!BBHHBB", header)
+    content = read_exact(conn, length + padding)
+    if content is None:
+        return None
+    return rtype, rid, content[:length]
+
+
+def parse_params(data):
+    params, pos = {}, 0
+    while pos < len(data):
+        lens = []
+        for _ in range(2):
+            if data[pos] & 0x80:
+                lens.append(struct.unpack("!I", data[pos:pos + 4])[0] & 0x7fffffff)
+                pos += 4
+            else:
+                lens.append(data[pos])
+                pos += 1
+        name = data[pos:pos + lens[0]].decode("latin-1")
+        pos += lens[0]
+        params[name] = data[pos:pos + lens[1]].decode("latin-1")
+        pos += lens[1]
+    return params
+
+
+def write_record(conn, rtype, rid, content):
+    for i in range(0, max(len(content), 1), 65535):
+        chunk = content[i:i + 65535]
+        conn.sendall(struct.pack("!BBHHBB", 1, rtype, rid, len(chunk), 0, 0) + chunk)
+
+
+def respond(params, body):
+    out = "pid: %d\n" % os.getpid()
+    out += "method: %s\n" % params.get("REQUEST_METHOD", "")
+    out += "script: %s\n" % params.get("SCRIPT_FILENAME", "")
+    out += "uri: %s\n" % params.get("REQUEST_URI", "")
+    out += "body: %d bytes\n" % len(body)
+    return ("Status: 200 OK\r\nContent-Type: text/plain\r\n\r\n" + out).encode()
+
+
+def serve(conn):
+    with conn:
+        while True:
+            record = read_record(conn)
+            if record is None or record[0] != BEGIN_REQUEST:
+                return
+            rid = record[1]
+            keep_conn = record[2][2] & 1
+            params_data, body = b"", b""
+            while True:
+                record = read_record(conn)
+                if record is None:
+                    return
+                if record[0] == PARAMS:
+                    params_data += record[2]
+                elif record[0] == STDIN:
+                    if not record[2]:
+                        break
+                    body += record[2]
+            write_record(conn, STDOUT, rid, respond(parse_params(params_data), body))
+            write_record(conn, STDOUT, rid, b"")
+            conn.sendall(struct.pack("!BBHHBB", 1, END_REQUEST, rid, 8, 0, 0) + bytes(8))
+            if not keep_conn:
+                return
+
+
+def main():
+    spec = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1:9000"
+    if spec.startswith("unix:"):
+        path = spec[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(path)
+    else:
+        host, port = spec.rsplit(":", 1)
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind((host, int(port)))
+    sock.listen(128)
+    while True:
+        conn, _ = sock.accept()
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,420 @@
+// Microbenchmarks for the per-request hot paths: request parsing, response
+// serialization, location matching, percent-decoding and MIME lookup.
+//
+// Each benchmark is calibrated to run for about --min-time per round, and
+// the median of --rounds rounds is reported (the minimum alongside), which
+// keeps one preempted round from moving the result. Results go to stdout
+// as JSONL, one object per benchmark, and can be saved as a baseline;
+// against a baseline, a benchmark slower by more than --threshold percent
+// is a regression and the exit status is 1. A --baseline file that cannot
+// be read exits with 2, so a gate never passes without numbers to compare.
+//
+// usage: ./micro_bench [--filter text] [--rounds n] [--min-time ms]
+//                      [--save file] [--baseline file] [--threshold percent]
+
+#include "Jsonl.hpp"
+#include "../http/HttpParser.hpp"
+#include "../http/HttpRequest.hpp"
+#include "../http/HttpResponse.hpp"
+#include "../server/Client.hpp"
+#include "../parsing/Config.hpp"
+#include <time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+static double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Results are folded into this so the work cannot be optimized away.
+static volatile size_t sink;
+
+// Inputs, built once in setupInputs(); the objects are allocated there
+// rather than being globals, as their constructors use other translation
+// units' statics.
+static std::string small_request;
+static std::string browser_request;
+static std::string large_header_request;
+static std::string post_request;
+static std::vector<std::string> split_request;
+static std::string encoded_uri;
+static std::string plain_uri;
+static HttpResponse* small_response;
+static HttpResponse* large_response;
+static HttpResponse* header_heavy_response;
+static ServerConfig* few_locations;
+static ServerConfig* many_locations;
+static ConfigSnapshot* snapshot;
+
+static void parseOnce(HttpParser& parser, const std::string& data) {
+    parser.reset();
+    sink += parser.parseHttpRequest(data);
+}
+
+static void benchParseSmall(size_t n) {
+    HttpParser parser;
+    for (size_t i = 0; i < n; i++)
+        parseOnce(parser, small_request);
+}
+
+static void benchParseBrowser(size_t n) {
+    HttpParser parser;
+    for (size_t i = 0; i < n; i++)
+        parseOnce(parser, browser_request);
+}
+
+static void benchParseLargeHeaders(size_t n) {
+    HttpParser parser;
+    for (size_t i = 0; i < n; i++)
+        parseOnce(parser, large_header_request);
+}
+
+static void benchParsePost(size_t n) {
+    HttpParser parser;
+    for (size_t i = 0; i < n; i++)
+        parseOnce(parser, post_request);
+}
+
+// The browser request arriving in 64-byte reads.
+static void benchParseSplit(size_t n) {
+    HttpParser parser;
+    for (size_t i = 0; i < n; i++) {
+        parser.reset();
+        for (size_t p = 0; p < split_request.size(); p++)
+            sink += parser.parseHttpRequest(split_request[p]);
+    }
+}
+
+static void benchParseLongUri(size_t n) {
+    HttpParser parser;
+    std::string request = "GET " + encoded_uri + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    for (size_t i = 0; i < n; i++)
+        parseOnce(parser, request);
+}
+
+static void benchResponseSmall(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        sink += small_response->toString().length();
+}
+
+static void benchResponseLarge(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        sink += large_response->toString().length();
+}
+
+static void benchBuildHeaders(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        sink += header_heavy_response->buildHeaders().length();
+}
+
+static void findLocations(const ServerConfig& config, const char* const* paths, size_t n) {
+    Client client(-1, &config, snapshot);
+    for (size_t i = 0; i < n; i++)
+        sink += reinterpret_cast<size_t>(client.findMatchingLocation(paths[i % 4]));
+}
+
+static void benchLocationsFew(size_t n) {
+    static const char* const paths[] = { "/", "/static/css/site.css", "/cgi-bin/post.py", "/nowhere/at/all" };
+    findLocations(*few_locations, paths, n);
+}
+
+static void benchLocationsMany(size_t n) {
+    static const char* const paths[] = { "/app/section150/page", "/app/section7", "/assets/img/logo.png",
+                                         "/app/section199/deep/path/to/resource.html" };
+    findLocations(*many_locations, paths, n);
+}
+
+static void benchPercentDecodeEncoded(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        sink += HttpRequest::percentDecode(encoded_uri).length();
+}
+
+static void benchPercentDecodePlain(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        sink += HttpRequest::percentDecode(plain_uri).length();
+}
+
+static void benchMimeType(size_t n) {
+    static const char* const extensions[] = { ".html", ".css", ".js", ".png", ".JPG", ".woff2", ".svg", ".unknown" };
+    for (size_t i = 0; i < n; i++)
+        sink += HttpResponse::getMimeType(extensions[i % 8]).length();
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)(size_t);
+};
+
+static const Benchmark BENCHMARKS[] = {
+    { "parse_small_request", benchParseSmall },
+    { "parse_browser_request", benchParseBrowser },
+    { "parse_large_headers", benchParseLargeHeaders },
+    { "parse_post_4k_body", benchParsePost },
+    { "parse_split_64b_reads", benchParseSplit },
+    { "parse_long_encoded_uri", benchParseLongUri },
+    { "response_to_string_1k", benchResponseSmall },
+    { "response_to_string_64k", benchResponseLarge },
+    { "response_build_headers", benchBuildHeaders },
+    { "find_location_5", benchLocationsFew },
+    { "find_location_200", benchLocationsMany },
+    { "percent_decode_encoded", benchPercentDecodeEncoded },
+    { "percent_decode_plain", benchPercentDecodePlain },
+    { "mime_type", benchMimeType },
+};
+
+static LocationConfig location(const std::string& path) {
+    LocationConfig config;
+    config.path = path;
+    config.root = "www";
+    config.methods.insert("GET");
+    return config;
+}
+
+static void setupInputs() {
+    small_request = "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+
+    browser_request =
+        "GET /static/css/site.css?v=20240101 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/124.0.0.0 Safari/537.36\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Referer: https://www.example.com/articles/2024/some-long-article-title\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: session=3f1c9a7e5b2d4c6a8e0f1a3b5c7d9e1f; theme=dark; consent=1; "
+        "_ga=GA1.1.123456789.1700000000; _gid=GA1.1.987654321.1700000000\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+        "Cache-Control: max-age=0\r\n\r\n";
+
+    large_header_request = "GET /api/items HTTP/1.1\r\nHost: localhost\r\n";
+    for (int i = 0; i < 60; i++) {
+        char header[160];
+        std::snprintf(header, sizeof(header), "X-Custom-Header-%02d: %0120d\r\n", i, i);
+        large_header_request += header;
+    }
+    large_header_request += "\r\n";
+
+    post_request = "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\n"
+                   "Content-Length: 4096\r\n\r\n" + std::string(4096, 'x');
+
+    for (size_t i = 0; i < browser_request.length(); i += 64)
+        split_request.push_back(browser_request.substr(i, 64));
+
+    // Well within MAX_URI_SIZE: a path of UTF-8 words, every other byte escaped.
+    encoded_uri = "/search/";
+    while (encoded_uri.length() < 900)
+        encoded_uri += "caf%C3%A9-cr%C3%A8me%20br%C3%BBl%C3%A9e/";
+    plain_uri = "/search/";
+    while (plain_uri.length() < 900)
+        plain_uri += "plain-ascii-path-segment/";
+
+    small_response = new HttpResponse();
+    large_response = new HttpResponse();
+    header_heavy_response = new HttpResponse();
+    small_response->setStatus(200);
+    small_response->setContentType("text/html; charset=utf-8");
+    small_response->setBody(std::string(1024, 'a'));
+    large_response->setStatus(200);
+    large_response->setContentType("application/octet-stream");
+    large_response->setBody(std::string(65536, 'b'));
+    header_heavy_response->setStatus(200);
+    header_heavy_response->setContentType("text/html; charset=utf-8");
+    header_heavy_response->setContentLength(5120);
+    header_heavy_response->setConnection("keep-alive");
+    header_heavy_response->setCacheControl("public, max-age=3600");
+    header_heavy_response->setLastModified(1700000000);
+    header_heavy_response->setExpires(1700003600);
+    header_heavy_response->setCookie("session=3f1c9a7e5b2d4c6a8e0f1a3b5c7d9e1f; Path=/; HttpOnly");
+    header_heavy_response->setLocation("/next");
+    for (int i = 0; i < 12; i++) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "X-Trace-%d", i);
+        header_heavy_response->setHeader(name, "0123456789abcdef0123456789abcdef");
+    }
+
+    few_locations = new ServerConfig();
+    many_locations = new ServerConfig();
+    const char* few[] = { "/", "/static", "/cgi-bin", "/upload", "/api" };
+    for (size_t i = 0; i < 5; i++)
+        few_locations->locations.push_back(location(few[i]));
+    many_locations->locations.push_back(location("/"));
+    many_locations->locations.push_back(location("/assets"));
+    for (int i = 0; i < 198; i++) {
+        char path[32];
+        std::snprintf(path, sizeof(path), "/app/section%d", i);
+        many_locations->locations.push_back(location(path));
+    }
+
+    Config config;
+    snapshot = new ConfigSnapshot(config, 1);
+}
+
+// A parser benchmark whose input is rejected would time the error path.
+static bool checkInputs() {
+    const std::string* inputs[] = { &small_request, &browser_request, &large_header_request, &post_request };
+    for (size_t i = 0; i < 4; i++) {
+        HttpParser parser;
+        if (parser.parseHttpRequest(*inputs[i]) != COMPLETE) {
+            std::fprintf(stderr, "micro_bench: parser input %lu does not parse\n", static_cast<unsigned long>(i));
+            return false;
+        }
+    }
+    HttpParser parser;
+    if (parser.parseHttpRequest("GET " + encoded_uri + " HTTP/1.1\r\nHost: localhost\r\n\r\n") != COMPLETE) {
+        std::fprintf(stderr, "micro_bench: the encoded URI does not parse\n");
+        return false;
+    }
+    return true;
+}
+
+// Grows the batch until one takes min_time, so the clock reads are noise.
+static size_t calibrate(const Benchmark& bench, double min_time_ns) {
+    size_t n = 1;
+    while (true) {
+        double start = nowNs();
+        bench.run(n);
+        double elapsed = nowNs() - start;
+        if (elapsed >= min_time_ns || n >= (1UL << 30))
+            return n;
+        double factor = elapsed > 0 ? min_time_ns / elapsed * 1.2 : 100;
+        n = static_cast<size_t>(n * std::min(std::max(factor, 1.5), 100.0)) + 1;
+    }
+}
+
+struct Result {
+    double median_ns;
+    double min_ns;
+    size_t iterations;
+};
+
+static Result measure(const Benchmark& bench, int rounds, double min_time_ns) {
+    size_t n = calibrate(bench, min_time_ns);
+    std::vector<double> per_op;
+    for (int r = 0; r < rounds; r++) {
+        double start = nowNs();
+        bench.run(n);
+        per_op.push_back((nowNs() - start) / n);
+    }
+    std::sort(per_op.begin(), per_op.end());
+    Result result;
+    result.median_ns = per_op[per_op.size() / 2];
+    result.min_ns = per_op[0];
+    result.iterations = n;
+    return result;
+}
+
+static bool loadBaseline(const std::string& path, std::map<std::string, double>& baseline) {
+    std::ifstream file(path.c_str());
+    if (!file)
+        return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        Jsonl::Fields fields;
+        std::string error;
+        if (line.empty() || !Jsonl::parse(line, fields, error) || !fields.count("name"))
+            continue;
+        baseline[fields["name"]] = std::atof(fields["ns_per_op"].c_str());
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    std::string save_path;
+    std::string baseline_path;
+    int rounds = 5;
+    double min_time_ms = 200;
+    double threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::fprintf(stderr, "micro_bench: %s needs a value\n", arg.c_str());
+            return 2;
+        }
+        if (arg == "--filter")
+            filter = argv[++i];
+        else if (arg == "--rounds")
+            rounds = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--min-time")
+            min_time_ms = std::atof(argv[++i]);
+        else if (arg == "--save")
+            save_path = argv[++i];
+        else if (arg == "--baseline")
+            baseline_path = argv[++i];
+        else if (arg == "--threshold")
+            threshold = std::atof(argv[++i]);
+        else {
+            std::fprintf(stderr, "usage: micro_bench [--filter text] [--rounds n] [--min-time ms] "
+                                 "[--save file] [--baseline file] [--threshold percent]\n");
+            return 2;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty() && !loadBaseline(baseline_path, baseline)) {
+        std::fprintf(stderr, "micro_bench: no baseline at %s, `make bench-baseline` records one\n",
+                     baseline_path.c_str());
+        return 2;
+    }
+
+    setupInputs();
+    if (!checkInputs())
+        return 2;
+    std::string saved;
+    int regressions = 0;
+    for (size_t b = 0; b < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); b++) {
+        const Benchmark& bench = BENCHMARKS[b];
+        if (!filter.empty() && std::string(bench.name).find(filter) == std::string::npos)
+            continue;
+        Result result = measure(bench, rounds, min_time_ms * 1e6);
+
+        char line[512];
+        int length = std::snprintf(line, sizeof(line),
+                                   "{\"name\": \"%s\", \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, "
+                                   "\"iterations\": %lu, \"rounds\": %d",
+                                   bench.name, result.median_ns, result.min_ns,
+                                   static_cast<unsigned long>(result.iterations), rounds);
+        std::string json(line, length);
+        saved += json + "}\n";
+        std::map<std::string, double>::const_iterator base = baseline.find(bench.name);
+        if (base != baseline.end() && base->second > 0) {
+            double change = (result.median_ns / base->second - 1) * 100;
+            bool regressed = change > threshold;
+            regressions += regressed;
+            length = std::snprintf(line, sizeof(line), ", \"baseline_ns_per_op\": %.1f, \"change_percent\": %.1f, "
+                                   "\"regression\": %s", base->second, change, regressed ? "true" : "false");
+            json.append(line, length);
+        }
+        std::printf("%s}\n", json.c_str());
+        std::fflush(stdout);
+    }
+    snapshot->release();
+
+    if (!save_path.empty()) {
+        std::ofstream out(save_path.c_str());
+        out << saved;
+        if (!out) {
+            std::fprintf(stderr, "micro_bench: cannot write %s\n", save_path.c_str());
+            return 2;
+        }
+    }
+    if (regressions) {
+        std::fprintf(stderr, "micro_bench: %d benchmark(s) more than %.0f%% slower than the baseline\n",
+                     regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1111 @@
+// HTTP/1.1 load generator, for benchmarking webserv builds against
+// localhost.
+//
+// Closed loop (the default): every connection sends its next request as
+// soon as the previous response is in. Open loop (-R): requests fall due at
+// a constant rate whether or not the server keeps up, and latency is
+// counted from when a request was due rather than from when a connection
+// got round to sending it. That corrects for coordinated omission: a server
+// that stalls for a second shows a second of latency on every request it
+// held up, not on one. The service time (write to last byte) is reported
+// alongside.
+//
+// Requests come from the URL, or from a JSONL mix (-m), one request per
+// line:
+//   {"method": "GET", "path": "/index.html", "headers": {"Accept": "*/*"}, "weight": 4}
+//   {"method": "POST", "path": "/cgi-bin/post.py", "body_size": 4096}
+//
+// Replay (--replay): the requests of a capture (the server's `capture`
+// directive) are sent once, in order, at the pace they arrived in, sped up
+// by --speed or as fast as the connections allow. Each line is a mix line
+// with the arrival time, status and time of the original response:
+//   {"t_us": 7714060311, "method": "GET", "uri": "/", "headers": {"Host": "a"},
+//    "body_size": 0, "status": 200, "time_us": 412}
+// The summary says which statuses changed and how latency compares with
+// what the server recorded; any changed status makes the exit code 1.
+//
+// With --metrics, the server's metrics are read before and after the run
+// for the kernel calls its event loop made (webserv_event_syscalls_total),
+// to compare event backends by syscalls per request.
+//
+// usage: ./webserv-bench [-c conns] [-t threads] [-d duration] [-R rate]
+//                        [-m mix.jsonl] [--replay capture.jsonl [--speed n|max]]
+//                        [-H header] [--timeout duration] [--metrics path]
+//                        [--no-keepalive] [--seed n] [--json] http://host:port[/path]
+
+#include "Jsonl.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <strings.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+static long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Log-linear latency histogram in microseconds: exact below 128us, then 64
+// sub-buckets per power of two (under 1.6% error), up to about 2^40us.
+class Histogram {
+public:
+    static const int SUB_BITS = 6;
+    static const int MAX_EXPONENT = 40;
+
+    Histogram() : counts(bucketCount(), 0), total(0), sum(0), max(0) {}
+
+    void record(long us) {
+        if (us < 0)
+            us = 0;
+        counts[index(us)]++;
+        total++;
+        sum += us;
+        if (us > max)
+            max = us;
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.max > max)
+            max = other.max;
+    }
+
+    long percentile(double p) const {
+        if (!total)
+            return 0;
+        unsigned long rank = static_cast<unsigned long>(p / 100.0 * total + 0.5);
+        if (rank < 1)
+            rank = 1;
+        unsigned long seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return value(i) < max ? value(i) : max;
+        }
+        return max;
+    }
+
+    unsigned long count() const { return total; }
+    long maximum() const { return max; }
+    double mean() const { return total ? sum / total : 0; }
+
+private:
+    std::vector<unsigned long> counts;
+    unsigned long total;
+    double sum;
+    long max;
+
+    static size_t bucketCount() { return (2 << SUB_BITS) + (MAX_EXPONENT - SUB_BITS) * (1 << SUB_BITS); }
+
+    static size_t index(long us) {
+        unsigned long v = us;
+        if (v < (2UL << SUB_BITS))
+            return v;
+        int exponent = 63 - __builtin_clzl(v);
+        if (exponent > MAX_EXPONENT)
+            return bucketCount() - 1;
+        int shift = exponent - SUB_BITS;
+        return (2 << SUB_BITS) + (exponent - SUB_BITS - 1) * (1 << SUB_BITS) +
+               ((v >> shift) - (1UL << SUB_BITS));
+    }
+
+    // The middle of the bucket.
+    static long value(size_t index) {
+        if (index < (2U << SUB_BITS))
+            return index;
+        size_t rest = index - (2 << SUB_BITS);
+        int exponent = rest / (1 << SUB_BITS) + SUB_BITS + 1;
+        int shift = exponent - SUB_BITS;
+        long low = static_cast<long>((1UL << SUB_BITS) + rest % (1 << SUB_BITS)) << shift;
+        return low + (1L << shift) / 2;
+    }
+};
+
+struct Request {
+    std::string wire;
+    bool head;
+    unsigned long weight;
+    // Replay only: when the request arrived, relative to the first one, and
+    // the status and time of the recorded response.
+    long offset_us;
+    int recorded_status;
+    long recorded_us;
+
+    Request() : head(false), weight(1), offset_us(0), recorded_status(0), recorded_us(-1) {}
+};
+
+// A request that fell due and waits for a connection. Without a request
+// one is picked from the mix; a due time of -1 means "when sent".
+struct Pending {
+    long due_us;
+    const Request* request;
+
+    Pending(long _due_us, const Request* _request) : due_us(_due_us), request(_request) {}
+};
+
+struct Options {
+    std::string host;
+    std::string port;
+    std::string path;
+    int connections;
+    int threads;
+    long duration_us;
+    bool duration_set;
+    double rate;
+    long timeout_us;
+    bool keep_alive;
+    bool json;
+    unsigned seed;
+    std::string mix;
+    std::string replay;
+    // Replay pace, 0 for as fast as possible.
+    double speed;
+    std::vector<std::string> headers;
+    std::string metrics;
+
+    Options()
+        : path("/"), connections(16), threads(2), duration_us(10000000), duration_set(false), rate(0),
+          timeout_us(5000000), keep_alive(true), json(false), seed(1), speed(1) {}
+};
+
+enum ConnState { CLOSED, CONNECTING, IDLE, SENDING, READING };
+enum BodyMode { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE };
+enum ChunkState { CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, CHUNK_TRAILER };
+
+struct Connection {
+    int fd;
+    ConnState state;
+    const Request* request;
+    size_t sent;
+    long due_us;
+    long started_us;
+    long retry_us;
+    std::string in;
+    bool head_done;
+    int status;
+    BodyMode body;
+    long remaining;
+    ChunkState chunk;
+    bool close_after;
+
+    Connection() : fd(-1), state(CLOSED), request(NULL), sent(0), due_us(0), started_us(0),
+                   retry_us(0), head_done(false), status(0), body(BODY_NONE), remaining(0),
+                   chunk(CHUNK_SIZE), close_after(false) {}
+};
+
+struct Worker {
+    pthread_t thread;
+    const Options* options;
+    const std::vector<Request>* requests;
+    const struct sockaddr_storage* address;
+    socklen_t address_length;
+    int connection_count;
+    double rate;
+    unsigned seed;
+    long start_us;
+
+    Histogram latency;
+    Histogram service;
+    unsigned long completed;
+    unsigned long bytes;
+    unsigned long connect_errors;
+    unsigned long read_errors;
+    unsigned long timeouts;
+    unsigned long unsent;
+    unsigned long status_classes[6];
+    // Replay: this thread's share of the capture, in order, and how the
+    // responses compare with the recorded ones. A request that got no
+    // response counts as status 0.
+    std::vector<const Request*> schedule;
+    Histogram recorded;
+    unsigned long matched;
+    std::map<std::pair<int, int>, unsigned long> changed;
+
+    int epoll_fd;
+    std::vector<Connection> connections;
+    std::vector<size_t> idle;
+    std::deque<Pending> due;
+    unsigned long total_weight;
+
+    Worker() : completed(0), bytes(0), connect_errors(0), read_errors(0), timeouts(0), unsent(0),
+               matched(0), epoll_fd(-1), total_weight(0) {
+        std::memset(status_classes, 0, sizeof(status_classes));
+    }
+};
+
+static const Request& pickRequest(Worker& worker) {
+    const std::vector<Request>& requests = *worker.requests;
+    if (requests.size() == 1)
+        return requests[0];
+    unsigned long point = rand_r(&worker.seed) % worker.total_weight;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (point < requests[i].weight)
+            return requests[i];
+        point -= requests[i].weight;
+    }
+    return requests.back();
+}
+
+static void watch(Worker& worker, size_t index, unsigned events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = index;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, worker.connections[index].fd, &event);
+}
+
+// Replay: a response, or 0 for none, against the recorded status.
+static void compareStatus(Worker& worker, const Request& request, int status) {
+    if (status == request.recorded_status)
+        worker.matched++;
+    else
+        worker.changed[std::make_pair(request.recorded_status, status)]++;
+}
+
+static void closeConnection(Worker& worker, size_t index, long retry_us) {
+    Connection& conn = worker.connections[index];
+    if ((conn.state == SENDING || conn.state == READING) && conn.request && conn.request->recorded_status)
+        compareStatus(worker, *conn.request, 0);
+    conn.request = NULL;
+    if (conn.fd != -1) {
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, conn.fd, NULL);
+        close(conn.fd);
+    }
+    conn.fd = -1;
+    conn.state = CLOSED;
+    conn.retry_us = retry_us;
+}
+
+static void openConnection(Worker& worker, size_t index) {
+    Connection& conn = worker.connections[index];
+    conn.fd = socket(worker.address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd == -1) {
+        worker.connect_errors++;
+        conn.retry_us = nowUs() + 100000;
+        return;
+    }
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn.fd, reinterpret_cast<const struct sockaddr*>(worker.address), worker.address_length) == -1 &&
+        errno != EINPROGRESS) {
+        worker.connect_errors++;
+        close(conn.fd);
+        conn.fd = -1;
+        conn.retry_us = nowUs() + 100000;
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.u64 = index;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, conn.fd, &event);
+    conn.state = CONNECTING;
+}
+
+static void sendMore(Worker& worker, size_t index) {
+    Connection& conn = worker.connections[index];
+    const std::string& wire = conn.request->wire;
+    while (conn.sent < wire.length()) {
+        ssize_t n = send(conn.fd, wire.data() + conn.sent, wire.length() - conn.sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.sent += n;
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            watch(worker, index, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        worker.read_errors++;
+        closeConnection(worker, index, 0);
+        return;
+    }
+    conn.state = READING;
+    watch(worker, index, EPOLLIN);
+}
+
+static void startRequest(Worker& worker, size_t index, const Pending& pending) {
+    Connection& conn = worker.connections[index];
+    conn.request = pending.request ? pending.request : &pickRequest(worker);
+    conn.sent = 0;
+    conn.started_us = nowUs();
+    conn.due_us = (pending.due_us < 0) ? conn.started_us : pending.due_us;
+    conn.in.clear();
+    conn.head_done = false;
+    conn.status = 0;
+    conn.body = BODY_NONE;
+    conn.remaining = 0;
+    conn.chunk = CHUNK_SIZE;
+    conn.close_after = !worker.options->keep_alive;
+    conn.state = SENDING;
+    sendMore(worker, index);
+}
+
+static bool headerIs(const std::string& head, size_t start, size_t end, const char* name) {
+    size_t length = std::strlen(name);
+    return end - start > length && strncasecmp(head.c_str() + start, name, length) == 0 &&
+           head[start + length] == ':';
+}
+
+static std::string headerValue(const std::string& head, size_t start, size_t end) {
+    size_t colon = head.find(':', start);
+    size_t from = colon + 1;
+    while (from < end && (head[from] == ' ' || head[from] == '\t'))
+        from++;
+    return head.substr(from, end - from);
+}
+
+// False when the head is malformed.
+static bool parseHead(Connection& conn, const std::string& head) {
+    if (head.compare(0, 5, "HTTP/") != 0 || head.length() < 12)
+        return false;
+    conn.status = std::atoi(head.c_str() + 9);
+    bool has_length = false;
+    size_t line = head.find("\r\n");
+    while (line != std::string::npos && line + 2 < head.length()) {
+        size_t start = line + 2;
+        size_t end = head.find("\r\n", start);
+        if (end == std::string::npos)
+            end = head.length();
+        if (headerIs(head, start, end, "Content-Length")) {
+            conn.remaining = std::atol(headerValue(head, start, end).c_str());
+            has_length = true;
+        }
+        else if (headerIs(head, start, end, "Transfer-Encoding") &&
+                 strcasestr(headerValue(head, start, end).c_str(), "chunked"))
+            conn.body = BODY_CHUNKED;
+        else if (headerIs(head, start, end, "Connection") &&
+                 strcasestr(headerValue(head, start, end).c_str(), "close"))
+            conn.close_after = true;
+        line = (end < head.length()) ? end : std::string::npos;
+    }
+    if (head.compare(0, 8, "HTTP/1.0") == 0)
+        conn.close_after = true;
+    if (conn.request->head || conn.status == 204 || conn.status == 304 || conn.status < 200)
+        conn.body = BODY_NONE;
+    else if (conn.body != BODY_CHUNKED)
+        conn.body = has_length ? BODY_LENGTH : BODY_UNTIL_CLOSE;
+    if (conn.body == BODY_UNTIL_CLOSE)
+        conn.close_after = true;
+    return true;
+}
+
+// Consumes what arrived; true once the response is complete.
+static bool consumeBody(Connection& conn) {
+    if (conn.body == BODY_LENGTH) {
+        long take = std::min<long>(conn.remaining, conn.in.length());
+        conn.remaining -= take;
+        conn.in.erase(0, take);
+        return conn.remaining == 0;
+    }
+    if (conn.body == BODY_UNTIL_CLOSE) {
+        conn.in.clear();
+        return false;
+    }
+    if (conn.body == BODY_NONE)
+        return true;
+    while (true) {
+        if (conn.chunk == CHUNK_DATA) {
+            long take = std::min<long>(conn.remaining, conn.in.length());
+            conn.remaining -= take;
+            conn.in.erase(0, take);
+            if (conn.remaining)
+                return false;
+            conn.chunk = CHUNK_CRLF;
+        }
+        if (conn.chunk == CHUNK_CRLF) {
+            if (conn.in.length() < 2)
+                return false;
+            conn.in.erase(0, 2);
+            conn.chunk = CHUNK_SIZE;
+        }
+        size_t eol = conn.in.find("\r\n");
+        if (conn.chunk == CHUNK_TRAILER) {
+            if (eol == std::string::npos)
+                return false;
+            conn.in.erase(0, eol + 2);
+            if (eol == 0)
+                return true;
+            continue;
+        }
+        if (eol == std::string::npos)
+            return false;
+        conn.remaining = std::strtol(conn.in.c_str(), NULL, 16);
+        conn.in.erase(0, eol + 2);
+        conn.chunk = conn.remaining ? CHUNK_DATA : CHUNK_TRAILER;
+    }
+}
+
+static void finishRequest(Worker& worker, size_t index) {
+    Connection& conn = worker.connections[index];
+    long now = nowUs();
+    worker.latency.record(now - conn.due_us);
+    worker.service.record(now - conn.started_us);
+    worker.completed++;
+    int status_class = conn.status / 100;
+    worker.status_classes[(status_class >= 1 && status_class <= 5) ? status_class : 0]++;
+    if (conn.request->recorded_status) {
+        compareStatus(worker, *conn.request, conn.status);
+        if (conn.request->recorded_us >= 0)
+            worker.recorded.record(conn.request->recorded_us);
+    }
+    conn.request = NULL;
+    if (conn.close_after) {
+        closeConnection(worker, index, 0);
+        return;
+    }
+    conn.state = IDLE;
+    worker.idle.push_back(index);
+}
+
+static void readResponse(Worker& worker, size_t index) {
+    Connection& conn = worker.connections[index];
+    char buffer[65536];
+    while (true) {
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            if (n == 0 && conn.head_done && conn.body == BODY_UNTIL_CLOSE)
+                finishRequest(worker, index);
+            else
+                worker.read_errors++;
+            closeConnection(worker, index, 0);
+            return;
+        }
+        worker.bytes += n;
+        conn.in.append(buffer, n);
+        if (!conn.head_done) {
+            size_t end = conn.in.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (conn.in.length() > 65536) {
+                    worker.read_errors++;
+                    closeConnection(worker, index, 0);
+                }
+                continue;
+            }
+            if (!parseHead(conn, conn.in.substr(0, end + 2))) {
+                worker.read_errors++;
+                closeConnection(worker, index, 0);
+                return;
+            }
+            conn.head_done = true;
+            conn.in.erase(0, end + 4);
+        }
+        if (consumeBody(conn)) {
+            finishRequest(worker, index);
+            return;
+        }
+    }
+}
+
+static void handleEvent(Worker& worker, size_t index, unsigned events) {
+    Connection& conn = worker.connections[index];
+    if (conn.state == CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (events & (EPOLLERR | EPOLLHUP))) {
+            worker.connect_errors++;
+            closeConnection(worker, index, nowUs() + 100000);
+            return;
+        }
+        conn.state = IDLE;
+        watch(worker, index, EPOLLIN);
+        worker.idle.push_back(index);
+        return;
+    }
+    if (conn.state == SENDING && (events & EPOLLOUT))
+        sendMore(worker, index);
+    if (conn.state == READING && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        readResponse(worker, index);
+    else if (conn.state == IDLE && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        // The server closed a kept-alive connection between requests.
+        closeConnection(worker, index, 0);
+}
+
+// Timeouts and reconnects, every few milliseconds rather than per event.
+static void housekeeping(Worker& worker, long now) {
+    for (size_t i = 0; i < worker.connections.size(); i++) {
+        Connection& conn = worker.connections[i];
+        if ((conn.state == SENDING || conn.state == READING) && now - conn.started_us > worker.options->timeout_us) {
+            worker.timeouts++;
+            closeConnection(worker, i, 0);
+        }
+        if (conn.state == CLOSED && now >= conn.retry_us)
+            openConnection(worker, i);
+    }
+}
+
+static void armTimer(int timer_fd, long at_us) {
+    struct itimerspec spec;
+    std::memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = at_us / 1000000;
+    spec.it_value.tv_nsec = (at_us % 1000000) * 1000;
+    if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+        spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void* runWorker(void* arg) {
+    Worker& worker = *static_cast<Worker*>(arg);
+    worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker.connections.resize(worker.connection_count);
+    for (size_t i = 0; i < worker.requests->size(); i++)
+        worker.total_weight += (*worker.requests)[i].weight;
+
+    // Open loop: a timerfd set to the next due time, at microsecond
+    // precision, so requests are not held back to a millisecond tick.
+    bool open_loop = worker.rate > 0;
+    double interval_us = open_loop ? 1e6 / worker.rate : 0;
+    int timer_fd = -1;
+
+    // A replay runs until its last request is answered, or for -d if that
+    // is shorter.
+    bool replay = !worker.options->replay.empty();
+    double speed = worker.options->speed;
+    long start = worker.start_us;
+    long end = start + worker.options->duration_us;
+    if (replay && !worker.options->duration_set)
+        end = start + (worker.schedule.empty() ? 0 : static_cast<long>(
+                           (speed > 0 ? worker.schedule.back()->offset_us / speed : 0) +
+                           worker.options->timeout_us * 2));
+    if (open_loop || (replay && speed > 0)) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = ~0ULL;
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+    }
+
+    for (size_t i = 0; i < worker.connections.size(); i++)
+        openConnection(worker, i);
+
+    // The idle list may hold connections that closed (and even reopened)
+    // since they were put on it; only those still IDLE are taken.
+    unsigned long scheduled = 0;
+    long housekept = 0;
+    struct epoll_event events[256];
+    long now = nowUs();
+    while (now < end) {
+        if (replay) {
+            // At full speed everything is due at once and latency runs
+            // from the send; otherwise from the scaled arrival time.
+            long next = 0;
+            while (scheduled < worker.schedule.size()) {
+                const Request* request = worker.schedule[scheduled];
+                next = (speed > 0) ? start + static_cast<long>(request->offset_us / speed) : now;
+                if (next > now)
+                    break;
+                worker.due.push_back(Pending(speed > 0 ? next : -1, request));
+                scheduled++;
+            }
+            if (scheduled < worker.schedule.size() && timer_fd != -1)
+                armTimer(timer_fd, next);
+            else if (worker.due.empty()) {
+                bool busy = false;
+                for (size_t i = 0; i < worker.connections.size() && !busy; i++)
+                    busy = (worker.connections[i].state == SENDING || worker.connections[i].state == READING);
+                if (!busy)
+                    break;
+            }
+        }
+        else if (open_loop) {
+            long next = start + static_cast<long>(scheduled * interval_us);
+            while (next <= now) {
+                worker.due.push_back(Pending(next, NULL));
+                scheduled++;
+                next = start + static_cast<long>(scheduled * interval_us);
+            }
+            armTimer(timer_fd, next);
+        }
+        if (replay || open_loop) {
+            while (!worker.due.empty() && !worker.idle.empty()) {
+                size_t index = worker.idle.back();
+                worker.idle.pop_back();
+                if (worker.connections[index].state != IDLE)
+                    continue;
+                Pending pending = worker.due.front();
+                worker.due.pop_front();
+                startRequest(worker, index, pending);
+            }
+        }
+        else {
+            while (!worker.idle.empty()) {
+                size_t index = worker.idle.back();
+                worker.idle.pop_back();
+                if (worker.connections[index].state == IDLE)
+                    startRequest(worker, index, Pending(-1, NULL));
+            }
+        }
+
+        int count = epoll_wait(worker.epoll_fd, events, 256, 5);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == ~0ULL) {
+                unsigned long long expirations;
+                ssize_t ignored = read(timer_fd, &expirations, sizeof(expirations));
+                (void)ignored;
+                continue;
+            }
+            handleEvent(worker, events[i].data.u64, events[i].events);
+        }
+        now = nowUs();
+        if (now - housekept >= 5000) {
+            housekeeping(worker, now);
+            housekept = now;
+        }
+    }
+    worker.unsent = worker.due.size() + (replay ? worker.schedule.size() - scheduled : 0);
+    for (size_t i = 0; i < worker.connections.size(); i++)
+        closeConnection(worker, i, 0);
+    if (timer_fd != -1)
+        close(timer_fd);
+    close(worker.epoll_fd);
+    return NULL;
+}
+
+static long parseDuration(const std::string& text) {
+    char* end;
+    double value = std::strtod(text.c_str(), &end);
+    std::string unit(end);
+    if (unit == "ms")
+        return static_cast<long>(value * 1000);
+    if (unit == "m")
+        return static_cast<long>(value * 60000000);
+    if (unit == "s" || unit.empty())
+        return static_cast<long>(value * 1000000);
+    return -1;
+}
+
+// A Host header of the mix (or capture) wins over the URL's, so requests
+// reach the virtual server they were meant for.
+static std::string buildRequest(const Options& options, const std::string& method, const std::string& path,
+                                const Jsonl::Fields& headers, const std::string& body) {
+    std::string wire = method + " " + path + " HTTP/1.1\r\n";
+    bool has_host = false;
+    for (Jsonl::Fields::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        wire += it->first + ": " + it->second + "\r\n";
+        has_host = has_host || strcasecmp(it->first.c_str(), "Host") == 0;
+    }
+    if (!has_host)
+        wire += "Host: " + options.host + ":" + options.port + "\r\n";
+    for (size_t i = 0; i < options.headers.size(); i++)
+        wire += options.headers[i] + "\r\n";
+    if (!options.keep_alive)
+        wire += "Connection: close\r\n";
+    if (!body.empty() || method == "POST" || method == "PUT") {
+        char length[32];
+        std::snprintf(length, sizeof(length), "%lu", static_cast<unsigned long>(body.length()));
+        wire += std::string("Content-Length: ") + length + "\r\n";
+    }
+    return wire + "\r\n" + body;
+}
+
+// A counter of the server's metrics, read over a connection of its own;
+// -1 when the server has no such counter or does not answer.
+static long scrapeCounter(const Options& options, const struct sockaddr_storage& address,
+                          socklen_t address_length, const std::string& name) {
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    struct timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request = "GET " + options.metrics + " HTTP/1.1\r\nHost: " + options.host + ":" + options.port +
+                          "\r\nConnection: close\r\n\r\n";
+    std::string response;
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&address), address_length) == 0 &&
+        send(fd, request.data(), request.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.length())) {
+        char buffer[16384];
+        ssize_t bytes;
+        while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+            response.append(buffer, bytes);
+    }
+    close(fd);
+    size_t at = response.find("\n" + name + " ");
+    if (at == std::string::npos)
+        return -1;
+    return std::strtol(response.c_str() + at + name.length() + 2, NULL, 10);
+}
+
+// Reads a mix, or with replay a capture, whose lines carry the timing and
+// the recorded response as well.
+static bool loadRequests(const Options& options, const std::string& name, bool replay,
+                         std::vector<Request>& requests) {
+    std::ifstream file(name.c_str());
+    if (!file) {
+        std::fprintf(stderr, "webserv-bench: cannot open %s\n", name.c_str());
+        return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(file, line)) {
+        number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#')
+            continue;
+        Jsonl::Fields fields;
+        std::string error;
+        if (!Jsonl::parse(line, fields, error)) {
+            std::fprintf(stderr, "webserv-bench: %s:%d: %s\n", name.c_str(), number, error.c_str());
+            return false;
+        }
+        std::string path = fields.count("path") ? fields["path"] : fields["uri"];
+        if (path.empty() || path[0] != '/') {
+            std::fprintf(stderr, "webserv-bench: %s:%d: path must start with /\n", name.c_str(), number);
+            return false;
+        }
+        std::string method = fields.count("method") && !fields["method"].empty() ? fields["method"] : "GET";
+        std::string body = fields["body"];
+        if (body.empty() && fields.count("body_size"))
+            body.assign(std::strtoul(fields["body_size"].c_str(), NULL, 10), 'x');
+        Request request;
+        request.wire = buildRequest(options, method, path, Jsonl::section(fields, "headers."), body);
+        request.head = (method == "HEAD");
+        request.weight = fields.count("weight") ? std::strtoul(fields["weight"].c_str(), NULL, 10) : 1;
+        if (replay) {
+            if (!fields.count("t_us") || !fields.count("status")) {
+                std::fprintf(stderr, "webserv-bench: %s:%d: a capture line needs t_us and status\n",
+                             name.c_str(), number);
+                return false;
+            }
+            request.offset_us = std::atol(fields["t_us"].c_str());
+            request.recorded_status = std::atoi(fields["status"].c_str());
+            request.recorded_us = fields.count("time_us") ? std::atol(fields["time_us"].c_str()) : -1;
+            request.weight = 1;
+        }
+        if (request.weight)
+            requests.push_back(request);
+    }
+    if (requests.empty()) {
+        std::fprintf(stderr, "webserv-bench: %s has no requests\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool arrivedEarlier(const Request& a, const Request& b) {
+    return a.offset_us < b.offset_us;
+}
+
+// Workers write the capture in the order requests finish, so it is put
+// back in arrival order, relative to the first.
+static void orderCapture(std::vector<Request>& requests) {
+    std::stable_sort(requests.begin(), requests.end(), arrivedEarlier);
+    long first = requests.front().offset_us;
+    for (size_t i = 0; i < requests.size(); i++)
+        requests[i].offset_us -= first;
+}
+
+static bool parseUrl(const std::string& url, Options& options) {
+    if (url.compare(0, 7, "http://") != 0)
+        return false;
+    std::string rest = url.substr(7);
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    if (slash != std::string::npos)
+        options.path = rest.substr(slash);
+    size_t colon = authority.rfind(':');
+    options.host = authority.substr(0, colon);
+    options.port = (colon == std::string::npos) ? "80" : authority.substr(colon + 1);
+    return !options.host.empty();
+}
+
+static void usage() {
+    std::fprintf(stderr,
+        "usage: webserv-bench [options] http://host:port[/path]\n"
+        "  -c N              connections (16)\n"
+        "  -t N              threads (2)\n"
+        "  -d DURATION       test length, e.g. 30s, 500ms, 2m (10s)\n"
+        "  -R RATE           open loop at RATE requests/s in total; closed loop without\n"
+        "  -m FILE           JSONL request mix instead of the URL's path\n"
+        "  --replay FILE     send the requests of a capture once, at their pace\n"
+        "  --speed N|max     replay N times faster, or as fast as possible (1)\n"
+        "  -H 'Name: value'  extra header on every request, repeatable\n"
+        "  --timeout D       per request (5s)\n"
+        "  --no-keepalive    a new connection for every request\n"
+        "  --seed N          seed for picking from the mix (1)\n"
+        "  --metrics PATH    report the server's event loop syscalls per request\n"
+        "  --json            print the summary as one JSON object\n");
+}
+
+static bool parseArguments(int argc, char** argv, Options& options) {
+    std::string url;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (arg == "-c" && has_value)
+            options.connections = std::atoi(argv[++i]);
+        else if (arg == "-t" && has_value)
+            options.threads = std::atoi(argv[++i]);
+        else if (arg == "-d" && has_value) {
+            options.duration_us = parseDuration(argv[++i]);
+            options.duration_set = true;
+        }
+        else if (arg == "-R" && has_value)
+            options.rate = std::atof(argv[++i]);
+        else if (arg == "-m" && has_value)
+            options.mix = argv[++i];
+        else if (arg == "--replay" && has_value)
+            options.replay = argv[++i];
+        else if (arg == "--speed" && has_value) {
+            std::string speed = argv[++i];
+            options.speed = (speed == "max") ? 0 : std::atof(speed.c_str());
+            if (options.speed <= 0 && speed != "max")
+                return false;
+        }
+        else if (arg == "-H" && has_value)
+            options.headers.push_back(argv[++i]);
+        else if (arg == "--timeout" && has_value)
+            options.timeout_us = parseDuration(argv[++i]);
+        else if (arg == "--seed" && has_value)
+            options.seed = std::strtoul(argv[++i], NULL, 10);
+        else if (arg == "--metrics" && has_value)
+            options.metrics = argv[++i];
+        else if (arg == "--no-keepalive")
+            options.keep_alive = false;
+        else if (arg == "--json")
+            options.json = true;
+        else if (arg[0] != '-' && url.empty())
+            url = arg;
+        else
+            return false;
+    }
+    if (url.empty() || !parseUrl(url, options)) {
+        std::fprintf(stderr, "webserv-bench: expected an http://host:port URL\n");
+        return false;
+    }
+    if (options.threads < 1 || options.connections < options.threads || options.duration_us <= 0 ||
+        options.timeout_us <= 0 || options.rate < 0) {
+        std::fprintf(stderr, "webserv-bench: need threads >= 1, connections >= threads, "
+                             "and positive durations\n");
+        return false;
+    }
+    if (!options.replay.empty() && (!options.mix.empty() || options.rate > 0)) {
+        std::fprintf(stderr, "webserv-bench: --replay sets the requests and their pace, "
+                             "without -m or -R\n");
+        return false;
+    }
+    return true;
+}
+
+static void printLatency(const char* title, const Histogram& histogram) {
+    std::printf("  %s\n    p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms  mean %.3fms\n", title,
+                histogram.percentile(50) / 1000.0, histogram.percentile(90) / 1000.0,
+                histogram.percentile(99) / 1000.0, histogram.percentile(99.9) / 1000.0,
+                histogram.maximum() / 1000.0, histogram.mean() / 1000.0);
+}
+
+static std::string latencyJson(const Histogram& histogram) {
+    char text[256];
+    std::snprintf(text, sizeof(text),
+                  "{\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld, \"mean\": %.1f}",
+                  histogram.percentile(50), histogram.percentile(90), histogram.percentile(99),
+                  histogram.percentile(99.9), histogram.maximum(), histogram.mean());
+    return text;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Request> requests;
+    if (!options.replay.empty()) {
+        if (!loadRequests(options, options.replay, true, requests))
+            return 2;
+        orderCapture(requests);
+    }
+    else if (!options.mix.empty()) {
+        if (!loadRequests(options, options.mix, false, requests))
+            return 2;
+    }
+    else {
+        Request request;
+        request.wire = buildRequest(options, "GET", options.path, Jsonl::Fields(), "");
+        request.head = false;
+        request.weight = 1;
+        requests.push_back(request);
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* resolved;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &resolved);
+    if (error) {
+        std::fprintf(stderr, "webserv-bench: %s: %s\n", options.host.c_str(), gai_strerror(error));
+        return 2;
+    }
+    struct sockaddr_storage address;
+    std::memcpy(&address, resolved->ai_addr, resolved->ai_addrlen);
+    socklen_t address_length = resolved->ai_addrlen;
+    freeaddrinfo(resolved);
+
+    const char* syscalls_counter = "webserv_event_syscalls_total";
+    long syscalls_before = options.metrics.empty() ? -1 : scrapeCounter(options, address, address_length,
+                                                                        syscalls_counter);
+    std::vector<Worker> workers(options.threads);
+    long start_us = nowUs();
+    for (int i = 0; i < options.threads; i++) {
+        Worker& worker = workers[i];
+        worker.options = &options;
+        worker.requests = &requests;
+        worker.address = &address;
+        worker.address_length = address_length;
+        worker.connection_count = options.connections / options.threads +
+                                  (i < options.connections % options.threads ? 1 : 0);
+        worker.rate = options.rate / options.threads;
+        worker.seed = options.seed + i;
+        worker.start_us = start_us;
+    }
+    // Round robin keeps each thread's share in arrival order.
+    if (!options.replay.empty())
+        for (size_t i = 0; i < requests.size(); i++)
+            workers[i % options.threads].schedule.push_back(&requests[i]);
+    for (int i = 0; i < options.threads; i++)
+        pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+    for (int i = 0; i < options.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (nowUs() - start_us) / 1e6;
+    long syscalls = -1;
+    if (syscalls_before >= 0) {
+        long syscalls_after = scrapeCounter(options, address, address_length, syscalls_counter);
+        if (syscalls_after >= syscalls_before)
+            syscalls = syscalls_after - syscalls_before;
+    }
+
+    Worker total;
+    for (int i = 0; i < options.threads; i++) {
+        const Worker& worker = workers[i];
+        total.latency.merge(worker.latency);
+        total.service.merge(worker.service);
+        total.completed += worker.completed;
+        total.bytes += worker.bytes;
+        total.connect_errors += worker.connect_errors;
+        total.read_errors += worker.read_errors;
+        total.timeouts += worker.timeouts;
+        total.unsent += worker.unsent;
+        for (int c = 0; c < 6; c++)
+            total.status_classes[c] += worker.status_classes[c];
+        total.recorded.merge(worker.recorded);
+        total.matched += worker.matched;
+        for (std::map<std::pair<int, int>, unsigned long>::const_iterator it = worker.changed.begin();
+             it != worker.changed.end(); ++it)
+            total.changed[it->first] += it->second;
+    }
+    bool replay = !options.replay.empty();
+    unsigned long changed = 0;
+    for (std::map<std::pair<int, int>, unsigned long>::const_iterator it = total.changed.begin();
+         it != total.changed.end(); ++it)
+        changed += it->second;
+
+    const char* mode = replay ? "replay" : options.rate > 0 ? "open" : "closed";
+    if (options.json) {
+        std::string extra;
+        if (replay) {
+            char text[128];
+            std::snprintf(text, sizeof(text), ", \"replay\": {\"speed\": %.1f, \"matched\": %lu, \"changed\": {",
+                          options.speed, total.matched);
+            extra = std::string(", \"capture\": ") + Jsonl::quote(options.replay) + text;
+            for (std::map<std::pair<int, int>, unsigned long>::const_iterator it = total.changed.begin();
+                 it != total.changed.end(); ++it) {
+                std::snprintf(text, sizeof(text), "%s\"%d->%d\": %lu", it == total.changed.begin() ? "" : ", ",
+                              it->first.first, it->first.second, it->second);
+                extra += text;
+            }
+            extra += "}, \"recorded_us\": " + latencyJson(total.recorded) + "}";
+        }
+        if (syscalls >= 0) {
+            char text[64];
+            std::snprintf(text, sizeof(text), ", \"event_syscalls\": %ld", syscalls);
+            extra += text;
+        }
+        std::printf("{\"threads\": %d, \"connections\": %d, \"duration_s\": %.3f, \"mode\": \"%s\", "
+                    "\"rate\": %.1f, \"keep_alive\": %s, \"requests\": %lu, \"throughput\": %.1f, "
+                    "\"bytes_per_s\": %.0f, \"errors\": {\"connect\": %lu, \"read\": %lu, \"timeout\": %lu, "
+                    "\"status_4xx\": %lu, \"status_5xx\": %lu, \"unsent\": %lu}, \"latency_us\": %s, "
+                    "\"service_us\": %s%s}\n",
+                    options.threads, options.connections, elapsed, mode, options.rate,
+                    options.keep_alive ? "true" : "false", total.completed, total.completed / elapsed,
+                    total.bytes / elapsed, total.connect_errors, total.read_errors, total.timeouts,
+                    total.status_classes[4], total.status_classes[5], total.unsent,
+                    latencyJson(total.latency).c_str(), latencyJson(total.service).c_str(), extra.c_str());
+        return (replay && changed) ? 1 : 0;
+    }
+
+    std::printf("webserv-bench: %s:%s, %d threads, %d connections, %.1fs, ",
+                options.host.c_str(), options.port.c_str(), options.threads, options.connections, elapsed);
+    if (replay && options.speed > 0)
+        std::printf("replay of %s at %gx", options.replay.c_str(), options.speed);
+    else if (replay)
+        std::printf("replay of %s at full speed", options.replay.c_str());
+    else if (options.rate > 0)
+        std::printf("open loop at %.0f req/s", options.rate);
+    else
+        std::printf("closed loop");
+    std::printf(", %s, %lu request(s) in the %s\n", options.keep_alive ? "keep-alive" : "no keep-alive",
+                static_cast<unsigned long>(requests.size()), replay ? "capture" : "mix");
+    std::printf("  requests  %lu (%.1f/s), %.2f MB/s read\n", total.completed, total.completed / elapsed,
+                total.bytes / elapsed / (1024 * 1024));
+    std::printf("  status    2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n", total.status_classes[2],
+                total.status_classes[3], total.status_classes[4], total.status_classes[5],
+                total.status_classes[0] + total.status_classes[1]);
+    std::printf("  errors    connect %lu, read %lu, timeout %lu", total.connect_errors, total.read_errors,
+                total.timeouts);
+    if (options.rate > 0 || replay)
+        std::printf(", unsent at the end %lu", total.unsent);
+    std::printf("\n");
+    if (syscalls >= 0)
+        std::printf("  server    %ld event loop syscalls, %.2f per request\n", syscalls,
+                    total.completed ? static_cast<double>(syscalls) / total.completed : 0.0);
+    else if (!options.metrics.empty())
+        std::printf("  server    no %s at %s\n", syscalls_counter, options.metrics.c_str());
+    if (replay) {
+        std::printf("  replay    %lu of %lu with the recorded status", total.matched,
+                    static_cast<unsigned long>(requests.size()));
+        if (total.unsent)
+            std::printf(", %lu not sent", total.unsent);
+        std::printf("\n");
+        for (std::map<std::pair<int, int>, unsigned long>::const_iterator it = total.changed.begin();
+             it != total.changed.end(); ++it) {
+            if (it->first.second)
+                std::printf("    %d -> %d  %lu\n", it->first.first, it->first.second, it->second);
+            else
+                std::printf("    %d -> no response  %lu\n", it->first.first, it->second);
+        }
+    }
+    if (options.rate > 0 || (replay && options.speed > 0)) {
+        printLatency("latency from when each request was due (corrected for coordinated omission)", total.latency);
+        printLatency("service time (write to last byte)", total.service);
+    }
+    else
+        printLatency("latency (write to last byte)", total.service);
+    if (replay && total.recorded.count()) {
+        printLatency("recorded by the server at capture time", total.recorded);
+        std::printf("    p50 %+.3fms  p99 %+.3fms replayed (service time) against recorded\n",
+                    (total.service.percentile(50) - total.recorded.percentile(50)) / 1000.0,
+                    (total.service.percentile(99) - total.recorded.percentile(99)) / 1000.0);
+    }
+    return (replay && changed) ? 1 : 0;
+}
@@ -0,0 +1,807 @@
+// Soak and stress harness: keeps webserv busy with the traffic that tends to
+// leak, for minutes or hours, and checks that the server gives everything
+// back once it stops.
+//
+// The load, all at once:
+//   slowloris    connections that send a request a header line at a time,
+//                one every --drip, and never finish it
+//   churn        connections opened at a steady rate that each do one of:
+//                close right after connecting, close halfway through the
+//                headers, close halfway through a body, reset right after a
+//                full request, or a complete request
+//   uploads      large POST bodies streamed to a CGI, every other one cut
+//                off at a random point
+//   cgi          requests to a script that outlives the CGI timeout
+//
+// Every --interval the server is sampled: resident memory and open fds of
+// the master and its workers (from /proc, with --pid) and the table sizes of
+// the metrics endpoint. After the load the harness closes everything,
+// waits --settle for the server's timeouts to run, and samples again. It
+// fails (exit 1) when fds, memory or tables ended above where they started.
+//
+// usage: ./webserv-stress [--pid pid] [-d duration] [--interval d] [--settle d]
+//                         [--slowloris n] [--drip d] [--churn rate] [--uploads n]
+//                         [--upload-size size] [--cgi n] [--metrics path]
+//                         [--max-fd-growth n] [--max-rss-growth mb] http://host:port
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+struct Options {
+    std::string host;
+    std::string port;
+    pid_t pid;
+    long duration_us;
+    long interval_us;
+    long settle_us;
+    int slowloris;
+    long drip_us;
+    double churn;
+    int uploads;
+    unsigned long upload_size;
+    int cgi;
+    std::string get_path;
+    std::string upload_path;
+    std::string cgi_path;
+    std::string metrics_path;
+    long max_fd_growth;
+    double max_rss_growth_mb;
+
+    Options()
+        : pid(0), duration_us(60000000), interval_us(10000000), settle_us(70000000), slowloris(1000),
+          drip_us(5000000), churn(200), uploads(4), upload_size(64UL << 20), cgi(8), get_path("/"),
+          upload_path("/cgi/sink.py"), cgi_path("/cgi/slow.py"), metrics_path("/metrics"),
+          max_fd_growth(8), max_rss_growth_mb(32) {}
+};
+
+enum Kind { SLOWLORIS, CHURN, UPLOAD, CGI, KIND_COUNT };
+static const char* KIND_NAMES[] = { "slowloris", "churn", "upload", "cgi" };
+
+// What a churn connection does.
+enum Action { CLOSE_ON_CONNECT, HALF_HEADERS, HALF_BODY, RESET_AFTER_REQUEST, COMPLETE, ACTION_COUNT };
+
+struct Connection {
+    int fd;
+    Kind kind;
+    Action action;
+    bool connected;
+    std::string out;
+    size_t sent;
+    // Upload body still to send, and where an aborted one stops.
+    unsigned long body_left;
+    unsigned long abort_left;
+    long next_us;
+    long started_us;
+    std::string in;
+
+    Connection() : fd(-1), kind(CHURN), action(COMPLETE), connected(false), sent(0), body_left(0),
+                   abort_left(0), next_us(0), started_us(0) {}
+};
+
+struct Counters {
+    unsigned long opened[KIND_COUNT];
+    unsigned long closed_by_server[KIND_COUNT];
+    unsigned long responses[6];
+    unsigned long connect_errors;
+    unsigned long aborted;
+
+    Counters() : connect_errors(0), aborted(0) {
+        std::memset(opened, 0, sizeof(opened));
+        std::memset(closed_by_server, 0, sizeof(closed_by_server));
+        std::memset(responses, 0, sizeof(responses));
+    }
+};
+
+struct Sample {
+    long at_us;
+    bool has_process;
+    double rss_mb;
+    long fds;
+    int processes;
+    // From the metrics endpoint; empty when it could not be read.
+    std::map<std::string, long> tables;
+    long connections;
+
+    Sample() : at_us(0), has_process(false), rss_mb(0), fds(0), processes(0), connections(-1) {}
+};
+
+class Stress {
+public:
+    Stress(const Options& _options, const struct sockaddr_storage& _address, socklen_t _length)
+        : options(_options), address(_address), address_length(_length), epoll_fd(-1), seed(1),
+          churn_credit(0), metrics_expected(false) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    int run();
+
+private:
+    const Options& options;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int epoll_fd;
+    unsigned seed;
+    double churn_credit;
+    std::map<int, Connection> connections;
+    int running[KIND_COUNT];
+    // A server at its connection limit turns new ones away at once; the
+    // standing kinds wait a little before trying again.
+    long retry_us[KIND_COUNT];
+    bool metrics_expected;
+    Counters counters;
+
+    Sample sample(long start_us);
+    void printSample(const Sample& sample);
+    bool open(Kind kind);
+    void close(int fd, bool by_server);
+    void closeAll();
+    void topUp(long now);
+    void onConnected(Connection& conn);
+    void flush(Connection& conn);
+    void readFrom(Connection& conn);
+    void tick(long now);
+    void watch(const Connection& conn);
+    std::string request(const std::string& method, const std::string& path, unsigned long length,
+                        bool close) const;
+    std::string metricsText() const;
+};
+
+// The master and its workers: every process whose parent is the master.
+static std::vector<pid_t> processTree(pid_t master) {
+    std::vector<pid_t> pids;
+    pids.push_back(master);
+    DIR* proc = opendir("/proc");
+    if (!proc)
+        return pids;
+    struct dirent* entry;
+    while ((entry = readdir(proc)) != NULL) {
+        pid_t pid = std::atoi(entry->d_name);
+        if (pid <= 0)
+            continue;
+        std::ifstream stat(("/proc/" + std::string(entry->d_name) + "/stat").c_str());
+        std::string line;
+        if (!std::getline(stat, line))
+            continue;
+        // pid (comm) state ppid ...; comm may hold spaces and parentheses.
+        size_t paren = line.rfind(')');
+        if (paren == std::string::npos)
+            continue;
+        char state;
+        int parent;
+        if (std::sscanf(line.c_str() + paren + 1, " %c %d", &state, &parent) == 2 && parent == master)
+            pids.push_back(pid);
+    }
+    closedir(proc);
+    return pids;
+}
+
+static long countFds(pid_t pid) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%d/fd", static_cast<int>(pid));
+    DIR* dir = opendir(path);
+    if (!dir)
+        return -1;
+    long count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.')
+            count++;
+    closedir(dir);
+    return count;
+}
+
+static double rssMb(pid_t pid) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%d/statm", static_cast<int>(pid));
+    std::ifstream statm(path);
+    long size = 0;
+    long resident = 0;
+    if (!(statm >> size >> resident))
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024.0) / 1024.0;
+}
+
+// A plain blocking GET on a connection of its own, so that sampling works
+// however busy the load connections are.
+std::string Stress::metricsText() const {
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return "";
+    struct timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string text;
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&address), address_length) == 0) {
+        std::string wire = request("GET", options.metrics_path, 0, true);
+        if (send(fd, wire.data(), wire.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(wire.length())) {
+            char buffer[16384];
+            ssize_t n;
+            while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                text.append(buffer, n);
+        }
+    }
+    ::close(fd);
+    if (text.compare(0, 12, "HTTP/1.1 200") != 0 && text.compare(0, 12, "HTTP/1.0 200") != 0)
+        return "";
+    return text;
+}
+
+Sample Stress::sample(long start_us) {
+    Sample result;
+    result.at_us = nowUs() - start_us;
+    if (options.pid > 0) {
+        std::vector<pid_t> pids = processTree(options.pid);
+        result.has_process = countFds(options.pid) >= 0;
+        for (size_t i = 0; i < pids.size() && result.has_process; i++) {
+            long fds = countFds(pids[i]);
+            double rss = rssMb(pids[i]);
+            if (fds < 0 || rss < 0)
+                continue;
+            result.fds += fds;
+            result.rss_mb += rss;
+            result.processes++;
+        }
+    }
+
+    static const std::string table_prefix = "webserv_table_entries{table=\"";
+    static const std::string connections_prefix = "webserv_connections{state=";
+    std::istringstream text(metricsText());
+    std::string line;
+    while (std::getline(text, line)) {
+        if (line.compare(0, table_prefix.length(), table_prefix) == 0) {
+            size_t quote = line.find('"', table_prefix.length());
+            size_t space = line.rfind(' ');
+            if (quote != std::string::npos && space != std::string::npos)
+                result.tables[line.substr(table_prefix.length(), quote - table_prefix.length())] =
+                    std::atol(line.c_str() + space + 1);
+        }
+        else if (line.compare(0, connections_prefix.length(), connections_prefix) == 0) {
+            size_t space = line.rfind(' ');
+            if (result.connections < 0)
+                result.connections = 0;
+            result.connections += std::atol(line.c_str() + space + 1);
+        }
+    }
+    return result;
+}
+
+void Stress::printSample(const Sample& sample) {
+    std::printf("%7.0fs", sample.at_us / 1e6);
+    if (sample.has_process)
+        std::printf("  rss %7.1fMB  fds %6ld (%d processes)", sample.rss_mb, sample.fds, sample.processes);
+    for (std::map<std::string, long>::const_iterator it = sample.tables.begin(); it != sample.tables.end(); ++it)
+        if (it->second || it->first == "clients")
+            std::printf("  %s %ld", it->first.c_str(), it->second);
+    if (sample.tables.empty() && metrics_expected)
+        std::printf("  metrics unavailable");
+    std::printf("  |");
+    for (int k = 0; k < KIND_COUNT; k++)
+        std::printf(" %s %d/%lu", KIND_NAMES[k], running[k], counters.opened[k]);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+std::string Stress::request(const std::string& method, const std::string& path, unsigned long length,
+                            bool close) const {
+    std::string wire = method + " " + path + " HTTP/1.1\r\nHost: " + options.host + ":" + options.port +
+                       "\r\nUser-Agent: webserv-stress\r\n";
+    if (method == "POST") {
+        char text[128];
+        std::snprintf(text, sizeof(text), "Content-Type: application/octet-stream\r\nContent-Length: %lu\r\n",
+                      length);
+        wire += text;
+    }
+    if (close)
+        wire += "Connection: close\r\n";
+    return wire + "\r\n";
+}
+
+void Stress::watch(const Connection& conn) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if (!conn.connected || conn.sent < conn.out.length() || conn.body_left)
+        event.events |= EPOLLOUT;
+    event.data.fd = conn.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+bool Stress::open(Kind kind) {
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        counters.connect_errors++;
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&address), address_length) == -1 &&
+        errno != EINPROGRESS) {
+        counters.connect_errors++;
+        ::close(fd);
+        return false;
+    }
+    Connection& conn = connections[fd];
+    conn = Connection();
+    conn.fd = fd;
+    conn.kind = kind;
+    conn.started_us = nowUs();
+    if (kind == CHURN)
+        conn.action = static_cast<Action>(rand_r(&seed) % ACTION_COUNT);
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    running[kind]++;
+    counters.opened[kind]++;
+    return true;
+}
+
+void Stress::close(int fd, bool by_server) {
+    std::map<int, Connection>::iterator it = connections.find(fd);
+    if (it == connections.end())
+        return;
+    if (by_server) {
+        counters.closed_by_server[it->second.kind]++;
+        retry_us[it->second.kind] = nowUs() + 100000;
+    }
+    running[it->second.kind]--;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    ::close(fd);
+    connections.erase(it);
+}
+
+void Stress::closeAll() {
+    while (!connections.empty())
+        close(connections.begin()->first, false);
+}
+
+// Keeps the standing connections at their counts; churn arrives at its
+// rate whatever happens to the earlier ones.
+void Stress::topUp(long now) {
+    static long last_us = now;
+    churn_credit += options.churn * (now - last_us) / 1e6;
+    last_us = now;
+    while (churn_credit >= 1) {
+        churn_credit -= 1;
+        open(CHURN);
+    }
+    const int wanted[KIND_COUNT] = { options.slowloris, 0, options.uploads, options.cgi };
+    for (int k = 0; k < KIND_COUNT; k++)
+        for (int opened = 0; running[k] < wanted[k] && opened < 256 && now >= retry_us[k]; opened++)
+            if (!open(static_cast<Kind>(k)))
+                break;
+}
+
+void Stress::onConnected(Connection& conn) {
+    conn.connected = true;
+    switch (conn.kind) {
+        case SLOWLORIS:
+            conn.out = "GET " + options.get_path + " HTTP/1.1\r\n";
+            conn.next_us = nowUs() + options.drip_us;
+            break;
+        case UPLOAD:
+            conn.out = request("POST", options.upload_path, options.upload_size, true);
+            conn.body_left = options.upload_size;
+            // Every other upload is cut off somewhere in its body.
+            if (counters.opened[UPLOAD] % 2)
+                conn.abort_left = 1 + rand_r(&seed) % options.upload_size;
+            break;
+        case CGI:
+            conn.out = request("GET", options.cgi_path, 0, true);
+            break;
+        case CHURN:
+            switch (conn.action) {
+                case CLOSE_ON_CONNECT:
+                    close(conn.fd, false);
+                    return;
+                case HALF_HEADERS:
+                    conn.out = "GET " + options.get_path + " HTTP/1.1\r\nHost: ";
+                    break;
+                case HALF_BODY:
+                    conn.out = request("POST", options.upload_path, 100000, false) + std::string(1000, 'x');
+                    break;
+                case RESET_AFTER_REQUEST:
+                case COMPLETE:
+                case ACTION_COUNT:
+                    conn.out = request("GET", options.get_path, 0, true);
+                    break;
+            }
+            break;
+        case KIND_COUNT:
+            break;
+    }
+    flush(conn);
+}
+
+// Sends what is pending; for a churn connection that means it is done with
+// everything but reading, and may be dropped right away.
+void Stress::flush(Connection& conn) {
+    int fd = conn.fd;
+    while (conn.sent < conn.out.length()) {
+        ssize_t n = send(fd, conn.out.data() + conn.sent, conn.out.length() - conn.sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            close(fd, true);
+            return;
+        }
+        conn.sent += n;
+    }
+    static const std::string filler(65536, 'u');
+    while (conn.sent >= conn.out.length() && conn.body_left) {
+        size_t piece = conn.body_left < filler.length() ? conn.body_left : filler.length();
+        if (conn.abort_left && conn.abort_left < piece)
+            piece = conn.abort_left;
+        ssize_t n = send(fd, filler.data(), piece, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            close(fd, true);
+            return;
+        }
+        conn.body_left -= n;
+        if (conn.abort_left) {
+            conn.abort_left -= n;
+            if (!conn.abort_left) {
+                counters.aborted++;
+                close(fd, false);
+                return;
+            }
+        }
+    }
+    bool done = conn.sent >= conn.out.length() && !conn.body_left;
+    if (done && conn.kind == CHURN) {
+        if (conn.action == HALF_HEADERS || conn.action == HALF_BODY) {
+            counters.aborted++;
+            close(fd, false);
+            return;
+        }
+        if (conn.action == RESET_AFTER_REQUEST) {
+            struct linger reset = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            counters.aborted++;
+            close(fd, false);
+            return;
+        }
+    }
+    watch(conn);
+}
+
+// Responses are read to the end (they all ask for Connection: close) and
+// counted by status class.
+void Stress::readFrom(Connection& conn) {
+    char buffer[65536];
+    while (true) {
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            if (conn.in.length() < 16)
+                conn.in.append(buffer, n < 16 ? n : 16);
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        bool answered = conn.in.compare(0, 5, "HTTP/") == 0 && conn.in.length() >= 12;
+        if (answered) {
+            int status_class = (conn.in[9] - '0');
+            counters.responses[(status_class >= 1 && status_class <= 5) ? status_class : 0]++;
+        }
+        close(conn.fd, !answered || conn.kind == SLOWLORIS);
+        return;
+    }
+}
+
+// Drips for the slowloris connections, and a cap on how long anything may
+// hang on our side.
+void Stress::tick(long now) {
+    std::vector<int> expired;
+    for (std::map<int, Connection>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        Connection& conn = it->second;
+        if (conn.kind == SLOWLORIS && conn.connected && now >= conn.next_us) {
+            char header[48];
+            std::snprintf(header, sizeof(header), "X-Drip-%u: %ld\r\n", rand_r(&seed) % 1000, now);
+            conn.out.append(header);
+            conn.next_us = now + options.drip_us;
+            flush(conn);
+            continue;
+        }
+        if (conn.kind != SLOWLORIS && now - conn.started_us > 120000000L)
+            expired.push_back(it->first);
+    }
+    for (size_t i = 0; i < expired.size(); i++)
+        close(expired[i], false);
+}
+
+static void printGrowth(const char* what, double before, double after, const char* unit) {
+    std::printf("  %-16s %10.1f%s -> %10.1f%s  (%+.1f)\n", what, before, unit, after, unit, after - before);
+}
+
+int Stress::run() {
+    std::memset(running, 0, sizeof(running));
+    std::memset(retry_us, 0, sizeof(retry_us));
+    long start = nowUs();
+    Sample baseline = sample(start);
+    metrics_expected = !baseline.tables.empty();
+    if (options.pid > 0 && !baseline.has_process)
+        std::fprintf(stderr, "webserv-stress: cannot read /proc/%d, memory and fds are not checked\n",
+                     static_cast<int>(options.pid));
+    if (baseline.tables.empty())
+        std::fprintf(stderr, "webserv-stress: no metrics at %s, tables are not checked\n",
+                     options.metrics_path.c_str());
+    std::printf("baseline\n");
+    printSample(baseline);
+
+    Sample peak = baseline;
+    long end = start + options.duration_us;
+    long sampled = start;
+    long ticked = 0;
+    struct epoll_event events[512];
+    long now = nowUs();
+    while (now < end) {
+        topUp(now);
+        int count = epoll_wait(epoll_fd, events, 512, 10);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            std::map<int, Connection>::iterator it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            Connection& conn = it->second;
+            if (!conn.connected) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error) {
+                    counters.connect_errors++;
+                    close(fd, false);
+                    continue;
+                }
+                onConnected(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush(conn);
+                if (connections.find(fd) == connections.end())
+                    continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                readFrom(connections[fd]);
+        }
+        now = nowUs();
+        if (now - ticked >= 100000) {
+            tick(now);
+            ticked = now;
+        }
+        if (now - sampled >= options.interval_us) {
+            Sample current = sample(start);
+            printSample(current);
+            if (current.fds > peak.fds)
+                peak.fds = current.fds;
+            if (current.rss_mb > peak.rss_mb)
+                peak.rss_mb = current.rss_mb;
+            sampled = now;
+        }
+    }
+
+    closeAll();
+    std::printf("load stopped, settling for %.0fs\n", options.settle_us / 1e6);
+    std::fflush(stdout);
+    long settled = nowUs() + options.settle_us;
+    while (nowUs() < settled)
+        usleep(100000);
+    Sample final = sample(start);
+    printSample(final);
+
+    std::printf("\nconnections  ");
+    for (int k = 0; k < KIND_COUNT; k++)
+        std::printf("%s %lu (%lu closed by the server)  ", KIND_NAMES[k], counters.opened[k],
+                    counters.closed_by_server[k]);
+    std::printf("\n             connect errors %lu, cut off on purpose %lu\n", counters.connect_errors,
+                counters.aborted);
+    std::printf("responses    2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n", counters.responses[2],
+                counters.responses[3], counters.responses[4], counters.responses[5],
+                counters.responses[0] + counters.responses[1]);
+
+    bool failed = false;
+    std::printf("after settling, against the baseline:\n");
+    if (baseline.has_process && final.has_process) {
+        printGrowth("open fds", baseline.fds, final.fds, "");
+        printGrowth("resident memory", baseline.rss_mb, final.rss_mb, "MB");
+        std::printf("  %-16s %10ld  %10.1fMB\n", "peak", peak.fds, peak.rss_mb);
+        if (final.processes != baseline.processes)
+            std::printf("  processes        %d -> %d (a worker restarted; compare with care)\n",
+                        baseline.processes, final.processes);
+        if (final.fds - baseline.fds > options.max_fd_growth) {
+            std::printf("FAIL: open fds grew by %ld (at most %ld)\n", final.fds - baseline.fds,
+                        options.max_fd_growth);
+            failed = true;
+        }
+        if (final.rss_mb - baseline.rss_mb > options.max_rss_growth_mb) {
+            std::printf("FAIL: resident memory grew by %.1fMB (at most %.1fMB)\n",
+                        final.rss_mb - baseline.rss_mb, options.max_rss_growth_mb);
+            failed = true;
+        }
+    }
+    for (std::map<std::string, long>::const_iterator it = final.tables.begin(); it != final.tables.end(); ++it) {
+        long before = baseline.tables.count(it->first) ? baseline.tables[it->first] : 0;
+        if (it->second > before) {
+            std::printf("FAIL: %s still holds %ld entries (%ld before the load)\n", it->first.c_str(),
+                        it->second, before);
+            failed = true;
+        }
+    }
+    if (!baseline.tables.empty() && final.tables.empty()) {
+        std::printf("FAIL: the metrics endpoint stopped answering\n");
+        failed = true;
+    }
+    std::printf(failed ? "stress: FAILED\n" : "stress: passed\n");
+    return failed ? 1 : 0;
+}
+
+static long parseDuration(const std::string& text) {
+    char* end;
+    double value = std::strtod(text.c_str(), &end);
+    std::string unit(end);
+    if (unit == "ms")
+        return static_cast<long>(value * 1000);
+    if (unit == "m")
+        return static_cast<long>(value * 60000000);
+    if (unit == "h")
+        return static_cast<long>(value * 3600000000.0);
+    if (unit == "s" || unit.empty())
+        return static_cast<long>(value * 1000000);
+    return -1;
+}
+
+static unsigned long parseSize(const std::string& text) {
+    char* end;
+    unsigned long value = std::strtoul(text.c_str(), &end, 10);
+    std::string unit(end);
+    if (unit == "k" || unit == "K")
+        return value << 10;
+    if (unit == "m" || unit == "M")
+        return value << 20;
+    if (unit == "g" || unit == "G")
+        return value << 30;
+    return unit.empty() ? value : 0;
+}
+
+static void usage() {
+    std::fprintf(stderr,
+        "usage: webserv-stress [options] http://host:port\n"
+        "  --pid PID            the master's pid, to sample memory and fds from /proc\n"
+        "  -d DURATION          how long the load runs, e.g. 30s, 10m, 4h (60s)\n"
+        "  --interval D         between samples (10s)\n"
+        "  --settle D           wait after the load before the final sample (70s)\n"
+        "  --slowloris N        standing connections that never finish their headers (1000)\n"
+        "  --drip D             between their header lines (5s)\n"
+        "  --churn RATE         short-lived, mostly abandoned connections per second (200)\n"
+        "  --uploads N          concurrent uploads, every other one cut off (4)\n"
+        "  --upload-size SIZE   of each upload (64m)\n"
+        "  --cgi N              concurrent requests to the slow script (8)\n"
+        "  --get PATH           for slowloris and churn requests (/)\n"
+        "  --upload-path PATH   (/cgi/sink.py)\n"
+        "  --cgi-path PATH      a script that outlives the CGI timeout (/cgi/slow.py)\n"
+        "  --metrics PATH       the metrics location (/metrics)\n"
+        "  --max-fd-growth N    allowed growth of open fds (8)\n"
+        "  --max-rss-growth MB  allowed growth of resident memory (32)\n");
+}
+
+static bool parseArguments(int argc, char** argv, Options& options) {
+    std::string url;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (arg == "--pid" && has_value)
+            options.pid = std::atoi(argv[++i]);
+        else if (arg == "-d" && has_value)
+            options.duration_us = parseDuration(argv[++i]);
+        else if (arg == "--interval" && has_value)
+            options.interval_us = parseDuration(argv[++i]);
+        else if (arg == "--settle" && has_value)
+            options.settle_us = parseDuration(argv[++i]);
+        else if (arg == "--slowloris" && has_value)
+            options.slowloris = std::atoi(argv[++i]);
+        else if (arg == "--drip" && has_value)
+            options.drip_us = parseDuration(argv[++i]);
+        else if (arg == "--churn" && has_value)
+            options.churn = std::atof(argv[++i]);
+        else if (arg == "--uploads" && has_value)
+            options.uploads = std::atoi(argv[++i]);
+        else if (arg == "--upload-size" && has_value)
+            options.upload_size = parseSize(argv[++i]);
+        else if (arg == "--cgi" && has_value)
+            options.cgi = std::atoi(argv[++i]);
+        else if (arg == "--get" && has_value)
+            options.get_path = argv[++i];
+        else if (arg == "--upload-path" && has_value)
+            options.upload_path = argv[++i];
+        else if (arg == "--cgi-path" && has_value)
+            options.cgi_path = argv[++i];
+        else if (arg == "--metrics" && has_value)
+            options.metrics_path = argv[++i];
+        else if (arg == "--max-fd-growth" && has_value)
+            options.max_fd_growth = std::atol(argv[++i]);
+        else if (arg == "--max-rss-growth" && has_value)
+            options.max_rss_growth_mb = std::atof(argv[++i]);
+        else if (arg[0] != '-' && url.empty())
+            url = arg;
+        else
+            return false;
+    }
+    if (url.compare(0, 7, "http://") != 0) {
+        std::fprintf(stderr, "webserv-stress: expected an http://host:port URL\n");
+        return false;
+    }
+    std::string authority = url.substr(7, url.find('/', 7) - 7);
+    size_t colon = authority.rfind(':');
+    options.host = authority.substr(0, colon);
+    options.port = (colon == std::string::npos) ? "80" : authority.substr(colon + 1);
+    if (options.host.empty() || options.duration_us <= 0 || options.interval_us <= 0 || options.settle_us < 0 ||
+        options.drip_us <= 0 || options.slowloris < 0 || options.uploads < 0 || options.cgi < 0 ||
+        options.churn < 0 || !options.upload_size) {
+        std::fprintf(stderr, "webserv-stress: need a host, positive durations and sizes, "
+                             "and counts of zero or more\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Tens of thousands of connections need the hard limit.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        unsigned long wanted = options.slowloris + options.uploads + options.cgi + options.churn * 2 + 64;
+        if (wanted > limit.rlim_cur)
+            std::fprintf(stderr, "webserv-stress: %lu connections wanted, %lu fds allowed\n", wanted,
+                         static_cast<unsigned long>(limit.rlim_cur));
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* resolved;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &resolved);
+    if (error) {
+        std::fprintf(stderr, "webserv-stress: %s: %s\n", options.host.c_str(), gai_strerror(error));
+        return 2;
+    }
+    struct sockaddr_storage address;
+    std::memcpy(&address, resolved->ai_addr, resolved->ai_addrlen);
+    socklen_t address_length = resolved->ai_addrlen;
+    freeaddrinfo(resolved);
+
+    Stress stress(options, address, address_length);
+    return stress.run();
+}
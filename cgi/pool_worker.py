@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+# Persistent worker for `cgi_pool .py cgi/pool_worker.py;`. Runs CGI scripts
+# in-process, one request at a time, so the interpreter start-up and module
+# imports are paid once per worker instead of once per request.
+#
+# Protocol on stdin/stdout, every frame is a 4-byte big-endian length + data:
+#   request:  <env: NAME=value\0...> <body>
+#   response: <output>... <empty frame>
+import io
+import os
+import struct
+import sys
+import traceback
+
+BASE_ENV = dict(os.environ)
+code_cache = {}
+
+
+def read_exact(stream, n):
+    data = b""
+    while len(data) < n:
+        chunk = stream.read(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_frame(stream):
+    header = read_exact(stream, 4)
+    if header is None:
+        return None
+    (length,) = struct.unpack("!I", header)
+    return read_exact(stream, length)
+
+
+def write_frame(stream, data):
+    stream.write(struct.pack("!I", len(data)) + data)
+
+
+def load(path):
+    mtime = os.stat(path).st_mtime
+    cached = code_cache.get(path)
+    if cached and cached[0] == mtime:
+        return cached[1]
+    with open(path, "rb") as f:
+        code = compile(f.read(), path, "exec")
+    code_cache[path] = (mtime, code)
+    return code
+
+
+def run(env, body):
+    path = env.get("SCRIPT_FILENAME") or env.get("SCRIPT_NAME", "")
+    os.environ.clear()
+    os.environ.update(BASE_ENV)
+    os.environ.update(env)
+
+    out = io.BytesIO()
+    stdout = io.TextIOWrapper(out, encoding="utf-8", write_through=True)
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body), encoding="utf-8")
+    sys.stdout = stdout
+    sys.argv = [path]
+    try:
+        code = load(path)
+        exec(code, {"__name__": "__main__", "__file__": path, "__builtins__": __builtins__})
+    except SystemExit as e:
+        if e.code not in (None, 0):
+            return b"Status: 500 Internal Server Error\r\n\r\n"
+    except FileNotFoundError:
+        return b"Status: 404 Not Found\r\n\r\n"
+    except Exception:
+        traceback.print_exc(file=sys.stderr)
+        return b"Status: 500 Internal Server Error\r\n\r\n"
+    finally:
+        stdout.flush()
+        stdout.detach()
+        sys.stdout = sys.__stdout__
+        sys.stdin = sys.__stdin__
+    return out.getvalue()
+
+
+def main():
+    # Keep the protocol pipes to ourselves: stray prints from a script or a
+    # library go to stderr and a read of fd 0 sees /dev/null.
+    requests = os.fdopen(os.dup(0), "rb", buffering=0)
+    responses = os.fdopen(os.dup(1), "wb")
+    null = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(null, 0)
+    os.dup2(2, 1)
+    os.close(null)
+
+    while True:
+        env_block = read_frame(requests)
+        body = read_frame(requests)
+        if env_block is None or body is None:
+            return
+        env = {}
+        for item in env_block.split(b"\0"):
+            if b"=" in item:
+                name, value = item.split(b"=", 1)
+                env[name.decode("latin-1")] = value.decode("latin-1")
+        output = run(env, body)
+        if output:
+            write_frame(responses, output)
+        write_frame(responses, b"")
+        responses.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# Zygote for `cgi_zygote .py cgi/zygote.py;`. Starts once, imports what CGI
+# scripts commonly need, then forks a child per request. The server sends,
+# on the SOCK_SEQPACKET socket it left on our stdin, one message per request:
+#   <script path>\0<NAME=value>\0...   plus the script's stdin and stdout fds
+# and gets back the child's pid as ASCII. Children are double-forked so they
+# are reparented to the server (a child subreaper) and waited for there.
+import array
+import os
+import socket
+import sys
+import traceback
+
+# Warm-up: whatever is imported here is shared, already initialized, by
+# every child.
+import base64
+import datetime
+import hashlib
+import html
+import io
+import json
+import re
+import time
+import urllib.parse
+
+
+code_cache = {}
+
+
+# Compiled in the zygote, keyed by path and mtime, so children inherit the
+# code object instead of each parsing the script again.
+def load(path):
+    mtime = os.stat(path).st_mtime
+    cached = code_cache.get(path)
+    if cached and cached[0] == mtime:
+        return cached[1]
+    with open(path, "rb") as f:
+        code = compile(f.read(), path, "exec")
+    code_cache[path] = (mtime, code)
+    return code
+
+
+def run_child(script, code, env, fds):
+    os.dup2(fds[0], 0)
+    os.dup2(fds[1], 1)
+    os.close(fds[0])
+    os.close(fds[1])
+    os.environ.clear()
+    os.environ.update(env)
+    sys.argv = [script]
+    status = 0
+    try:
+        if code is None:
+            code = load(script)
+        exec(code, {"__name__": "__main__", "__file__": script, "__builtins__": __builtins__})
+    except SystemExit as e:
+        status = e.code if isinstance(e.code, int) else (0 if e.code is None else 1)
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    try:
+        sys.stdout.flush()
+    except BaseException:
+        pass
+    os._exit(status)
+
+
+def serve(control):
+    fd_size = array.array("i").itemsize
+    while True:
+        msg, ancdata, _, _ = control.recvmsg(1 << 20, socket.CMSG_SPACE(2 * fd_size))
+        if not msg:
+            return
+        fds = array.array("i")
+        for level, kind, data in ancdata:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds.frombytes(data[:len(data) - (len(data) % fd_size)])
+        parts = msg.split(b"\0")
+        script = parts[0].decode("latin-1")
+        env = {}
+        for item in parts[1:]:
+            if b"=" in item:
+                name, value = item.split(b"=", 1)
+                env[name.decode("latin-1")] = value.decode("latin-1")
+
+        if len(fds) != 2:
+            for fd in fds:
+                os.close(fd)
+            control.send(b"0")
+            continue
+
+        try:
+            code = load(script)
+        except (OSError, SyntaxError):
+            code = None  # let the child report it
+
+        r, w = os.pipe()
+        middle = os.fork()
+        if middle == 0:
+            control.close()
+            os.close(r)
+            child = os.fork()
+            if child == 0:
+                os.close(w)
+                run_child(script, code, env, fds)
+            os.write(w, str(child).encode())
+            os._exit(0)
+        os.close(w)
+        for fd in fds:
+            os.close(fd)
+        pid = os.read(r, 32)
+        os.close(r)
+        os.waitpid(middle, 0)
+        control.send(pid or b"0")
+
+
+def main():
+    # The control socket is on fd 0; move it out of the way so children
+    # start with a clean stdin slot.
+    control = socket.socket(fileno=os.dup(0))
+    null = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(null, 0)
+    os.close(null)
+    try:
+        serve(control)
+    except (ConnectionError, KeyboardInterrupt):
+        pass
+
+
+if __name__ == "__main__":
+    main()
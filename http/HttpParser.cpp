@@ -1,7 +1,8 @@
 #include "HttpParser.hpp"
 
 HttpParser::HttpParser() 
-    : buffer_(""), state_(PARSING_REQUEST_LINE), bytes_read_(0), content_length_(0), content_length_found_(false) {}
+    : buffer_(""), state_(PARSING_REQUEST_LINE), bytes_read_(0), content_length_(0), content_length_found_(false),
+      body_handler_(NULL), stream_body_(false) {}
 HttpParser::~HttpParser() {}
 
 void HttpParser::reset() {
@@ -10,6 +11,7 @@ void HttpParser::reset() {
     bytes_read_ = 0;
     content_length_ = 0;
     content_length_found_ = false;
+    stream_body_ = false;
     httpRequest_ = HttpRequest();
 }
 
@@ -31,8 +33,11 @@ int HttpParser::parseHttpRequest(const std::string& RequestData) {
                             state_ = ERROR;
                             return ERROR;
                         }
-                        if (content_length_ > 0)
+                        if (content_length_ > 0) {
                             state_ = PARSING_BODY;
+                            if (body_handler_ && body_handler_->streamBody(httpRequest_))
+                                stream_body_ = true;
+                        }
                         else
                             state_ = COMPLETE;
                     } else
@@ -42,6 +47,8 @@ int HttpParser::parseHttpRequest(const std::string& RequestData) {
                     break;
                 break;
             case PARSING_BODY:
+                if (stream_body_)
+                    return state_;
                 if (HttpParser::parseBody())
                     state_ = COMPLETE;
                 else 
@@ -139,4 +146,18 @@ bool HttpParser::hasEnoughData() {
         return !buffer_.empty();
     size_t newLineEx = buffer_.find("\r\n");
     return newLineEx != std::string::npos;
+}
+
+// What a streamed body has received but not handed out yet. Anything past
+// Content-Length in the buffer belongs to the next request.
+size_t HttpParser::bodyBuffered() const {
+    size_t needed = content_length_ - bytes_read_;
+    return buffer_.length() < needed ? buffer_.length() : needed;
+}
+
+void HttpParser::consumeBody(size_t bytes) {
+    buffer_.erase(0, bytes);
+    bytes_read_ += bytes;
+    if (bytes_read_ >= content_length_)
+        state_ = COMPLETE;
 }
\ No newline at end of file
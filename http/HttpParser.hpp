@@ -12,6 +12,15 @@ enum ParserState {
     ERROR
 };
 
+// Consulted once the headers of a request with a body are parsed. Returning
+// true makes the parser hand the body out piecewise (bodyData/consumeBody)
+// instead of collecting it into the request.
+class BodyHandler {
+    public:
+    virtual ~BodyHandler() {}
+    virtual bool streamBody(const HttpRequest& request) = 0;
+};
+
 class HttpParser {
     private:
     std::string buffer_;
@@ -20,6 +29,8 @@ class HttpParser {
     size_t bytes_read_;
     size_t content_length_;
     bool content_length_found_;
+    BodyHandler* body_handler_;
+    bool stream_body_;
     
     bool parseRequestLine();
     bool parseHeaders();
@@ -35,6 +46,15 @@ class HttpParser {
 
     const HttpRequest& getRequest() const { return httpRequest_; }
     ParserState getState() const { return state_; }
+    bool isIdle() const { return state_ == PARSING_REQUEST_LINE && buffer_.empty(); }
+
+    // Streamed bodies
+    void setBodyHandler(BodyHandler* handler) { body_handler_ = handler; }
+    bool isStreamingBody() const { return stream_body_; }
+    size_t bodyBuffered() const;
+    bool bodyReceived() const { return bytes_read_ + bodyBuffered() >= content_length_; }
+    const char* bodyData() const { return buffer_.data(); }
+    void consumeBody(size_t bytes);
 };
 
 #endif
\ No newline at end of file
@@ -17,7 +17,7 @@ std::string HttpRequest::getMethod() const { return method_; }
 std::string HttpRequest::getPath() const { return path_; }
 std::string HttpRequest::getVersion() const { return version_; }
 std::string HttpRequest::getQueryString() const { return query_string_; }
-std::string HttpRequest::getBody() const { return body_; }
+const std::string& HttpRequest::getBody() const { return body_; }
 size_t HttpRequest::getContentlength() const { return content_length_; }
 std::map<std::string, std::string> HttpRequest::getHeadersMap() const { return headers_; }
 
@@ -32,7 +32,12 @@ std::string HttpRequest::getHeader(const std::string& headerName) const {
         return "";
     std::map<std::string, std::string>::const_iterator it;
     for (it = headers_.begin(); it != headers_.end(); ++it) {
-        if (it->first == headerName)
+        if (it->first.length() != headerName.length())
+            continue;
+        size_t i = 0;
+        while (i < headerName.length() && std::tolower(it->first[i]) == std::tolower(headerName[i]))
+            i++;
+        if (i == headerName.length())
             return it->second;
     }
     return "";
@@ -57,6 +62,7 @@ void HttpRequest::handleURI(const std::string& uri) {
         throw ;
     if (uri.empty() || uri[0] != '/')
         throw MalformedRequestLineException("");
+    uri_ = uri;
     std::string allowedChars = "$_-.!*'(),%:@&=+/;?";
     // if (uri.find_first_not_of(allowedChars) != std::string::npos)
     //     throw ;
@@ -17,6 +17,7 @@ class HttpRequest {
     std::string path_;
     std::string version_;
     std::string query_string_;
+    std::string uri_;
 
     // headers
     std::map<std::string, std::string> headers_;
@@ -38,7 +39,6 @@ class HttpRequest {
     void addHeader(const std::string& key, const std::string& value);
     
     // helper functions
-    std::string percentDecode(const std::string& encoded);
     bool isDublicate(const std::string& name);
     
     public:
@@ -47,13 +47,15 @@ class HttpRequest {
     ~HttpRequest();
     
     friend class HttpParser;
+    static std::string percentDecode(const std::string& encoded);
     
     // getters
     std::string getMethod() const;
     std::string getPath() const;
     std::string getVersion() const;
     std::string getQueryString() const;
-    std::string getBody() const;
+    const std::string& getURI() const { return uri_; }
+    const std::string& getBody() const;
     size_t getContentlength() const;
     std::map<std::string, std::string> getHeadersMap() const; 
     
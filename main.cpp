@@ -1,5 +1,6 @@
 #include "parsing/Config.hpp"
 #include "server/Server.hpp"
+#include "server/Master.hpp"
 #include <iostream>
 int main(int argc, char** argv) {
     try {
@@ -36,9 +37,15 @@ int main(int argc, char** argv) {
                 std::cout << "\n";
         }
         
-        Server server(servers);
+        Server server(config);
+        server.setExecArgs(argc, argv);
         server.start();
-        server.run();
+        if (config.getGlobal().worker_processes > 0) {
+            Master master(server);
+            master.run();
+        }
+        else
+            server.run();
         
     } catch (const std::exception& e) {
         std::cerr << RED << "Error: " << e.what() << std::endl;
@@ -8,13 +8,56 @@ LocationConfig::LocationConfig()
     : autoindex(false), 
       redirect(0, ""), 
       client_max_body_size(0), 
-      has_body_count(false) {}
+      has_body_count(false),
+      fastcgi_keepalive(8),
+      fastcgi_max_conns(64),
+      fastcgi_read_timeout_ms(30000),
+      cgi_pool_min(1),
+      cgi_pool_max(4),
+      cgi_pool_max_requests(500),
+      cgi_pool_idle_timeout_ms(60000),
+      cgi_pool_timeout_ms(30000),
+      cgi_max_concurrent(0),
+      cgi_cache(false),
+      cgi_cache_ttl_ms(0),
+      cgi_cache_stale_ms(0),
+      cgi_nph(false),
+      proxy_connect_timeout_ms(5000),
+      proxy_read_timeout_ms(60000) {}
 
 ServerConfig::ServerConfig() 
     : port(80), 
       host("0.0.0.0"), 
       client_max_body_size(1048576) {}
 
+UpstreamServerConfig::UpstreamServerConfig()
+    : weight(1),
+      max_fails(1),
+      fail_timeout_ms(10000) {}
+
+UpstreamConfig::UpstreamConfig()
+    : balance("round_robin"),
+      keepalive(32) {}
+
+GlobalConfig::GlobalConfig() 
+    : worker_processes(0),
+      shutdown_timeout_ms(30000),
+      cgi_max_concurrent(64),
+      cgi_queue_size(128),
+      cgi_queue_timeout_ms(10000),
+      cgi_cache_entries(1024),
+      access_log("stdout"),
+      access_log_format("combined"),
+      access_log_buffer(1024 * 1024),
+      capture_sample(1.0),
+      capture_buffer(1024 * 1024),
+      trace_slowest(0),
+      loop_lag_warn_ms(100),
+      event_backend("epoll") {
+    log_formats["combined"] = "$remote_addr - - [$time_local] \"$request\" $status $body_bytes_sent "
+                              "\"$http_referer\" \"$http_user_agent\"";
+}
+
 Config::Config() {}
 
 Config::Config(const std::string& config_file) : _config_file(config_file) {
@@ -31,7 +74,8 @@ void Config::parse() {
 
 void Config::parse(const std::string& config_file) {
     _config_file = config_file;
-    _servers = Parser::parseConfigFile(config_file);
+    _global = GlobalConfig();
+    _servers = Parser::parseConfigFile(config_file, _global);
     validate();
 }
 
@@ -66,8 +110,15 @@ void Config::validate() {
                 throw ConfigException(ss.str());
             }
             location_paths.insert(_servers[i].locations[j].path);
+            
+            const std::string& pass = _servers[i].locations[j].proxy_pass;
+            if (!pass.empty() && _global.upstreams.find(pass) == _global.upstreams.end()
+                && (pass.rfind(':') == std::string::npos || pass.rfind(':') == 0))
+                throw ConfigException("proxy_pass: no upstream named " + pass);
         }
     }
+    if (!_global.access_log.empty() && !_global.log_formats.count(_global.access_log_format))
+        throw ConfigException("access_log: no log_format named " + _global.access_log_format);
 }
 
 const std::vector<ServerConfig>& Config::getServers() const {
@@ -78,6 +129,28 @@ std::vector<ServerConfig>& Config::getServers() {
     return _servers;
 }
 
+const GlobalConfig& Config::getGlobal() const {
+    return _global;
+}
+
+const std::string& Config::getConfigFile() const {
+    return _config_file;
+}
+
+ConfigSnapshot::ConfigSnapshot(const Config& config, unsigned long generation)
+    : _servers(config.getServers()), _global(config.getGlobal()), _generation(generation), _refs(1) {}
+
+ConfigSnapshot::~ConfigSnapshot() {}
+
+void ConfigSnapshot::retain() {
+    _refs++;
+}
+
+void ConfigSnapshot::release() {
+    if (--_refs == 0)
+        delete this;
+}
+
 ConfigException::ConfigException(const std::string& msg) 
     : _msg("Config Error:: " + msg + RESET) {}
 
@@ -22,6 +22,29 @@ struct LocationConfig {
     std::map<std::string, std::string> cgi;
     size_t client_max_body_size;
     bool has_body_count; //👀
+    std::string fastcgi_pass;
+    size_t fastcgi_keepalive;
+    size_t fastcgi_max_conns;
+    long fastcgi_read_timeout_ms;
+    std::map<std::string, std::string> cgi_pool;
+    size_t cgi_pool_min;
+    size_t cgi_pool_max;
+    size_t cgi_pool_max_requests;
+    long cgi_pool_idle_timeout_ms;
+    long cgi_pool_timeout_ms;
+    std::map<std::string, std::string> cgi_zygote;
+    size_t cgi_max_concurrent;
+    bool cgi_cache;
+    long cgi_cache_ttl_ms;
+    long cgi_cache_stale_ms;
+    std::vector<std::string> cgi_cache_vary;
+    bool cgi_nph;
+    // "prometheus", "slowest" (the trace_slowest dump), or empty.
+    std::string metrics;
+    std::string proxy_pass;
+    std::string proxy_uri;
+    long proxy_connect_timeout_ms;
+    long proxy_read_timeout_ms;
     
     LocationConfig();
 };
@@ -37,9 +60,62 @@ struct ServerConfig {
     ServerConfig();
 };
 
+// One `server` line of an upstream block.
+struct UpstreamServerConfig {
+    std::string address;
+    int weight;
+    int max_fails;
+    long fail_timeout_ms;
+    
+    UpstreamServerConfig();
+};
+
+// A named group of backends for proxy_pass. `balance` is "round_robin",
+// "least_conn" or "hash" (keyed on hash_key: $request_uri, $remote_addr,
+// $http_<header> or a literal).
+struct UpstreamConfig {
+    std::string name;
+    std::string balance;
+    std::string hash_key;
+    size_t keepalive;
+    std::vector<UpstreamServerConfig> servers;
+    
+    UpstreamConfig();
+};
+
+// Directives that live outside of any server block.
+struct GlobalConfig {
+    int worker_processes;
+    long shutdown_timeout_ms;
+    size_t cgi_max_concurrent;
+    size_t cgi_queue_size;
+    long cgi_queue_timeout_ms;
+    size_t cgi_cache_entries;
+    std::map<std::string, UpstreamConfig> upstreams;
+    // A file, "stdout" or "stderr"; empty when access_log is off.
+    std::string access_log;
+    std::string access_log_format;
+    size_t access_log_buffer;
+    std::map<std::string, std::string> log_formats;
+    // Where sampled requests are recorded for replay; empty when off.
+    std::string capture;
+    // The share of requests recorded, (0, 1].
+    double capture_sample;
+    size_t capture_buffer;
+    // Slowest requests kept per worker for `metrics slowest`; 0 is off.
+    int trace_slowest;
+    // An event handler running longer than this is reported; 0 is off.
+    long loop_lag_warn_ms;
+    // "epoll" or "io_uring", picked up by workers as they start.
+    std::string event_backend;
+    
+    GlobalConfig();
+};
+
 class Config {
 private:
     std::vector<ServerConfig> _servers;
+    GlobalConfig _global;
     std::string _config_file;
     
 public:
@@ -53,6 +129,33 @@ public:
     
     const std::vector<ServerConfig>& getServers() const;
     std::vector<ServerConfig>& getServers();
+    const GlobalConfig& getGlobal() const;
+    const std::string& getConfigFile() const;
+};
+
+// Immutable view of a parsed configuration. The server swaps in a new one on
+// reload; clients retain the snapshot they were accepted with until they are
+// gone, so pointers into it stay valid for the whole connection.
+class ConfigSnapshot {
+private:
+    const std::vector<ServerConfig> _servers;
+    const GlobalConfig _global;
+    unsigned long _generation;
+    int _refs;
+
+    ConfigSnapshot(const ConfigSnapshot&);
+    ConfigSnapshot& operator=(const ConfigSnapshot&);
+    ~ConfigSnapshot();
+
+public:
+    ConfigSnapshot(const Config& config, unsigned long generation);
+
+    void retain();
+    void release();
+
+    const std::vector<ServerConfig>& getServers() const { return _servers; }
+    const GlobalConfig& getGlobal() const { return _global; }
+    unsigned long getGeneration() const { return _generation; }
 };
 
 class ConfigException : public std::exception {
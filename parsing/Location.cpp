@@ -116,6 +116,126 @@ LocationConfig Parser::parseLocation(std::ifstream& file, const std::string& pat
                 throw ConfigException("cgi extension must start with '.': " + ext);
             location.cgi[ext] = handler;
         }
+        else if (directive == "cgi_pool") {
+            std::string ext, worker;
+            iss >> ext >> worker;
+            worker = Utils::removeSemicolon(worker);
+            if (ext.empty() || worker.empty())
+                throw ConfigException("cgi_pool directive requires extension and worker script");
+            if (ext[0] != '.')
+                throw ConfigException("cgi_pool extension must start with '.': " + ext);
+            location.cgi_pool[ext] = worker;
+        }
+        else if (directive == "cgi_zygote") {
+            std::string ext, zygote;
+            iss >> ext >> zygote;
+            zygote = Utils::removeSemicolon(zygote);
+            if (ext.empty() || zygote.empty())
+                throw ConfigException("cgi_zygote directive requires extension and zygote script");
+            if (ext[0] != '.')
+                throw ConfigException("cgi_zygote extension must start with '.': " + ext);
+            location.cgi_zygote[ext] = zygote;
+        }
+        else if (directive == "cgi_pool_workers") {
+            std::string min, max;
+            iss >> min >> max;
+            max = Utils::removeSemicolon(max);
+            if (!Utils::isNumber(min) || !Utils::isNumber(max) || std::atoi(max.c_str()) < 1
+                || std::atoi(min.c_str()) > std::atoi(max.c_str()))
+                throw ConfigException("cgi_pool_workers requires <min> <max> with 0 <= min <= max, max >= 1");
+            location.cgi_pool_min = std::atoi(min.c_str());
+            location.cgi_pool_max = std::atoi(max.c_str());
+        }
+        else if (directive == "cgi_max_concurrent") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (!Utils::isNumber(value))
+                throw ConfigException("cgi_max_concurrent requires a number, got: " + value);
+            location.cgi_max_concurrent = std::atoi(value.c_str());
+        }
+        else if (directive == "cgi_cache" || directive == "cgi_cache_stale") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            long duration = 0;
+            if (value != "off" && value != "on") {
+                try {
+                    duration = Utils::parseDuration(value);
+                }
+                catch (const std::exception&) {
+                    throw ConfigException("invalid " + directive + ": " + value);
+                }
+            }
+            // "cgi_cache on" caches only what the script marks with max-age.
+            if (directive == "cgi_cache") {
+                location.cgi_cache = (value != "off");
+                location.cgi_cache_ttl_ms = duration;
+            }
+            else
+                location.cgi_cache_stale_ms = duration;
+        }
+        else if (directive == "cgi_cache_vary") {
+            std::string header;
+            while (iss >> header) {
+                header = Utils::removeSemicolon(header);
+                if (!header.empty())
+                    location.cgi_cache_vary.push_back(header);
+            }
+            if (location.cgi_cache_vary.empty())
+                throw ConfigException("cgi_cache_vary requires at least one header name");
+        }
+        else if (directive == "cgi_nph") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (value != "on" && value != "off")
+                throw ConfigException("cgi_nph requires on or off, got: " + value);
+            // The scripts write the whole response, status line included.
+            location.cgi_nph = (value == "on");
+        }
+        else if (directive == "metrics") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (value != "on" && value != "off" && value != "slowest")
+                throw ConfigException("metrics requires on, slowest or off, got: " + value);
+            location.metrics = (value == "on") ? "prometheus" : (value == "slowest") ? "slowest" : "";
+        }
+        else if (directive == "cgi_pool_max_requests") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (!Utils::isNumber(value))
+                throw ConfigException("cgi_pool_max_requests requires a number, got: " + value);
+            location.cgi_pool_max_requests = std::atoi(value.c_str());
+        }
+        else if (directive == "cgi_pool_idle_timeout") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            try {
+                location.cgi_pool_idle_timeout_ms = Utils::parseDuration(value);
+            }
+            catch (const std::exception&) {
+                throw ConfigException("invalid cgi_pool_idle_timeout: " + value);
+            }
+        }
+        else if (directive == "cgi_pool_timeout") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            long timeout_ms;
+            try {
+                timeout_ms = Utils::parseDuration(value);
+            }
+            catch (const std::exception&) {
+                throw ConfigException("invalid cgi_pool_timeout: " + value);
+            }
+            if (timeout_ms <= 0)
+                throw ConfigException("cgi_pool_timeout must be positive, got: " + value);
+            location.cgi_pool_timeout_ms = timeout_ms;
+        }
         else if (directive == "client_max_body_size") {
             std::string size;
             iss >> size;
@@ -125,6 +245,73 @@ LocationConfig Parser::parseLocation(std::ifstream& file, const std::string& pat
             location.client_max_body_size = Utils::parseSize(size);
             location.has_body_count = true;
         }
+        else if (directive == "fastcgi_pass") {
+            iss >> location.fastcgi_pass;
+            location.fastcgi_pass = Utils::removeSemicolon(location.fastcgi_pass);
+            const std::string& pass = location.fastcgi_pass;
+            size_t colon = pass.rfind(':');
+            bool is_unix = pass.compare(0, 5, "unix:") == 0 && pass.length() > 5;
+            if (!is_unix && (colon == std::string::npos || colon == 0 || !Utils::isNumber(pass.substr(colon + 1))))
+                throw ConfigException("fastcgi_pass expects unix:/path or host:port, got: " + pass);
+        }
+        else if (directive == "fastcgi_keepalive" || directive == "fastcgi_max_conns") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (!Utils::isNumber(value))
+                throw ConfigException(directive + " requires a number, got: " + value);
+            if (directive == "fastcgi_keepalive")
+                location.fastcgi_keepalive = std::atoi(value.c_str());
+            else
+                location.fastcgi_max_conns = std::atoi(value.c_str());
+        }
+        else if (directive == "fastcgi_read_timeout") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            long timeout_ms;
+            try {
+                timeout_ms = Utils::parseDuration(value);
+            }
+            catch (const std::exception&) {
+                throw ConfigException("invalid fastcgi_read_timeout: " + value);
+            }
+            if (timeout_ms <= 0)
+                throw ConfigException("fastcgi_read_timeout must be positive, got: " + value);
+            location.fastcgi_read_timeout_ms = timeout_ms;
+        }
+        else if (directive == "proxy_pass") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (value.compare(0, 7, "http://") != 0 || value.length() == 7 || value[7] == '/')
+                throw ConfigException("proxy_pass expects http://upstream[/uri] or http://host:port[/uri], got: " + value);
+            std::string target = value.substr(7);
+            size_t slash = target.find('/');
+            if (slash != std::string::npos) {
+                location.proxy_uri = target.substr(slash);
+                target = target.substr(0, slash);
+            }
+            location.proxy_pass = target;
+        }
+        else if (directive == "proxy_connect_timeout" || directive == "proxy_read_timeout") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            long timeout_ms;
+            try {
+                timeout_ms = Utils::parseDuration(value);
+            }
+            catch (const std::exception&) {
+                throw ConfigException("invalid " + directive + ": " + value);
+            }
+            if (timeout_ms <= 0)
+                throw ConfigException(directive + " must be positive, got: " + value);
+            if (directive == "proxy_connect_timeout")
+                location.proxy_connect_timeout_ms = timeout_ms;
+            else
+                location.proxy_read_timeout_ms = timeout_ms;
+        }
         else {
             throw ConfigException("Unknown directive in location block: " + directive);
         }
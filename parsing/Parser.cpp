@@ -3,6 +3,7 @@
 #include <sstream>
 #include <cstdlib>
 #include <iostream>
+#include <unistd.h>
 
 void Parser::validateBraceLine(const std::string& line, char brace) {
     size_t brace_pos = line.find(brace);
@@ -167,7 +168,276 @@ ServerConfig Parser::parseServer(std::ifstream& file) {
     return server;
 }
 
-std::vector<ServerConfig> Parser::parseConfigFile(const std::string& filename) {
+// upstream <name> {
+//     server <host:port> [weight=N] [max_fails=N] [fail_timeout=T];
+//     least_conn; | hash <key>;
+//     keepalive <idle connections per server>;
+// }
+UpstreamConfig Parser::parseUpstream(std::ifstream& file, const std::string& header) {
+    UpstreamConfig upstream;
+    std::istringstream head(header);
+    std::string keyword, brace, extra;
+    head >> keyword >> upstream.name >> brace;
+    
+    if (upstream.name.empty() || upstream.name == "{")
+        throw ConfigException("upstream requires a name");
+    if (brace.empty()) {
+        std::string next_line;
+        if (!std::getline(file, next_line) || Utils::trim(Utils::removeComment(next_line)) != "{")
+            throw ConfigException("expected '{' after upstream " + upstream.name);
+    }
+    else if (brace != "{" || (head >> extra))
+        throw ConfigException("unexpected tokens in upstream header: " + header);
+    
+    std::string line;
+    while (std::getline(file, line)) {
+        line = Utils::trim(Utils::removeComment(line));
+        if (line.empty()) continue;
+        
+        if (line == "}") {
+            if (upstream.servers.empty())
+                throw ConfigException("upstream " + upstream.name + " has no servers");
+            return upstream;
+        }
+        
+        std::istringstream iss(line);
+        std::string directive;
+        iss >> directive;
+        
+        validateDirectiveLine(line, directive);
+        directive = Utils::removeSemicolon(directive);
+        
+        if (directive == "server") {
+            UpstreamServerConfig server;
+            iss >> server.address;
+            server.address = Utils::removeSemicolon(server.address);
+            size_t colon = server.address.rfind(':');
+            if (colon == std::string::npos || colon == 0 || !Utils::isNumber(server.address.substr(colon + 1)))
+                throw ConfigException("upstream server expects host:port, got: " + server.address);
+            
+            std::string token;
+            while (iss >> token) {
+                token = Utils::removeSemicolon(token);
+                if (token.empty())
+                    continue;
+                size_t eq = token.find('=');
+                std::string name = token.substr(0, eq);
+                std::string value = (eq == std::string::npos) ? "" : token.substr(eq + 1);
+                if (name == "weight" && Utils::isNumber(value)) {
+                    server.weight = std::atoi(value.c_str());
+                    if (server.weight < 1 || server.weight > 100)
+                        throw ConfigException("upstream server weight must be between 1 and 100, got: " + value);
+                }
+                else if (name == "max_fails" && Utils::isNumber(value))
+                    server.max_fails = std::atoi(value.c_str());
+                else if (name == "fail_timeout") {
+                    try {
+                        server.fail_timeout_ms = Utils::parseDuration(value);
+                    }
+                    catch (const std::exception& e) {
+                        throw ConfigException("fail_timeout: " + std::string(e.what()));
+                    }
+                }
+                else
+                    throw ConfigException("unknown upstream server parameter: " + token);
+            }
+            upstream.servers.push_back(server);
+        }
+        else if (directive == "least_conn")
+            upstream.balance = "least_conn";
+        else if (directive == "hash") {
+            iss >> upstream.hash_key;
+            upstream.hash_key = Utils::removeSemicolon(upstream.hash_key);
+            if (upstream.hash_key.empty())
+                throw ConfigException("hash requires a key");
+            upstream.balance = "hash";
+        }
+        else if (directive == "keepalive") {
+            std::string value;
+            iss >> value;
+            value = Utils::removeSemicolon(value);
+            if (!Utils::isNumber(value))
+                throw ConfigException("keepalive requires a number, got: " + value);
+            upstream.keepalive = std::atoi(value.c_str());
+        }
+        else
+            throw ConfigException("Unknown directive in upstream block: " + directive);
+    }
+    throw ConfigException("unexpected end of file in upstream " + upstream.name);
+}
+
+void Parser::parseGlobalDirective(const std::string& line, GlobalConfig& global) {
+    std::istringstream iss(line);
+    std::string directive;
+    iss >> directive;
+    
+    // A format may contain semicolons of its own.
+    if (directive != "log_format")
+        validateDirectiveLine(line, directive);
+    
+    if (directive == "worker_processes") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        if (value == "auto") {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            global.worker_processes = (cpus > 0) ? static_cast<int>(cpus) : 1;
+        }
+        else {
+            if (!Utils::isNumber(value))
+                throw ConfigException("worker_processes must be a number or 'auto', got: " + value);
+            global.worker_processes = std::atoi(value.c_str());
+            if (global.worker_processes > 64)
+                throw ConfigException("worker_processes must be between 0 and 64");
+        }
+    }
+    else if (directive == "shutdown_timeout") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        try {
+            global.shutdown_timeout_ms = Utils::parseDuration(value);
+        }
+        catch (const std::exception& e) {
+            throw ConfigException("shutdown_timeout: " + std::string(e.what()));
+        }
+    }
+    else if (directive == "cgi_max_concurrent" || directive == "cgi_queue_size" ||
+             directive == "cgi_cache_entries") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        if (!Utils::isNumber(value))
+            throw ConfigException(directive + " requires a number, got: " + value);
+        if (directive == "cgi_max_concurrent")
+            global.cgi_max_concurrent = std::atoi(value.c_str());
+        else if (directive == "cgi_queue_size")
+            global.cgi_queue_size = std::atoi(value.c_str());
+        else
+            global.cgi_cache_entries = std::atoi(value.c_str());
+    }
+    else if (directive == "cgi_queue_timeout") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        try {
+            global.cgi_queue_timeout_ms = Utils::parseDuration(value);
+        }
+        catch (const std::exception& e) {
+            throw ConfigException("cgi_queue_timeout: " + std::string(e.what()));
+        }
+    }
+    else if (directive == "access_log") {
+        std::string target;
+        iss >> target;
+        target = Utils::removeSemicolon(target);
+        if (target.empty())
+            throw ConfigException("access_log requires a path, stdout, stderr or off");
+        global.access_log = (target == "off") ? "" : target;
+        std::string arg;
+        while (iss >> arg) {
+            arg = Utils::removeSemicolon(arg);
+            if (arg.empty())
+                continue;
+            if (arg.compare(0, 7, "buffer=") == 0) {
+                try {
+                    global.access_log_buffer = Utils::parseSize(arg.substr(7));
+                }
+                catch (const std::exception& e) {
+                    throw ConfigException("access_log: " + std::string(e.what()));
+                }
+                if (global.access_log_buffer < 4096)
+                    throw ConfigException("access_log buffer must be at least 4k");
+            }
+            else
+                global.access_log_format = arg;
+        }
+    }
+    else if (directive == "capture") {
+        // capture <path>|off [sample=<percent>%] [buffer=<size>];
+        std::string target;
+        iss >> target;
+        target = Utils::removeSemicolon(target);
+        if (target.empty())
+            throw ConfigException("capture requires a path, stdout, stderr or off");
+        global.capture = (target == "off") ? "" : target;
+        std::string arg;
+        while (iss >> arg) {
+            arg = Utils::removeSemicolon(arg);
+            if (arg.empty())
+                continue;
+            if (arg.compare(0, 7, "sample=") == 0) {
+                std::string value = arg.substr(7);
+                char* end = NULL;
+                double percent = std::strtod(value.c_str(), &end);
+                if (value.empty() || end == value.c_str() || std::string(end) != "%" ||
+                    !(percent > 0) || percent > 100)
+                    throw ConfigException("capture sample must be a percentage in (0, 100], got: " + value);
+                global.capture_sample = percent / 100;
+            }
+            else if (arg.compare(0, 7, "buffer=") == 0) {
+                try {
+                    global.capture_buffer = Utils::parseSize(arg.substr(7));
+                }
+                catch (const std::exception& e) {
+                    throw ConfigException("capture: " + std::string(e.what()));
+                }
+                if (global.capture_buffer < 4096)
+                    throw ConfigException("capture buffer must be at least 4k");
+            }
+            else
+                throw ConfigException("capture: unknown parameter " + arg);
+        }
+    }
+    else if (directive == "loop_lag_warn") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        try {
+            global.loop_lag_warn_ms = (value == "off") ? 0 : Utils::parseDuration(value);
+        }
+        catch (const std::exception& e) {
+            throw ConfigException("loop_lag_warn: " + std::string(e.what()));
+        }
+    }
+    else if (directive == "event_backend") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        if (value != "epoll" && value != "io_uring")
+            throw ConfigException("event_backend must be 'epoll' or 'io_uring', got: " + value);
+        global.event_backend = value;
+    }
+    else if (directive == "trace_slowest") {
+        std::string value;
+        iss >> value;
+        value = Utils::removeSemicolon(value);
+        if (!Utils::isNumber(value))
+            throw ConfigException("trace_slowest must be a number, got: " + value);
+        global.trace_slowest = std::atoi(value.c_str());
+        if (global.trace_slowest > 64)
+            throw ConfigException("trace_slowest must be between 0 and 64");
+    }
+    else if (directive == "log_format") {
+        // log_format <name> '<format>';
+        std::string name;
+        std::string format;
+        iss >> name;
+        std::getline(iss, format);
+        format = Utils::trim(format);
+        if (name.empty() || format.empty() || format[format.length() - 1] != ';')
+            throw ConfigException("log_format requires a name and a quoted format ending with ';'");
+        format = Utils::trim(format.substr(0, format.length() - 1));
+        if (format.length() < 2 || (format[0] != '\'' && format[0] != '"') ||
+            format[format.length() - 1] != format[0])
+            throw ConfigException("log_format " + name + ": the format must be quoted");
+        global.log_formats[name] = format.substr(1, format.length() - 2);
+    }
+    else
+        throw ConfigException("unexpected token outside server block: " + line);
+}
+
+std::vector<ServerConfig> Parser::parseConfigFile(const std::string& filename, GlobalConfig& global) {
     std::vector<ServerConfig> servers;
     std::ifstream file(filename.c_str());
     
@@ -200,8 +470,13 @@ std::vector<ServerConfig> Parser::parseConfigFile(const std::string& filename) {
                     throw ConfigException("unexpected end of file after 'server'");
             } else
                 throw ConfigException("invalid server directive: " + line);
+        } else if (line.compare(0, 9, "upstream ") == 0) {
+            UpstreamConfig upstream = parseUpstream(file, line);
+            if (global.upstreams.count(upstream.name))
+                throw ConfigException("duplicate upstream: " + upstream.name);
+            global.upstreams[upstream.name] = upstream;
         } else
-            throw ConfigException("unexpected token outside server block: " + line);
+            parseGlobalDirective(line, global);
     }
     
     file.close();
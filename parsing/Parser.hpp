@@ -8,8 +8,10 @@
 
 class Parser {
 public:
-    static std::vector<ServerConfig> parseConfigFile(const std::string& filename);
+    static std::vector<ServerConfig> parseConfigFile(const std::string& filename, GlobalConfig& global);
+    static void parseGlobalDirective(const std::string& line, GlobalConfig& global);
     static ServerConfig parseServer(std::ifstream& file);
+    static UpstreamConfig parseUpstream(std::ifstream& file, const std::string& header);
     static LocationConfig parseLocation(std::ifstream& file, const std::string& path, bool braceOnSameLine = false);
     static void validateBraceLine(const std::string& line, char brace);
     static void validateDirectiveLine(const std::string& line, const std::string& directive);
@@ -75,6 +75,26 @@ size_t Utils::parseSize(const std::string& str) {
     return value;
 }
 
+// Durations are in milliseconds: "250ms", "30s", "2m", a bare number is seconds.
+long Utils::parseDuration(const std::string& str) {
+    size_t i = 0;
+    while (i < str.length() && ::isdigit(str[i]))
+        i++;
+    if (i == 0)
+        throw std::runtime_error("invalid duration: " + str);
+    
+    long value = std::atol(str.substr(0, i).c_str());
+    std::string unit = str.substr(i);
+    
+    if (unit == "ms")
+        return value;
+    if (unit.empty() || unit == "s")
+        return value * 1000;
+    if (unit == "m")
+        return value * 60 * 1000;
+    throw std::runtime_error("invalid duration unit: " + unit);
+}
+
 bool Utils::isNumber(const std::string& str) {
     if (str.empty()) return false;
     for (size_t i = 0; i < str.length(); i++)
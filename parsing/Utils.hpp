@@ -15,6 +15,7 @@ public:
     static std::string removeSemicolon(const std::string& str); 
     static std::vector<std::string> split(const std::string& str, char delim);
     static size_t parseSize(const std::string& str);
+    static long parseDuration(const std::string& str);
     static bool isNumber(const std::string& str);
     static bool isValidIPv4(const std::string& host);
     static bool isValidHostname(const std::string& host);
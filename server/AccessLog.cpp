@@ -0,0 +1,260 @@
+#include "AccessLog.hpp"
+#include "LogWriter.hpp"
+#include "Metrics.hpp"
+#include "../http/HttpRequest.hpp"
+#include <sys/time.h>
+#include <unistd.h>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+
+std::vector<AccessLog::Token> AccessLog::format;
+std::string AccessLog::line;
+
+static LogWriter writer("access_log");
+static unsigned long process_id = 0;
+
+AccessLog::Entry::Entry()
+    : request(NULL), remote_addr(NULL), status(0), bytes_sent(0), body_bytes_sent(0),
+      request_length(0), request_time_us(0), first_byte_us(-1) {
+    for (int i = 0; i < Metrics::PHASE_COUNT; i++)
+        phases_us[i] = -1;
+}
+
+std::vector<AccessLog::Token> AccessLog::compile(const std::string& text) {
+    static const struct {
+        const char* name;
+        Field field;
+    } variables[] = {
+        { "remote_addr", REMOTE_ADDR }, { "time_local", TIME_LOCAL },
+        { "time_iso8601", TIME_ISO8601 }, { "msec", MSEC }, { "request", REQUEST },
+        { "request_method", REQUEST_METHOD }, { "request_uri", REQUEST_URI },
+        { "server_protocol", SERVER_PROTOCOL }, { "status", STATUS },
+        { "bytes_sent", BYTES_SENT }, { "body_bytes_sent", BODY_BYTES_SENT },
+        { "request_length", REQUEST_LENGTH }, { "request_time", REQUEST_TIME },
+        { "pid", PID }, { "phase_headers", PHASE_HEADERS }, { "phase_body", PHASE_BODY },
+        { "phase_handler", PHASE_HANDLER }, { "phase_send", PHASE_SEND },
+        { "phase_total", PHASE_TOTAL }, { "phase_first_byte", PHASE_FIRST_BYTE },
+        { "phases", PHASES }, { NULL, LITERAL }
+    };
+
+    std::vector<Token> tokens;
+    Token literal;
+    literal.field = LITERAL;
+    size_t i = 0;
+    while (i < text.length()) {
+        size_t end = i + 1;
+        while (end < text.length() && (std::isalnum(text[end]) || text[end] == '_'))
+            end++;
+        if (text[i] != '$' || end == i + 1) {
+            literal.text += text[i++];
+            continue;
+        }
+
+        std::string name = text.substr(i + 1, end - i - 1);
+        Token token;
+        token.field = LITERAL;
+        if (name.compare(0, 5, "http_") == 0 && name.length() > 5) {
+            token.field = HTTP_HEADER;
+            token.text = name.substr(5);
+            for (size_t c = 0; c < token.text.length(); c++)
+                if (token.text[c] == '_')
+                    token.text[c] = '-';
+        }
+        for (size_t v = 0; variables[v].name && token.field == LITERAL; v++)
+            if (name == variables[v].name)
+                token.field = variables[v].field;
+        if (token.field == LITERAL) {
+            literal.text += text.substr(i, end - i);
+            i = end;
+            continue;
+        }
+        if (!literal.text.empty())
+            tokens.push_back(literal);
+        literal.text.clear();
+        tokens.push_back(token);
+        i = end;
+    }
+    if (!literal.text.empty())
+        tokens.push_back(literal);
+    return tokens;
+}
+
+void AccessLog::configure(const GlobalConfig& global) {
+    if (!global.access_log.empty())
+        format = compile(global.log_formats.find(global.access_log_format)->second);
+    writer.configure(global.access_log, global.access_log_buffer);
+}
+
+void AccessLog::start() {
+    process_id = getpid();
+    writer.start();
+}
+
+void AccessLog::stop() {
+    writer.stop();
+}
+
+void AccessLog::reopen() {
+    writer.reopen();
+}
+
+static void appendNumber(std::string& out, unsigned long value) {
+    char digits[24];
+    int length = std::snprintf(digits, sizeof(digits), "%lu", value);
+    out.append(digits, length);
+}
+
+static void appendOrDash(std::string& out, const std::string& value) {
+    if (value.empty())
+        out += '-';
+    else
+        out += value;
+}
+
+// Seconds with microseconds, "-" for a phase that did not happen.
+static void appendPhase(std::string& out, long us) {
+    if (us < 0) {
+        out += '-';
+        return;
+    }
+    char text[32];
+    out.append(text, std::snprintf(text, sizeof(text), "%ld.%06ld", us / 1000000, us % 1000000));
+}
+
+static long handlerPhase(const AccessLog::Entry& entry) {
+    long process = entry.phases_us[Metrics::PROCESS];
+    return process >= 0 ? process : entry.phases_us[Metrics::CGI];
+}
+
+// Both time formats change once a second; so does the work for them.
+static const std::string& timeField(bool iso8601) {
+    static time_t cached = 0;
+    static std::string local;
+    static std::string iso;
+    time_t now = std::time(NULL);
+    if (now != cached) {
+        struct tm tm;
+        char text[64];
+        localtime_r(&now, &tm);
+        strftime(text, sizeof(text), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        local = text;
+        strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        iso = text;
+        // %z gives +hhmm, ISO 8601 wants +hh:mm.
+        if (iso.length() >= 5)
+            iso.insert(iso.length() - 2, ":");
+        cached = now;
+    }
+    return iso8601 ? iso : local;
+}
+
+void AccessLog::append(const Token& token, const Entry& entry) {
+    const HttpRequest& request = *entry.request;
+    char text[32];
+    switch (token.field) {
+        case LITERAL:
+            line += token.text;
+            break;
+        case REMOTE_ADDR:
+            appendOrDash(line, *entry.remote_addr);
+            break;
+        case TIME_LOCAL:
+            line += timeField(false);
+            break;
+        case TIME_ISO8601:
+            line += timeField(true);
+            break;
+        case MSEC: {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            line.append(text, std::snprintf(text, sizeof(text), "%ld.%03ld",
+                                            static_cast<long>(tv.tv_sec), static_cast<long>(tv.tv_usec / 1000)));
+            break;
+        }
+        case REQUEST:
+            if (!request.getMethod().empty()) {
+                line += request.getMethod();
+                line += ' ';
+                line += request.getURI();
+                line += ' ';
+                line += request.getVersion();
+            }
+            break;
+        case REQUEST_METHOD:
+            appendOrDash(line, request.getMethod());
+            break;
+        case REQUEST_URI:
+            appendOrDash(line, request.getURI());
+            break;
+        case SERVER_PROTOCOL:
+            appendOrDash(line, request.getVersion());
+            break;
+        case STATUS:
+            appendNumber(line, entry.status);
+            break;
+        case BYTES_SENT:
+            appendNumber(line, entry.bytes_sent);
+            break;
+        case BODY_BYTES_SENT:
+            appendNumber(line, entry.body_bytes_sent);
+            break;
+        case REQUEST_LENGTH:
+            appendNumber(line, entry.request_length);
+            break;
+        case REQUEST_TIME:
+            line.append(text, std::snprintf(text, sizeof(text), "%ld.%03ld",
+                                            entry.request_time_us / 1000000,
+                                            (entry.request_time_us / 1000) % 1000));
+            break;
+        case PID:
+            appendNumber(line, process_id);
+            break;
+        case PHASE_HEADERS:
+            appendPhase(line, entry.phases_us[Metrics::HEADERS]);
+            break;
+        case PHASE_BODY:
+            appendPhase(line, entry.phases_us[Metrics::BODY]);
+            break;
+        case PHASE_HANDLER:
+            appendPhase(line, handlerPhase(entry));
+            break;
+        case PHASE_SEND:
+            appendPhase(line, entry.phases_us[Metrics::SEND]);
+            break;
+        case PHASE_TOTAL:
+            appendPhase(line, entry.phases_us[Metrics::TOTAL]);
+            break;
+        case PHASE_FIRST_BYTE:
+            appendPhase(line, entry.first_byte_us);
+            break;
+        case PHASES:
+            line += "headers=";
+            appendPhase(line, entry.phases_us[Metrics::HEADERS]);
+            line += " body=";
+            appendPhase(line, entry.phases_us[Metrics::BODY]);
+            line += " handler=";
+            appendPhase(line, handlerPhase(entry));
+            line += " first_byte=";
+            appendPhase(line, entry.first_byte_us);
+            line += " send=";
+            appendPhase(line, entry.phases_us[Metrics::SEND]);
+            line += " total=";
+            appendPhase(line, entry.phases_us[Metrics::TOTAL]);
+            break;
+        case HTTP_HEADER:
+            appendOrDash(line, request.getHeader(token.text));
+            break;
+    }
+}
+
+void AccessLog::log(const Entry& entry) {
+    if (!writer.running())
+        return;
+    line.clear();
+    for (size_t i = 0; i < format.size(); i++)
+        append(format[i], entry);
+    line += '\n';
+    if (!writer.push(line))
+        Metrics::logDropped();
+}
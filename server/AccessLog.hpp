@@ -0,0 +1,80 @@
+#ifndef ACCESSLOG_HPP
+#define ACCESSLOG_HPP
+
+#include "../parsing/Config.hpp"
+#include "Metrics.hpp"
+#include <string>
+#include <vector>
+
+class HttpRequest;
+
+// One line per request, formatted on the event loop and written by a
+// LogWriter. A line that does not fit its buffer is dropped and counted.
+// SIGUSR1 makes it reopen the file, for log rotation.
+class AccessLog {
+public:
+    struct Entry {
+        const HttpRequest* request;
+        const std::string* remote_addr;
+        int status;
+        size_t bytes_sent;
+        size_t body_bytes_sent;
+        size_t request_length;
+        long request_time_us;
+        // Indexed by Metrics::Phase, -1 for a phase the request skipped.
+        long phases_us[Metrics::PHASE_COUNT];
+        long first_byte_us;
+
+        Entry();
+    };
+
+private:
+    enum Field {
+        LITERAL,
+        REMOTE_ADDR,
+        TIME_LOCAL,
+        TIME_ISO8601,
+        MSEC,
+        REQUEST,
+        REQUEST_METHOD,
+        REQUEST_URI,
+        SERVER_PROTOCOL,
+        STATUS,
+        BYTES_SENT,
+        BODY_BYTES_SENT,
+        REQUEST_LENGTH,
+        REQUEST_TIME,
+        PID,
+        PHASE_HEADERS,
+        PHASE_BODY,
+        PHASE_HANDLER,
+        PHASE_SEND,
+        PHASE_TOTAL,
+        PHASE_FIRST_BYTE,
+        PHASES,
+        HTTP_HEADER
+    };
+    struct Token {
+        Field field;
+        std::string text;  // the literal, or the header name
+    };
+
+    static std::vector<Token> format;
+    static std::string line;
+
+    static std::vector<Token> compile(const std::string& format);
+    static void append(const Token& token, const Entry& entry);
+
+public:
+    // Takes the access_log settings of a (re)loaded configuration. The
+    // buffer size is fixed once the writer runs.
+    static void configure(const GlobalConfig& global);
+    // Starts the writer for this process, now or once logging is enabled.
+    static void start();
+    // Writes out what is buffered and stops the writer.
+    static void stop();
+    static void reopen();
+    static void log(const Entry& entry);
+};
+
+#endif
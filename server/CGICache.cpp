@@ -0,0 +1,173 @@
+#include "CGICache.hpp"
+#include <cstdlib>
+#include <cctype>
+
+CacheEntry::CacheEntry()
+    : has_response(false), stored_ms(0), fresh_until_ms(0), stale_until_ms(0),
+      pass_until_ms(0), filler_fd(-1) {}
+
+CGICache::CGICache() : max_entries(1024) {}
+
+CGICache::Result CGICache::lookup(const std::string& key, long now_ms, int client_fd,
+                                  const CacheEntry*& found) {
+    found = NULL;
+    std::map<std::string, CacheEntry>::iterator it = entries.find(key);
+    if (it == entries.end()) {
+        if (entries.size() >= max_entries)
+            evict(now_ms);
+        if (entries.size() >= max_entries)
+            return PASS;
+        entries[key].filler_fd = client_fd;
+        return MISS;
+    }
+
+    CacheEntry& entry = it->second;
+    found = &entry;
+    if (entry.pass_until_ms > now_ms)
+        return PASS;
+    if (entry.has_response && now_ms < entry.fresh_until_ms)
+        return HIT;
+    if (entry.filler_fd == -1) {
+        entry.filler_fd = client_fd;
+        return MISS;
+    }
+    if (entry.has_response && now_ms < entry.stale_until_ms)
+        return STALE;
+    entry.waiters.push_back(client_fd);
+    return WAIT;
+}
+
+const CacheEntry* CGICache::find(const std::string& key) const {
+    std::map<std::string, CacheEntry>::const_iterator it = entries.find(key);
+    return it != entries.end() && it->second.has_response ? &it->second : NULL;
+}
+
+// The fill finished with a cacheable response. Returns the waiters, who are
+// now served from it.
+std::vector<int> CGICache::store(const std::string& key, const HttpResponse& response,
+                                 long now_ms, long ttl_ms, long stale_ms) {
+    CacheEntry& entry = entries[key];
+    entry.response = response;
+    entry.has_response = true;
+    entry.stored_ms = now_ms;
+    entry.fresh_until_ms = now_ms + ttl_ms;
+    entry.stale_until_ms = now_ms + ttl_ms + stale_ms;
+    entry.pass_until_ms = 0;
+    entry.filler_fd = -1;
+
+    std::vector<int> waiters;
+    waiters.swap(entry.waiters);
+    return waiters;
+}
+
+// The fill produced nothing to keep (an uncacheable or unbuffered response,
+// or its client went away). With pass_ms the key is not cached for that
+// long. Returns the waiters, who must run the CGI themselves.
+std::vector<int> CGICache::abandon(const std::string& key, long now_ms, long pass_ms) {
+    std::vector<int> waiters;
+    std::map<std::string, CacheEntry>::iterator it = entries.find(key);
+    if (it == entries.end())
+        return waiters;
+
+    CacheEntry& entry = it->second;
+    entry.filler_fd = -1;
+    waiters.swap(entry.waiters);
+    if (pass_ms > 0) {
+        entry.pass_until_ms = now_ms + pass_ms;
+        entry.has_response = false;
+    }
+    else if (!entry.has_response)
+        entries.erase(it);
+    return waiters;
+}
+
+void CGICache::removeWaiter(const std::string& key, int client_fd) {
+    std::map<std::string, CacheEntry>::iterator it = entries.find(key);
+    if (it == entries.end())
+        return;
+    std::vector<int>& waiters = it->second.waiters;
+    for (std::vector<int>::iterator w = waiters.begin(); w != waiters.end(); ++w) {
+        if (*w == client_fd) {
+            waiters.erase(w);
+            return;
+        }
+    }
+}
+
+// Drops everything past its stale window, then, if still full, the idle
+// entries closest to expiry. Entries with a fill running are kept.
+void CGICache::evict(long now_ms) {
+    std::map<std::string, CacheEntry>::iterator it = entries.begin();
+    while (it != entries.end()) {
+        const CacheEntry& entry = it->second;
+        if (entry.filler_fd == -1 && entry.stale_until_ms <= now_ms && entry.pass_until_ms <= now_ms)
+            entries.erase(it++);
+        else
+            ++it;
+    }
+    while (entries.size() >= max_entries) {
+        std::map<std::string, CacheEntry>::iterator victim = entries.end();
+        for (it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.filler_fd == -1 &&
+                (victim == entries.end() || it->second.stale_until_ms < victim->second.stale_until_ms))
+                victim = it;
+        }
+        if (victim == entries.end())
+            return;
+        entries.erase(victim);
+    }
+}
+
+static std::string lowercase(const std::string& str) {
+    std::string lower = str;
+    for (size_t i = 0; i < lower.length(); i++)
+        lower[i] = std::tolower(lower[i]);
+    return lower;
+}
+
+// How long a response may be served: the script's Cache-Control (s-maxage,
+// max-age, stale-while-revalidate) wins over the location's cgi_cache and
+// cgi_cache_stale. False for anything that must not be shared.
+bool CGICache::lifetime(const HttpResponse& response, long default_ttl_ms,
+                        long default_stale_ms, long& ttl_ms, long& stale_ms) {
+    int status = response.getStatusCode();
+    if (status != 200 && status != 203 && status != 204 && status != 300 &&
+        status != 301 && status != 404 && status != 410)
+        return false;
+    if (response.hasHeader("Set-Cookie"))
+        return false;
+
+    ttl_ms = default_ttl_ms;
+    stale_ms = default_stale_ms;
+    bool shared_max_age = false;
+    std::string directives = lowercase(response.getHeader("Cache-Control"));
+    size_t pos = 0;
+    while (pos < directives.length()) {
+        size_t end = directives.find(',', pos);
+        if (end == std::string::npos)
+            end = directives.length();
+        std::string directive = directives.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t first = directive.find_first_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        directive = directive.substr(first, directive.find_last_not_of(" \t") - first + 1);
+        std::string name = directive.substr(0, directive.find('='));
+        long seconds = -1;
+        if (name.length() < directive.length())
+            seconds = std::atol(directive.c_str() + name.length() + 1);
+
+        if (name == "no-store" || name == "no-cache" || name == "private")
+            return false;
+        if (name == "s-maxage" && seconds >= 0) {
+            ttl_ms = seconds * 1000;
+            shared_max_age = true;
+        }
+        else if (name == "max-age" && seconds >= 0 && !shared_max_age)
+            ttl_ms = seconds * 1000;
+        else if (name == "stale-while-revalidate" && seconds >= 0)
+            stale_ms = seconds * 1000;
+    }
+    return ttl_ms > 0;
+}
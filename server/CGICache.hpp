@@ -0,0 +1,65 @@
+#ifndef CGICACHE_HPP
+#define CGICACHE_HPP
+
+#include "../http/HttpResponse.hpp"
+#include <string>
+#include <vector>
+#include <map>
+
+// One cached CGI response, or a fill in progress. `filler_fd` is the client
+// whose CGI run will (re)fill it; other clients that need it meanwhile wait
+// in `waiters`, or get the stale copy while one is there.
+struct CacheEntry {
+    HttpResponse response;
+    bool has_response;
+    long stored_ms;
+    long fresh_until_ms;
+    long stale_until_ms;
+    long pass_until_ms;
+    int filler_fd;
+    std::vector<int> waiters;
+
+    CacheEntry();
+};
+
+// Micro-cache for GET responses of a `cgi_cache` location. Concurrent misses
+// for one key run a single CGI; an uncacheable answer marks the key
+// pass-through for a while so its waiters (and whoever follows) stop queuing
+// behind each other.
+class CGICache {
+public:
+    enum Result {
+        MISS,   // run the CGI, its response fills the entry
+        HIT,
+        STALE,  // expired but inside the stale window, a refresh is running
+        WAIT,   // a fill is running and there is nothing to serve yet
+        PASS    // do not cache, run the CGI
+    };
+
+private:
+    std::map<std::string, CacheEntry> entries;
+    size_t max_entries;
+
+    CGICache(const CGICache&);
+    CGICache& operator=(const CGICache&);
+
+    void evict(long now_ms);
+
+public:
+    CGICache();
+
+    void setMaxEntries(size_t max) { max_entries = max; }
+    size_t size() const { return entries.size(); }
+    const CacheEntry* find(const std::string& key) const;
+
+    Result lookup(const std::string& key, long now_ms, int client_fd, const CacheEntry*& entry);
+    std::vector<int> store(const std::string& key, const HttpResponse& response,
+                           long now_ms, long ttl_ms, long stale_ms);
+    std::vector<int> abandon(const std::string& key, long now_ms, long pass_ms);
+    void removeWaiter(const std::string& key, int client_fd);
+
+    static bool lifetime(const HttpResponse& response, long default_ttl_ms,
+                         long default_stale_ms, long& ttl_ms, long& stale_ms);
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include "CGIPool.hpp"
+#include "CGIhelper.hpp"
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+extern char** environ;
+
+CGIWorker::CGIWorker()
+    : pid(-1), to_worker(-1), from_worker(-1), pool(NULL), client_fd(-1), requests(0),
+      idle_since_ms(0), out_sent(0) {}
+
+CGIPool::CGIPool(const std::string& interpreter, const std::string& script, size_t _min,
+                 size_t _max, size_t _max_requests, long _idle_timeout_ms)
+    : min_workers(_min), max_workers(_max), max_requests(_max_requests),
+      idle_timeout_ms(_idle_timeout_ms) {
+    if (!interpreter.empty())
+        argv.push_back(interpreter);
+    argv.push_back(script);
+}
+
+CGIPool::~CGIPool() {
+    shutdown();
+}
+
+static long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Same launch path as a one-shot CGI: pipes are O_CLOEXEC and the child gets
+// our environment (the request env travels in each frame instead).
+CGIWorker* CGIPool::spawn() {
+    int in[2];
+    int out[2];
+
+    if (pipe2(in, O_CLOEXEC) == -1)
+        return NULL;
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        close(in[0]); close(in[1]);
+        return NULL;
+    }
+    if (!setFdNonBlocking(in[1]) || !setFdNonBlocking(out[0])) {
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    char** args = vectorToCharArray(argv);
+    pid_t pid;
+    int err = posix_spawn(&pid, args[0], &actions, &attr, args, environ);
+
+    freeCharArray(args);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+
+    if (err != 0) {
+        close(in[1]);
+        close(out[0]);
+        errno = err;
+        return NULL;
+    }
+
+    CGIWorker* worker = new CGIWorker();
+    worker->pid = pid;
+    worker->to_worker = in[1];
+    worker->from_worker = out[0];
+    worker->pool = this;
+    worker->idle_since_ms = monotonicMs();
+    workers.push_back(worker);
+    return worker;
+}
+
+// An idle worker, or a new one while below max_workers. NULL with errno
+// EAGAIN when every worker is busy.
+CGIWorker* CGIPool::acquire(bool& spawned) {
+    spawned = false;
+    for (size_t i = 0; i < workers.size(); i++)
+        if (!workers[i]->isBusy())
+            return workers[i];
+
+    if (workers.size() >= max_workers) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    CGIWorker* worker = spawn();
+    spawned = (worker != NULL);
+    return worker;
+}
+
+// Closing its stdin ends an idle worker's read loop; a busy one is killed
+// since we no longer care about its output. Either way it is reaped later.
+void CGIPool::retire(CGIWorker* worker, bool kill_now) {
+    for (std::vector<CGIWorker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+        if (*it == worker) {
+            workers.erase(it);
+            break;
+        }
+    }
+    if (kill_now && worker->pid > 0)
+        kill(worker->pid, SIGKILL);
+    close(worker->to_worker);
+    close(worker->from_worker);
+    if (worker->pid > 0)
+        exited.push_back(worker->pid);
+    delete worker;
+}
+
+// The server reaped `pid`. A live worker keeps its slot until its pipes
+// report EOF; it just must not be signalled or waited for any more.
+bool CGIPool::childExited(pid_t pid) {
+    for (std::vector<pid_t>::iterator it = exited.begin(); it != exited.end(); ++it) {
+        if (*it == pid) {
+            exited.erase(it);
+            return true;
+        }
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i]->pid == pid) {
+            workers[i]->pid = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CGIPool::reapExited() {
+    std::vector<pid_t>::iterator it = exited.begin();
+    while (it != exited.end()) {
+        if (waitpid(*it, NULL, WNOHANG) != 0)
+            it = exited.erase(it);
+        else
+            ++it;
+    }
+}
+
+void CGIPool::shutdown() {
+    while (!workers.empty())
+        retire(workers.back(), true);
+    for (size_t i = 0; i < exited.size(); i++) {
+        kill(exited[i], SIGKILL);
+        waitpid(exited[i], NULL, 0);
+    }
+    exited.clear();
+    waiting.clear();
+}
+
+bool CGIPool::matches(size_t _min, size_t _max, size_t _max_requests, long _idle_timeout_ms) const {
+    return min_workers == _min && max_workers == _max && max_requests == _max_requests
+        && idle_timeout_ms == _idle_timeout_ms;
+}
+
+// No more pre-forking, and idle workers are let go as soon as they are idle.
+void CGIPool::drain() {
+    min_workers = 0;
+    idle_timeout_ms = 0;
+}
+
+// Idle workers past idle_timeout, keeping min_workers alive.
+std::vector<CGIWorker*> CGIPool::idleExpired(long now_ms) const {
+    std::vector<CGIWorker*> expired;
+    size_t remaining = workers.size();
+
+    for (size_t i = 0; i < workers.size() && remaining > min_workers; i++) {
+        if (!workers[i]->isBusy() && now_ms - workers[i]->idle_since_ms >= idle_timeout_ms) {
+            expired.push_back(workers[i]);
+            remaining--;
+        }
+    }
+    return expired;
+}
+
+static void appendFrame(std::string& out, const std::string& data) {
+    size_t len = data.length();
+    out += static_cast<char>((len >> 24) & 0xff);
+    out += static_cast<char>((len >> 16) & 0xff);
+    out += static_cast<char>((len >> 8) & 0xff);
+    out += static_cast<char>(len & 0xff);
+    out += data;
+}
+
+std::string CGIPool::encodeRequest(const std::vector<std::string>& env, const std::string& body) {
+    std::string block;
+    for (size_t i = 0; i < env.size(); i++) {
+        block += env[i];
+        block += '\0';
+    }
+    std::string out;
+    appendFrame(out, block);
+    appendFrame(out, body);
+    return out;
+}
+
+bool CGIPool::decodeFrame(std::string& buffer, std::string& frame) {
+    if (buffer.length() < 4)
+        return false;
+    const unsigned char* h = reinterpret_cast<const unsigned char*>(buffer.data());
+    size_t len = (static_cast<size_t>(h[0]) << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+    if (buffer.length() < 4 + len)
+        return false;
+    frame.assign(buffer, 4, len);
+    buffer.erase(0, 4 + len);
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef CGIPOOL_HPP
+#define CGIPOOL_HPP
+
+#include "Timers.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <ctime>
+#include <sys/types.h>
+
+class CGIPool;
+
+// A long-lived interpreter running the pool worker script. Requests go in on
+// its stdin and the CGI output comes back on its stdout, both framed as a
+// 4-byte big-endian length followed by that many bytes:
+//   request:  <env: NAME=value\0...> <body>
+//   response: <chunk>... <empty frame>
+struct CGIWorker {
+    pid_t pid;
+    int to_worker;
+    int from_worker;
+    CGIPool* pool;
+    int client_fd;
+    size_t requests;
+    long idle_since_ms;
+    std::string out;
+    size_t out_sent;
+    std::string in;
+    std::string output;
+    // cgi_pool_timeout for the request in progress.
+    Timers::Handle deadline;
+
+    CGIWorker();
+    bool isBusy() const { return client_fd != -1; }
+};
+
+class CGIPool {
+private:
+    std::vector<std::string> argv;
+    size_t min_workers;
+    size_t max_workers;
+    size_t max_requests;
+    long idle_timeout_ms;
+    std::vector<CGIWorker*> workers;
+    std::vector<pid_t> exited;
+
+    CGIPool(const CGIPool&);
+    CGIPool& operator=(const CGIPool&);
+
+public:
+    std::deque<int> waiting;
+
+    CGIPool(const std::string& interpreter, const std::string& script, size_t _min,
+            size_t _max, size_t _max_requests, long _idle_timeout_ms);
+    ~CGIPool();
+
+    CGIWorker* spawn();
+    CGIWorker* acquire(bool& spawned);
+    void retire(CGIWorker* worker, bool kill_now);
+    void reapExited();
+    bool childExited(pid_t pid);
+    void shutdown();
+    bool matches(size_t _min, size_t _max, size_t _max_requests, long _idle_timeout_ms) const;
+    void drain();
+    bool isDrained() const { return workers.empty() && exited.empty() && waiting.empty(); }
+
+    bool wantsMore() const { return workers.size() < min_workers; }
+    bool isWornOut(const CGIWorker* worker) const { return max_requests > 0 && worker->requests >= max_requests; }
+    std::vector<CGIWorker*> idleExpired(long now_ms) const;
+    const std::vector<CGIWorker*>& getWorkers() const { return workers; }
+
+    static std::string encodeRequest(const std::vector<std::string>& env, const std::string& body);
+    static bool decodeFrame(std::string& buffer, std::string& frame);
+};
+
+#endif
@@ -11,52 +11,74 @@ std::string extractValueAfterColon(const std::string& line) {
 }
 
 void setCGIResponseHeaders(HttpResponse& response, const std::string& headers) {
-    std::string content_type;
-    std::string location;
-    size_t content_length = 0;
     int status_code = 0;
+    std::string status_message;
     
     std::istringstream iss(headers);
     std::string line;
 
     while (std::getline(iss, line)) {
-        if (line == "\r" || line.empty()) // momkin ERROR hna !!!
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line.empty())
             break;
-        if (line.find("status:", 0) != std::string::npos)
-            status_code = atoi(extractValueAfterColon(line).c_str());
-        else if (line.find("content-length:", 0) != std::string::npos) {
-            content_length = atoi(extractValueAfterColon(line).c_str());
-            response.setContentLength(content_length); 
-        } else if (line.find("content-type:", 0) != std::string::npos) {
-            content_type = extractValueAfterColon(line);
-            response.setContentType(content_type);
-        } else if (line.find("location:", 0), std::string::npos) {
-            location = extractValueAfterColon(line);
-            if (!location.empty()) response.setLocation(location);
-        } else {
-            size_t colon_pos = line.find(':');
-            std::string name = line.substr(0, colon_pos);
-            std::string value = extractValueAfterColon(value);
-            response.setHeader(name, value);
+        size_t colon_pos = line.find(':');
+        if (colon_pos == std::string::npos || colon_pos == 0)
+            continue;
+        std::string name = HttpRequest::trim(line.substr(0, colon_pos));
+        std::string lower = name;
+        for (size_t i = 0; i < lower.length(); i++)
+            lower[i] = std::tolower(lower[i]);
+        std::string value = extractValueAfterColon(line);
+
+        if (lower == "status") {
+            status_code = atoi(value.c_str());
+            size_t space = value.find(' ');
+            if (space != std::string::npos)
+                status_message = HttpRequest::trim(value.substr(space + 1));
+        }
+        else if (lower == "content-length")
+            response.setContentLength(atoi(value.c_str()));
+        else if (lower == "content-type")
+            response.setContentType(value);
+        else if (lower == "location") {
+            if (!value.empty()) response.setLocation(value);
         }
+        else
+            response.setHeader(name, value);
     }
 
-    // Set default if not found
+    // Set default if not found (a Location without Status is a redirect)
+    if (!status_code && !response.getHeader("Location").empty())
+        status_code = 302;
+    if (status_code && !status_message.empty())
+        response.setStatus(status_code, status_message);
+    else if (status_code)
+        response.setStatus(status_code);
     if (!response.getStatusCode()) response.setStatus(200);
-    if (response.getHeader("Content-Length").empty()) 
-        response.setContentLength(response.getBody().length());
     if (response.getHeader("Content-Type").empty())
         response.setContentType("text/html; charset=utf-8");
 }
 
+// Offset of the body in a CGI's output (past the blank line ending the
+// headers, CRLF or bare LF), npos while the headers are incomplete.
+size_t findCGIBody(const std::string& cgi_output) {
+    size_t separator = 4;
+    size_t headers_end = cgi_output.find("\r\n\r\n");
+    size_t lf_end = cgi_output.find("\n\n");
+    if (headers_end == std::string::npos || (lf_end != std::string::npos && lf_end < headers_end)) {
+        headers_end = lf_end;
+        separator = 2;
+    }
+    return headers_end == std::string::npos ? headers_end : headers_end + separator;
+}
+
 // validate that the CGI headers comply with HTTP/1.0 formatting rules!!!
 HttpResponse processCGIOutput(const std::string& cgi_output) {
     HttpResponse cgi_response;
-    size_t headers_end = cgi_output.find("\r\n\r\n");
-    if (headers_end == std::string::npos) 
-        headers_end = cgi_output.find("\n\n");
+    size_t body_start = findCGIBody(cgi_output);
 
-    if (headers_end == std::string::npos) {
+    if (body_start == std::string::npos) {
         std::string headers = "";
         std::string body = cgi_output;
         cgi_response.setStatus(200);
@@ -65,14 +87,33 @@ HttpResponse processCGIOutput(const std::string& cgi_output) {
         return cgi_response;
     }
 
-    std::string headers = cgi_output.substr(0, headers_end);
-    std::string body = cgi_output.substr(headers_end + 1);
+    std::string headers = cgi_output.substr(0, body_start);
+    std::string body = cgi_output.substr(body_start);
 
+    // setBody supplies Content-Length unless the script sends its own.
     cgi_response.setBody(body);
     setCGIResponseHeaders(cgi_response, headers);
     return cgi_response;
 }
 
+// An NPH script's first line is its own status line, the only part of its
+// output we look at: "HTTP/1.x NNN[ reason]".
+bool validNPHStatusLine(const std::string& line) {
+    size_t length = line.length();
+    if (length && line[length - 1] == '\r')
+        length--;
+    if (length < 12 || line.compare(0, 7, "HTTP/1.") != 0 || (line[7] != '0' && line[7] != '1')
+        || line[8] != ' ' || line[9] < '1' || line[9] > '5'
+        || !std::isdigit(line[10]) || !std::isdigit(line[11]))
+        return false;
+    if (length > 12 && line[12] != ' ')
+        return false;
+    for (size_t i = 12; i < length; i++)
+        if (std::iscntrl(static_cast<unsigned char>(line[i])))
+            return false;
+    return true;
+}
+
 bool setFdNonBlocking(int fd) {
     int flags;
     flags = fcntl(fd, F_GETFL, 0);
@@ -19,6 +19,8 @@ std::vector<std::string> prepareEnv(const HttpRequest* _request, const ServerCon
 char** vectorToCharArray(const std::vector<std::string>& vec);
 std::string extractValueAfterColon(const std::string& line);
 void setCGIResponseHeaders(HttpResponse& response, const std::string& headers);
+size_t findCGIBody(const std::string& cgi_output);
 HttpResponse processCGIOutput(const std::string& cgi_output);
+bool validNPHStatusLine(const std::string& line);
 void freeCharArray(char** arr);
 bool setFdNonBlocking(int fd);
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "Capture.hpp"
+#include "LogWriter.hpp"
+#include "../http/HttpRequest.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <strings.h>
+
+double Capture::sample = 1.0;
+double Capture::credit = 0.0;
+std::string Capture::line;
+
+static LogWriter writer("capture");
+
+// Left out of the record: what the replayer rebuilds from body_size and
+// its own connection handling, and what should not end up in a file.
+static bool skippedHeader(const std::string& name) {
+    static const char* skipped[] = {
+        "Content-Length", "Transfer-Encoding", "Connection", "Keep-Alive",
+        "Authorization", "Proxy-Authorization", "Cookie", NULL
+    };
+    for (int i = 0; skipped[i]; i++)
+        if (strcasecmp(name.c_str(), skipped[i]) == 0)
+            return true;
+    return false;
+}
+
+static void appendQuoted(std::string& out, const std::string& text) {
+    out += '"';
+    for (size_t i = 0; i < text.length(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20 || c == 0x7F) {
+            char escaped[8];
+            out.append(escaped, std::snprintf(escaped, sizeof(escaped), "\\u%04x", c));
+        }
+        else
+            out += c;
+    }
+    out += '"';
+}
+
+void Capture::configure(const GlobalConfig& global) {
+    sample = global.capture_sample;
+    writer.configure(global.capture, global.capture_buffer);
+}
+
+void Capture::start() {
+    writer.start();
+}
+
+void Capture::stop() {
+    writer.stop();
+}
+
+void Capture::reopen() {
+    writer.reopen();
+}
+
+// Sampling is by credit rather than chance: at 10% every tenth request is
+// recorded, so a short capture still has the configured share.
+void Capture::record(const HttpRequest& request, long arrived_us, int status, long time_us) {
+    if (!writer.running() || request.getMethod().empty())
+        return;
+    credit += sample;
+    if (credit < 1.0)
+        return;
+    credit -= 1.0;
+
+    std::string length = request.getHeader("Content-Length");
+    size_t body_size = length.empty() ? request.getBody().size() : std::strtoul(length.c_str(), NULL, 10);
+    char number[128];
+
+    line.clear();
+    line.append(number, std::snprintf(number, sizeof(number), "{\"t_us\":%ld,\"method\":", arrived_us));
+    appendQuoted(line, request.getMethod());
+    line += ",\"uri\":";
+    appendQuoted(line, request.getURI());
+    line += ",\"headers\":{";
+    std::map<std::string, std::string> headers = request.getHeadersMap();
+    bool first = true;
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        if (skippedHeader(it->first))
+            continue;
+        if (!first)
+            line += ',';
+        first = false;
+        appendQuoted(line, it->first);
+        line += ':';
+        appendQuoted(line, it->second);
+    }
+    line.append(number, std::snprintf(number, sizeof(number), "},\"body_size\":%lu,\"status\":%d,\"time_us\":%ld}\n",
+                                      static_cast<unsigned long>(body_size), status, time_us));
+    // A full buffer loses the line; the capture is a sample anyway.
+    writer.push(line);
+}
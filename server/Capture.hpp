@@ -0,0 +1,33 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include "../parsing/Config.hpp"
+#include <string>
+
+class HttpRequest;
+
+// Records a sample of the requests served as JSON lines, for webserv-bench
+// --replay: arrival time, method, URI, headers, body size, and the status
+// and total time of the response. Bodies are not kept, only their size, and
+// neither are credentials (Authorization, Cookie) or the framing headers
+// the replayer sets itself.
+//
+// Lines go through a LogWriter of their own; SIGUSR1 reopens the file
+// along with the access log.
+class Capture {
+private:
+    static double sample;
+    static double credit;
+    static std::string line;
+
+public:
+    static void configure(const GlobalConfig& global);
+    static void start();
+    static void stop();
+    static void reopen();
+    // arrived_us is when the request started arriving (Metrics::nowUs),
+    // time_us how long it took until the response was sent.
+    static void record(const HttpRequest& request, long arrived_us, int status, long time_us);
+};
+
+#endif
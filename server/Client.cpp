@@ -1,6 +1,9 @@
 #include "Client.hpp"
 #include "../http/HttpResponse.hpp"
 #include "../http/Methods.hpp"
+#include "Metrics.hpp"
+#include "AccessLog.hpp"
+#include "Capture.hpp"
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -9,19 +12,37 @@
 #include <cstring>
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
 
-Client::Client(int _fd, const ServerConfig* config) 
+Client::Client(int _fd, const ServerConfig* config, ConfigSnapshot* _snapshot) 
     : fd(_fd), 
       state(READING_REQUEST), 
       server_config(config),
+      snapshot(_snapshot),
       bytes_sent(0),
       keep_alive(false), 
-      cgi_requested(false) {
+      close_requested(false),
+      cgi_requested(false),
+      response_streaming(false),
+      started_us(Metrics::nowUs()),
+      headers_us(0),
+      body_us(0),
+      handler_us(0),
+      responded_us(0),
+      status(0),
+      request_length(0),
+      response_bytes(0),
+      response_head(0) {
     last_activity = std::time(NULL);
+    snapshot->retain();
+    http_parser.setBodyHandler(this);
 }
 
 Client::~Client() {
+    // Cut short mid-response, still counted.
+    recordRequest();
     close();
+    snapshot->release();
 }
 
 bool Client::readRequest() {
@@ -30,11 +51,20 @@ bool Client::readRequest() {
     
     if (bytes > 0) {
         last_activity = std::time(NULL);
+        Metrics::received(bytes);
+        request_length += bytes;
+        if (!started_us)
+            started_us = Metrics::nowUs();
         
         try {
             int parser_state = http_parser.parseHttpRequest(std::string(buffer, bytes));
+            if ((parser_state == PARSING_BODY || parser_state == COMPLETE) && !headers_us)
+                headers_us = Metrics::nowUs();
+            if (parser_state == COMPLETE || (parser_state == PARSING_BODY && http_parser.isStreamingBody() &&
+                                             http_parser.bodyReceived()))
+                body_us = Metrics::nowUs();
             
-            if (parser_state == COMPLETE) {
+            if (parser_state == COMPLETE || (parser_state == PARSING_BODY && http_parser.isStreamingBody())) {
                 state = PROCESSING_REQUEST;
                 return true;
             }
@@ -74,27 +104,101 @@ bool Client::readRequest() {
     }
 }
 
+// More of a streamed body, buffered in the parser until the server writes it
+// to the CGI. False when the peer is gone.
+bool Client::readBody() {
+    char buffer[8192];
+    ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+
+    if (bytes > 0) {
+        last_activity = std::time(NULL);
+        Metrics::received(bytes);
+        request_length += bytes;
+        http_parser.parseHttpRequest(std::string(buffer, bytes));
+        if (!body_us && http_parser.bodyReceived())
+            body_us = Metrics::nowUs();
+        return true;
+    }
+    if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    state = CLOSING;
+    return false;
+}
+
+// What was sent already is dropped first, so a slow client holds at most
+// what is still unsent.
+void Client::appendResponse(const char* data, size_t length) {
+    if (bytes_sent > 0) {
+        response_buffer.erase(0, bytes_sent);
+        bytes_sent = 0;
+    }
+    response_buffer.append(data, length);
+}
+
+// True when the connection is done with, false when it was reset for the
+// next request.
+bool Client::finishResponse() {
+    recordRequest();
+    response_streaming = false;
+    if (isKeepAlive()) {
+        http_parser.reset();
+        cgi_requested = false;
+        state = READING_REQUEST;
+        return false;
+    }
+    return true;
+}
+
+// A response that goes out before a streamed body was fully read leaves the
+// rest of it on the wire, so the connection cannot be reused.
+bool Client::isKeepAlive() const {
+    return keep_alive && (!http_parser.isStreamingBody() || http_parser.getState() == COMPLETE);
+}
+
+// True once nothing interim is left. A hard error drops it: the connection
+// is gone, and the next read or write on it says so.
+bool Client::flushInterim() {
+    while (!interim.empty()) {
+        ssize_t bytes = send(fd, interim.data(), interim.length(), 0);
+        if (bytes > 0) {
+            interim.erase(0, bytes);
+            Metrics::sent(bytes);
+            continue;
+        }
+        if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        interim.clear();
+    }
+    return true;
+}
+
 bool Client::sendResponse() {
+    if (!flushInterim())
+        return false;
     if (response_buffer.empty())
         return true;
+    // Every response goes out through here first, starting with its status line.
+    if (!responded_us) {
+        responded_us = Metrics::nowUs();
+        if (response_buffer.compare(0, 5, "HTTP/") == 0 && response_buffer.length() > 12)
+            status = std::atoi(response_buffer.c_str() + 9);
+        size_t head_end = response_buffer.find("\r\n\r\n");
+        response_head = (head_end == std::string::npos) ? 0 : head_end + 4;
+    }
     
     ssize_t bytes = send(fd, response_buffer.c_str() + bytes_sent, response_buffer.length() - bytes_sent, 0);
 
     if (bytes > 0) {
         bytes_sent += bytes;
+        countSent(bytes);
         last_activity = std::time(NULL);
         
         if (bytes_sent >= response_buffer.length()) {
             response_buffer.clear();
             bytes_sent = 0;
-            
-            if (keep_alive) {
-                http_parser.reset();
-                cgi_requested = false;
-                state = READING_REQUEST;
+            if (response_streaming)
                 return false;
-            }
-            return true;
+            return finishResponse();
         }
         return false;
     }
@@ -108,6 +212,72 @@ bool Client::sendResponse() {
     }
 }
 
+// One finished (or abandoned) response: its status and the time spent in
+// each phase. The handler phase of a CGI, FastCGI or proxied request runs
+// until the first byte of its response, which includes a streamed upload.
+void Client::recordRequest() {
+    if (!responded_us)
+        return;
+    const HttpRequest& request = http_parser.getRequest();
+    Metrics::request(request.getMethod(), status);
+    long now = Metrics::nowUs();
+    long start = started_us ? started_us : responded_us;
+
+    AccessLog::Entry entry;
+    if (headers_us)
+        entry.phases_us[Metrics::HEADERS] = headers_us - start;
+    bool has_body = !request.getHeader("Content-Length").empty() ||
+                    !request.getHeader("Transfer-Encoding").empty();
+    if (headers_us && body_us && has_body)
+        entry.phases_us[Metrics::BODY] = body_us - headers_us;
+    if (handler_us)
+        entry.phases_us[cgi_requested ? Metrics::CGI : Metrics::PROCESS] = responded_us - handler_us;
+    entry.phases_us[Metrics::SEND] = now - responded_us;
+    entry.phases_us[Metrics::TOTAL] = now - start;
+    entry.first_byte_us = responded_us - start;
+    for (int phase = 0; phase < Metrics::PHASE_COUNT; phase++)
+        if (entry.phases_us[phase] >= 0)
+            Metrics::observe(static_cast<Metrics::Phase>(phase), entry.phases_us[phase]);
+
+    if (Metrics::tracing()) {
+        Metrics::Trace trace;
+        std::memcpy(trace.phases_us, entry.phases_us, sizeof(trace.phases_us));
+        trace.status = status;
+        trace.finished = std::time(NULL);
+        std::string line = request.getMethod() + " " + request.getURI();
+        size_t length = std::min(line.length(), static_cast<size_t>(Metrics::TRACE_REQUEST_MAX - 1));
+        line.copy(trace.request, length);
+        trace.request[length] = '\0';
+        Metrics::trace(trace);
+    }
+
+
+    entry.request = &http_parser.getRequest();
+    entry.remote_addr = &remote_addr;
+    entry.status = status;
+    entry.bytes_sent = response_bytes;
+    entry.body_bytes_sent = response_bytes > response_head ? response_bytes - response_head : 0;
+    entry.request_length = request_length;
+    entry.request_time_us = now - start;
+    AccessLog::log(entry);
+    Capture::record(request, start, status, now - start);
+
+    started_us = 0;
+    headers_us = 0;
+    body_us = 0;
+    handler_us = 0;
+    responded_us = 0;
+    status = 0;
+    request_length = 0;
+    response_bytes = 0;
+    response_head = 0;
+}
+
+void Client::countSent(size_t bytes) {
+    response_bytes += bytes;
+    Metrics::sent(bytes);
+}
+
 static std::string getExtension(const std::string& filepath) {
     size_t dot_pos = filepath.rfind('.');
     if (dot_pos == std::string::npos)
@@ -116,6 +286,7 @@ static std::string getExtension(const std::string& filepath) {
 }
 
 void Client::processRequest() {
+    handler_us = Metrics::nowUs();
     const HttpRequest& request = http_parser.getRequest();
     HttpResponse response;
 
@@ -124,8 +295,9 @@ void Client::processRequest() {
     std::string version = request.getVersion();
     std::string connection = request.getHeader("Connection");
     
-    keep_alive = (version == "HTTP/1.1" && connection != "close") ||
-                 (version == "HTTP/1.0" && connection == "keep-alive");
+    keep_alive = !close_requested &&
+                 ((version == "HTTP/1.1" && connection != "close") ||
+                  (version == "HTTP/1.0" && connection == "keep-alive"));
     
     LocationConfig* location = findMatchingLocation(path);
     
@@ -185,7 +357,29 @@ void Client::processRequest() {
         return;
     }
     
-    if (method == "GET")
+    if (!location->proxy_pass.empty()) {
+        size_t max_body_size = location->has_body_count ? location->client_max_body_size
+                                                        : server_config->client_max_body_size;
+        if (std::strtoul(request.getHeader("Content-Length").c_str(), NULL, 10) > max_body_size) {
+            buildErrorResponse(413, "Payload Too Large");
+            state = SENDING_RESPONSE;
+            return;
+        }
+        cgi_requested = true;
+    }
+    else if (!location->fastcgi_pass.empty())
+        cgi_requested = true;
+    else if (location->metrics == "prometheus") {
+        response.setStatus(200);
+        response.setContentType("text/plain; version=0.0.4; charset=utf-8");
+        response.setBody(Metrics::render());
+    }
+    else if (location->metrics == "slowest") {
+        response.setStatus(200);
+        response.setContentType("text/plain; charset=utf-8");
+        response.setBody(Metrics::renderSlowest(request.getQueryString() == "reset"));
+    }
+    else if (method == "GET")
         handleGet(request, location, response, cgi_requested);
     else if (method == "POST")
         handlePost(request, location, server_config, response, cgi_requested);
@@ -221,6 +415,26 @@ void Client::processRequest() {
     state = SENDING_RESPONSE;
 }
 
+// Bodies posted to a spawned CGI or a proxy_pass upstream are passed on as
+// they arrive rather than buffered whole first. FastCGI and cgi_pool
+// locations frame the complete request, so they keep collecting it.
+bool Client::streamBody(const HttpRequest& request) {
+    LocationConfig* location = findMatchingLocation(request.getPath());
+    if (!location)
+        location = findMatchingLocation("/");
+    if (!location || location->redirect.first > 0 ||
+        location->methods.find(request.getMethod()) == location->methods.end())
+        return false;
+    if (!location->proxy_pass.empty())
+        return true;
+    if (request.getMethod() != "POST" || !location->fastcgi_pass.empty())
+        return false;
+
+    std::string extension = getExtension(location->root + request.getPath());
+    return location->cgi.find(extension) != location->cgi.end() &&
+           location->cgi_pool.find(extension) == location->cgi_pool.end();
+}
+
 LocationConfig* Client::findMatchingLocation(const std::string& path) {
     LocationConfig* best_match = NULL;
     size_t best_match_length = 0;
@@ -9,7 +9,7 @@
 
 class HttpResponse;
 
-class Client {
+class Client : private BodyHandler {
 public:
     enum State {
         READING_REQUEST,
@@ -24,19 +24,38 @@ private:
     State state;
     std::string request_buffer;
     std::string response_buffer;
+    // Interim (1xx) responses, sent ahead of anything in response_buffer.
+    std::string interim;
     time_t last_activity;
     const ServerConfig* server_config;
+    ConfigSnapshot* snapshot;
     size_t bytes_sent;
     HttpParser http_parser;
     bool keep_alive;
+    bool close_requested;
     bool cgi_requested;
+    bool response_streaming;
+    std::string remote_addr;
+    // Request timing (Metrics::nowUs) and the status of the response, for
+    // the metrics and the access log; zero until the phase is reached. A
+    // request starts at accept, or at its first byte on a reused connection.
+    long started_us;
+    long headers_us;
+    long body_us;
+    long handler_us;
+    long responded_us;
+    int status;
+    size_t request_length;
+    size_t response_bytes;
+    size_t response_head;
     
 public:
-    Client(int _fd, const ServerConfig* config);
+    Client(int _fd, const ServerConfig* config, ConfigSnapshot* _snapshot);
     ~Client();
     
     bool readRequest();
     bool sendResponse();
+    bool finishResponse();
     void setState(State _state) { state = _state; }
     State getState() const { return state; }
     void processRequest();
@@ -45,15 +64,29 @@ public:
     int getFd() const { return fd; }
     time_t getLastActivity() const { return last_activity; }
     bool isTimedOut(time_t timeout_seconds = 60) const;
-    bool hasDataToSend() const { return !response_buffer.empty(); }
+    bool hasDataToSend() const { return !response_buffer.empty() || !interim.empty(); }
+    void queueInterim(const std::string& head) { interim += head; }
+    bool flushInterim();
     void close();
-    bool isKeepAlive() const { return keep_alive; }
+    bool isKeepAlive() const;
+    void disableKeepAlive() { keep_alive = false; }
+    void touch() { last_activity = std::time(NULL); }
+    void requestClose() { close_requested = true; }
+    bool isIdle() const { return state == READING_REQUEST && http_parser.isIdle(); }
+    void setRemoteAddress(const std::string& address) { remote_addr = address; }
+    const std::string& getRemoteAddress() const { return remote_addr; }
+    const HttpRequest& getRequest() const { return http_parser.getRequest(); }
+    // Longest prefix match over the server's locations.
+    LocationConfig* findMatchingLocation(const std::string& path);
+    // Response bytes written to the socket by someone else (splice).
+    void countSent(size_t bytes);
 
 private:
     bool checkHeaders();
     size_t getContentLength() const;
     size_t getBodySize() const;
-    LocationConfig* findMatchingLocation(const std::string& path);
+    bool streamBody(const HttpRequest& request);
+    void recordRequest();
 
 
 // CGI
@@ -70,9 +103,23 @@ public:
     const HttpRequest* getCGIRequest() { return cgi_request; }
     const ServerConfig* getServerConfig() { return server_config; }
 
+    // Streamed CGI request bodies
+    bool readBody();
+    bool isStreamingBody() const { return http_parser.isStreamingBody(); }
+    size_t bodyBuffered() const { return http_parser.bodyBuffered(); }
+    bool bodyReceived() const { return http_parser.bodyReceived(); }
+    const char* bodyData() const { return http_parser.bodyData(); }
+    void consumeBody(size_t bytes) { http_parser.consumeBody(bytes); }
+
     // FOR TESTING
     void setResponseBuffer(std::string response_) { this->response_buffer = response_; }
+    // The body follows the buffer from elsewhere (a spliced CGI pipe); the
+    // response ends with finishResponse() instead of with the buffer.
+    void setResponseStreaming(bool streaming) { response_streaming = streaming; }
     std::string getResponseBuffer() { return response_buffer; }
+    // Proxied bodies are appended as they arrive from the upstream.
+    void appendResponse(const char* data, size_t length);
+    size_t pendingResponse() const { return response_buffer.length() - bytes_sent; }
     void resetForNextRequest();
 };
 
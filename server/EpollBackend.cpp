@@ -0,0 +1,70 @@
+#include "EpollBackend.hpp"
+#include "Metrics.hpp"
+#include <stdexcept>
+#include <sstream>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+EpollBackend::EpollBackend() : epoll_fd(-1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        throw std::runtime_error("epoll_create1() failed: " + std::string(strerror(errno)));
+    epoll_events.resize(MAX_EVENTS);
+}
+
+EpollBackend::~EpollBackend() {
+    if (epoll_fd != -1)
+        ::close(epoll_fd);
+}
+
+// A change reaches epoll only at the next wait, by when the fd may have
+// been closed (ENOENT, EBADF); that is not an error.
+void EpollBackend::control(int op, int fd, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    Metrics::eventSyscall();
+    if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+        if (op == EPOLL_CTL_MOD && (errno == ENOENT || errno == EBADF))
+            return;
+        std::stringstream ss;
+        ss << "epoll_ctl(" << (op == EPOLL_CTL_ADD ? "ADD" : "MOD") << ") failed for fd " << fd << ": "
+           << strerror(errno);
+        throw std::runtime_error(ss.str());
+    }
+}
+
+void EpollBackend::add(int fd, uint32_t events) {
+    control(EPOLL_CTL_ADD, fd, events);
+}
+
+void EpollBackend::modify(int fd, uint32_t events) {
+    control(EPOLL_CTL_MOD, fd, events);
+}
+
+// A closed fd has left the epoll set on its own (ENOENT, EBADF).
+void EpollBackend::remove(int fd) {
+    Metrics::eventSyscall();
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void EpollBackend::wait(int timeout_ms, std::vector<Event>& events) {
+    Metrics::eventSyscall();
+    int nfds = epoll_wait(epoll_fd, &epoll_events[0], MAX_EVENTS, timeout_ms);
+
+    if (nfds == -1) {
+        if (errno == EINTR)
+            return;
+        throw std::runtime_error("epoll_wait() failed: " + std::string(strerror(errno)));
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        Event e;
+        e.fd = epoll_events[i].data.fd;
+        e.readable = (epoll_events[i].events & EPOLLIN) != 0;
+        e.writable = (epoll_events[i].events & EPOLLOUT) != 0;
+        e.error = (epoll_events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
+        events.push_back(e);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef EPOLLBACKEND_HPP
+#define EPOLLBACKEND_HPP
+
+#include "EventBackend.hpp"
+#include <sys/epoll.h>
+
+// One epoll_ctl per interest change, one epoll_wait per loop iteration.
+class EpollBackend : public EventBackend {
+private:
+    int epoll_fd;
+    std::vector<struct epoll_event> epoll_events;
+    static const int MAX_EVENTS = 1024;
+
+    EpollBackend(const EpollBackend&);
+    EpollBackend& operator=(const EpollBackend&);
+
+    void control(int op, int fd, uint32_t events);
+
+public:
+    EpollBackend();
+    ~EpollBackend();
+
+    const char* name() const { return "epoll"; }
+    void add(int fd, uint32_t events);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+    void wait(int timeout_ms, std::vector<Event>& events);
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef EVENTBACKEND_HPP
+#define EVENTBACKEND_HPP
+
+#include <vector>
+#include <stdint.h>
+
+// What EventManager needs from the kernel: readiness of file descriptors,
+// level-triggered. Interest is EPOLLIN/EPOLLOUT (the same bits as POLLIN and
+// POLLOUT); errors and hangups are reported whatever the interest.
+class EventBackend {
+public:
+    struct Event {
+        int fd;
+        bool readable;
+        bool writable;
+        bool error;
+    };
+
+    virtual ~EventBackend() {}
+
+    virtual const char* name() const = 0;
+    virtual void add(int fd, uint32_t events) = 0;
+    virtual void modify(int fd, uint32_t events) = 0;
+    // The fd may already be closed.
+    virtual void remove(int fd) = 0;
+    // Appends what became ready within timeout_ms (-1 waits for good).
+    virtual void wait(int timeout_ms, std::vector<Event>& events) = 0;
+};
+
+#endif
@@ -1,18 +1,12 @@
 #include "EventManager.hpp"
-#include <stdexcept>
-#include <unistd.h>
-#include <sstream>
+#include "EpollBackend.hpp"
+#include "UringBackend.hpp"
+#include <iostream>
 
-EventManager::EventManager() : epoll_fd(-1) {
-    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd == -1)
-        throw std::runtime_error("epoll_create1() failed: " + std::string(strerror(errno)));
-    epoll_events.resize(MAX_EVENTS);
-}
+EventManager::EventManager() : backend(new EpollBackend()) {}
 
 EventManager::~EventManager() {
-    if (epoll_fd != -1)
-        ::close(epoll_fd);
+    delete backend;
 }
 
 //just encaps bcus the server doesn't know or care whether EventManager uses poll or epoll, kisayn wait()
@@ -20,23 +14,15 @@ void EventManager::addFd(int fd, bool monitor_read, bool monitor_write) {
     if (fd_events.find(fd) != fd_events.end())
         return;
     
-    struct epoll_event ev;
-    ev.events = 0;
+    uint32_t events = 0;
     
     if (monitor_read)
-        ev.events |= EPOLLIN;
+        events |= EPOLLIN;
     if (monitor_write)
-        ev.events |= EPOLLOUT;
-    
-    ev.data.fd = fd;
-    
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-        std::stringstream ss;
-        ss << "epoll_ctl(ADD) failed for fd " << fd << ": " << strerror(errno);
-        throw std::runtime_error(ss.str());
-    }
+        events |= EPOLLOUT;
     
-    fd_events[fd] = ev.events;
+    backend->add(fd, events);
+    fd_events[fd] = events;
 }
 
 void EventManager::removeFd(int fd) {
@@ -44,14 +30,9 @@ void EventManager::removeFd(int fd) {
     if (it == fd_events.end())
         return;
     
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-        if (errno != ENOENT && errno != EBADF) {
-            std::stringstream ss;
-            ss << "epoll_ctl(DEL) failed for fd " << fd << ": " << strerror(errno);
-        }
-    }
-
+    backend->remove(fd);
     fd_events.erase(it);
+    pending.erase(fd);
 }
 
 void EventManager::setWriteMonitoring(int fd, bool enable) {
@@ -67,7 +48,7 @@ void EventManager::setWriteMonitoring(int fd, bool enable) {
         new_events &= ~EPOLLOUT;
     
     if (new_events != it->second) {
-        modifyFd(fd, new_events);
+        modifyFd(fd, it->second);
         it->second = new_events;
     }
 }
@@ -85,47 +66,74 @@ void EventManager::setReadMonitoring(int fd, bool enable) {
         new_events &= ~EPOLLIN;
     
     if (new_events != it->second) {
-        modifyFd(fd, new_events);
+        modifyFd(fd, it->second);
         it->second = new_events;
     }
 }
 
-void EventManager::modifyFd(int fd, uint32_t events) {
-    struct epoll_event ev;
-    ev.events = events;
-    ev.data.fd = fd;
-    
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-        std::stringstream ss;
-        ss << "epoll_ctl(MOD) failed for fd " << fd << ": " << strerror(errno);
-        throw std::runtime_error(ss.str());
+void EventManager::modifyFd(int fd, uint32_t previous) {
+    pending.insert(std::make_pair(fd, previous));
+}
+
+void EventManager::applyPending() {
+    for (std::map<int, uint32_t>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        uint32_t wanted = fd_events[it->first];
+        if (wanted != it->second)
+            backend->modify(it->first, wanted);
     }
+    pending.clear();
 }
 
 int EventManager::wait(int timeout_ms) {
     events.clear();
-    
+
     if (fd_events.empty())
         return 0;
-    
-    int nfds = epoll_wait(epoll_fd, &epoll_events[0], MAX_EVENTS, timeout_ms);
-    
-    if (nfds == -1) {
-        if (errno == EINTR)
-            return 0;
-        throw std::runtime_error("epoll_wait() failed: " + std::string(strerror(errno)));
+
+    applyPending();
+    backend->wait(timeout_ms, events);
+    return events.size();
+}
+
+// A forked worker must not share the parent's epoll instance or ring, so it
+// gets a fresh one with the same interest list.
+void EventManager::reopen() {
+    EventBackend* fresh = NULL;
+    if (std::string(backend->name()) == "io_uring")
+        fresh = UringBackend::create();
+    if (!fresh)
+        fresh = new EpollBackend();
+    replaceBackend(fresh);
+}
+
+void EventManager::useBackend(const std::string& name) {
+    if (name == backend->name())
+        return;
+    EventBackend* fresh = NULL;
+    if (name == "io_uring") {
+        fresh = UringBackend::create();
+        if (!fresh) {
+            std::cerr << "event_backend: io_uring unavailable (needs Linux 5.11), using epoll" << std::endl;
+            return;
+        }
     }
-    
-    for (int i = 0; i < nfds; i++) {
-        Event e;
-        e.fd = epoll_events[i].data.fd;
-        e.readable = (epoll_events[i].events & EPOLLIN) != 0;
-        e.writable = (epoll_events[i].events & EPOLLOUT) != 0;
-        e.error = (epoll_events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
-        events.push_back(e);
+    else
+        fresh = new EpollBackend();
+    replaceBackend(fresh);
+}
+
+void EventManager::replaceBackend(EventBackend* fresh) {
+    try {
+        for (std::map<int, uint32_t>::iterator it = fd_events.begin(); it != fd_events.end(); ++it)
+            fresh->add(it->first, it->second);
     }
-    
-    return events.size();
+    catch (...) {
+        delete fresh;
+        throw;
+    }
+    delete backend;
+    backend = fresh;
+    pending.clear();
 }
 
 //was testing with it, to ignore
@@ -1,43 +1,58 @@
 #ifndef EVENTMANAGER_HPP
 #define EVENTMANAGER_HPP
 
+#include "EventBackend.hpp"
 #include <vector>
 #include <map>
+#include <string>
 #include <sys/epoll.h>
 #include <cerrno>
 #include <cstring>
+
+// The interest list of the event loop, kept here so that a backend can be
+// swapped (event_backend) or recreated after a fork without the server
+// noticing.
+//
+// Interest changes are only recorded, and reach the backend right before
+// the next wait: a state transition that turns reading off and writing on
+// costs one epoll_ctl, and one that is undone before the wait costs none.
 class EventManager {
 public:
-    struct Event {
-        int fd;
-        bool readable;
-        bool writable;
-        bool error;
-    };
-    
+    typedef EventBackend::Event Event;
+
 private:
-    int epoll_fd;
-    std::vector<struct epoll_event> epoll_events;
+    EventBackend* backend;
     std::map<int, uint32_t> fd_events;
+    // Changed since the last wait: fd -> the interest the backend has.
+    std::map<int, uint32_t> pending;
     std::vector<Event> events;
-    static const int MAX_EVENTS = 1024;
-    
+
+    EventManager(const EventManager&);
+    EventManager& operator=(const EventManager&);
+
 public:
     EventManager();
     ~EventManager();
-    
+
     void addFd(int fd, bool monitor_read = true, bool monitor_write = false);
     void removeFd(int fd);
     void setWriteMonitoring(int fd, bool enable);
     void setReadMonitoring(int fd, bool enable);
-    
+
     int wait(int timeout_ms = -1);
-    
+    void reopen();
+    // "epoll" or "io_uring"; io_uring falls back to epoll where the kernel
+    // lacks it.
+    void useBackend(const std::string& name);
+    const char* backendName() const { return backend->name(); }
+
     const std::vector<Event>& getEvents() const { return events; }
     bool isMonitored(int fd) const;
-    
+
 private:
-    void modifyFd(int fd, uint32_t events);
+    void modifyFd(int fd, uint32_t previous);
+    void applyPending();
+    void replaceBackend(EventBackend* fresh);
 };
 
-#endif
\ No newline at end of file
+#endif
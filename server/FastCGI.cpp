@@ -0,0 +1,92 @@
+#include "FastCGI.hpp"
+
+FastCGIRequest::FastCGIRequest()
+    : client_fd(-1), upstream_fd(-1), pool(NULL), reused(false), connected(false),
+      retried(false), out_sent(0), read_timeout_ms(0), last_activity_ms(0) {}
+
+static void appendHeader(std::string& out, int type, int request_id, size_t length, size_t padding) {
+    out += static_cast<char>(1);
+    out += static_cast<char>(type);
+    out += static_cast<char>((request_id >> 8) & 0xff);
+    out += static_cast<char>(request_id & 0xff);
+    out += static_cast<char>((length >> 8) & 0xff);
+    out += static_cast<char>(length & 0xff);
+    out += static_cast<char>(padding);
+    out += static_cast<char>(0);
+}
+
+// Splits content into records of at most MAX_CONTENT bytes, padded to 8.
+static void appendStream(std::string& out, int type, int request_id, const std::string& content) {
+    size_t pos = 0;
+    while (pos < content.length()) {
+        size_t len = content.length() - pos;
+        if (len > FastCGI::MAX_CONTENT)
+            len = FastCGI::MAX_CONTENT;
+        size_t padding = (8 - (len % 8)) % 8;
+        appendHeader(out, type, request_id, len, padding);
+        out.append(content, pos, len);
+        out.append(padding, '\0');
+        pos += len;
+    }
+    appendHeader(out, type, request_id, 0, 0);
+}
+
+static void appendLength(std::string& out, size_t len) {
+    if (len < 128) {
+        out += static_cast<char>(len);
+        return;
+    }
+    out += static_cast<char>(((len >> 24) & 0x7f) | 0x80);
+    out += static_cast<char>((len >> 16) & 0xff);
+    out += static_cast<char>((len >> 8) & 0xff);
+    out += static_cast<char>(len & 0xff);
+}
+
+std::string FastCGI::encodeRequest(int request_id, const std::vector<std::string>& env,
+                                   const std::string& body, bool keep_conn) {
+    std::string out;
+    
+    appendHeader(out, BEGIN_REQUEST, request_id, 8, 0);
+    out += static_cast<char>(0);
+    out += static_cast<char>(RESPONDER);
+    out += static_cast<char>(keep_conn ? KEEP_CONN : 0);
+    out.append(5, '\0');
+    
+    std::string params;
+    for (size_t i = 0; i < env.size(); i++) {
+        size_t eq = env[i].find('=');
+        if (eq == std::string::npos)
+            continue;
+        appendLength(params, eq);
+        appendLength(params, env[i].length() - eq - 1);
+        params.append(env[i], 0, eq);
+        params.append(env[i], eq + 1, std::string::npos);
+    }
+    appendStream(out, PARAMS, request_id, params);
+    appendStream(out, STDIN, request_id, body);
+    return out;
+}
+
+bool FastCGI::decodeRecord(std::string& buffer, Record& record) {
+    if (buffer.length() < HEADER_LEN)
+        return false;
+    
+    const unsigned char* h = reinterpret_cast<const unsigned char*>(buffer.data());
+    size_t length = (h[4] << 8) | h[5];
+    size_t padding = h[6];
+    if (buffer.length() < HEADER_LEN + length + padding)
+        return false;
+    
+    record.type = h[1];
+    record.request_id = (h[2] << 8) | h[3];
+    record.content.assign(buffer, HEADER_LEN, length);
+    buffer.erase(0, HEADER_LEN + length + padding);
+    return true;
+}
+
+int FastCGI::endRequestAppStatus(const Record& record) {
+    if (record.content.length() < 8)
+        return -1;
+    const unsigned char* c = reinterpret_cast<const unsigned char*>(record.content.data());
+    return (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+}
@@ -0,0 +1,62 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include "Timers.hpp"
+#include <string>
+#include <vector>
+
+class UpstreamPool;
+
+namespace FastCGI {
+    enum RecordType {
+        BEGIN_REQUEST = 1,
+        ABORT_REQUEST = 2,
+        END_REQUEST = 3,
+        PARAMS = 4,
+        STDIN = 5,
+        STDOUT = 6,
+        STDERR = 7
+    };
+    
+    static const int RESPONDER = 1;
+    static const int KEEP_CONN = 1;
+    static const size_t HEADER_LEN = 8;
+    static const size_t MAX_CONTENT = 65535;
+    
+    struct Record {
+        int type;
+        int request_id;
+        std::string content;
+    };
+    
+    // Whole request: BEGIN_REQUEST, PARAMS from "NAME=value" strings, STDIN.
+    std::string encodeRequest(int request_id, const std::vector<std::string>& env,
+                              const std::string& body, bool keep_conn);
+    // Pops one complete record off the front of buffer, false if incomplete.
+    bool decodeRecord(std::string& buffer, Record& record);
+    int endRequestAppStatus(const Record& record);
+}
+
+// One request in flight on an upstream connection (a single request per
+// connection at a time, the connection goes back to the pool afterwards).
+struct FastCGIRequest {
+    int client_fd;
+    int upstream_fd;
+    UpstreamPool* pool;
+    bool reused;
+    bool connected;
+    bool retried;
+    std::string out;
+    size_t out_sent;
+    std::string in;
+    std::string stdout_data;
+    // fastcgi_read_timeout, counted from the last byte exchanged with the
+    // upstream.
+    long read_timeout_ms;
+    long last_activity_ms;
+    Timers::Handle deadline;
+    
+    FastCGIRequest();
+};
+
+#endif
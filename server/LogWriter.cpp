@@ -0,0 +1,215 @@
+#include "LogWriter.hpp"
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+LogWriter::LogWriter(const char* _name)
+    : name(_name), active(false), buffer_size(0), ring(NULL), capacity(0), head(0), tail(0),
+      writer_idle(0), reopen_requested(0), stopping(0), wake_fd(-1), log_fd(-1),
+      writer_running(false), writer_wanted(false) {
+    pthread_mutex_init(&path_lock, NULL);
+}
+
+void LogWriter::configure(const std::string& target, size_t size) {
+    active = !target.empty();
+    if (!active)
+        return;
+    if (!writer_running)
+        buffer_size = size;
+
+    pthread_mutex_lock(&path_lock);
+    bool changed = (path != target);
+    path = target;
+    pthread_mutex_unlock(&path_lock);
+    if (changed)
+        reopen();
+    if (writer_wanted)
+        start();
+}
+
+// Signals stay with the event loop's thread: the writer is created with
+// all of them blocked.
+void LogWriter::start() {
+    writer_wanted = true;
+    if (writer_running || !active)
+        return;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring = new char[buffer_size];
+    capacity = buffer_size;
+    head = 0;
+    tail = 0;
+    stopping = 0;
+    reopen_requested = 1;
+
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    writer_running = (wake_fd != -1 && pthread_create(&writer, NULL, threadMain, this) == 0);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (!writer_running) {
+        std::fprintf(stderr, "%s: cannot start the writer thread, logging disabled\n", name);
+        delete[] ring;
+        ring = NULL;
+        if (wake_fd != -1)
+            close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+// A writer stuck on a destination that stopped reading gets a second to
+// finish; after that it is left behind (with its ring) for the exit.
+void LogWriter::stop() {
+    writer_wanted = false;
+    if (!writer_running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    wake();
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    writer_running = false;
+    if (pthread_timedjoin_np(writer, NULL, &deadline) != 0) {
+        std::fprintf(stderr, "%s: writer blocked, unwritten lines dropped\n", name);
+        active = false;
+        return;
+    }
+    close(wake_fd);
+    wake_fd = -1;
+    if (log_fd > STDERR_FILENO)
+        close(log_fd);
+    log_fd = -1;
+    delete[] ring;
+    ring = NULL;
+}
+
+void LogWriter::reopen() {
+    __atomic_store_n(&reopen_requested, 1, __ATOMIC_SEQ_CST);
+    if (writer_running)
+        wake();
+}
+
+void LogWriter::wake() {
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+bool LogWriter::push(const std::string& text) {
+    if (!active || !ring)
+        return true;
+    size_t length = text.length();
+    size_t buffered = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (length > capacity - buffered)
+        return false;
+    size_t start = head % capacity;
+    size_t first = std::min(length, capacity - start);
+    std::memcpy(ring + start, text.data(), first);
+    std::memcpy(ring, text.data() + first, length - first);
+    __atomic_store_n(&head, head + length, __ATOMIC_SEQ_CST);
+    // Only the line that finds the writer asleep pays for the wakeup.
+    if (__atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&writer_idle, 0, __ATOMIC_SEQ_CST))
+        wake();
+    return true;
+}
+
+void* LogWriter::threadMain(void* self) {
+    static_cast<LogWriter*>(self)->run();
+    return NULL;
+}
+
+void LogWriter::run() {
+    for (;;) {
+        if (__atomic_exchange_n(&reopen_requested, 0, __ATOMIC_SEQ_CST))
+            openTarget();
+        size_t from = tail;
+        size_t to = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if (from != to) {
+            writeOut(from, to);
+            __atomic_store_n(&tail, to, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            break;
+
+        // Announce the nap, then look again: a line pushed in between either
+        // shows up here or sees the flag and wakes us.
+        __atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&head, __ATOMIC_SEQ_CST) == from) {
+            struct pollfd wait;
+            wait.fd = wake_fd;
+            wait.events = POLLIN;
+            wait.revents = 0;
+            poll(&wait, 1, 1000);
+        }
+        __atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+        uint64_t count;
+        ssize_t ignored = read(wake_fd, &count, sizeof(count));
+        (void)ignored;
+    }
+}
+
+void LogWriter::openTarget() {
+    pthread_mutex_lock(&path_lock);
+    std::string target = path;
+    pthread_mutex_unlock(&path_lock);
+
+    int fd;
+    if (target == "stdout")
+        fd = STDOUT_FILENO;
+    else if (target == "stderr")
+        fd = STDERR_FILENO;
+    else
+        fd = open(target.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        std::fprintf(stderr, "%s: cannot open %s: %s\n", name, target.c_str(), std::strerror(errno));
+        return;
+    }
+    if (log_fd > STDERR_FILENO && log_fd != fd)
+        close(log_fd);
+    log_fd = fd;
+}
+
+// Everything buffered goes in one writev (two pieces when it wraps), so
+// with O_APPEND the lines of several workers never interleave mid-line.
+void LogWriter::writeOut(size_t from, size_t to) {
+    if (log_fd == -1)
+        return;
+    size_t start = from % capacity;
+    size_t length = to - from;
+    size_t first = std::min(length, capacity - start);
+    struct iovec pieces[2];
+    pieces[0].iov_base = ring + start;
+    pieces[0].iov_len = first;
+    pieces[1].iov_base = ring;
+    pieces[1].iov_len = length - first;
+    int count = (length > first) ? 2 : 1;
+
+    while (count > 0) {
+        ssize_t written = writev(log_fd, pieces, count);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (count > 0 && static_cast<size_t>(written) >= pieces[0].iov_len) {
+            written -= pieces[0].iov_len;
+            pieces[0] = pieces[1];
+            count--;
+        }
+        if (count > 0) {
+            pieces[0].iov_base = static_cast<char*>(pieces[0].iov_base) + written;
+            pieces[0].iov_len -= written;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef LOGWRITER_HPP
+#define LOGWRITER_HPP
+
+#include <pthread.h>
+#include <string>
+
+// A log file written by a background thread. Lines are copied by the event
+// loop into a ring allocated once, and the thread writes them out in
+// batches, so a slow disk, pipe or terminal never stalls the loop. A line
+// that does not fit is dropped rather than waited for.
+//
+// The thread is started by the process that serves (each worker), never
+// before a fork, and reopen() makes it reopen the file, for log rotation.
+class LogWriter {
+public:
+    // name prefixes the writer's messages ("access_log").
+    explicit LogWriter(const char* name);
+
+    // path is a file, "stdout", "stderr", or empty for off. The buffer
+    // size is fixed once the writer runs.
+    void configure(const std::string& path, size_t buffer_size);
+    bool enabled() const { return active; }
+    // Whether push() has somewhere to put lines, so callers can skip
+    // formatting them.
+    bool running() const { return active && ring; }
+    // Starts the writer, now or once the log is enabled.
+    void start();
+    // Writes out what is buffered and stops the writer.
+    void stop();
+    void reopen();
+    // False when the line was dropped.
+    bool push(const std::string& line);
+
+private:
+    const char* name;
+    bool active;
+    size_t buffer_size;
+
+    // The ring is single-producer (the event loop), single-consumer (the
+    // writer). head and tail only grow; their difference is what is
+    // buffered.
+    char* ring;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    int writer_idle;
+    int reopen_requested;
+    int stopping;
+    int wake_fd;
+    int log_fd;
+    pthread_t writer;
+    bool writer_running;
+    bool writer_wanted;
+
+    // The writer reads the path when it reopens; the loop changes it on
+    // reload.
+    pthread_mutex_t path_lock;
+    std::string path;
+
+    LogWriter(const LogWriter&);
+    LogWriter& operator=(const LogWriter&);
+
+    static void* threadMain(void* self);
+    void run();
+    void wake();
+    void openTarget();
+    void writeOut(size_t from, size_t to);
+};
+
+#endif
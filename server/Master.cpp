@@ -0,0 +1,246 @@
+#include "Master.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <poll.h>
+
+// How long a new binary has to report that it is listening.
+static const int UPGRADE_TIMEOUT_S = 10;
+
+Master::Master(Server& _server) 
+    : server(_server), generation(1), stopping(false), upgrade_pid(-1), upgrade_fd(-1),
+      upgrade_deadline(0) {
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGHUP);
+    sigaddset(&handled_signals, SIGQUIT);
+    sigaddset(&handled_signals, SIGUSR2);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigaddset(&handled_signals, SIGCHLD);
+    // Signals are consumed synchronously with sigtimedwait, so they stay
+    // blocked in the master; workers restore the original mask after fork.
+    sigprocmask(SIG_BLOCK, &handled_signals, &original_mask);
+}
+
+Master::~Master() {
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+}
+
+void Master::run() {
+    spawnGeneration();
+    
+    while (!workers.empty() || !stopping) {
+        // A pending upgrade is polled for between signals, so its wait never
+        // holds up respawning workers or a shutdown.
+        struct timespec timeout;
+        timeout.tv_sec = upgrade_fd != -1 ? 0 : 1;
+        timeout.tv_nsec = upgrade_fd != -1 ? 100 * 1000000L : 0;
+        
+        int sig = sigtimedwait(&handled_signals, NULL, &timeout);
+        if (sig == SIGCHLD || sig == -1)
+            reapWorkers();
+        else if (sig == SIGHUP)
+            reload();
+        else if (sig == SIGUSR2)
+            upgrade();
+        else if (sig == SIGUSR1)
+            reopenLogs();
+        else if (sig == SIGINT || sig == SIGTERM || sig == SIGQUIT)
+            shutdown(sig);
+        if (upgrade_fd != -1)
+            checkUpgrade();
+    }
+    std::cout << "master: all workers exited" << std::endl;
+}
+
+// Workers keep their metrics slot until reaped; a replacement takes over the
+// counters of the one it replaces. Slot 0 is ours, shared by whoever finds
+// no free one (which only costs exactness).
+size_t Master::freeMetricsSlot() const {
+    std::vector<bool> used(Metrics::MAX_SLOTS, false);
+    for (std::map<pid_t, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it)
+        used[it->second.metrics_slot] = true;
+    for (size_t slot = 1; slot < Metrics::MAX_SLOTS; slot++)
+        if (!used[slot])
+            return slot;
+    return 0;
+}
+
+void Master::spawnWorker() {
+    size_t metrics_slot = freeMetricsSlot();
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cerr << RED << "master: fork failed: " << strerror(errno) << RESET << std::endl;
+        return;
+    }
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        if (upgrade_fd != -1)
+            close(upgrade_fd);
+        try {
+            Metrics::use(metrics_slot);
+            server.becomeWorker();
+            server.run();
+            server.stop();
+        }
+        catch (const std::exception& e) {
+            std::cerr << RED << "worker " << getpid() << ": " << e.what() << RESET << std::endl;
+            std::exit(1);
+        }
+        std::exit(0);
+    }
+    
+    Worker worker;
+    worker.generation = generation;
+    worker.started = time(NULL);
+    worker.metrics_slot = metrics_slot;
+    workers[pid] = worker;
+    std::cout << "master: started worker " << pid << std::endl;
+}
+
+void Master::spawnGeneration() {
+    int count = server.getGlobalConfig().worker_processes;
+    if (count < 1)
+        count = 1;
+    for (int i = 0; i < count; i++)
+        spawnWorker();
+}
+
+void Master::reapWorkers() {
+    int status;
+    pid_t pid;
+    
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == upgrade_pid) {
+            upgrade_pid = -1;
+            continue;
+        }
+        std::map<pid_t, Worker>::iterator it = workers.find(pid);
+        if (it == workers.end())
+            continue;
+        
+        Worker worker = it->second;
+        workers.erase(it);
+        Metrics::release(worker.metrics_slot);
+        
+        bool crashed = WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0);
+        if (!crashed || stopping || worker.generation != generation) {
+            std::cout << "master: worker " << pid << " exited" << std::endl;
+            continue;
+        }
+        
+        if (WIFSIGNALED(status))
+            std::cerr << RED << "master: worker " << pid << " killed by signal " << WTERMSIG(status) << RESET << std::endl;
+        else
+            std::cerr << RED << "master: worker " << pid << " exited with status " << WEXITSTATUS(status) << RESET << std::endl;
+        
+        // Avoid a fork storm when a worker dies right at startup.
+        if (time(NULL) - worker.started < 1)
+            sleep(1);
+        spawnWorker();
+    }
+}
+
+// The master re-reads the config and adjusts its listeners; a new generation
+// of workers inherits them and the previous generation is told to stop.
+void Master::reload() {
+    if (stopping || !server.reloadConfig())
+        return;
+    
+    unsigned long previous = generation;
+    generation++;
+    spawnGeneration();
+    std::cout << "master: draining " << countGeneration(previous) << " worker(s) of the previous generation" << std::endl;
+    signalGeneration(previous, SIGQUIT);
+}
+
+// Execs the new binary with our listeners. Once it reports that it is
+// listening (checkUpgrade), our workers drain their clients and the master
+// exits after them.
+void Master::upgrade() {
+    if (stopping || upgrade_fd != -1)
+        return;
+    
+    pid_t pid = server.spawnUpgrade(upgrade_fd);
+    if (pid == -1) {
+        upgrade_fd = -1;
+        std::cerr << RED << "master: upgrade failed to start new binary: " << strerror(errno) << RESET << std::endl;
+        return;
+    }
+    upgrade_pid = pid;
+    upgrade_deadline = time(NULL) + UPGRADE_TIMEOUT_S;
+    std::cout << "master: started new binary (pid=" << pid << ")" << std::endl;
+}
+
+void Master::checkUpgrade() {
+    struct pollfd pfd;
+    pfd.fd = upgrade_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) != 1) {
+        if (time(NULL) >= upgrade_deadline) {
+            std::cerr << RED << "master: new binary did not start in time, keeping this one" << RESET << std::endl;
+            abandonUpgrade();
+        }
+        return;
+    }
+    
+    char c;
+    if (read(upgrade_fd, &c, 1) != 1) {
+        std::cerr << RED << "master: new binary failed to start, keeping this one" << RESET << std::endl;
+        abandonUpgrade();
+        return;
+    }
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    upgrade_pid = -1;
+    std::cout << "master: new binary is listening, handing over" << std::endl;
+    shutdown(SIGQUIT);
+}
+
+void Master::abandonUpgrade() {
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    if (upgrade_pid > 0) {
+        kill(upgrade_pid, SIGKILL);
+        waitpid(upgrade_pid, NULL, 0);
+    }
+    upgrade_pid = -1;
+}
+
+// A new binary still starting up is not left behind to take over.
+void Master::shutdown(int sig) {
+    if (upgrade_fd != -1)
+        abandonUpgrade();
+    if (!stopping)
+        std::cout << "\nmaster: " << (sig == SIGQUIT ? "draining " : "shutting down ")
+                  << workers.size() << " worker(s)" << std::endl;
+    stopping = true;
+    for (std::map<pid_t, Worker>::iterator it = workers.begin(); it != workers.end(); ++it)
+        kill(it->first, sig);
+}
+
+// Log rotation: every worker, draining ones included, reopens its access log.
+void Master::reopenLogs() {
+    for (std::map<pid_t, Worker>::iterator it = workers.begin(); it != workers.end(); ++it)
+        kill(it->first, SIGUSR1);
+}
+
+void Master::signalGeneration(unsigned long gen, int sig) {
+    for (std::map<pid_t, Worker>::iterator it = workers.begin(); it != workers.end(); ++it)
+        if (it->second.generation == gen)
+            kill(it->first, sig);
+}
+
+size_t Master::countGeneration(unsigned long gen) const {
+    size_t count = 0;
+    for (std::map<pid_t, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it)
+        if (it->second.generation == gen)
+            count++;
+    return count;
+}
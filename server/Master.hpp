@@ -0,0 +1,54 @@
+#ifndef MASTER_HPP
+#define MASTER_HPP
+
+#include "Server.hpp"
+#include <map>
+#include <signal.h>
+#include <sys/types.h>
+
+// Supervisor for the multi-process mode: owns the listening sockets (bound by
+// Server::start) and forks workers that each run the event loop on them.
+class Master {
+private:
+    struct Worker {
+        unsigned long generation;
+        time_t started;
+        size_t metrics_slot;
+    };
+    
+    Server& server;
+    std::map<pid_t, Worker> workers;
+    unsigned long generation;
+    sigset_t handled_signals;
+    sigset_t original_mask;
+    bool stopping;
+    // A new binary started by SIGUSR2 that has not reported in yet.
+    pid_t upgrade_pid;
+    int upgrade_fd;
+    time_t upgrade_deadline;
+    
+    Master(const Master&);
+    Master& operator=(const Master&);
+    
+public:
+    Master(Server& _server);
+    ~Master();
+    
+    void run();
+    
+private:
+    void spawnWorker();
+    size_t freeMetricsSlot() const;
+    void spawnGeneration();
+    void reapWorkers();
+    void reload();
+    void upgrade();
+    void checkUpgrade();
+    void abandonUpgrade();
+    void reopenLogs();
+    void shutdown(int sig);
+    void signalGeneration(unsigned long gen, int sig);
+    size_t countGeneration(unsigned long gen) const;
+};
+
+#endif
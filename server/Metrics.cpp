@@ -0,0 +1,282 @@
+#include "Metrics.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+Metrics::Region* Metrics::region = NULL;
+Metrics::Slot* Metrics::local = &Metrics::fallback;
+Metrics::Slot Metrics::fallback;
+int Metrics::trace_limit = 0;
+
+static const char* METHOD_NAMES[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OTHER" };
+static const char* PHASE_NAMES[] = { "headers", "body", "process", "cgi", "send", "total" };
+static const char* STATE_NAMES[] = { "reading", "processing", "sending", "cgi", "closing" };
+static const char* TABLE_NAMES[] = {
+    "clients", "cgi_fds", "cgi_processes", "streaming_cgis", "spliced_cgis",
+    "fastcgi_requests", "proxy_requests", "timers"
+};
+static const int FIRST_BUCKET_BITS = 6;
+
+// Slot 0 is the single-process server's (or, with workers, the master's);
+// workers are given the others by the master.
+bool Metrics::init() {
+    void* shared = mmap(NULL, sizeof(Region), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return false;
+    region = static_cast<Region*>(shared);
+    use(0);
+    return true;
+}
+
+void Metrics::use(size_t slot) {
+    if (!region || slot >= MAX_SLOTS)
+        return;
+    local = &region->slots[slot];
+    local->pid = getpid();
+}
+
+void Metrics::release(size_t slot) {
+    if (!region || slot >= MAX_SLOTS)
+        return;
+    std::memset(region->slots[slot].connections, 0, sizeof(region->slots[slot].connections));
+    std::memset(region->slots[slot].tables, 0, sizeof(region->slots[slot].tables));
+}
+
+long Metrics::nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void Metrics::setConnections(const long counts[STATE_COUNT]) {
+    for (int i = 0; i < STATE_COUNT; i++)
+        local->connections[i] = counts[i];
+}
+
+void Metrics::setTables(const long sizes[TABLE_COUNT]) {
+    for (int i = 0; i < TABLE_COUNT; i++)
+        local->tables[i] = sizes[i];
+}
+
+void Metrics::request(const std::string& method, int status) {
+    int index = OTHER;
+    for (int i = 0; i < OTHER; i++) {
+        if (method == METHOD_NAMES[i]) {
+            index = i;
+            break;
+        }
+    }
+    if (status < MIN_STATUS || status >= MIN_STATUS + STATUS_COUNT)
+        return;
+    local->requests[index][status - MIN_STATUS]++;
+}
+
+static void add(Metrics::Histogram& histogram, long us) {
+    if (us < 0)
+        us = 0;
+    int bucket = 0;
+    if (us > (1L << FIRST_BUCKET_BITS)) {
+        bucket = (64 - __builtin_clzl(static_cast<unsigned long>(us - 1))) - FIRST_BUCKET_BITS;
+        if (bucket >= Metrics::BUCKET_COUNT)
+            bucket = Metrics::BUCKET_COUNT - 1;
+    }
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.sum_us += us;
+}
+
+static void merge(Metrics::Histogram& total, const Metrics::Histogram& histogram) {
+    for (int b = 0; b < Metrics::BUCKET_COUNT; b++)
+        total.buckets[b] += histogram.buckets[b];
+    total.count += histogram.count;
+    total.sum_us += histogram.sum_us;
+}
+
+// labels is empty or `name="value",`, placed before le.
+static void renderHistogram(std::ostringstream& out, const char* name, const std::string& labels,
+                            const Metrics::Histogram& histogram) {
+    std::string braces = labels.empty() ? "" : "{" + labels.substr(0, labels.length() - 1) + "}";
+    unsigned long cumulative = 0;
+    for (int b = 0; b < Metrics::BUCKET_COUNT; b++) {
+        cumulative += histogram.buckets[b];
+        out << name << "_bucket{" << labels << "le=\"";
+        if (b == Metrics::BUCKET_COUNT - 1)
+            out << "+Inf";
+        else
+            out << static_cast<double>(1L << (FIRST_BUCKET_BITS + b)) / 1e6;
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum" << braces << " " << static_cast<double>(histogram.sum_us) / 1e6 << "\n"
+        << name << "_count" << braces << " " << histogram.count << "\n";
+}
+
+void Metrics::observe(Phase phase, long us) {
+    add(local->phases[phase], us);
+}
+
+void Metrics::loopLag(long us) {
+    add(local->loop_lag, us);
+}
+
+// Inserting costs a scan of the list only for a request slower than its
+// fastest entry.
+void Metrics::trace(const Trace& trace) {
+    unsigned long epoch = region ? region->trace_epoch : 0;
+    if (local->trace_epoch != epoch) {
+        local->trace_epoch = epoch;
+        local->trace_count = 0;
+    }
+    int limit = (trace_limit < MAX_TRACES) ? trace_limit : MAX_TRACES;
+    if (local->trace_count < limit) {
+        local->slowest[local->trace_count++] = trace;
+        return;
+    }
+    int fastest = -1;
+    for (int i = 0; i < local->trace_count; i++)
+        if (fastest == -1 || local->slowest[i].phases_us[TOTAL] < local->slowest[fastest].phases_us[TOTAL])
+            fastest = i;
+    if (fastest != -1 && trace.phases_us[TOTAL] > local->slowest[fastest].phases_us[TOTAL])
+        local->slowest[fastest] = trace;
+}
+
+static bool slowerThan(const std::pair<Metrics::Trace, pid_t>& a, const std::pair<Metrics::Trace, pid_t>& b) {
+    return a.first.phases_us[Metrics::TOTAL] > b.first.phases_us[Metrics::TOTAL];
+}
+
+static void appendPhase(std::ostringstream& out, long us) {
+    char text[24];
+    if (us < 0)
+        std::snprintf(text, sizeof(text), "%10s", "-");
+    else
+        std::snprintf(text, sizeof(text), "%10.3f", us / 1000.0);
+    out << text;
+}
+
+// A list is read while its worker may be replacing an entry; at worst one
+// line of the dump is garbled, which is fine for a diagnostic.
+std::string Metrics::renderSlowest(bool reset) {
+    std::vector<std::pair<Trace, pid_t> > traces;
+    unsigned long epoch = region ? region->trace_epoch : 0;
+    size_t count = region ? MAX_SLOTS : 1;
+    for (size_t s = 0; s < count; s++) {
+        const Slot& slot = region ? region->slots[s] : *local;
+        if ((!slot.pid && region) || slot.trace_epoch != epoch)
+            continue;
+        for (int i = 0; i < slot.trace_count && i < MAX_TRACES; i++)
+            traces.push_back(std::make_pair(slot.slowest[i], slot.pid));
+    }
+    std::sort(traces.begin(), traces.end(), slowerThan);
+    if (traces.size() > static_cast<size_t>(trace_limit))
+        traces.resize(trace_limit);
+
+    std::ostringstream out;
+    if (!trace_limit)
+        out << "# tracing is off, set trace_slowest to keep the slowest requests\n";
+    out << "# times in ms; handler is process or cgi, which one shows in the kind column\n"
+        << "     total   headers      body   handler      send  kind    status      pid  finished             request\n";
+    for (size_t i = 0; i < traces.size(); i++) {
+        const Trace& trace = traces[i].first;
+        bool cgi = trace.phases_us[CGI] >= 0;
+        char when[32] = "-";
+        struct tm tm;
+        if (localtime_r(&trace.finished, &tm))
+            strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        char tail[64];
+        std::snprintf(tail, sizeof(tail), "  %-7s %6d %8d  %s  ", cgi ? "cgi" : "process",
+                      trace.status, static_cast<int>(traces[i].second), when);
+
+        appendPhase(out, trace.phases_us[TOTAL]);
+        appendPhase(out, trace.phases_us[HEADERS]);
+        appendPhase(out, trace.phases_us[BODY]);
+        appendPhase(out, cgi ? trace.phases_us[CGI] : trace.phases_us[PROCESS]);
+        appendPhase(out, trace.phases_us[SEND]);
+        out << tail << std::string(trace.request, strnlen(trace.request, TRACE_REQUEST_MAX)) << "\n";
+    }
+    if (reset && region)
+        region->trace_epoch++;
+    else if (reset)
+        local->trace_count = 0;
+    return out.str();
+}
+
+std::string Metrics::render() {
+    Slot total;
+    std::memset(&total, 0, sizeof(total));
+    size_t count = region ? MAX_SLOTS : 1;
+    for (size_t s = 0; s < count; s++) {
+        const Slot& slot = region ? region->slots[s] : *local;
+        if (!slot.pid && region)
+            continue;
+        for (int m = 0; m < METHOD_COUNT; m++)
+            for (int c = 0; c < STATUS_COUNT; c++)
+                total.requests[m][c] += slot.requests[m][c];
+        total.bytes_received += slot.bytes_received;
+        total.bytes_sent += slot.bytes_sent;
+        total.connections_accepted += slot.connections_accepted;
+        total.log_lines_dropped += slot.log_lines_dropped;
+        for (int i = 0; i < STATE_COUNT; i++)
+            total.connections[i] += slot.connections[i];
+        for (int i = 0; i < TABLE_COUNT; i++)
+            total.tables[i] += slot.tables[i];
+        for (int p = 0; p < PHASE_COUNT; p++)
+            merge(total.phases[p], slot.phases[p]);
+        merge(total.loop_lag, slot.loop_lag);
+        total.slow_handlers += slot.slow_handlers;
+        total.event_syscalls += slot.event_syscalls;
+    }
+
+    std::ostringstream out;
+    out.precision(10);
+    out << "# HELP webserv_requests_total Requests answered, by method and status code.\n"
+        << "# TYPE webserv_requests_total counter\n";
+    for (int m = 0; m < METHOD_COUNT; m++)
+        for (int c = 0; c < STATUS_COUNT; c++)
+            if (total.requests[m][c])
+                out << "webserv_requests_total{method=\"" << METHOD_NAMES[m] << "\",code=\""
+                    << c + MIN_STATUS << "\"} " << total.requests[m][c] << "\n";
+
+    out << "# HELP webserv_received_bytes_total Bytes read from client connections.\n"
+        << "# TYPE webserv_received_bytes_total counter\n"
+        << "webserv_received_bytes_total " << total.bytes_received << "\n"
+        << "# HELP webserv_sent_bytes_total Bytes written to client connections.\n"
+        << "# TYPE webserv_sent_bytes_total counter\n"
+        << "webserv_sent_bytes_total " << total.bytes_sent << "\n"
+        << "# HELP webserv_connections_accepted_total Client connections accepted.\n"
+        << "# TYPE webserv_connections_accepted_total counter\n"
+        << "webserv_connections_accepted_total " << total.connections_accepted << "\n"
+        << "# HELP webserv_access_log_dropped_total Access log lines lost to a full buffer.\n"
+        << "# TYPE webserv_access_log_dropped_total counter\n"
+        << "webserv_access_log_dropped_total " << total.log_lines_dropped << "\n";
+
+    out << "# HELP webserv_connections Open client connections, by state.\n"
+        << "# TYPE webserv_connections gauge\n";
+    for (int i = 0; i < STATE_COUNT; i++)
+        out << "webserv_connections{state=\"" << STATE_NAMES[i] << "\"} " << total.connections[i] << "\n";
+    out << "# HELP webserv_table_entries Entries in the server's bookkeeping tables.\n"
+        << "# TYPE webserv_table_entries gauge\n";
+    for (int i = 0; i < TABLE_COUNT; i++)
+        out << "webserv_table_entries{table=\"" << TABLE_NAMES[i] << "\"} " << total.tables[i] << "\n";
+
+    out << "# HELP webserv_request_phase_seconds Time spent in each phase of a request.\n"
+        << "# TYPE webserv_request_phase_seconds histogram\n";
+    for (int p = 0; p < PHASE_COUNT; p++)
+        renderHistogram(out, "webserv_request_phase_seconds",
+                        std::string("phase=\"") + PHASE_NAMES[p] + "\",", total.phases[p]);
+
+    out << "# HELP webserv_event_loop_lag_seconds Busy time of an event loop iteration.\n"
+        << "# TYPE webserv_event_loop_lag_seconds histogram\n";
+    renderHistogram(out, "webserv_event_loop_lag_seconds", "", total.loop_lag);
+    out << "# HELP webserv_slow_handlers_total Event handlers that ran past loop_lag_warn.\n"
+        << "# TYPE webserv_slow_handlers_total counter\n"
+        << "webserv_slow_handlers_total " << total.slow_handlers << "\n"
+        << "# HELP webserv_event_syscalls_total Kernel calls of the event backend, waits and interest changes.\n"
+        << "# TYPE webserv_event_syscalls_total counter\n"
+        << "webserv_event_syscalls_total " << total.event_syscalls << "\n";
+    return out.str();
+}
@@ -0,0 +1,141 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <ctime>
+#include <sys/types.h>
+
+// Counters and latency histograms, shared by all worker processes. The
+// region is mapped MAP_SHARED before the workers are forked and split into
+// slots: each process only ever writes its own slot (plain increments, no
+// locks or atomics on the request path), a scrape sums them all. Counters
+// of a worker that exited stay in its slot for the next one to continue.
+class Metrics {
+public:
+    // A request starts at accept (the first on a connection) or at its
+    // first byte. A streamed body can still be arriving while the handler
+    // runs, so the phases may overlap.
+    enum Phase {
+        HEADERS,    // start to headers parsed
+        BODY,       // headers to the last body byte
+        PROCESS,    // handler to first response byte, static and error responses
+        CGI,        // handler to first response byte, CGI, FastCGI and proxy
+        SEND,       // first to last response byte
+        TOTAL,      // start to last response byte
+        PHASE_COUNT
+    };
+    enum Method {
+        GET,
+        HEAD,
+        POST,
+        PUT,
+        DELETE,
+        OTHER,
+        METHOD_COUNT
+    };
+    // The server's bookkeeping, which should drain back to its idle size
+    // once the traffic stops; growth that does not is a leak.
+    enum Table {
+        CLIENTS,
+        CGI_FDS,            // active_cgis: script pipes being watched
+        CGI_PROCESSES,      // cgi_pids
+        STREAMING_CGIS,
+        SPLICED_CGIS,
+        FASTCGI_REQUESTS,
+        PROXY_REQUESTS,
+        TIMERS,
+        TABLE_COUNT
+    };
+    // Indexed by Client::State.
+    static const int STATE_COUNT = 5;
+    static const int MIN_STATUS = 100;
+    static const int STATUS_COUNT = 500;
+    // Bucket i holds latencies up to 2^(6 + i) microseconds (64us .. ~16.8s),
+    // the last one everything above.
+    static const int BUCKET_COUNT = 20;
+    static const size_t MAX_SLOTS = 256;
+    static const int MAX_TRACES = 64;
+    static const int TRACE_REQUEST_MAX = 120;
+
+    struct Histogram {
+        unsigned long buckets[BUCKET_COUNT];
+        unsigned long count;
+        unsigned long sum_us;
+    };
+
+    // One of the slowest requests (trace_slowest); a phase it did not go
+    // through is -1.
+    struct Trace {
+        long phases_us[PHASE_COUNT];
+        int status;
+        time_t finished;
+        char request[TRACE_REQUEST_MAX];
+    };
+
+    struct Slot {
+        pid_t pid;
+        unsigned long requests[METHOD_COUNT][STATUS_COUNT];
+        unsigned long bytes_received;
+        unsigned long bytes_sent;
+        unsigned long connections_accepted;
+        unsigned long log_lines_dropped;
+        long connections[STATE_COUNT];
+        long tables[TABLE_COUNT];
+        Histogram phases[PHASE_COUNT];
+        // Busy time of each event loop iteration, from waking up to waiting
+        // again: how long a ready connection can go unserved.
+        Histogram loop_lag;
+        unsigned long slow_handlers;
+        // Calls into the kernel by the event backend: waits and interest
+        // changes.
+        unsigned long event_syscalls;
+        // Unordered; a reset (a newer epoch) empties it on the next insert.
+        unsigned long trace_epoch;
+        int trace_count;
+        Trace slowest[MAX_TRACES];
+    };
+
+    struct Region {
+        unsigned long trace_epoch;
+        Slot slots[MAX_SLOTS];
+    };
+
+private:
+    static Region* region;
+    static Slot* local;
+    static Slot fallback;
+    static int trace_limit;
+
+public:
+    // Maps the shared region; without it every process counts on its own.
+    static bool init();
+    static void use(size_t slot);
+    // Zeroes the gauges of a slot whose worker exited.
+    static void release(size_t slot);
+
+    static long nowUs();
+
+    static void received(size_t bytes) { local->bytes_received += bytes; }
+    static void sent(size_t bytes) { local->bytes_sent += bytes; }
+    static void accepted() { local->connections_accepted++; }
+    static void logDropped() { local->log_lines_dropped++; }
+    static void setConnections(const long counts[STATE_COUNT]);
+    static void setTables(const long sizes[TABLE_COUNT]);
+    static void request(const std::string& method, int status);
+    static void observe(Phase phase, long us);
+    static void loopLag(long us);
+    static void slowHandler() { local->slow_handlers++; }
+    static void eventSyscall() { local->event_syscalls++; }
+    static void setTraceLimit(int limit) { trace_limit = limit; }
+    static bool tracing() { return trace_limit > 0; }
+    // Keeps the trace if it is among this process's trace_limit slowest.
+    static void trace(const Trace& trace);
+
+    // Prometheus text exposition format, version 0.0.4.
+    static std::string render();
+    // The slowest requests of all workers, slowest first; with reset, the
+    // lists start over afterwards.
+    static std::string renderSlowest(bool reset);
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include "Proxy.hpp"
+#include "../http/HttpResponse.hpp"
+#include "../parsing/Utils.hpp"
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+
+// Longest chunk-size or trailer line we accept.
+static const size_t MAX_CHUNK_LINE = 4096;
+
+static std::string lowercase(const std::string& str) {
+    std::string lower = str;
+    for (size_t i = 0; i < lower.length(); i++)
+        lower[i] = std::tolower(lower[i]);
+    return lower;
+}
+
+// Headers that describe one connection and must not cross the proxy: the
+// fixed set plus whatever the Connection header names.
+static bool isHopByHop(const std::string& name, const std::string& connection) {
+    static const char* fixed[] = {
+        "connection", "keep-alive", "proxy-connection", "te", "trailer",
+        "transfer-encoding", "upgrade", NULL
+    };
+    std::string lower = lowercase(name);
+    for (size_t i = 0; fixed[i]; i++)
+        if (lower == fixed[i])
+            return true;
+
+    std::istringstream tokens(lowercase(connection));
+    std::string token;
+    while (std::getline(tokens, token, ','))
+        if (Utils::trim(token) == lower)
+            return true;
+    return false;
+}
+
+Proxy::ResponseHead::ResponseHead()
+    : status(0), framing(NO_BODY), content_length(-1), keep_alive(false) {}
+
+std::string Proxy::encodeRequestHead(const HttpRequest& request, const std::string& uri,
+                                     const std::string& client_addr) {
+    std::string connection = request.getHeader("Connection");
+    std::string forwarded_for;
+    std::ostringstream head;
+    head << request.getMethod() << " " << uri << " HTTP/1.1\r\n";
+
+    std::map<std::string, std::string> headers = request.getHeadersMap();
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        std::string lower = lowercase(it->first);
+        if (isHopByHop(it->first, connection) || lower == "expect" || lower == "x-forwarded-proto")
+            continue;
+        if (lower == "x-forwarded-for") {
+            forwarded_for = it->second + ", ";
+            continue;
+        }
+        head << it->first << ": " << it->second << "\r\n";
+    }
+    if (request.getHeader("Host").empty())
+        head << "Host: localhost\r\n";
+    head << "X-Forwarded-For: " << forwarded_for << client_addr << "\r\n";
+    head << "X-Forwarded-Proto: http\r\n";
+    head << "\r\n";
+    return head.str();
+}
+
+size_t Proxy::findHeadEnd(const std::string& buffer) {
+    size_t end = buffer.find("\r\n\r\n");
+    if (end != std::string::npos)
+        return end + 4;
+    end = buffer.find("\n\n");
+    if (end != std::string::npos)
+        return end + 2;
+    return 0;
+}
+
+bool Proxy::parseResponseHead(const std::string& head, ResponseHead& out) {
+    out = ResponseHead();
+    std::istringstream lines(head);
+    std::string line;
+    std::getline(lines, line);
+    if (!line.empty() && line[line.length() - 1] == '\r')
+        line.erase(line.length() - 1);
+
+    // HTTP/1.x NNN [reason]
+    if (line.length() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' '
+        || !std::isdigit(line[9]) || !std::isdigit(line[10]) || !std::isdigit(line[11])
+        || (line.length() > 12 && line[12] != ' '))
+        return false;
+    out.keep_alive = (line[7] == '1');
+    out.status = std::atoi(line.substr(9, 3).c_str());
+    if (line.length() > 13)
+        out.reason = line.substr(13);
+
+    bool chunked = false;
+    bool transfer_encoded = false;
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line.empty())
+            break;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            return false;
+        std::string name = Utils::trim(line.substr(0, colon));
+        std::string value = Utils::trim(line.substr(colon + 1));
+        out.headers.push_back(std::make_pair(name, value));
+
+        std::string lower = lowercase(name);
+        if (lower == "connection") {
+            std::istringstream tokens(lowercase(value));
+            std::string token;
+            while (std::getline(tokens, token, ',')) {
+                if (Utils::trim(token) == "close")
+                    out.keep_alive = false;
+                else if (Utils::trim(token) == "keep-alive")
+                    out.keep_alive = true;
+            }
+        }
+        else if (lower == "transfer-encoding") {
+            std::string codings = lowercase(value);
+            transfer_encoded = true;
+            chunked = codings.length() >= 7 && codings.compare(codings.length() - 7, 7, "chunked") == 0;
+        }
+        else if (lower == "content-length") {
+            if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.length() > 15)
+                return false;
+            long length = std::atol(value.c_str());
+            if (out.content_length != -1 && out.content_length != length)
+                return false;
+            out.content_length = length;
+        }
+    }
+
+    if (out.status < 200 || out.status == 204 || out.status == 304)
+        out.framing = NO_BODY;
+    else if (transfer_encoded)
+        out.framing = chunked ? CHUNKED : UNTIL_CLOSE;
+    else if (out.content_length >= 0)
+        out.framing = LENGTH;
+    else
+        out.framing = UNTIL_CLOSE;
+    if (out.framing == UNTIL_CLOSE)
+        out.keep_alive = false;
+    return true;
+}
+
+std::string Proxy::encodeResponseHead(const ResponseHead& head, bool chunked, bool keep_alive) {
+    std::string connection;
+    for (size_t i = 0; i < head.headers.size(); i++)
+        if (lowercase(head.headers[i].first) == "connection")
+            connection += head.headers[i].second + ",";
+
+    std::ostringstream out;
+    out << "HTTP/1.1 " << head.status << " "
+        << (head.reason.empty() ? HttpResponse::getStatusMessage(head.status) : head.reason) << "\r\n";
+    for (size_t i = 0; i < head.headers.size(); i++) {
+        const std::string& name = head.headers[i].first;
+        if (isHopByHop(name, connection))
+            continue;
+        if (head.framing != LENGTH && lowercase(name) == "content-length")
+            continue;
+        out << name << ": " << head.headers[i].second << "\r\n";
+    }
+    if (chunked)
+        out << "Transfer-Encoding: chunked\r\n";
+    out << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n";
+    out << "\r\n";
+    return out.str();
+}
+
+Proxy::ChunkedDecoder::ChunkedDecoder() : state(SIZE), remaining(0) {}
+
+long Proxy::ChunkedDecoder::feed(const char* data, size_t len, std::string* decoded) {
+    size_t i = 0;
+    while (i < len && state != DONE) {
+        if (state == DATA) {
+            size_t take = std::min(remaining, len - i);
+            if (decoded)
+                decoded->append(data + i, take);
+            i += take;
+            remaining -= take;
+            if (remaining == 0)
+                state = DATA_END;
+            continue;
+        }
+
+        char c = data[i++];
+        if (c != '\n') {
+            if (line.length() >= MAX_CHUNK_LINE)
+                return -1;
+            line += c;
+            continue;
+        }
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+
+        if (state == SIZE) {
+            std::string size = Utils::trim(line.substr(0, line.find(';')));
+            if (size.empty() || size.length() > 15 ||
+                size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                return -1;
+            remaining = std::strtoul(size.c_str(), NULL, 16);
+            state = remaining ? DATA : TRAILER;
+        }
+        else if (state == DATA_END) {
+            if (!line.empty())
+                return -1;
+            state = SIZE;
+        }
+        else if (state == TRAILER && line.empty())
+            state = DONE;
+        line.clear();
+    }
+    return i;
+}
+
+ProxyRequest::ProxyRequest()
+    : client_fd(-1), upstream_fd(-1), group(NULL), peer(-1), reused(false), connected(false),
+      idempotent(true), out_sent(0), body_streaming(false), body_started(false), body_sent(false),
+      send_failed(false), head_done(false), framing(Proxy::NO_BODY), remaining(0), dechunk(false),
+      upstream_keep_alive(false), connect_timeout_ms(0), read_timeout_ms(0), last_activity_ms(0) {}
@@ -0,0 +1,102 @@
+#ifndef PROXY_HPP
+#define PROXY_HPP
+
+#include "../http/HttpRequest.hpp"
+#include "Timers.hpp"
+#include <string>
+#include <vector>
+
+class UpstreamGroup;
+
+namespace Proxy {
+    // How the end of an upstream response body is found.
+    enum Framing {
+        NO_BODY,
+        LENGTH,
+        CHUNKED,
+        UNTIL_CLOSE
+    };
+
+    struct ResponseHead {
+        int status;
+        std::string reason;
+        std::vector<std::pair<std::string, std::string> > headers;
+        Framing framing;
+        long content_length;
+        bool keep_alive;
+
+        ResponseHead();
+    };
+
+    // Request line and headers for the upstream: hop-by-hop headers and
+    // Expect are dropped (we answer 100-continue ourselves), X-Forwarded-For
+    // and X-Forwarded-Proto are added.
+    std::string encodeRequestHead(const HttpRequest& request, const std::string& uri,
+                                  const std::string& client_addr);
+    // Length of the head (through the blank line), 0 while incomplete.
+    size_t findHeadEnd(const std::string& buffer);
+    bool parseResponseHead(const std::string& head, ResponseHead& out);
+    // The head passed on to the client: the upstream's headers minus the
+    // hop-by-hop ones, with our own framing and Connection.
+    std::string encodeResponseHead(const ResponseHead& head, bool chunked, bool keep_alive);
+
+    // Walks a chunked body to find where it ends, optionally collecting the
+    // payload (for clients that cannot take chunked).
+    class ChunkedDecoder {
+    private:
+        enum State {
+            SIZE,
+            DATA,
+            DATA_END,
+            TRAILER,
+            DONE
+        };
+        State state;
+        size_t remaining;
+        std::string line;
+
+    public:
+        ChunkedDecoder();
+
+        // Consumes up to len bytes, appending the payload to `decoded` when
+        // given. Returns the bytes consumed (fewer than len only once done),
+        // or -1 on a malformed stream.
+        long feed(const char* data, size_t len, std::string* decoded);
+        bool done() const { return state == DONE; }
+    };
+}
+
+// One proxied request. The upstream connection comes from the chosen peer's
+// pool and goes back to it when the response ended cleanly.
+struct ProxyRequest {
+    int client_fd;
+    int upstream_fd;
+    UpstreamGroup* group;
+    int peer;
+    std::string hash_key;
+    std::vector<bool> tried;
+    bool reused;
+    bool connected;
+    bool idempotent;
+    std::string out;
+    size_t out_sent;
+    bool body_streaming;
+    bool body_started;
+    bool body_sent;
+    bool send_failed;
+    std::string in;
+    bool head_done;
+    Proxy::Framing framing;
+    long remaining;
+    bool dechunk;
+    Proxy::ChunkedDecoder chunked;
+    bool upstream_keep_alive;
+    long connect_timeout_ms;
+    long read_timeout_ms;
+    long last_activity_ms;
+    Timers::Handle deadline;
+
+    ProxyRequest();
+};
+
+#endif
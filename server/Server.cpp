@@ -1,9 +1,51 @@
 #include "Server.hpp"
+#include "../parsing/Utils.hpp"
+#include "Metrics.hpp"
+#include "AccessLog.hpp"
+#include "Capture.hpp"
 #include <iostream>
 #include <cstring>
+#include <strings.h>
+#include <cstdlib>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sstream>
+#include <algorithm>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+extern char** environ;
 
 static bool g_server_running = true;
+static volatile sig_atomic_t g_reload_requested = 0;
+static volatile sig_atomic_t g_drain_requested = 0;
+static volatile sig_atomic_t g_upgrade_requested = 0;
+static volatile sig_atomic_t g_reopen_requested = 0;
+
+// Environment used to hand the listening sockets over to a new binary.
+static const char* LISTEN_FDS_ENV = "WEBSERV_LISTEN_FDS";
+static const char* UPGRADE_NOTIFY_ENV = "WEBSERV_UPGRADE_NOTIFY";
+static const long CGI_TIMEOUT_MS = 30000;
+// How long a zygote may take to answer with the pid; it also covers the
+// first request racing the interpreter start-up.
+static const long ZYGOTE_TIMEOUT_MS = 2000;
+// How much of a streamed request body may sit in memory while the script is
+// slow to read its stdin; past it the client socket is left unread.
+static const size_t CGI_STDIN_HIGH_WATER = 64 * 1024;
+// CGI output is buffered (and answered with a Content-Length and keep-alive)
+// up to this much; beyond it the body is spliced from the pipe instead.
+static const size_t CGI_SPLICE_THRESHOLD = 64 * 1024;
+static const size_t CGI_SPLICE_CHUNK = 1024 * 1024;
+// An NPH script that writes this much without ending its first line is not
+// sending a status line.
+static const size_t NPH_MAX_STATUS_LINE = 1024;
+// Per proxied request, at most this much of the request body and of the
+// response is held here; past it the sending side is left unread.
+static const size_t PROXY_HIGH_WATER = 64 * 1024;
+static const size_t PROXY_MAX_HEAD = 64 * 1024;
 
 static void signalHandler(int sig) {
     (void)sig;
@@ -11,70 +53,585 @@ static void signalHandler(int sig) {
     std::cout << "\nshutting down server." << std::endl;
 }
 
-Server::Server(const std::vector<ServerConfig>& _configs) 
-    : configs(_configs), running(false) {
+static void reopenHandler(int sig) {
+    (void)sig;
+    g_reopen_requested = 1;
+}
+
+static void reloadHandler(int sig) {
+    (void)sig;
+    g_reload_requested = 1;
+}
+
+static void drainHandler(int sig) {
+    (void)sig;
+    g_drain_requested = 1;
+}
+
+static void upgradeHandler(int sig) {
+    (void)sig;
+    g_upgrade_requested = 1;
+}
+
+static long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static std::string listenKey(const std::string& host, int port) {
+    std::stringstream ss;
+    ss << host << ":" << port;
+    return ss.str();
+}
+
+static std::string clientAddress(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char text[INET6_ADDRSTRLEN] = "";
+    if (getpeername(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0) {
+        if (addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in*>(&addr)->sin_addr, text, sizeof(text));
+        else if (addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+// Listening fds passed down by the process we are replacing, keyed by host:port.
+static std::map<std::string, int> takeInheritedListeners() {
+    std::map<std::string, int> inherited;
+    const char* env = getenv(LISTEN_FDS_ENV);
+    if (!env)
+        return inherited;
+    
+    std::vector<std::string> entries = Utils::split(env, ';');
+    for (size_t i = 0; i < entries.size(); i++) {
+        size_t eq = entries[i].find('=');
+        if (eq == std::string::npos)
+            continue;
+        int fd = std::atoi(entries[i].substr(0, eq).c_str());
+        if (fd > 2)
+            inherited[entries[i].substr(eq + 1)] = fd;
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    return inherited;
+}
+
+// Tells the process we are replacing that our listeners are up.
+static void notifyUpgradeParent() {
+    const char* env = getenv(UPGRADE_NOTIFY_ENV);
+    if (!env)
+        return;
+    int fd = std::atoi(env);
+    if (fd > 2) {
+        if (write(fd, "1", 1) == -1)
+            std::cerr << RED << "failed to notify previous process: " << strerror(errno) << RESET << std::endl;
+        close(fd);
+    }
+    unsetenv(UPGRADE_NOTIFY_ENV);
+}
+
+Server::Server(const Config& config) 
+    : config_file(config.getConfigFile()), running(false), draining(false),
+      drain_started_ms(0), gauges_updated_ms(0),
+      loop_woke_us(0), lag_window_ms(0), lag_warnings(0), lag_suppressed(0), upgrade_pid(-1), upgrade_notify_fd(-1), child_fd(-1), cgi_running_total(0), next_launch_id(0) {
     
+    snapshot = new ConfigSnapshot(config, 1);
+    installSignalHandlers();
+}
+
+void Server::installSignalHandlers() {
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
+    signal(SIGHUP, reloadHandler);
+    signal(SIGQUIT, drainHandler);
+    signal(SIGUSR2, upgradeHandler);
+    signal(SIGUSR1, reopenHandler);
     signal(SIGPIPE, SIG_IGN);
 }
 
+void Server::setExecArgs(int argc, char** argv) {
+    exec_args.assign(argv, argv + argc);
+}
+
 Server::~Server() {
     stop();
     
+    for (std::map<std::string, UpstreamPool*>::iterator it = upstream_pools.begin();
+         it != upstream_pools.end(); ++it)
+        delete it->second;
+    for (std::map<std::string, UpstreamGroup*>::iterator it = upstream_groups.begin();
+         it != upstream_groups.end(); ++it)
+        delete it->second;
+    for (size_t i = 0; i < retired_groups.size(); i++)
+        delete retired_groups[i];
+    for (size_t i = 0; i < retired_pools.size(); i++)
+        delete retired_pools[i];
+    for (std::map<std::string, CGIPool*>::iterator it = cgi_pools.begin();
+         it != cgi_pools.end(); ++it)
+        delete it->second;
+    for (size_t i = 0; i < retired_cgi_pools.size(); i++)
+        delete retired_cgi_pools[i];
+    for (std::map<std::string, Zygote*>::iterator it = zygotes.begin();
+         it != zygotes.end(); ++it)
+        delete it->second;
+    if (child_fd != -1)
+        close(child_fd);
+    
     for (size_t i = 0; i < listen_sockets.size(); i++)
         delete listen_sockets[i];
     
     for (std::map<int, Client*>::iterator it = clients.begin(); 
          it != clients.end(); ++it)
         delete it->second;
+    snapshot->release();
+}
+
+Socket* Server::openListener(const ServerConfig& config) {
+    Socket* sock = new Socket();
+    
+    try {
+        sock->create();
+        sock->setReuseAddr();
+        sock->setNonBlocking(); 
+        sock->bind(config.host, config.port);
+        sock->listen();
+        event_manager.addFd(sock->getFd(), true, false);
+    }
+    catch (const std::exception& e) {
+        delete sock;
+        throw;
+    }
+    std::cout << "listening on " << YELLOW << config.host 
+              << ":" << config.port 
+              << RESET << " (fd=" << sock->getFd() << ")" << std::endl;
+    return sock;
 }
 
 void Server::start() {
     std::cout << PURPLE << "\nstarting ircerv..." << RESET << std::endl;
     
+    std::map<std::string, int> inherited = takeInheritedListeners();
+    const std::vector<ServerConfig>& configs = snapshot->getServers();
     for (size_t i = 0; i < configs.size(); i++) {
-        Socket* sock = new Socket();
-        
         try {
-            sock->create();
-            sock->setReuseAddr();
-            sock->setNonBlocking(); 
-            sock->bind(configs[i].host, configs[i].port);
-            sock->listen();
-            
+            Socket* sock;
+            std::map<std::string, int>::iterator it = inherited.find(listenKey(configs[i].host, configs[i].port));
+            if (it != inherited.end()) {
+                sock = new Socket();
+                sock->adopt(it->second, configs[i].host, configs[i].port);
+                inherited.erase(it);
+                event_manager.addFd(sock->getFd(), true, false);
+                std::cout << "listening on " << YELLOW << configs[i].host << ":" << configs[i].port
+                          << RESET << " (fd=" << sock->getFd() << ", inherited)" << std::endl;
+            }
+            else
+                sock = openListener(configs[i]);
             listen_sockets.push_back(sock);
             fd_to_config[sock->getFd()] = &configs[i];
-            event_manager.addFd(sock->getFd(), true, false);
-            
-            std::cout << "listening on " << YELLOW << configs[i].host 
-                      << ":" << configs[i].port 
-                      << RESET << " (fd=" << sock->getFd() << ")" << std::endl;
         }
         catch (const std::exception& e) {
-            delete sock;
             throw std::runtime_error("failed to start server: " + std::string(e.what()));
         }
     }
+    for (std::map<std::string, int>::iterator it = inherited.begin(); it != inherited.end(); ++it)
+        close(it->second);
+    if (!preparePools(snapshot))
+        throw std::runtime_error("failed to start server: bad fastcgi_pass or upstream address");
+    cgi_cache.setMaxEntries(snapshot->getGlobal().cgi_cache_entries);
+    AccessLog::configure(snapshot->getGlobal());
+    Capture::configure(snapshot->getGlobal());
+    Metrics::setTraceLimit(snapshot->getGlobal().trace_slowest);
+    if (!Metrics::init())
+        std::cerr << RED << "metrics: shared mapping failed, counting per process" << RESET << std::endl;
     
     running = true;
+    notifyUpgradeParent();
     std::cout << GREEN << "server started successfully! <3" << RESET << std::endl;
 }
 
+// Stops accepting: listeners are closed here (another process may own the
+// port by now) and the loop exits once the remaining clients are done, or
+// when shutdown_timeout runs out. Every client gets Connection: close on its
+// next response.
+void Server::beginDrain() {
+    if (draining)
+        return;
+    draining = true;
+    drain_started_ms = monotonicMs();
+    for (size_t i = 0; i < listen_sockets.size(); i++) {
+        event_manager.removeFd(listen_sockets[i]->getFd());
+        delete listen_sockets[i];
+    }
+    listen_sockets.clear();
+    fd_to_config.clear();
+    for (std::map<int, Client*>::iterator it = clients.begin(); it != clients.end(); ++it)
+        it->second->requestClose();
+    std::cout << "draining " << clients.size() << " client(s) and " << cgiCount()
+              << " CGI(s), grace period " << snapshot->getGlobal().shutdown_timeout_ms << "ms" << std::endl;
+}
+
+// Forks and execs exec_args with the listening fds inherited. The child
+// reports readiness on notify_fd; EOF without data means it failed.
+// The path execvp would run, looked up here since exec in the child may
+// only use what is already built.
+static std::string resolveExecutable(const std::string& name) {
+    if (name.find('/') != std::string::npos)
+        return name;
+    const char* path = std::getenv("PATH");
+    std::istringstream dirs(path ? path : "/usr/local/bin:/usr/bin:/bin");
+    std::string dir;
+    while (std::getline(dirs, dir, ':')) {
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0)
+            return candidate;
+    }
+    return name;
+}
+
+// Everything the child needs (argv, envp, the fds to keep) is built before
+// the fork: in single-process mode the log writer threads are running, and
+// one of them may hold the malloc lock as we fork. The child only closes
+// fds, resets its signal mask and execs.
+pid_t Server::spawnUpgrade(int& notify_fd) {
+    int notify[2];
+    if (exec_args.empty() || pipe2(notify, O_CLOEXEC) == -1)
+        return -1;
+    
+    std::vector<int> keep;
+    std::stringstream fds;
+    for (size_t i = 0; i < listen_sockets.size(); i++) {
+        if (i > 0)
+            fds << ";";
+        fds << listen_sockets[i]->getFd() << "="
+            << listenKey(listen_sockets[i]->getHost(), listen_sockets[i]->getPort());
+        keep.push_back(listen_sockets[i]->getFd());
+    }
+    keep.push_back(notify[1]);
+    std::sort(keep.begin(), keep.end());
+    std::stringstream notify_str;
+    notify_str << notify[1];
+    
+    std::vector<std::string> env;
+    std::string listen_prefix = std::string(LISTEN_FDS_ENV) + "=";
+    std::string notify_prefix = std::string(UPGRADE_NOTIFY_ENV) + "=";
+    for (char** var = environ; *var; var++) {
+        std::string entry = *var;
+        if (entry.compare(0, listen_prefix.length(), listen_prefix) != 0 &&
+            entry.compare(0, notify_prefix.length(), notify_prefix) != 0)
+            env.push_back(entry);
+    }
+    env.push_back(listen_prefix + fds.str());
+    env.push_back(notify_prefix + notify_str.str());
+    
+    std::string path = resolveExecutable(exec_args[0]);
+    std::string failure = "upgrade: exec " + path + " failed\n";
+    char** argv = vectorToCharArray(exec_args);
+    char** envp = vectorToCharArray(env);
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    sigset_t empty;
+    sigemptyset(&empty);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Client sockets, CGI pipes and the epoll fd must not leak into the
+        // new process, or connections would outlive our close().
+        for (int fd = 3; fd < max_fd && fd < 65536; fd++) {
+            if (std::binary_search(keep.begin(), keep.end(), fd))
+                fcntl(fd, F_SETFD, 0);
+            else
+                close(fd);
+        }
+        
+        // The master runs with its signals blocked; exec would keep that mask.
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execve(path.c_str(), argv, envp);
+        ssize_t ignored = write(STDERR_FILENO, failure.data(), failure.length());
+        (void)ignored;
+        _exit(1);
+    }
+    freeCharArray(argv);
+    freeCharArray(envp);
+    close(notify[1]);
+    if (pid == -1) {
+        close(notify[0]);
+        return -1;
+    }
+    notify_fd = notify[0];
+    return pid;
+}
+
+void Server::startUpgrade() {
+    if (upgrade_pid != -1 || draining)
+        return;
+    
+    upgrade_pid = spawnUpgrade(upgrade_notify_fd);
+    if (upgrade_pid == -1) {
+        std::cerr << RED << "upgrade: failed to start new binary: " << strerror(errno) << RESET << std::endl;
+        return;
+    }
+    event_manager.addFd(upgrade_notify_fd, true, false);
+    std::cout << "upgrade: started new binary (pid=" << upgrade_pid << ")" << std::endl;
+}
+
+void Server::handleUpgradeNotify() {
+    char c;
+    ssize_t bytes = read(upgrade_notify_fd, &c, 1);
+    if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    
+    event_manager.removeFd(upgrade_notify_fd);
+    close(upgrade_notify_fd);
+    upgrade_notify_fd = -1;
+    
+    if (bytes == 1) {
+        std::cout << "upgrade: new binary is listening, handing over" << std::endl;
+        beginDrain();
+        return;
+    }
+    std::cerr << RED << "upgrade: new binary failed to start, keeping this one" << RESET << std::endl;
+    if (upgrade_pid > 0)
+        waitpid(upgrade_pid, NULL, 0);
+    upgrade_pid = -1;
+}
+
+// SIGCHLD is taken off the async path and read from a signalfd in the event
+// loop, so every child (CGI, pool worker, zygote, the upgrade binary, and the
+// zygote's grandchildren we inherit as subreaper) is reaped the moment it
+// exits. A pidfd per child would not cover the grandchildren. Without a
+// signalfd or timerfd the loop falls back to polling both every iteration.
+void Server::watchChildren() {
+    if (child_fd == -1) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        child_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (child_fd != -1)
+            event_manager.addFd(child_fd, true, false);
+        else
+            std::cerr << RED << "signalfd: " << strerror(errno) << ", polling for child exits" << RESET << std::endl;
+    }
+    if (timers.getFd() == -1) {
+        if (timers.open())
+            event_manager.addFd(timers.getFd(), true, false);
+        else
+            std::cerr << RED << "timerfd: " << strerror(errno) << ", polling for deadlines" << RESET << std::endl;
+    }
+}
+
+// Signals coalesce, so one wakeup may stand for several children: reap until
+// waitpid has nothing left and route each pid to whoever owns it.
+void Server::handleChildExit() {
+    struct signalfd_siginfo info;
+    while (child_fd != -1 && read(child_fd, &info, sizeof(info)) > 0)
+        ;
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        std::map<pid_t, CGIProcess*>::iterator it = cgi_pids.find(pid);
+        if (it != cgi_pids.end()) {
+            CGIProcess* cgi = it->second;
+            cgi_pids.erase(it);
+            finishExitedCGI(cgi, status);
+            continue;
+        }
+        if (pid == upgrade_pid) {
+            // Its notify pipe reports success or failure, nothing to wait for.
+            upgrade_pid = -1;
+            continue;
+        }
+        bool owned = false;
+        for (std::map<std::string, Zygote*>::iterator z = zygotes.begin(); !owned && z != zygotes.end(); ++z) {
+            owned = z->second->childExited(pid);
+            if (owned)
+                watchZygote(z->second);
+        }
+        for (std::map<std::string, CGIPool*>::iterator p = cgi_pools.begin(); !owned && p != cgi_pools.end(); ++p)
+            owned = p->second->childExited(pid);
+        for (size_t i = 0; !owned && i < retired_cgi_pools.size(); i++)
+            owned = retired_cgi_pools[i]->childExited(pid);
+        // Anything else is an orphan handed to us as subreaper; reaping it is
+        // all, unless it may be a zygote child whose pid is still on its way.
+        if (!owned && zygoteLaunchesPending())
+            unclaimed_exits[pid] = status;
+    }
+}
+
+void Server::handleTimers() {
+    std::vector<Timers::Entry> due = timers.expire(monotonicMs());
+    for (size_t i = 0; i < due.size(); i++) {
+        if (due[i].kind == Timers::CGI_DEADLINE)
+            expireCGI(due[i].id);
+        else if (due[i].kind == Timers::PROXY_DEADLINE)
+            expireProxy(due[i].id);
+        else if (due[i].kind == Timers::FASTCGI_DEADLINE)
+            expireFastCGI(due[i].id);
+        else if (due[i].kind == Timers::POOL_DEADLINE)
+            expirePooledCGI(due[i].id);
+        else if (due[i].kind == Timers::CGI_QUEUE_DEADLINE)
+            expireCGIQueue(due[i].id);
+        else if (due[i].kind == Timers::ZYGOTE_DEADLINE)
+            expireZygoteLaunch(due[i].id);
+    }
+}
+
+// Called in a freshly forked worker: the listening sockets are inherited from
+// the master, everything else (epoll instance, signal dispositions) is ours.
+void Server::becomeWorker() {
+    installSignalHandlers();
+    event_manager.reopen();
+}
+
+// Re-reads the config file and swaps in the new snapshot. Listeners whose
+// host:port survives are kept as-is (no accept gap), new ones are opened and
+// dropped ones closed. Connected clients keep the snapshot they were accepted
+// with. Any parse or bind error leaves the running configuration untouched.
+bool Server::reloadConfig() {
+    ConfigSnapshot* fresh;
+    try {
+        Config config(config_file);
+        fresh = new ConfigSnapshot(config, snapshot->getGeneration() + 1);
+    }
+    catch (const std::exception& e) {
+        std::cerr << RED << "reload failed, keeping current configuration: " << e.what() << RESET << std::endl;
+        return false;
+    }
+    if (!preparePools(fresh)) {
+        std::cerr << RED << "reload failed, keeping current configuration" << RESET << std::endl;
+        fresh->release();
+        return false;
+    }
+    
+    std::map<std::pair<std::string, int>, Socket*> current;
+    for (size_t i = 0; i < listen_sockets.size(); i++)
+        current[std::make_pair(listen_sockets[i]->getHost(), listen_sockets[i]->getPort())] = listen_sockets[i];
+    
+    const std::vector<ServerConfig>& configs = fresh->getServers();
+    std::vector<Socket*> next_sockets;
+    std::vector<Socket*> opened;
+    std::map<int, const ServerConfig*> next_fd_to_config;
+    
+    for (size_t i = 0; i < configs.size(); i++) {
+        std::pair<std::string, int> addr(configs[i].host, configs[i].port);
+        std::map<std::pair<std::string, int>, Socket*>::iterator it = current.find(addr);
+        Socket* sock;
+        
+        if (it != current.end()) {
+            sock = it->second;
+            current.erase(it);
+        }
+        else {
+            try {
+                sock = openListener(configs[i]);
+            }
+            catch (const std::exception& e) {
+                std::cerr << RED << "reload failed, keeping current configuration: " << e.what() << RESET << std::endl;
+                for (size_t j = 0; j < opened.size(); j++) {
+                    event_manager.removeFd(opened[j]->getFd());
+                    delete opened[j];
+                }
+                fresh->release();
+                return false;
+            }
+            opened.push_back(sock);
+        }
+        next_sockets.push_back(sock);
+        next_fd_to_config[sock->getFd()] = &configs[i];
+    }
+    
+    for (std::map<std::pair<std::string, int>, Socket*>::iterator it = current.begin();
+         it != current.end(); ++it) {
+        std::cout << "no longer listening on " << YELLOW << it->first.first << ":" << it->first.second
+                  << RESET << " (fd=" << it->second->getFd() << ")" << std::endl;
+        event_manager.removeFd(it->second->getFd());
+        delete it->second;
+    }
+    
+    listen_sockets = next_sockets;
+    fd_to_config = next_fd_to_config;
+    snapshot->release();
+    snapshot = fresh;
+    cgi_cache.setMaxEntries(snapshot->getGlobal().cgi_cache_entries);
+    AccessLog::configure(snapshot->getGlobal());
+    Capture::configure(snapshot->getGlobal());
+    Metrics::setTraceLimit(snapshot->getGlobal().trace_slowest);
+    
+    std::cout << GREEN << "configuration reloaded (generation " << snapshot->getGeneration()
+              << ")" << RESET << std::endl;
+    return true;
+}
+
 void Server::run() {
-    std::cout << "server is running. Ctrl+C if you wanna stop." << std::endl;
+    // Like the log writers, the ring belongs to the process that serves.
+    event_manager.useBackend(snapshot->getGlobal().event_backend);
+    std::cout << "server is running on " << event_manager.backendName() << ". Ctrl+C if you wanna stop." << std::endl;
+    watchChildren();
+    AccessLog::start();
+    Capture::start();
     
     while (running && g_server_running) {
+        if (g_reopen_requested) {
+            g_reopen_requested = 0;
+            AccessLog::reopen();
+            Capture::reopen();
+        }
+        if (g_reload_requested) {
+            g_reload_requested = 0;
+            if (!draining)
+                reloadConfig();
+        }
+        if (g_upgrade_requested) {
+            g_upgrade_requested = 0;
+            startUpgrade();
+        }
+        if (g_drain_requested) {
+            g_drain_requested = 0;
+            beginDrain();
+        }
+        if (draining) {
+            closeIdleClients();
+            if (clients.empty() && active_cgis.empty())
+                break;
+            if (monotonicMs() - drain_started_ms >= snapshot->getGlobal().shutdown_timeout_ms) {
+                std::cout << "grace period expired, dropping " << clients.size() << " client(s) and "
+                          << cgiCount() << " CGI(s)" << std::endl;
+                break;
+            }
+        }
+        
+        // Everything since the last wakeup (events, housekeeping, a reload)
+        // kept ready connections waiting.
+        if (loop_woke_us)
+            Metrics::loopLag(Metrics::nowUs() - loop_woke_us);
         int num_events = event_manager.wait(100);
+        loop_woke_us = Metrics::nowUs();
         
         if (num_events > 0) {
             const std::vector<EventManager::Event>& events = event_manager.getEvents();
             
             for (size_t i = 0; i < events.size(); i++) {
                 const EventManager::Event& event = events[i];
+                long began_us = Metrics::nowUs();
+                const char* handler = "unknown fd";
                 
-                if (fd_to_config.find(event.fd) != fd_to_config.end()) 
+                if (event.fd == upgrade_notify_fd) {
+                    handler = "upgrade";
+                    handleUpgradeNotify();
+                }
+                else if (event.fd == child_fd) {
+                    handler = "child exit";
+                    handleChildExit();
+                }
+                else if (event.fd == timers.getFd()) {
+                    handler = "timers";
+                    handleTimers();
+                }
+                else if (fd_to_config.find(event.fd) != fd_to_config.end()) 
                 {
+                    handler = "accept";
                     if (event.readable)
                         acceptNewClient(event.fd);
                 }
@@ -82,37 +639,120 @@ void Server::run() {
                     Client* client = clients[event.fd];
                     
                     if (event.error) {
+                        handler = "client error";
                         removeClient(client);
                     }
                     else {
-                        if (event.readable && client->getState() == Client::READING_REQUEST)
+                        handler = "client";
+                        if (event.readable && client->getState() == Client::READING_REQUEST) {
+                            handler = "client read";
                             handleClientRead(client);
-                        if (event.writable && client->getState() == Client::SENDING_RESPONSE)
-                            handleClientWrite(client);
-                            
-                        if (client->getState() == Client::PROCESSING_REQUEST) {
-                            client->processRequest();
-                            event_manager.setReadMonitoring(client->getFd(), false);
-                            event_manager.setWriteMonitoring(client->getFd(), true);
+                        }
+                        else if (event.readable && (client->getState() == Client::CGI_IN_PROGRESS ||
+                                                    proxy_clients.count(event.fd))) {
+                            handler = "request body";
+                            readCGIBody(client);
+                        }
+                        if (clients.find(event.fd) != clients.end()) {
+                            if (event.writable && client->getState() == Client::CGI_IN_PROGRESS) {
+                                handler = "client write";
+                                if (client->flushInterim())
+                                    event_manager.setWriteMonitoring(client->getFd(), false);
+                            }
+                            if (event.writable && client->getState() == Client::SENDING_RESPONSE) {
+                                handler = "client write";
+                                handleClientWrite(client);
+                            }
+                                
+                            if (client->getState() == Client::PROCESSING_REQUEST) {
+                                handler = "request handler";
+                                client->processRequest();
+                                event_manager.setReadMonitoring(client->getFd(), false);
+                                event_manager.setWriteMonitoring(client->getFd(), true);
+                            }
                         }
                     }
                 }
                 else if (active_cgis.find(event.fd) != active_cgis.end()) {
-                    // Handle CGI pipe
+                    handler = "cgi pipe";
                     handleGCIEventPipe(event.fd, event);
                 }
+                else if (fastcgi_requests.find(event.fd) != fastcgi_requests.end()) {
+                    handler = "fastcgi";
+                    handleFastCGIEvent(fastcgi_requests[event.fd], event);
+                }
+                else if (proxy_requests.find(event.fd) != proxy_requests.end()) {
+                    handler = "proxy";
+                    handleProxyEvent(proxy_requests[event.fd], event);
+                }
+                else if (pool_fds.find(event.fd) != pool_fds.end()) {
+                    handler = "cgi pool";
+                    handlePoolEvent(pool_fds[event.fd], event.fd, event);
+                }
+                else if (zygote_fds.find(event.fd) != zygote_fds.end()) {
+                    handler = "cgi zygote";
+                    handleZygoteEvent(event.fd);
+                }
+                checkHandler(event.fd, handler, began_us);
             }
-            checkCGITimeout();
         }
+        long began_us = Metrics::nowUs();
+        if (child_fd == -1)
+            handleChildExit();
+        if (timers.getFd() == -1)
+            handleTimers();
+        maintainCGIPools();
         checkTimeouts();
+        updateConnectionGauges();
+        checkHandler(-1, "housekeeping", began_us);
+    }
+    if (draining) {
+        long elapsed = monotonicMs() - drain_started_ms;
+        std::cout << "shutdown completed in " << elapsed / 1000 << "." 
+                  << (elapsed % 1000) / 100 << (elapsed % 100) / 10 << elapsed % 10 << "s" << std::endl;
     }
 }
 
 void Server::stop() {
     running = false;
     
+    while (!active_cgis.empty())
+        terminateCGI(active_cgis.begin()->second);
+    while (!cgi_pids.empty())
+        terminateCGI(cgi_pids.begin()->second);
     while (!clients.empty())
         removeClient(clients.begin()->second);
+    for (std::map<std::string, CGIPool*>::iterator it = cgi_pools.begin();
+         it != cgi_pools.end(); ++it)
+        it->second->shutdown();
+    for (size_t i = 0; i < retired_cgi_pools.size(); i++)
+        retired_cgi_pools[i]->shutdown();
+    pool_fds.clear();
+    for (std::map<int, std::deque<ZygoteLaunch> >::iterator it = zygote_launches.begin();
+         it != zygote_launches.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            ZygoteLaunch& launch = it->second[i];
+            close(launch.pipeIn[0]); close(launch.pipeIn[1]);
+            close(launch.pipeOut[0]); close(launch.pipeOut[1]);
+        }
+    }
+    zygote_launches.clear();
+    for (std::map<int, Zygote*>::iterator it = zygote_fds.begin(); it != zygote_fds.end(); ++it)
+        event_manager.removeFd(it->first);
+    zygote_fds.clear();
+    for (std::map<std::string, Zygote*>::iterator it = zygotes.begin();
+         it != zygotes.end(); ++it)
+        it->second->stop();
+    // After the clients: the last of their lines are in the ring by now.
+    AccessLog::stop();
+    Capture::stop();
+}
+
+size_t Server::cgiCount() const {
+    std::set<CGIProcess*> unique;
+    for (std::map<int, CGIProcess*>::const_iterator it = active_cgis.begin(); it != active_cgis.end(); ++it)
+        unique.insert(it->second);
+    return unique.size();
 }
 
 void Server::acceptNewClient(int listen_fd) {
@@ -141,15 +781,13 @@ void Server::acceptNewClient(int listen_fd) {
             break;
         }
         
-        ServerConfig* config = fd_to_config[listen_fd];
-        Client* client = new Client(client_fd, config);
+        const ServerConfig* config = fd_to_config[listen_fd];
+        Client* client = new Client(client_fd, config, snapshot);
         clients[client_fd] = client;
+        Metrics::accepted();
+        client->setRemoteAddress(clientAddress(client_fd));
         
         event_manager.addFd(client_fd, true, false);
-        
-        std::cout << "new client connected: fd=" << client_fd 
-                  << " on " << config->host << ":" << config->port << std::endl;
-        
         accepted_count++;
     }
 }
@@ -166,24 +804,50 @@ void Server::handleClientRead(Client* client) {
         client->processRequest();
         
         if (client->getState() == Client::CGI_IN_PROGRESS) {
-            executeCGI(client);
-            event_manager.setReadMonitoring(client->getFd(), false);
-            event_manager.setWriteMonitoring(client->getFd(), false);
-        }
-        else if (client->getState() == Client::SENDING_RESPONSE) {
+            // A CGI with a streamed body turns reads back on as it wants more.
             event_manager.setReadMonitoring(client->getFd(), false);
-            event_manager.setWriteMonitoring(client->getFd(), true);
+            bool started = startCGI(client);
+            event_manager.setWriteMonitoring(client->getFd(), !started);
+            return;
         }
     }
+    // Also a request rejected while parsing (400, 411): its error response
+    // would otherwise wait for the idle timeout.
+    if (client->getState() == Client::SENDING_RESPONSE) {
+        event_manager.setReadMonitoring(client->getFd(), false);
+        event_manager.setWriteMonitoring(client->getFd(), true);
+    }
 }
 
 void Server::handleClientWrite(Client* client) {
+    // An error set without sendCGIResponse (failCGI) still ends the fill.
+    if (cache_fills.count(client->getFd()))
+        endCacheFill(client, NULL, false);
+    std::map<int, CGIProcess*>::iterator spliced = spliced_cgis.find(client->getFd());
+    if (spliced != spliced_cgis.end() && !client->hasDataToSend()) {
+        spliceCGIOutput(spliced->second);
+        return;
+    }
+    std::map<int, ProxyRequest*>::iterator proxied = proxy_clients.find(client->getFd());
+    if (proxied != proxy_clients.end() && !client->hasDataToSend()) {
+        flowProxy(proxied->second);
+        return;
+    }
+
     bool response_complete = client->sendResponse();
     
     if (client->getState() == Client::CLOSING) {
         removeClient(client);
         return;
     }
+    if (spliced != spliced_cgis.end() && !client->hasDataToSend()) {
+        spliceCGIOutput(spliced->second);
+        return;
+    }
+    if (proxied != proxy_clients.end()) {
+        flowProxy(proxied->second);
+        return;
+    }
     
     if (response_complete) {
         removeClient(client);
@@ -194,16 +858,146 @@ void Server::handleClientWrite(Client* client) {
     }
 }
 
+// Answers "Expect: 100-continue" once the body is wanted, unless the client
+// already started sending it. Whatever the socket does not take now goes on
+// the next writable event, still ahead of the response.
+void Server::sendContinue(Client* client) {
+    if (client->bodyBuffered() > 0 ||
+        strcasecmp(client->getCGIRequest()->getHeader("Expect").c_str(), "100-continue") != 0)
+        return;
+    client->queueInterim("HTTP/1.1 100 Continue\r\n\r\n");
+    if (!client->flushInterim())
+        event_manager.setWriteMonitoring(client->getFd(), true);
+}
+
+void Server::closeIdleClients() {
+    std::vector<Client*> idle;
+    
+    for (std::map<int, Client*>::iterator it = clients.begin(); 
+         it != clients.end(); ++it)
+        if (it->second->isIdle())
+            idle.push_back(it->second);
+    
+    for (size_t i = 0; i < idle.size(); i++)
+        removeClient(idle[i]);
+}
+
 void Server::removeClient(Client* client) {
     int fd = client->getFd();
     
-    std::cout << "client disconnected: fd=" << fd << std::endl;
+    for (std::map<int, CGIProcess*>::iterator it = active_cgis.begin(); it != active_cgis.end(); ++it) {
+        if (it->second->client_fd == fd) {
+            terminateCGI(it->second);
+            break;
+        }
+    }
+    abortFastCGI(fd);
+    abortPooledCGI(fd);
+    abortProxy(fd);
+    if (cache_fills.count(fd))
+        endCacheFill(client, NULL, false);
+    std::map<int, std::string>::iterator wait = cache_waits.find(fd);
+    if (wait != cache_waits.end()) {
+        cgi_cache.removeWaiter(wait->second, fd);
+        cache_waits.erase(wait);
+    }
+    for (std::deque<CGIWaiter>::iterator it = cgi_queue.begin(); it != cgi_queue.end(); ++it) {
+        if (it->client_fd == fd) {
+            timers.cancel(it->deadline);
+            cgi_queue.erase(it);
+            break;
+        }
+    }
+    // The zygote answers anyway; the child is killed when it does.
+    for (std::map<int, std::deque<ZygoteLaunch> >::iterator it = zygote_launches.begin();
+         it != zygote_launches.end(); ++it)
+        for (size_t i = 0; i < it->second.size(); i++)
+            if (it->second[i].client_fd == fd)
+                it->second[i].client_fd = -1;
     
     event_manager.removeFd(fd);
     clients.erase(fd);
     delete client;
 }
 
+// Connections by state and the sizes of the tables for the metrics,
+// recounted about once a second rather than tracked on every change.
+void Server::updateConnectionGauges() {
+    long now = monotonicMs();
+    if (now - gauges_updated_ms < 1000)
+        return;
+    gauges_updated_ms = now;
+
+    long counts[Metrics::STATE_COUNT] = { 0 };
+    for (std::map<int, Client*>::iterator it = clients.begin(); it != clients.end(); ++it)
+        counts[it->second->getState()]++;
+    Metrics::setConnections(counts);
+
+    long sizes[Metrics::TABLE_COUNT];
+    sizes[Metrics::CLIENTS] = clients.size();
+    sizes[Metrics::CGI_FDS] = active_cgis.size();
+    sizes[Metrics::CGI_PROCESSES] = cgi_pids.size();
+    sizes[Metrics::STREAMING_CGIS] = streaming_cgis.size();
+    sizes[Metrics::SPLICED_CGIS] = spliced_cgis.size();
+    sizes[Metrics::FASTCGI_REQUESTS] = fastcgi_requests.size();
+    sizes[Metrics::PROXY_REQUESTS] = proxy_requests.size();
+    sizes[Metrics::TIMERS] = timers.size();
+    Metrics::setTables(sizes);
+}
+
+// One handler invocation that held the loop for loop_lag_warn or longer.
+// Warnings are capped at ten a second so that a stall storm does not add
+// a flood of terminal writes on top.
+void Server::checkHandler(int fd, const char* handler, long began_us) {
+    long threshold_us = snapshot->getGlobal().loop_lag_warn_ms * 1000;
+    if (!threshold_us)
+        return;
+    long elapsed_us = Metrics::nowUs() - began_us;
+    if (elapsed_us < threshold_us)
+        return;
+    Metrics::slowHandler();
+
+    long now = monotonicMs();
+    if (now - lag_window_ms >= 1000) {
+        if (lag_suppressed)
+            std::cerr << YELLOW << "slow handler: " << lag_suppressed << " more warning(s) suppressed"
+                      << RESET << std::endl;
+        lag_window_ms = now;
+        lag_warnings = 0;
+        lag_suppressed = 0;
+    }
+    if (++lag_warnings > 10) {
+        lag_suppressed++;
+        return;
+    }
+    std::cerr << YELLOW << "slow handler: " << handler << " held the event loop for "
+              << elapsed_us / 1000 << "." << (elapsed_us / 100) % 10 << "ms";
+    if (fd != -1)
+        std::cerr << " (fd " << fd << ", " << describeFd(fd) << ")";
+    std::cerr << RESET << std::endl;
+}
+
+// The request behind an fd, looked up after its handler ran: "-" when the
+// connection is gone by then.
+std::string Server::describeFd(int fd) {
+    int client_fd = fd;
+    if (active_cgis.count(fd))
+        client_fd = active_cgis[fd]->client_fd;
+    else if (fastcgi_requests.count(fd))
+        client_fd = fastcgi_requests[fd]->client_fd;
+    else if (proxy_requests.count(fd))
+        client_fd = proxy_requests[fd]->client_fd;
+    else if (fd_to_config.count(fd))
+        return "listening socket";
+    std::map<int, Client*>::iterator it = clients.find(client_fd);
+    if (it == clients.end())
+        return "-";
+    const HttpRequest& request = it->second->getRequest();
+    if (request.getMethod().empty())
+        return "no request yet";
+    return request.getMethod() + " " + request.getURI();
+}
+
 void Server::checkTimeouts() {
     std::vector<Client*> timed_out;
     
@@ -218,164 +1012,682 @@ void Server::checkTimeouts() {
     }
 }
 
-ServerConfig* Server::getConfigForListenFd(int fd) {
-    std::map<int, ServerConfig*>::iterator it = fd_to_config.find(fd);
+const ServerConfig* Server::getConfigForListenFd(int fd) {
+    std::map<int, const ServerConfig*>::iterator it = fd_to_config.find(fd);
     if (it != fd_to_config.end())
         return it->second;
     return NULL;
 }
 
-// Need more refining 
-void Server::executeCGI(Client* client) {
-    int pipeIn[2];
-    int pipeOut[2];
-    pid_t pid;
-
-    if (pipe(pipeIn) == -1 || pipe(pipeOut) == -1)
-        throw std::runtime_error("pipe failed");   
+static bool failCGI(Client* client, int code, const std::string& message) {
+    client->buildErrorResponse(code, message);
+    client->setState(Client::SENDING_RESPONSE);
+    return false;
+}
 
-    if (!setFdNonBlocking(pipeOut[0]) || !setFdNonBlocking(pipeIn[1])) {
-        close(pipeIn[0]); close(pipeIn[1]);
-        close(pipeOut[0]); close(pipeOut[1]);
-        throw std::runtime_error("fcntl failed");
-    }
+// Picks the backend for a CGI_IN_PROGRESS client: a proxy_pass upstream,
+// the cgi_cache, a FastCGI upstream, a persistent worker from a cgi_pool, or
+// a freshly spawned process. Returns false when a response (cached or error)
+// was set instead.
+bool Server::startCGI(Client* client) {
+    if (!client->getCGILocation()->proxy_pass.empty())
+        return startProxy(client);
+    if (lookupCGICache(client))
+        return client->getState() == Client::CGI_IN_PROGRESS;
+    if (!client->getCGILocation()->fastcgi_pass.empty())
+        return startFastCGI(client);
+    CGIPool* pool = findCGIPool(client);
+    if (pool)
+        return startPooledCGI(client, pool);
+    if (cgiSlotFree(client))
+        return executeCGI(client);
 
-    pid = fork();
-    if (pid == -1) {
-        close(pipeIn[0]); close(pipeIn[1]);
-        close(pipeOut[0]); close(pipeOut[1]);
-        throw std::runtime_error("fork failed");
+    // Saturated: wait for a slot, or get a fast 503 when even the queue is
+    // full, so a CGI burst never turns into thousands of interpreters.
+    if (cgi_queue.size() >= snapshot->getGlobal().cgi_queue_size) {
+        HttpResponse response = HttpResponse::makeError(503, "Too many CGI requests");
+        response.setHeader("Retry-After", "1");
+        sendCGIResponse(client, response);
+        return false;
     }
-    if (pid == 0) {
-        // CHILD PROCESS
-        close(pipeIn[1]);
-        close(pipeOut[0]);
+    CGIWaiter waiter;
+    waiter.client_fd = client->getFd();
+    waiter.deadline = timers.add(monotonicMs() + snapshot->getGlobal().cgi_queue_timeout_ms,
+                                 Timers::CGI_QUEUE_DEADLINE, waiter.client_fd);
+    cgi_queue.push_back(waiter);
+    return true;
+}
 
-        dup2(pipeIn[0], STDIN_FILENO);
-        dup2(pipeOut[1], STDOUT_FILENO);
-
-        close(pipeIn[0]);
-        close(pipeOut[1]);
-
-        const std::string& fullPath = client->getCGIFullPath();
-        std::vector<std::string> env_vect = prepareEnv(client->getCGIRequest(), client->getServerConfig(), fullPath);
-        char **envp = vectorToCharArray(env_vect);
-        std::string interpreter = client->getCGILocation()->cgi[client->getCGIExtension()];
-        if (interpreter.empty()) {
-            char* argv[] = { const_cast<char*>(fullPath.c_str()), NULL };
-            execve(fullPath.c_str(), argv, envp);
-        } else {
-            char* argv[] = {
-                const_cast<char*>(interpreter.c_str()),
-                const_cast<char*>(fullPath.c_str()),
-                NULL
-            };
-            execve(interpreter.c_str(), argv, envp);
-        }
-        freeCharArray(envp);
-        exit(1);
-    }
-    // PARENT PROCESS
-    close(pipeIn[0]);
-    close(pipeOut[1]);
+// Method, listener, path and query, plus the cgi_cache_vary request headers.
+// Empty when the request is not cacheable.
+static std::string cgiCacheKey(Client* client) {
+    const LocationConfig* location = client->getCGILocation();
+    const HttpRequest* request = client->getCGIRequest();
+    if (!location->cgi_cache || request->getMethod() != "GET")
+        return "";
 
-    // Create CGI tracker
-    CGIProcess *cgi = new CGIProcess();
-    cgi->pid = pid;
-    cgi->pipeIn = pipeIn[1];
-    cgi->pipeOut = pipeOut[0];
-    cgi->client_fd = client->getFd();
-    cgi->post_body = client->getCGIRequest()->getBody();
-    cgi->bytes_written = 0;
-    cgi->cgi_output = "";
-    cgi->start_time = time(NULL);
-    cgi->stdin_closed = false;
-    cgi->error = false;
-    
-    // Add pipes to epoll
-    active_cgis[pipeOut[0]] = cgi;
-    event_manager.addFd(pipeOut[0], true, false);
-    if (!cgi->post_body.empty()) {
-        active_cgis[pipeIn[1]] = cgi;
-        event_manager.addFd(pipeIn[1], false, true);
-    }
+    const ServerConfig* config = client->getServerConfig();
+    std::string key = "GET " + listenKey(config->host, config->port) + request->getPath() +
+                      "?" + request->getQueryString();
+    for (size_t i = 0; i < location->cgi_cache_vary.size(); i++)
+        key += "\n" + location->cgi_cache_vary[i] + ": " + request->getHeader(location->cgi_cache_vary[i]);
+    return key;
 }
 
-void Server::handleGCIEventPipe(int fd, const EventManager::Event& event) {
-    CGIProcess* cgi_ptr = NULL;
-    for (std::map<int, CGIProcess*>::iterator it = active_cgis.begin();
-        it != active_cgis.end(); ++it) {
-        if (it->second->pipeOut == fd || it->second->pipeIn == fd) {
-            cgi_ptr = it->second;
+// True when the request needs no CGI run of its own: it was answered from
+// the cache, or waits for the run that fills its entry.
+bool Server::lookupCGICache(Client* client) {
+    std::string key = cgiCacheKey(client);
+    if (key.empty())
+        return false;
+
+    const CacheEntry* entry = NULL;
+    switch (cgi_cache.lookup(key, monotonicMs(), client->getFd(), entry)) {
+        case CGICache::HIT:
+            serveCached(client, *entry, "HIT");
+            return true;
+        case CGICache::STALE:
+            serveCached(client, *entry, "STALE");
+            return true;
+        case CGICache::WAIT:
+            cache_waits[client->getFd()] = key;
+            return true;
+        case CGICache::MISS:
+            cache_fills[client->getFd()] = key;
+            return false;
+        case CGICache::PASS:
             break;
-        }
     }
-    if (!cgi_ptr) return;
-  
-    // Hadchi lahma 3raft ach andir fih
-    // if (event.error) {
-    //     // std::cerr << "ER!!!!!!!!!!!!!\n";
-    //     // completeCGI(cgi);
-    //     // return ; // khasni wa9ila ndir chi tmajnina hna     
-    // }
+    return false;
+}
 
-    if (event.readable)
-        readCGIOutput(cgi_ptr);
+void Server::serveCached(Client* client, const CacheEntry& entry, const char* status) {
+    HttpResponse response = entry.response;
+    std::ostringstream age;
+    age << (monotonicMs() - entry.stored_ms) / 1000;
+    response.setHeader("Age", age.str());
+    response.setHeader("X-Cache", status);
+    sendCGIResponse(client, response);
+}
 
-    if (event.writable)
-        writeCGIInput(cgi_ptr);
+// The filling client has its response. A cacheable one is stored and handed
+// to the waiters; otherwise they go run the CGI (one of them becoming the
+// next filler, unless `pass` marks the key uncacheable for a while).
+void Server::endCacheFill(Client* client, HttpResponse* response, bool pass) {
+    std::map<int, std::string>::iterator fill = cache_fills.find(client->getFd());
+    if (fill == cache_fills.end())
+        return;
+    std::string key = fill->second;
+    cache_fills.erase(fill);
 
-    // Check if process exited
-    int status;
-    pid_t result = waitpid(cgi_ptr->pid, &status, WNOHANG);
-    if (result > 0) {
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            cgi_ptr->error = true;
-            cgi_ptr->error_code = WEXITSTATUS(status);
-        }
-        completeCGI(cgi_ptr);
+    const LocationConfig* location = client->getCGILocation();
+    long now = monotonicMs();
+    long ttl = 0;
+    long stale = 0;
+    bool stored = response && CGICache::lifetime(*response, location->cgi_cache_ttl_ms,
+                                                 location->cgi_cache_stale_ms, ttl, stale);
+    std::vector<int> waiters;
+    if (stored) {
+        response->setHeader("X-Cache", "MISS");
+        waiters = cgi_cache.store(key, *response, now, ttl, stale);
+    }
+    else {
+        long pass_ms = location->cgi_cache_ttl_ms > 1000 ? location->cgi_cache_ttl_ms : 1000;
+        waiters = cgi_cache.abandon(key, now, pass ? pass_ms : 0);
     }
-}
 
-void Server::readCGIOutput(CGIProcess* cgi) {
-    char buffer[8192];
-    ssize_t bytes = read(cgi->pipeOut, buffer, sizeof(buffer));
-    if (bytes > 0)
-        cgi->cgi_output.append(buffer, bytes);
-    else if (bytes == 0) {
-        // EOF : CGI closed output
-        close(cgi->pipeOut);
-        event_manager.removeFd(cgi->pipeOut);
+    for (size_t i = 0; i < waiters.size(); i++) {
+        cache_waits.erase(waiters[i]);
+        std::map<int, Client*>::iterator it = clients.find(waiters[i]);
+        if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS)
+            continue;
+        const CacheEntry* entry = cgi_cache.find(key);
+        if (stored && entry)
+            serveCached(it->second, *entry, "HIT");
+        else if (!startCGI(it->second))
+            event_manager.setWriteMonitoring(it->first, true);
     }
-    else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+}
+
+static std::string cgiSlotKey(Client* client) {
+    const ServerConfig* config = client->getServerConfig();
+    return listenKey(config->host, config->port) + client->getCGILocation()->path;
+}
+
+bool Server::cgiSlotFree(Client* client) {
+    size_t global_max = snapshot->getGlobal().cgi_max_concurrent;
+    if (global_max > 0 && cgi_running_total >= global_max)
+        return false;
+    size_t location_max = client->getCGILocation()->cgi_max_concurrent;
+    if (location_max > 0 && cgi_running[cgiSlotKey(client)] >= location_max)
+        return false;
+    return true;
+}
+
+void Server::takeCGISlot(const std::string& slot_key) {
+    cgi_running[slot_key]++;
+    cgi_running_total++;
+}
+
+// Gives the slot back without starting anyone from the queue.
+void Server::returnCGISlot(const std::string& slot_key) {
+    std::map<std::string, size_t>::iterator it = cgi_running.find(slot_key);
+    if (it != cgi_running.end() && --it->second == 0)
+        cgi_running.erase(it);
+    if (cgi_running_total > 0)
+        cgi_running_total--;
+}
+
+void Server::releaseCGISlot(CGIProcess* cgi) {
+    returnCGISlot(cgi->slot_key);
+    pumpCGIQueue();
+}
+
+// Starts queued clients in arrival order; one whose location is still at its
+// own limit stays queued without holding up the others.
+void Server::pumpCGIQueue() {
+    size_t i = 0;
+    while (running && i < cgi_queue.size()) {
+        std::map<int, Client*>::iterator it = clients.find(cgi_queue[i].client_fd);
+        if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS) {
+            timers.cancel(cgi_queue[i].deadline);
+            cgi_queue.erase(cgi_queue.begin() + i);
+            continue;
+        }
+        size_t global_max = snapshot->getGlobal().cgi_max_concurrent;
+        if (global_max > 0 && cgi_running_total >= global_max)
+            return;
+        if (!cgiSlotFree(it->second)) {
+            i++;
+            continue;
+        }
+        timers.cancel(cgi_queue[i].deadline);
+        cgi_queue.erase(cgi_queue.begin() + i);
+        if (!executeCGI(it->second))
+            event_manager.setWriteMonitoring(it->first, true);
+    }
+}
+
+void Server::expireCGIQueue(int client_fd) {
+    for (std::deque<CGIWaiter>::iterator waiter = cgi_queue.begin(); waiter != cgi_queue.end(); ++waiter) {
+        if (waiter->client_fd != client_fd)
+            continue;
+        cgi_queue.erase(waiter);
+        std::map<int, Client*>::iterator it = clients.find(client_fd);
+        if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS)
+            return;
+        HttpResponse response = HttpResponse::makeError(503, "CGI queue timeout");
+        response.setHeader("Retry-After", "1");
+        sendCGIResponse(it->second, response);
+        return;
+    }
+}
+
+bool Server::executeCGI(Client* client) {
+    int pipeIn[2];
+    int pipeOut[2];
+
+    if (pipe2(pipeIn, O_CLOEXEC) == -1)
+        return failCGI(client, 500, "CGI pipe failed");
+    if (pipe2(pipeOut, O_CLOEXEC) == -1) {
+        close(pipeIn[0]); close(pipeIn[1]);
+        return failCGI(client, 500, "CGI pipe failed");
+    }
+
+    if (!setFdNonBlocking(pipeOut[0]) || !setFdNonBlocking(pipeIn[1])) {
+        close(pipeIn[0]); close(pipeIn[1]);
+        close(pipeOut[0]); close(pipeOut[1]);
+        return failCGI(client, 500, "CGI pipe failed");
+    }
+    return launchCGI(client, pipeIn, pipeOut, findZygote(client));
+}
+
+// argv and envp are built here in the parent: posix_spawn (clone+vfork in
+// glibc) shares our address space until exec, so the launch cost does not
+// grow with the server's RSS and nothing is allocated in the child. With a
+// cgi_zygote the request is only sent here and the CGI is tracked once the
+// pid comes back (handleZygoteEvent); posix_spawn remains the fallback
+// whenever the zygote cannot take it. Owns the four pipe ends.
+bool Server::launchCGI(Client* client, int pipeIn[2], int pipeOut[2], Zygote* zygote) {
+    const std::string& fullPath = client->getCGIFullPath();
+    std::vector<std::string> env_vect = prepareEnv(client->getCGIRequest(), client->getServerConfig(), fullPath);
+
+    if (zygote) {
+        bool sent = zygote->send(fullPath, env_vect, pipeIn[0], pipeOut[1]);
+        watchZygote(zygote);
+        if (sent) {
+            ZygoteLaunch launch;
+            launch.id = next_launch_id++;
+            launch.client_fd = client->getFd();
+            launch.pipeIn[0] = pipeIn[0];
+            launch.pipeIn[1] = pipeIn[1];
+            launch.pipeOut[0] = pipeOut[0];
+            launch.pipeOut[1] = pipeOut[1];
+            launch.slot_key = cgiSlotKey(client);
+            launch.deadline = timers.add(monotonicMs() + ZYGOTE_TIMEOUT_MS, Timers::ZYGOTE_DEADLINE, launch.id);
+            zygote_launches[zygote->getFd()].push_back(launch);
+            takeCGISlot(launch.slot_key);
+            return true;
+        }
+    }
+
+    std::vector<std::string> args;
+    const std::map<std::string, std::string>& interpreters = client->getCGILocation()->cgi;
+    std::map<std::string, std::string>::const_iterator it = interpreters.find(client->getCGIExtension());
+    if (it != interpreters.end() && !it->second.empty())
+        args.push_back(it->second);
+    args.push_back(fullPath);
+
+    char** argv = vectorToCharArray(args);
+    char** envp = vectorToCharArray(env_vect);
+
+    // The pipes are O_CLOEXEC, dup2 onto 0/1 clears the flag on the copies.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipeIn[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipeOut[1], STDOUT_FILENO);
+
+    // Scripts get a clean signal state rather than our ignored SIGPIPE.
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid = -1;
+    int err = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    freeCharArray(argv);
+    freeCharArray(envp);
+    close(pipeIn[0]);
+    close(pipeOut[1]);
+
+    if (err != 0) {
+        close(pipeIn[1]);
+        close(pipeOut[0]);
+        if (err == ENOENT)
+            return failCGI(client, 404, "CGI Script not found");
+        if (err == EACCES)
+            return failCGI(client, 403, "CGI Permission denied");
+        return failCGI(client, 500, "CGI execution failed");
+    }
+    takeCGISlot(cgiSlotKey(client));
+    trackCGI(client, pid, pipeIn[1], pipeOut[0]);
+    return true;
+}
+
+// The child is running with its ends of the pipes; the slot is already taken.
+CGIProcess* Server::trackCGI(Client* client, pid_t pid, int stdin_fd, int stdout_fd) {
+    CGIProcess *cgi = new CGIProcess();
+    cgi->pid = pid;
+    cgi->pipeIn = stdin_fd;
+    cgi->pipeOut = stdout_fd;
+    cgi->client_fd = client->getFd();
+    cgi->streaming = client->isStreamingBody();
+    cgi->nph = client->getCGILocation()->cgi_nph;
+    cgi->spliced = false;
+    cgi->splice_checked = false;
+    cgi->pipe_watched = true;
+    cgi->splice_remaining = -1;
+    cgi->bytes_written = 0;
+    cgi->cgi_output = "";
+    cgi->start_time = time(NULL);
+    cgi->stdin_closed = false;
+    cgi->error = false;
+    cgi->slot_key = cgiSlotKey(client);
+    cgi->deadline = timers.add(monotonicMs() + CGI_TIMEOUT_MS, Timers::CGI_DEADLINE, pid);
+    cgi_pids[pid] = cgi;
+    
+    // Add pipes to epoll
+    active_cgis[stdout_fd] = cgi;
+    event_manager.addFd(stdout_fd, true, false);
+    if (cgi->streaming) {
+        // The client is told to go ahead only now that someone reads the body.
+        sendContinue(client);
+        streaming_cgis[cgi->client_fd] = cgi;
+        active_cgis[stdin_fd] = cgi;
+        event_manager.addFd(stdin_fd, false, false);
+        flowCGIBody(cgi);
+    }
+    else if (!client->getCGIRequest()->getBody().empty()) {
+        active_cgis[stdin_fd] = cgi;
+        event_manager.addFd(stdin_fd, false, true);
+    }
+    else
+        closeCGIStdin(cgi);
+    return cgi;
+}
+
+void Server::handleGCIEventPipe(int fd, const EventManager::Event& event) {
+    CGIProcess* cgi_ptr = NULL;
+    for (std::map<int, CGIProcess*>::iterator it = active_cgis.begin();
+        it != active_cgis.end(); ++it) {
+        if (it->second->pipeOut == fd || it->second->pipeIn == fd) {
+            cgi_ptr = it->second;
+            break;
+        }
+    }
+    if (!cgi_ptr) return;
+
+    if (cgi_ptr->spliced && fd == cgi_ptr->pipeOut) {
+        spliceCGIOutput(cgi_ptr);
+        return;
+    }
+  
+    // Hadchi lahma 3raft ach andir fih
+    // if (event.error) {
+    //     // std::cerr << "ER!!!!!!!!!!!!!\n";
+    //     // completeCGI(cgi);
+    //     // return ; // khasni wa9ila ndir chi tmajnina hna     
+    // }
+
+    if (fd == cgi_ptr->pipeIn && event.error && !event.writable) {
+        // The script closed its stdin before taking the whole body.
+        closeCGIStdin(cgi_ptr);
+        if (cgi_ptr->streaming)
+            flowCGIBody(cgi_ptr);
+        return;
+    }
+
+    if (event.readable)
+        readCGIOutput(cgi_ptr);
+
+    if (event.writable)
+        writeCGIInput(cgi_ptr);
+}
+
+// The child is gone, so whatever it wrote is already in the pipe: take it
+// all now instead of waiting for more readiness events. Output from a
+// grandchild still holding the pipe is not waited for.
+void Server::finishExitedCGI(CGIProcess* cgi, int status) {
+    cgi->pid = -1;
+    if (cgi->spliced) {
+        // The head is out already; the response ends with the pipe.
+        if (cgi->client_fd == -1) {
+            timers.cancel(cgi->deadline);
+            releaseCGISlot(cgi);
+            delete cgi;
+        }
+        return;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        cgi->error = true;
+        cgi->error_code = WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status)) {
+        cgi->error = true;
+        cgi->error_code = 128 + WTERMSIG(status);
+    }
+
+    char buffer[8192];
+    ssize_t bytes;
+    while ((bytes = read(cgi->pipeOut, buffer, sizeof(buffer))) > 0)
+        cgi->cgi_output.append(buffer, bytes);
+    completeCGI(cgi);
+}
+
+void Server::readCGIOutput(CGIProcess* cgi) {
+    char buffer[8192];
+    ssize_t bytes = read(cgi->pipeOut, buffer, sizeof(buffer));
+    if (bytes > 0) {
+        cgi->cgi_output.append(buffer, bytes);
+        if (cgi->nph)
+            startNPHResponse(cgi);
+        else if (!cgi->splice_checked && cgi->cgi_output.length() >= CGI_SPLICE_THRESHOLD)
+            startCGISplice(cgi);
+    }
+    else if (bytes == 0) {
+        // EOF : CGI closed output, the fd is closed in completeCGI
+        event_manager.removeFd(cgi->pipeOut);
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK) {
         // fatal error
         // makhsnach n3ayto 3la errno wra read/write ms khasni nchecki -1
         return;
     }
 }
 
+// Past CGI_SPLICE_THRESHOLD the head is sent with what was read so far and
+// the rest of the body is splice()d from the script's stdout pipe into the
+// socket, never passing through our memory. Without a Content-Length from
+// the script the body ends with the connection. Skipped while a streamed
+// request body is still being read.
+void Server::startCGISplice(CGIProcess* cgi) {
+    cgi->splice_checked = true;
+    size_t body_start = findCGIBody(cgi->cgi_output);
+    if (body_start == std::string::npos || streaming_cgis.count(cgi->client_fd))
+        return;
+
+    HttpResponse response;
+    setCGIResponseHeaders(response, cgi->cgi_output.substr(0, body_start));
+    if (response.getStatusCode() == 204 || response.getStatusCode() == 304)
+        return;
+
+    Client* client = clients[cgi->client_fd];
+    std::string body = cgi->cgi_output.substr(body_start);
+    if (response.hasHeader("Content-Length")) {
+        long length = std::atol(response.getHeader("Content-Length").c_str());
+        if (length < static_cast<long>(body.length()))
+            body.resize(length);
+        cgi->splice_remaining = length - static_cast<long>(body.length());
+    }
+    else
+        client->disableKeepAlive();
+    response.setConnection(client->isKeepAlive() ? "keep-alive" : "close");
+    spliceCGIRest(cgi, response.toString() + body);
+}
+
+// NPH scripts (cgi_nph) write the whole response themselves. Once the status
+// line checks out, everything is spliced to the socket untouched; the script
+// does its own framing, so the connection ends with its output. Waits while a
+// streamed request body is still being read.
+void Server::startNPHResponse(CGIProcess* cgi) {
+    if (cgi->spliced || streaming_cgis.count(cgi->client_fd))
+        return;
+    size_t line_end = cgi->cgi_output.find('\n');
+    if (line_end == std::string::npos && cgi->cgi_output.length() < NPH_MAX_STATUS_LINE)
+        return;
+
+    Client* client = clients[cgi->client_fd];
+    if (!validNPHStatusLine(cgi->cgi_output.substr(0, line_end))) {
+        terminateCGI(cgi);
+        HttpResponse response = HttpResponse::makeError(502, "Invalid NPH status line");
+        sendCGIResponse(client, response);
+        return;
+    }
+    client->disableKeepAlive();
+    cgi->splice_checked = true;
+    spliceCGIRest(cgi, cgi->cgi_output);
+}
+
+// Sends `head` (the response so far) and leaves the rest of the script's
+// output to spliceCGIOutput.
+void Server::spliceCGIRest(CGIProcess* cgi, const std::string& head) {
+    Client* client = clients[cgi->client_fd];
+    client->setResponseBuffer(head);
+    client->setResponseStreaming(true);
+    client->setState(Client::SENDING_RESPONSE);
+    event_manager.setReadMonitoring(client->getFd(), false);
+    event_manager.setWriteMonitoring(client->getFd(), true);
+
+    // Too big to keep (or not ours to parse), and it will be next time too.
+    if (cache_fills.count(cgi->client_fd))
+        endCacheFill(client, NULL, true);
+
+    cgi->cgi_output.clear();
+    cgi->spliced = true;
+    spliced_cgis[cgi->client_fd] = cgi;
+    // The pipe waits until the head is out.
+    event_manager.removeFd(cgi->pipeOut);
+    cgi->pipe_watched = false;
+}
+
+// Moves as much as both sides allow. On EAGAIN it is unclear which side
+// blocked, so FIONREAD on the pipe decides which one to wait for; the other
+// is taken out of epoll (a writable socket or a hung-up pipe would otherwise
+// keep waking us).
+void Server::spliceCGIOutput(CGIProcess* cgi) {
+    Client* client = clients[cgi->client_fd];
+
+    while (cgi->splice_remaining != 0) {
+        size_t chunk = CGI_SPLICE_CHUNK;
+        if (cgi->splice_remaining > 0 && static_cast<size_t>(cgi->splice_remaining) < chunk)
+            chunk = cgi->splice_remaining;
+        ssize_t moved = splice(cgi->pipeOut, NULL, client->getFd(), NULL, chunk,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            client->touch();
+            client->countSent(moved);
+            if (cgi->splice_remaining > 0)
+                cgi->splice_remaining -= moved;
+            continue;
+        }
+        if (moved == 0) {
+            finishSplicedCGI(cgi, cgi->splice_remaining < 0);
+            return;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        removeClient(client);
+        return;
+    }
+    if (cgi->splice_remaining == 0) {
+        finishSplicedCGI(cgi, true);
+        return;
+    }
+
+    int pending = 0;
+    ioctl(cgi->pipeOut, FIONREAD, &pending);
+    bool wait_pipe = (pending == 0);
+    if (wait_pipe && !cgi->pipe_watched)
+        event_manager.addFd(cgi->pipeOut, true, false);
+    else if (!wait_pipe && cgi->pipe_watched)
+        event_manager.removeFd(cgi->pipeOut);
+    cgi->pipe_watched = wait_pipe;
+    event_manager.setWriteMonitoring(client->getFd(), !wait_pipe);
+}
+
+// The response is over (complete, or cut short by the script). The client
+// moves on; the process, if still running, stays tracked until it exits.
+void Server::finishSplicedCGI(CGIProcess* cgi, bool complete) {
+    Client* client = clients[cgi->client_fd];
+    spliced_cgis.erase(cgi->client_fd);
+
+    event_manager.removeFd(cgi->pipeOut);
+    active_cgis.erase(cgi->pipeOut);
+    close(cgi->pipeOut);
+    cgi->pipeOut = -1;
+    closeCGIStdin(cgi);
+    cgi->client_fd = -1;
+    if (cgi->pid <= 0) {
+        timers.cancel(cgi->deadline);
+        releaseCGISlot(cgi);
+        delete cgi;
+    }
+
+    if (!complete)
+        client->disableKeepAlive();
+    if (client->finishResponse()) {
+        removeClient(client);
+        return;
+    }
+    event_manager.setWriteMonitoring(client->getFd(), false);
+    event_manager.setReadMonitoring(client->getFd(), true);
+}
+
+// Closing stdin is how the script sees the end of the body; it must happen
+// exactly once since the fd number may be reused right after.
+void Server::closeCGIStdin(CGIProcess* cgi) {
+    if (cgi->stdin_closed)
+        return;
+    event_manager.removeFd(cgi->pipeIn);
+    std::map<int, CGIProcess*>::iterator it = active_cgis.find(cgi->pipeIn);
+    if (it != active_cgis.end() && it->second == cgi)
+        active_cgis.erase(it);
+    close(cgi->pipeIn);
+    cgi->stdin_closed = true;
+}
+
+// Streamed bodies: more from the client socket, written straight on to the
+// script (or upstream) when its pipe (or socket) has room.
+void Server::readCGIBody(Client* client) {
+    std::map<int, ProxyRequest*>::iterator proxied = proxy_clients.find(client->getFd());
+    if (proxied != proxy_clients.end()) {
+        if (!client->readBody()) {
+            removeClient(client);
+            return;
+        }
+        sendProxyRequest(proxied->second);
+        return;
+    }
+    std::map<int, CGIProcess*>::iterator it = streaming_cgis.find(client->getFd());
+    if (it == streaming_cgis.end()) {
+        event_manager.setReadMonitoring(client->getFd(), false);
+        return;
+    }
+    if (!client->readBody()) {
+        removeClient(client);
+        return;
+    }
+    writeCGIInput(it->second);
+}
+
+// Flow control between the client socket and the script's stdin: read the
+// socket while less than CGI_STDIN_HIGH_WATER is buffered, watch the pipe
+// while anything is, and close stdin once the whole body went through.
+void Server::flowCGIBody(CGIProcess* cgi) {
+    Client* client = clients[cgi->client_fd];
+
+    if (!cgi->stdin_closed && client->bodyReceived() && client->bodyBuffered() == 0)
+        closeCGIStdin(cgi);
+    if (cgi->stdin_closed) {
+        streaming_cgis.erase(cgi->client_fd);
+        event_manager.setReadMonitoring(client->getFd(), false);
+        return;
+    }
+    event_manager.setWriteMonitoring(cgi->pipeIn, client->bodyBuffered() > 0);
+    event_manager.setReadMonitoring(client->getFd(),
+        !client->bodyReceived() && client->bodyBuffered() < CGI_STDIN_HIGH_WATER);
+}
+
 // For POST wa9ila
 void Server::writeCGIInput(CGIProcess* cgi) {
-    if (cgi->stdin_closed || cgi->bytes_written >= cgi->post_body.length()) {
-        if (!cgi->stdin_closed) {
-            close(cgi->pipeIn);
-            event_manager.removeFd(cgi->pipeIn);
-            cgi->stdin_closed = true;
-        }
+    if (cgi->stdin_closed)
+        return;
+
+    if (cgi->streaming) {
+        Client* client = clients[cgi->client_fd];
+        size_t buffered = client->bodyBuffered();
+        ssize_t written = buffered ? write(cgi->pipeIn, client->bodyData(), buffered) : 0;
+        if (written > 0)
+            client->consumeBody(written);
+        else if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            closeCGIStdin(cgi);  // the script stopped reading; the rest is dropped
+        flowCGIBody(cgi);
+        return;
+    }
+
+    const std::string& body = clients[cgi->client_fd]->getCGIRequest()->getBody();
+    if (cgi->bytes_written >= body.length()) {
+        closeCGIStdin(cgi);
         return ;
     }
 
-    size_t remaining = cgi->post_body.length() - cgi->bytes_written;
-    const char* data = cgi->post_body.c_str() + cgi->bytes_written;
+    size_t remaining = body.length() - cgi->bytes_written;
+    const char* data = body.c_str() + cgi->bytes_written;
     ssize_t written = write(cgi->pipeIn, data, remaining);
     
     if (written > 0) {
         cgi->bytes_written += written;
-        if (cgi->bytes_written >= cgi->post_body.length()) {
-            close(cgi->pipeIn);
-            event_manager.removeFd(cgi->pipeIn);
-            cgi->stdin_closed = true;
-        }
+        if (cgi->bytes_written >= body.length())
+            closeCGIStdin(cgi);
     }
     else if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
         // fatal error
@@ -390,71 +1702,1296 @@ void Server::completeCGI(CGIProcess* cgi) {
     HttpResponse response;
     
     event_manager.removeFd(cgi->pipeOut);
-    event_manager.removeFd(cgi->pipeIn);
+    active_cgis.erase(cgi->pipeOut);
     close(cgi->pipeOut);
-    close(cgi->pipeIn);
+    closeCGIStdin(cgi);
 
     // Errors check !
-    if (cgi->error || cgi->cgi_output.find("HTTP/1.0 500") == 0) {
+    timers.cancel(cgi->deadline);
+    if (cgi->pid > 0)
+        cgi_pids.erase(cgi->pid);
+    streaming_cgis.erase(cgi->client_fd);
+
+    if (cgi->error || (!cgi->nph && cgi->cgi_output.find("HTTP/1.0 500") == 0)) {
         if (cgi->error_code == 126)
             response = HttpResponse::makeError(403, "CGI Permission denied");
         else if (cgi->error_code == 127)
             response = HttpResponse::makeError(404, "CGI Script not found");
         response = HttpResponse::makeError(500, "CGI execution failed");
     }
+    else if (cgi->nph) {
+        // The whole output arrived before streaming could start.
+        if (validNPHStatusLine(cgi->cgi_output.substr(0, cgi->cgi_output.find('\n')))) {
+            sendNPHOutput(client, cgi->cgi_output);
+            releaseCGISlot(cgi);
+            delete cgi;
+            return;
+        }
+        response = HttpResponse::makeError(502, "Invalid NPH status line");
+    }
     else {
         // Parse CGI Output
         response = processCGIOutput(cgi->cgi_output);
     }
-    
+    sendCGIResponse(client, response);
+
+    releaseCGISlot(cgi);
+    delete cgi;
+}
+
+// Kills and reaps the child, releases its pipes and forgets about it. The
+// owning client (if any) is left for the caller to deal with.
+void Server::terminateCGI(CGIProcess* cgi) {
+    timers.cancel(cgi->deadline);
+    if (cgi->pid > 0) {
+        kill(cgi->pid, SIGKILL);
+        waitpid(cgi->pid, NULL, 0);
+        cgi_pids.erase(cgi->pid);
+    }
+    streaming_cgis.erase(cgi->client_fd);
+    std::map<int, CGIProcess*>::iterator spliced = spliced_cgis.find(cgi->client_fd);
+    if (spliced != spliced_cgis.end() && spliced->second == cgi)
+        spliced_cgis.erase(spliced);
+
+    if (cgi->pipeOut != -1) {
+        event_manager.removeFd(cgi->pipeOut);
+        active_cgis.erase(cgi->pipeOut);
+        close(cgi->pipeOut);
+    }
+    closeCGIStdin(cgi);
+    releaseCGISlot(cgi);
+    delete cgi;
+}
+
+// The deadline fired before the child exited.
+void Server::expireCGI(pid_t pid) {
+    std::map<pid_t, CGIProcess*>::iterator it = cgi_pids.find(pid);
+    if (it == cgi_pids.end())
+        return;
+    CGIProcess* cgi = it->second;
+    int client_fd = cgi->client_fd;
+    bool cgi_was_spliced = cgi->spliced;
+    cgi->deadline = timers.none();
+    terminateCGI(cgi);
+
+    // Too late for an error response once a spliced body is under way.
+    if (cgi_was_spliced) {
+        if (client_fd != -1)
+            removeClient(clients[client_fd]);
+        return;
+    }
+    HttpResponse response = HttpResponse::makeError(504, "CGI timeout");
+    sendCGIResponse(clients[client_fd], response);
+}
+
+void Server::sendCGIResponse(Client* client, HttpResponse& response) {
+    if (cache_fills.count(client->getFd()))
+        endCacheFill(client, &response, response.getStatusCode() < 500);
+    response.setConnection(client->isKeepAlive() ? "keep-alive" : "close");
     client->setResponseBuffer(response.toString());
     client->setState(Client::SENDING_RESPONSE);
     event_manager.setWriteMonitoring(client->getFd(), true);
     event_manager.setReadMonitoring(client->getFd(), false);
+}
 
-    active_cgis.erase(cgi->pipeOut);
-    active_cgis.erase(cgi->pipeIn);
+void Server::sendNPHOutput(Client* client, const std::string& output) {
+    if (cache_fills.count(client->getFd()))
+        endCacheFill(client, NULL, true);
+    client->disableKeepAlive();
+    client->setResponseBuffer(output);
+    client->setState(Client::SENDING_RESPONSE);
+    event_manager.setWriteMonitoring(client->getFd(), true);
+    event_manager.setReadMonitoring(client->getFd(), false);
+}
 
-    delete cgi;
+// One pool per fastcgi_pass address, created (and resolved) at load time so
+// the event loop never blocks on DNS, and one per cgi_pool interpreter and
+// worker script (or zygote). The limits of the first location win.
+//
+// FastCGI pools and upstream groups are resolved again on every reload and
+// staged: nothing changes unless all of them resolve. A pool whose address or
+// limits changed, or that no location uses any more, is retired; in-flight
+// requests finish on it. CGI pools follow the same rule once all of that
+// succeeded, their retired workers finishing the requests they hold, and
+// zygotes no location names any more are stopped.
+bool Server::preparePools(const ConfigSnapshot* snap) {
+    const std::vector<ServerConfig>& configs = snap->getServers();
+    std::map<std::string, UpstreamPool*> fresh_pools;
+    std::set<std::string> passes;
+    for (size_t i = 0; i < configs.size(); i++) {
+        for (size_t j = 0; j < configs[i].locations.size(); j++) {
+            const LocationConfig& location = configs[i].locations[j];
+            if (location.fastcgi_pass.empty() || passes.count(location.fastcgi_pass))
+                continue;
+            passes.insert(location.fastcgi_pass);
+            UpstreamAddress address;
+            if (!parseUpstreamAddress(location.fastcgi_pass, address)) {
+                std::cerr << RED << "cannot resolve fastcgi_pass " << location.fastcgi_pass << RESET << std::endl;
+                for (std::map<std::string, UpstreamPool*>::iterator f = fresh_pools.begin(); f != fresh_pools.end(); ++f)
+                    delete f->second;
+                return false;
+            }
+            std::map<std::string, UpstreamPool*>::iterator current = upstream_pools.find(location.fastcgi_pass);
+            if (current != upstream_pools.end() &&
+                current->second->matches(address, location.fastcgi_max_conns, location.fastcgi_keepalive))
+                continue;
+            fresh_pools[location.fastcgi_pass] = new UpstreamPool(address,
+                location.fastcgi_max_conns, location.fastcgi_keepalive);
+        }
+    }
+    // proxy_pass targets: upstream blocks, and bare host:port ones standing
+    // for a group of one. A group whose definition changed is replaced; the
+    // old one lives on for the requests still using it.
+    std::map<std::string, UpstreamConfig> wanted = snap->getGlobal().upstreams;
+    for (size_t i = 0; i < configs.size(); i++) {
+        for (size_t j = 0; j < configs[i].locations.size(); j++) {
+            const std::string& pass = configs[i].locations[j].proxy_pass;
+            if (pass.empty() || wanted.count(pass))
+                continue;
+            UpstreamConfig single;
+            single.name = pass;
+            single.servers.push_back(UpstreamServerConfig());
+            single.servers.back().address = pass;
+            wanted[pass] = single;
+        }
+    }
+    std::map<std::string, UpstreamGroup*> fresh;
+    for (std::map<std::string, UpstreamConfig>::iterator it = wanted.begin(); it != wanted.end(); ++it) {
+        std::map<std::string, UpstreamGroup*>::iterator current = upstream_groups.find(it->first);
+        if (current != upstream_groups.end() &&
+            current->second->getSignature() == UpstreamGroup::signatureOf(it->second))
+            continue;
+        UpstreamGroup* group = UpstreamGroup::create(it->second);
+        if (!group) {
+            std::cerr << RED << "cannot resolve a server of upstream " << it->first << RESET << std::endl;
+            for (std::map<std::string, UpstreamGroup*>::iterator f = fresh.begin(); f != fresh.end(); ++f)
+                delete f->second;
+            for (std::map<std::string, UpstreamPool*>::iterator f = fresh_pools.begin(); f != fresh_pools.end(); ++f)
+                delete f->second;
+            return false;
+        }
+        fresh[it->first] = group;
+    }
+
+    std::map<std::string, UpstreamPool*>::iterator pool = upstream_pools.begin();
+    while (pool != upstream_pools.end()) {
+        if (passes.count(pool->first) && !fresh_pools.count(pool->first)) {
+            ++pool;
+            continue;
+        }
+        retirePool(pool->second);
+        upstream_pools.erase(pool++);
+    }
+    for (std::map<std::string, UpstreamPool*>::iterator it = fresh_pools.begin(); it != fresh_pools.end(); ++it)
+        upstream_pools[it->first] = it->second;
+    for (std::map<std::string, UpstreamGroup*>::iterator it = fresh.begin(); it != fresh.end(); ++it) {
+        if (upstream_groups.count(it->first))
+            retired_groups.push_back(upstream_groups[it->first]);
+        upstream_groups[it->first] = it->second;
+    }
+
+    std::set<std::string> cgi_keys;
+    std::set<std::string> zygote_keys;
+    for (size_t i = 0; i < configs.size(); i++) {
+        for (size_t j = 0; j < configs[i].locations.size(); j++) {
+            const LocationConfig& location = configs[i].locations[j];
+            for (std::map<std::string, std::string>::const_iterator it = location.cgi_pool.begin();
+                 it != location.cgi_pool.end(); ++it) {
+                std::map<std::string, std::string>::const_iterator interp = location.cgi.find(it->first);
+                std::string interpreter = interp != location.cgi.end() ? interp->second : "";
+                std::string key = interpreter + " " + it->second;
+                if (cgi_keys.count(key))
+                    continue;
+                cgi_keys.insert(key);
+                std::map<std::string, CGIPool*>::iterator current = cgi_pools.find(key);
+                if (current != cgi_pools.end() &&
+                    current->second->matches(location.cgi_pool_min, location.cgi_pool_max,
+                        location.cgi_pool_max_requests, location.cgi_pool_idle_timeout_ms))
+                    continue;
+                if (current != cgi_pools.end()) {
+                    retireCGIPool(current->second);
+                    cgi_pools.erase(current);
+                }
+                cgi_pools[key] = new CGIPool(interpreter, it->second, location.cgi_pool_min,
+                    location.cgi_pool_max, location.cgi_pool_max_requests, location.cgi_pool_idle_timeout_ms);
+            }
+            for (std::map<std::string, std::string>::const_iterator it = location.cgi_zygote.begin();
+                 it != location.cgi_zygote.end(); ++it) {
+                std::map<std::string, std::string>::const_iterator interp = location.cgi.find(it->first);
+                std::string interpreter = interp != location.cgi.end() ? interp->second : "";
+                std::string key = interpreter + " " + it->second;
+                zygote_keys.insert(key);
+                if (!zygotes.count(key))
+                    zygotes[key] = new Zygote(interpreter, it->second);
+            }
+        }
+    }
+
+    std::map<std::string, CGIPool*>::iterator cgi = cgi_pools.begin();
+    while (cgi != cgi_pools.end()) {
+        if (cgi_keys.count(cgi->first)) {
+            ++cgi;
+            continue;
+        }
+        retireCGIPool(cgi->second);
+        cgi_pools.erase(cgi++);
+    }
+    // A zygote nobody uses is stopped outright; launches it still owes fall
+    // back to posix_spawn, and children it already forked run to completion.
+    std::map<std::string, Zygote*>::iterator zygote = zygotes.begin();
+    while (zygote != zygotes.end()) {
+        if (zygote_keys.count(zygote->first)) {
+            ++zygote;
+            continue;
+        }
+        zygote->second->stop();
+        watchZygote(zygote->second);
+        delete zygote->second;
+        zygotes.erase(zygote++);
+    }
+    return true;
 }
 
-// Need more testing !! (ma3t lach matidkholch bzzf lhad l function)
-void Server::checkCGITimeout() {
-    time_t timeout_ms = 30;
-    time_t current_time = time(NULL);
-
-    std::map<int, CGIProcess*>::iterator it = active_cgis.begin();
-    while (it != active_cgis.end()) {
-        CGIProcess* cgi = it->second;
-        time_t elapsed = current_time - cgi->start_time;
-
-        if (elapsed >= timeout_ms) {
-            std::map<int, CGIProcess*>::iterator next_it = it;
-            ++next_it;
-            // TIMEOUT: terminate CGI process
-            kill(cgi->pid, SIGKILL);
-            waitpid(cgi->pid, NULL, 0);
-
-            // Close pipes
-            close(cgi->pipeIn);
-            close(cgi->pipeOut);
-            event_manager.removeFd(cgi->pipeIn);
-            event_manager.removeFd(cgi->pipeOut);
-
-            // Send 500 response to client
-            Client* client = clients[cgi->client_fd];
-            HttpResponse response = HttpResponse::makeError(504, "CGI timeout");
-            client->setResponseBuffer(response.toString());
-            client->setState(Client::SENDING_RESPONSE);
-            event_manager.setWriteMonitoring(client->getFd(), true);
-            event_manager.setReadMonitoring(client->getFd(), false);
-            active_cgis.erase(cgi->pipeOut);
-            active_cgis.erase(cgi->pipeIn);
-            
-            delete cgi;
-            it = next_it;
-        } 
-        else 
-            ++it;
+bool Server::startFastCGI(Client* client) {
+    std::map<std::string, UpstreamPool*>::iterator it = upstream_pools.find(client->getCGILocation()->fastcgi_pass);
+    if (it == upstream_pools.end())
+        return failCGI(client, 502, "FastCGI backend unavailable");
+    return dispatchFastCGI(client, it->second);
+}
+
+// Sends the request over a pooled connection, or queues the client when the
+// pool is at fastcgi_max_conns. Returns false when an error response was set.
+bool Server::dispatchFastCGI(Client* client, UpstreamPool* pool) {
+    bool reused = false;
+    int fd = pool->acquire(reused);
+    if (fd == -1) {
+        if (errno == EAGAIN) {
+            pool->waiting.push_back(client->getFd());
+            return true;
+        }
+        std::cerr << RED << "fastcgi connect to " << pool->getAddress().name << " failed: "
+                  << strerror(errno) << RESET << std::endl;
+        return failCGI(client, 502, "FastCGI backend unavailable");
+    }
+    
+    const HttpRequest* request = client->getCGIRequest();
+    const LocationConfig* location = client->getCGILocation();
+    std::vector<std::string> params = prepareEnv(request, client->getServerConfig(), client->getCGIFullPath());
+    params.push_back("SCRIPT_FILENAME=" + client->getCGIFullPath());
+    params.push_back("DOCUMENT_ROOT=" + location->root);
+    std::string uri = request->getPath();
+    if (!request->getQueryString().empty())
+        uri += "?" + request->getQueryString();
+    params.push_back("REQUEST_URI=" + uri);
+    
+    FastCGIRequest* req = new FastCGIRequest();
+    req->client_fd = client->getFd();
+    req->upstream_fd = fd;
+    req->pool = pool;
+    req->reused = reused;
+    req->connected = reused;
+    req->out = FastCGI::encodeRequest(1, params, request->getBody(), true);
+    req->read_timeout_ms = location->fastcgi_read_timeout_ms;
+    req->last_activity_ms = monotonicMs();
+    req->deadline = timers.add(req->last_activity_ms + req->read_timeout_ms, Timers::FASTCGI_DEADLINE, fd);
+    
+    fastcgi_requests[fd] = req;
+    event_manager.addFd(fd, false, true);
+    return true;
+}
+
+void Server::handleFastCGIEvent(FastCGIRequest* req, const EventManager::Event& event) {
+    int fd = req->upstream_fd;
+    
+    if (!req->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            std::cerr << RED << "fastcgi connect to " << req->pool->getAddress().name << " failed: "
+                      << strerror(err ? err : errno) << RESET << std::endl;
+            finishFastCGI(req, false, 502);
+            return;
+        }
+        req->connected = true;
+    }
+    
+    if (event.writable && req->out_sent < req->out.length()) {
+        ssize_t n = send(fd, req->out.data() + req->out_sent, req->out.length() - req->out_sent, MSG_NOSIGNAL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            retryFastCGI(req);
+            return;
+        }
+        if (n > 0) {
+            req->out_sent += n;
+            req->last_activity_ms = monotonicMs();
+        }
+        if (req->out_sent == req->out.length()) {
+            event_manager.setWriteMonitoring(fd, false);
+            event_manager.setReadMonitoring(fd, true);
+        }
+    }
+    
+    if (!event.readable && !event.error)
+        return;
+    
+    char buffer[8192];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        retryFastCGI(req);
+        return;
+    }
+    req->in.append(buffer, n);
+    req->last_activity_ms = monotonicMs();
+    
+    FastCGI::Record record;
+    while (FastCGI::decodeRecord(req->in, record)) {
+        if (record.request_id != 1)
+            continue;
+        if (record.type == FastCGI::STDOUT)
+            req->stdout_data += record.content;
+        else if (record.type == FastCGI::STDERR)
+            std::cerr << "fastcgi: " << record.content;
+        else if (record.type == FastCGI::END_REQUEST) {
+            finishFastCGI(req, req->in.empty(), req->stdout_data.empty() ? 502 : 0);
+            return;
+        }
+    }
+}
+
+// A kept-alive connection can die between our liveness probe and the first
+// write; such a request is replayed once on a fresh connection. Anything else
+// (or a second failure) is a 502.
+void Server::retryFastCGI(FastCGIRequest* req) {
+    if (!req->reused || req->retried || !req->stdout_data.empty() || !req->in.empty()) {
+        finishFastCGI(req, false, 502);
+        return;
+    }
+    
+    event_manager.removeFd(req->upstream_fd);
+    fastcgi_requests.erase(req->upstream_fd);
+    timers.cancel(req->deadline);
+    req->pool->release(req->upstream_fd, false);
+    
+    bool reused = false;
+    int fd = req->pool->acquire(reused);
+    if (fd == -1) {
+        Client* client = clients.count(req->client_fd) ? clients[req->client_fd] : NULL;
+        if (client) {
+            HttpResponse response = HttpResponse::makeError(502, "FastCGI backend unavailable");
+            sendCGIResponse(client, response);
+        }
+        UpstreamPool* pool = req->pool;
+        delete req;
+        pumpFastCGIQueue(pool);
+        return;
+    }
+    req->upstream_fd = fd;
+    req->reused = reused;
+    req->connected = reused;
+    req->retried = true;
+    req->out_sent = 0;
+    req->last_activity_ms = monotonicMs();
+    req->deadline = timers.add(req->last_activity_ms + req->read_timeout_ms, Timers::FASTCGI_DEADLINE, fd);
+    fastcgi_requests[fd] = req;
+    event_manager.addFd(fd, false, true);
+}
+
+void Server::finishFastCGI(FastCGIRequest* req, bool reusable, int error_code) {
+    UpstreamPool* pool = req->pool;
+    
+    event_manager.removeFd(req->upstream_fd);
+    fastcgi_requests.erase(req->upstream_fd);
+    timers.cancel(req->deadline);
+    pool->release(req->upstream_fd, reusable);
+    
+    std::map<int, Client*>::iterator it = clients.find(req->client_fd);
+    if (it != clients.end()) {
+        HttpResponse response;
+        if (error_code == 504)
+            response = HttpResponse::makeError(504, "FastCGI timeout");
+        else if (error_code)
+            response = HttpResponse::makeError(502, "Bad Gateway");
+        else
+            response = processCGIOutput(req->stdout_data);
+        sendCGIResponse(it->second, response);
+    }
+    delete req;
+    pumpFastCGIQueue(pool);
+}
+
+// The client went away: its upstream connection is mid-request and cannot be
+// reused, and a queued client just leaves the queue.
+void Server::abortFastCGI(int client_fd) {
+    std::vector<UpstreamPool*> pools = retired_pools;
+    for (std::map<std::string, UpstreamPool*>::iterator it = upstream_pools.begin();
+         it != upstream_pools.end(); ++it)
+        pools.push_back(it->second);
+    for (size_t i = 0; i < pools.size(); i++) {
+        std::deque<int>& waiting = pools[i]->waiting;
+        for (std::deque<int>::iterator w = waiting.begin(); w != waiting.end(); ++w) {
+            if (*w == client_fd) {
+                waiting.erase(w);
+                break;
+            }
+        }
+    }
+    
+    for (std::map<int, FastCGIRequest*>::iterator it = fastcgi_requests.begin();
+         it != fastcgi_requests.end(); ++it) {
+        FastCGIRequest* req = it->second;
+        if (req->client_fd != client_fd)
+            continue;
+        UpstreamPool* pool = req->pool;
+        event_manager.removeFd(req->upstream_fd);
+        fastcgi_requests.erase(it);
+        timers.cancel(req->deadline);
+        pool->release(req->upstream_fd, false);
+        delete req;
+        pumpFastCGIQueue(pool);
+        return;
+    }
+}
+
+void Server::pumpFastCGIQueue(UpstreamPool* pool) {
+    while (running && !pool->waiting.empty() && !pool->atLimit()) {
+        int client_fd = pool->waiting.front();
+        pool->waiting.pop_front();
+        std::map<int, Client*>::iterator it = clients.find(client_fd);
+        if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS)
+            continue;
+        if (!dispatchFastCGI(it->second, pool))
+            event_manager.setWriteMonitoring(client_fd, true);
+    }
+    dropRetiredPool(pool);
+}
+
+// Queued clients stay with the pool they were queued on.
+void Server::retirePool(UpstreamPool* pool) {
+    retired_pools.push_back(pool);
+    dropRetiredPool(pool);
+}
+
+void Server::dropRetiredPool(UpstreamPool* pool) {
+    if (pool->activeCount() > 0 || !pool->waiting.empty())
+        return;
+    std::vector<UpstreamPool*>::iterator it = std::find(retired_pools.begin(), retired_pools.end(), pool);
+    if (it == retired_pools.end())
+        return;
+    retired_pools.erase(it);
+    delete pool;
+}
+
+// Like expireProxy: the deadline is only pushed out when it fires, so
+// traffic on the connection costs a clock read rather than a timer update.
+void Server::expireFastCGI(int upstream_fd) {
+    std::map<int, FastCGIRequest*>::iterator it = fastcgi_requests.find(upstream_fd);
+    if (it == fastcgi_requests.end())
+        return;
+    FastCGIRequest* req = it->second;
+    req->deadline = timers.none();
+    long now = monotonicMs();
+    long due = req->last_activity_ms + req->read_timeout_ms;
+    if (due > now) {
+        req->deadline = timers.add(due, Timers::FASTCGI_DEADLINE, upstream_fd);
+        return;
+    }
+    std::cerr << RED << "fastcgi " << req->pool->getAddress().name << " timed out" << RESET << std::endl;
+    finishFastCGI(req, false, 504);
+}
+
+// The value an upstream `hash` key stands for in this request.
+static std::string proxyHashKey(const std::string& key, const HttpRequest* request,
+                                const std::string& client_addr) {
+    if (key == "$request_uri")
+        return request->getURI();
+    if (key == "$remote_addr")
+        return client_addr;
+    if (key.compare(0, 6, "$http_") == 0) {
+        std::string header = key.substr(6);
+        std::replace(header.begin(), header.end(), '_', '-');
+        return request->getHeader(header);
+    }
+    return key;
+}
+
+static void peerFailed(UpstreamGroup* group, int peer) {
+    const UpstreamPeer& failed = group->peer(peer);
+    if (group->failed(peer, monotonicMs()))
+        std::cerr << RED << "upstream " << group->getName() << ": " << failed.pool->getAddress().name
+                  << " marked down for " << failed.fail_timeout_ms << "ms" << RESET << std::endl;
+}
+
+// Forwards the request to a server of the location's upstream group; a
+// streamed body follows as the client sends it. The location prefix is
+// replaced by the proxy_pass URI when there is one.
+bool Server::startProxy(Client* client) {
+    const LocationConfig* location = client->getCGILocation();
+    std::map<std::string, UpstreamGroup*>::iterator it = upstream_groups.find(location->proxy_pass);
+    if (it == upstream_groups.end())
+        return failCGI(client, 502, "Bad Gateway");
+
+    const HttpRequest* request = client->getCGIRequest();
+    std::string uri = request->getURI();
+    if (!location->proxy_uri.empty()) {
+        std::string rest = uri.substr(std::min(location->path.length(), uri.length()));
+        if (!rest.empty() && rest[0] == '/' && location->proxy_uri[location->proxy_uri.length() - 1] == '/')
+            rest.erase(0, 1);
+        uri = location->proxy_uri + rest;
+    }
+    const std::string& client_addr = client->getRemoteAddress();
+
+    ProxyRequest* req = new ProxyRequest();
+    req->client_fd = client->getFd();
+    req->group = it->second;
+    req->hash_key = proxyHashKey(req->group->getHashKey(), request, client_addr);
+    req->tried.assign(req->group->size(), false);
+    req->idempotent = (request->getMethod() != "POST");
+    req->out = Proxy::encodeRequestHead(*request, uri, client_addr);
+    req->body_streaming = client->isStreamingBody();
+    if (!req->body_streaming)
+        req->out += request->getBody();
+    req->body_sent = !req->body_streaming;
+    req->connect_timeout_ms = location->proxy_connect_timeout_ms;
+    req->read_timeout_ms = location->proxy_read_timeout_ms;
+    req->deadline = timers.none();
+
+    req->peer = req->group->select(req->hash_key, monotonicMs(), req->tried);
+    if (req->peer == -1)
+        std::cerr << RED << "upstream " << req->group->getName() << ": no live servers" << RESET << std::endl;
+    if (req->peer == -1 || !connectProxy(req)) {
+        delete req;
+        return failCGI(client, 502, "Bad Gateway");
+    }
+    proxy_clients[req->client_fd] = req;
+    if (req->body_streaming)
+        sendContinue(client);
+    flowProxy(req);
+    return true;
+}
+
+// Takes a pooled connection to req->peer, or starts a new one, moving on to
+// the next server while connects fail outright. False when none is left.
+bool Server::connectProxy(ProxyRequest* req) {
+    while (req->peer != -1) {
+        UpstreamPool* pool = req->group->peer(req->peer).pool;
+        bool reused = false;
+        int fd = pool->acquire(reused);
+        if (fd != -1) {
+            req->upstream_fd = fd;
+            req->reused = reused;
+            req->connected = reused;
+            req->out_sent = 0;
+            req->in.clear();
+            req->last_activity_ms = monotonicMs();
+            req->deadline = timers.add(req->last_activity_ms +
+                (reused ? req->read_timeout_ms : req->connect_timeout_ms), Timers::PROXY_DEADLINE, fd);
+            proxy_requests[fd] = req;
+            event_manager.addFd(fd, true, true);
+            return true;
+        }
+        std::cerr << RED << "proxy connect to " << pool->getAddress().name << " failed: "
+                  << strerror(errno) << RESET << std::endl;
+        peerFailed(req->group, req->peer);
+        req->tried[req->peer] = true;
+        req->peer = req->group->select(req->hash_key, monotonicMs(), req->tried);
+    }
+    return false;
+}
+
+void Server::handleProxyEvent(ProxyRequest* req, const EventManager::Event& event) {
+    if (!req->connected) {
+        if (!event.writable && !event.error)
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(req->upstream_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            std::cerr << RED << "proxy connect to " << req->group->peer(req->peer).pool->getAddress().name
+                      << " failed: " << strerror(err ? err : errno) << RESET << std::endl;
+            upstreamFailed(req, true);
+            return;
+        }
+        // A stale event for a recycled fd number must not pass for a connect.
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(req->upstream_fd, reinterpret_cast<struct sockaddr*>(&peer), &peer_len) == -1)
+            return;
+        req->connected = true;
+        req->last_activity_ms = monotonicMs();
+        timers.cancel(req->deadline);
+        req->deadline = timers.add(req->last_activity_ms + req->read_timeout_ms,
+                                   Timers::PROXY_DEADLINE, req->upstream_fd);
+    }
+
+    if (event.writable && !sendProxyRequest(req))
+        return;
+    if (event.readable || event.error)
+        readProxyResponse(req);
+}
+
+// The head (with a buffered body) first, then the streamed body as the
+// client delivers it. A failed send stops the request side only: the
+// upstream may well have answered already, the read side finds out.
+bool Server::sendProxyRequest(ProxyRequest* req) {
+    Client* client = clients[req->client_fd];
+
+    while (req->out_sent < req->out.length()) {
+        ssize_t n = send(req->upstream_fd, req->out.data() + req->out_sent,
+                         req->out.length() - req->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            req->out_sent += n;
+            req->last_activity_ms = monotonicMs();
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        req->send_failed = true;
+        break;
+    }
+    if (!req->send_failed && req->out_sent == req->out.length() && !req->body_sent) {
+        size_t buffered = client->bodyBuffered();
+        ssize_t n = buffered ? send(req->upstream_fd, client->bodyData(), buffered, MSG_NOSIGNAL) : 0;
+        if (n > 0) {
+            client->consumeBody(n);
+            req->body_started = true;
+            req->last_activity_ms = monotonicMs();
+        }
+        else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            req->send_failed = true;
+        if (client->bodyReceived() && client->bodyBuffered() == 0)
+            req->body_sent = true;
+    }
+    if (req->send_failed) {
+        req->body_sent = true;
+        req->upstream_keep_alive = false;
+    }
+    flowProxy(req);
+    return true;
+}
+
+void Server::readProxyResponse(ProxyRequest* req) {
+    Client* client = clients[req->client_fd];
+    char buffer[16384];
+    ssize_t n = recv(req->upstream_fd, buffer, sizeof(buffer), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        if (!req->head_done)
+            upstreamFailed(req, false);
+        else
+            finishProxy(req, n == 0 && req->framing == Proxy::UNTIL_CLOSE);
+        return;
+    }
+    req->last_activity_ms = monotonicMs();
+    client->touch();
+
+    if (req->head_done) {
+        forwardProxyBody(req, client, buffer, n);
+        return;
+    }
+    req->in.append(buffer, n);
+    startProxyResponse(req, client);
+}
+
+// Waits for the complete head (skipping interim 1xx ones), then starts the
+// client's response with it and whatever part of the body came along.
+void Server::startProxyResponse(ProxyRequest* req, Client* client) {
+    Proxy::ResponseHead head;
+    size_t head_len;
+    while (true) {
+        head_len = Proxy::findHeadEnd(req->in);
+        if (head_len == 0) {
+            if (req->in.length() > PROXY_MAX_HEAD) {
+                std::cerr << RED << "upstream " << req->group->getName() << ": response head too large" << RESET << std::endl;
+                failProxy(req, 502);
+            }
+            return;
+        }
+        if (!Proxy::parseResponseHead(req->in.substr(0, head_len), head)) {
+            std::cerr << RED << "upstream " << req->group->getName() << ": malformed response head" << RESET << std::endl;
+            failProxy(req, 502);
+            return;
+        }
+        if (head.status >= 200)
+            break;
+        req->in.erase(0, head_len);
+    }
+
+    req->head_done = true;
+    req->group->succeeded(req->peer);
+    req->framing = head.framing;
+    req->remaining = head.content_length;
+    req->upstream_keep_alive = head.keep_alive && !req->send_failed;
+    // HTTP/1.0 clients get the chunked payload decoded and the end of the
+    // body marked by closing; so does any body framed by the upstream closing.
+    req->dechunk = (head.framing == Proxy::CHUNKED && client->getCGIRequest()->getVersion() != "HTTP/1.1");
+    if (req->dechunk || head.framing == Proxy::UNTIL_CLOSE)
+        client->disableKeepAlive();
+
+    client->setResponseBuffer(Proxy::encodeResponseHead(head,
+        head.framing == Proxy::CHUNKED && !req->dechunk, client->isKeepAlive()));
+    client->setResponseStreaming(true);
+    client->setState(Client::SENDING_RESPONSE);
+
+    std::string rest = req->in.substr(head_len);
+    req->in.clear();
+    forwardProxyBody(req, client, rest.data(), rest.length());
+}
+
+// Passes body bytes on and ends the request with the body. Anything past
+// its end means the connection is out of step and cannot be reused.
+void Server::forwardProxyBody(ProxyRequest* req, Client* client, const char* data, size_t length) {
+    bool done = false;
+    if (req->framing == Proxy::NO_BODY) {
+        done = true;
+        if (length > 0)
+            req->upstream_keep_alive = false;
+    }
+    else if (req->framing == Proxy::LENGTH) {
+        size_t take = std::min(static_cast<size_t>(req->remaining), length);
+        client->appendResponse(data, take);
+        req->remaining -= take;
+        if (take < length)
+            req->upstream_keep_alive = false;
+        done = (req->remaining == 0);
+    }
+    else if (req->framing == Proxy::CHUNKED) {
+        std::string decoded;
+        long used = req->chunked.feed(data, length, req->dechunk ? &decoded : NULL);
+        if (used < 0) {
+            std::cerr << RED << "upstream " << req->group->getName() << ": malformed chunked body" << RESET << std::endl;
+            finishProxy(req, false);
+            return;
+        }
+        if (req->dechunk)
+            client->appendResponse(decoded.data(), decoded.length());
+        else
+            client->appendResponse(data, used);
+        if (static_cast<size_t>(used) < length)
+            req->upstream_keep_alive = false;
+        done = req->chunked.done();
+    }
+    else
+        client->appendResponse(data, length);
+
+    if (done)
+        finishProxy(req, true);
+    else
+        flowProxy(req);
+}
+
+// Flow control in all three directions: the upstream is written while
+// request bytes wait and read while the client has room for more response,
+// the client is read while the request body buffer has room. Each side
+// buffers at most PROXY_HIGH_WATER.
+void Server::flowProxy(ProxyRequest* req) {
+    Client* client = clients[req->client_fd];
+    bool write_upstream = !req->connected || req->out_sent < req->out.length() ||
+                          (!req->body_sent && client->bodyBuffered() > 0);
+
+    event_manager.setWriteMonitoring(req->upstream_fd, write_upstream);
+    event_manager.setReadMonitoring(req->upstream_fd, client->pendingResponse() < PROXY_HIGH_WATER);
+    event_manager.setReadMonitoring(client->getFd(),
+        !req->body_sent && !client->bodyReceived() && client->bodyBuffered() < PROXY_HIGH_WATER);
+    if (client->getState() == Client::SENDING_RESPONSE)
+        event_manager.setWriteMonitoring(client->getFd(), client->hasDataToSend());
+}
+
+// The upstream failed before answering. A pooled connection that dies
+// without a byte of response was most likely closed by the server while it
+// sat idle: the request goes again on a fresh connection to the same server.
+// Anything else counts against the server and the request moves on to the
+// next one, unless it can no longer be replayed (part of a streamed body is
+// gone, or a POST reached the server).
+void Server::upstreamFailed(ProxyRequest* req, bool peer_failed) {
+    if (req->head_done) {
+        finishProxy(req, false);
+        return;
+    }
+    bool stale = !peer_failed && req->reused && req->in.empty();
+    bool replayable = !req->body_started && (req->idempotent || stale || req->out_sent == 0);
+    if (!stale)
+        peerFailed(req->group, req->peer);
+    releaseUpstream(req, false);
+    if (!replayable) {
+        failProxy(req, 502);
+        return;
     }
-}
\ No newline at end of file
+
+    if (!stale) {
+        req->tried[req->peer] = true;
+        req->peer = req->group->select(req->hash_key, monotonicMs(), req->tried);
+    }
+    req->send_failed = false;
+    req->body_sent = !req->body_streaming;
+    if (!connectProxy(req)) {
+        failProxy(req, 502);
+        return;
+    }
+    flowProxy(req);
+}
+
+void Server::releaseUpstream(ProxyRequest* req, bool reusable) {
+    if (req->upstream_fd == -1)
+        return;
+    timers.cancel(req->deadline);
+    event_manager.removeFd(req->upstream_fd);
+    proxy_requests.erase(req->upstream_fd);
+    req->group->peer(req->peer).pool->release(req->upstream_fd, reusable);
+    req->upstream_fd = -1;
+}
+
+// The response is over, cleanly or cut short. The upstream connection goes
+// back to the pool only after a complete exchange; the client finishes
+// sending what is buffered and then moves on like after any response.
+void Server::finishProxy(ProxyRequest* req, bool complete) {
+    bool reusable = complete && req->upstream_keep_alive && req->body_sent && !req->send_failed;
+    Client* client = clients[req->client_fd];
+    releaseUpstream(req, reusable);
+    proxy_clients.erase(req->client_fd);
+    delete req;
+
+    if (!complete)
+        client->disableKeepAlive();
+    client->setResponseStreaming(false);
+    if (client->hasDataToSend()) {
+        event_manager.setReadMonitoring(client->getFd(), false);
+        event_manager.setWriteMonitoring(client->getFd(), true);
+        return;
+    }
+    if (client->finishResponse()) {
+        removeClient(client);
+        return;
+    }
+    event_manager.setWriteMonitoring(client->getFd(), false);
+    event_manager.setReadMonitoring(client->getFd(), true);
+}
+
+// Nothing went to the client yet, so it gets an error response instead.
+void Server::failProxy(ProxyRequest* req, int code) {
+    if (req->head_done) {
+        finishProxy(req, false);
+        return;
+    }
+    Client* client = clients[req->client_fd];
+    releaseUpstream(req, false);
+    proxy_clients.erase(req->client_fd);
+    delete req;
+
+    HttpResponse response = HttpResponse::makeError(code, code == 504 ? "Gateway Timeout" : "Bad Gateway");
+    sendCGIResponse(client, response);
+}
+
+// The client went away; its upstream connection is mid-exchange and closed.
+void Server::abortProxy(int client_fd) {
+    std::map<int, ProxyRequest*>::iterator it = proxy_clients.find(client_fd);
+    if (it == proxy_clients.end())
+        return;
+    ProxyRequest* req = it->second;
+    proxy_clients.erase(it);
+    releaseUpstream(req, false);
+    delete req;
+}
+
+// A connect that takes too long counts against the server like a refused
+// one. Once connected the deadline is pushed out lazily: it fires
+// proxy_read_timeout after the last progress, never while the upstream is
+// held back for a slow client.
+void Server::expireProxy(int upstream_fd) {
+    std::map<int, ProxyRequest*>::iterator it = proxy_requests.find(upstream_fd);
+    if (it == proxy_requests.end())
+        return;
+    ProxyRequest* req = it->second;
+    req->deadline = timers.none();
+    long now = monotonicMs();
+
+    if (!req->connected) {
+        std::cerr << RED << "proxy connect to " << req->group->peer(req->peer).pool->getAddress().name
+                  << " timed out" << RESET << std::endl;
+        upstreamFailed(req, true);
+        return;
+    }
+    long due = req->last_activity_ms + req->read_timeout_ms;
+    if (due > now || clients[req->client_fd]->pendingResponse() >= PROXY_HIGH_WATER) {
+        req->deadline = timers.add(due > now ? due : now + req->read_timeout_ms, Timers::PROXY_DEADLINE, upstream_fd);
+        return;
+    }
+    std::cerr << RED << "upstream " << req->group->peer(req->peer).pool->getAddress().name
+              << " timed out" << RESET << std::endl;
+    peerFailed(req->group, req->peer);
+    failProxy(req, 504);
+}
+
+CGIPool* Server::findCGIPool(Client* client) {
+    const LocationConfig* location = client->getCGILocation();
+    std::map<std::string, std::string>::const_iterator it = location->cgi_pool.find(client->getCGIExtension());
+    if (it == location->cgi_pool.end())
+        return NULL;
+    std::map<std::string, std::string>::const_iterator interp = location->cgi.find(it->first);
+    std::string key = (interp != location->cgi.end() ? interp->second : "") + " " + it->second;
+    std::map<std::string, CGIPool*>::iterator pool = cgi_pools.find(key);
+    return pool != cgi_pools.end() ? pool->second : NULL;
+}
+
+// Hands the request to an idle worker (spawning one below the pool maximum)
+// or queues the client until one frees up.
+bool Server::startPooledCGI(Client* client, CGIPool* pool) {
+    bool spawned = false;
+    CGIWorker* worker = pool->acquire(spawned);
+    if (!worker) {
+        if (errno == EAGAIN) {
+            pool->waiting.push_back(client->getFd());
+            return true;
+        }
+        return failCGI(client, 500, "CGI execution failed");
+    }
+    if (spawned)
+        watchWorker(worker);
+
+    std::vector<std::string> env = prepareEnv(client->getCGIRequest(), client->getServerConfig(), client->getCGIFullPath());
+    env.push_back("SCRIPT_FILENAME=" + client->getCGIFullPath());
+
+    worker->client_fd = client->getFd();
+    worker->out = CGIPool::encodeRequest(env, client->getCGIRequest()->getBody());
+    worker->out_sent = 0;
+    worker->output.clear();
+    worker->deadline = timers.add(monotonicMs() + client->getCGILocation()->cgi_pool_timeout_ms,
+                                  Timers::POOL_DEADLINE, worker->from_worker);
+    pool_fds[worker->to_worker] = worker;
+    event_manager.addFd(worker->to_worker, false, true);
+    return true;
+}
+
+// A worker's stdout stays registered for its whole life, so a worker that
+// dies while idle is noticed (EOF) and replaced.
+void Server::watchWorker(CGIWorker* worker) {
+    worker->deadline = timers.none();
+    pool_fds[worker->from_worker] = worker;
+    event_manager.addFd(worker->from_worker, true, false);
+}
+
+void Server::handlePoolEvent(CGIWorker* worker, int fd, const EventManager::Event& event) {
+    if (fd == worker->to_worker) {
+        ssize_t n = write(fd, worker->out.data() + worker->out_sent, worker->out.length() - worker->out_sent);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            finishPooledCGI(worker, 502);
+            return;
+        }
+        if (n > 0)
+            worker->out_sent += n;
+        if (worker->out_sent == worker->out.length()) {
+            event_manager.removeFd(fd);
+            pool_fds.erase(fd);
+            worker->out.clear();
+        }
+        return;
+    }
+
+    if (!event.readable && !event.error)
+        return;
+    char buffer[8192];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        if (worker->isBusy())
+            finishPooledCGI(worker, 502);
+        else
+            retireWorker(worker, false);
+        return;
+    }
+    worker->in.append(buffer, n);
+
+    std::string frame;
+    while (CGIPool::decodeFrame(worker->in, frame)) {
+        if (!worker->isBusy()) {
+            // Output nobody asked for: the worker is out of sync.
+            retireWorker(worker, true);
+            return;
+        }
+        if (frame.empty()) {
+            finishPooledCGI(worker, 0);
+            return;
+        }
+        worker->output += frame;
+    }
+}
+
+// Answers the client and puts the worker back in the pool, unless it failed
+// or has served cgi_pool_max_requests.
+void Server::finishPooledCGI(CGIWorker* worker, int error_code) {
+    CGIPool* pool = worker->pool;
+    std::map<int, Client*>::iterator it = clients.find(worker->client_fd);
+
+    if (it != clients.end()) {
+        HttpResponse response;
+        if (error_code == 504)
+            response = HttpResponse::makeError(504, "CGI timeout");
+        else if (error_code)
+            response = HttpResponse::makeError(502, "CGI worker failed");
+        else
+            response = processCGIOutput(worker->output);
+        sendCGIResponse(it->second, response);
+    }
+
+    if (worker->to_worker != -1 && pool_fds.count(worker->to_worker)) {
+        event_manager.removeFd(worker->to_worker);
+        pool_fds.erase(worker->to_worker);
+    }
+    timers.cancel(worker->deadline);
+    worker->client_fd = -1;
+    worker->output.clear();
+    worker->requests++;
+    worker->idle_since_ms = monotonicMs();
+    if (error_code || pool->isWornOut(worker))
+        retireWorker(worker, error_code != 0);
+    pumpCGIPoolQueue(pool);
+}
+
+void Server::retireWorker(CGIWorker* worker, bool kill_now) {
+    timers.cancel(worker->deadline);
+    event_manager.removeFd(worker->to_worker);
+    event_manager.removeFd(worker->from_worker);
+    pool_fds.erase(worker->to_worker);
+    pool_fds.erase(worker->from_worker);
+    worker->pool->retire(worker, kill_now);
+}
+
+// The client went away mid-request: the worker is killed rather than left
+// to finish a script whose output nobody will read.
+void Server::abortPooledCGI(int client_fd) {
+    std::vector<CGIPool*> pools = retired_cgi_pools;
+    for (std::map<std::string, CGIPool*>::iterator it = cgi_pools.begin(); it != cgi_pools.end(); ++it)
+        pools.push_back(it->second);
+    for (size_t i = 0; i < pools.size(); i++) {
+        std::deque<int>& waiting = pools[i]->waiting;
+        for (std::deque<int>::iterator w = waiting.begin(); w != waiting.end(); ++w) {
+            if (*w == client_fd) {
+                waiting.erase(w);
+                break;
+            }
+        }
+    }
+
+    for (std::map<int, CGIWorker*>::iterator it = pool_fds.begin(); it != pool_fds.end(); ++it) {
+        CGIWorker* worker = it->second;
+        if (worker->client_fd != client_fd)
+            continue;
+        CGIPool* pool = worker->pool;
+        retireWorker(worker, true);
+        pumpCGIPoolQueue(pool);
+        return;
+    }
+}
+
+void Server::pumpCGIPoolQueue(CGIPool* pool) {
+    while (running && !pool->waiting.empty()) {
+        int client_fd = pool->waiting.front();
+        pool->waiting.pop_front();
+        std::map<int, Client*>::iterator it = clients.find(client_fd);
+        if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS)
+            continue;
+        if (!startPooledCGI(it->second, pool)) {
+            event_manager.setWriteMonitoring(client_fd, true);
+            continue;
+        }
+        if (!pool->waiting.empty() && pool->waiting.back() == client_fd)
+            break;
+    }
+}
+
+// Queued clients stay with the pool they were queued on; its workers serve
+// them and are let go once idle.
+void Server::retireCGIPool(CGIPool* pool) {
+    pool->drain();
+    retired_cgi_pools.push_back(pool);
+}
+
+// The request outlived cgi_pool_timeout; the worker is killed with it.
+void Server::expirePooledCGI(int from_worker) {
+    std::map<int, CGIWorker*>::iterator it = pool_fds.find(from_worker);
+    if (it == pool_fds.end() || !it->second->isBusy())
+        return;
+    it->second->deadline = timers.none();
+    finishPooledCGI(it->second, 504);
+}
+
+// Runs every loop iteration: reaps retired workers, trims idle ones past
+// cgi_pool_idle_timeout and pre-forks up to the pool minimum. Pools retired
+// by a reload lose their idle workers at once and go when empty.
+void Server::maintainCGIPools() {
+    long now_ms = monotonicMs();
+
+    std::vector<CGIPool*>::iterator retired = retired_cgi_pools.begin();
+    while (retired != retired_cgi_pools.end()) {
+        CGIPool* pool = *retired;
+        pool->reapExited();
+        std::vector<CGIWorker*> expired = pool->idleExpired(now_ms);
+        for (size_t i = 0; i < expired.size(); i++)
+            retireWorker(expired[i], false);
+        if (!pool->isDrained()) {
+            ++retired;
+            continue;
+        }
+        retired = retired_cgi_pools.erase(retired);
+        delete pool;
+    }
+
+    for (std::map<std::string, CGIPool*>::iterator it = cgi_pools.begin();
+         it != cgi_pools.end(); ++it) {
+        CGIPool* pool = it->second;
+        pool->reapExited();
+
+        std::vector<CGIWorker*> expired = pool->idleExpired(now_ms);
+        for (size_t i = 0; i < expired.size(); i++)
+            retireWorker(expired[i], false);
+
+        while (running && !draining && pool->wantsMore()) {
+            CGIWorker* worker = pool->spawn();
+            if (!worker) {
+                std::cerr << RED << "cgi_pool: cannot start worker: " << strerror(errno) << RESET << std::endl;
+                break;
+            }
+            watchWorker(worker);
+        }
+    }
+
+    // Zygotes are started (and restarted after a crash) from here too, so
+    // their start-up never lands on a request.
+    for (std::map<std::string, Zygote*>::iterator it = zygotes.begin(); it != zygotes.end(); ++it) {
+        if (running && !draining && !it->second->isRunning() && !it->second->startedRecently()
+            && !it->second->start())
+            std::cerr << RED << "cgi_zygote: cannot start: " << strerror(errno) << RESET << std::endl;
+        watchZygote(it->second);
+    }
+}
+
+Zygote* Server::findZygote(Client* client) {
+    const LocationConfig* location = client->getCGILocation();
+    std::map<std::string, std::string>::const_iterator it = location->cgi_zygote.find(client->getCGIExtension());
+    if (it == location->cgi_zygote.end())
+        return NULL;
+    std::map<std::string, std::string>::const_iterator interp = location->cgi.find(it->first);
+    std::string key = (interp != location->cgi.end() ? interp->second : "") + " " + it->second;
+    std::map<std::string, Zygote*>::iterator zygote = zygotes.find(key);
+    return zygote != zygotes.end() ? zygote->second : NULL;
+}
+
+// Keeps the event loop in step with the zygote's control socket; called
+// right after anything that may have started or stopped it, before its old
+// fd number can be reused. The launches of a stopped zygote fall back to
+// posix_spawn.
+void Server::watchZygote(Zygote* zygote) {
+    int fd = zygote->getFd();
+    int old_fd = -1;
+    for (std::map<int, Zygote*>::iterator it = zygote_fds.begin(); it != zygote_fds.end(); ++it) {
+        if (it->second == zygote && it->first != fd) {
+            old_fd = it->first;
+            break;
+        }
+    }
+    if (old_fd != -1) {
+        event_manager.removeFd(old_fd);
+        zygote_fds.erase(old_fd);
+        std::deque<ZygoteLaunch> launches;
+        launches.swap(zygote_launches[old_fd]);
+        zygote_launches.erase(old_fd);
+        for (size_t i = 0; i < launches.size(); i++)
+            finishZygoteLaunch(launches[i], -1);
+    }
+    if (fd != -1 && !zygote_fds.count(fd)) {
+        zygote_fds[fd] = zygote;
+        event_manager.addFd(fd, true, false);
+    }
+}
+
+// Replies come in request order, one per launch.
+void Server::handleZygoteEvent(int fd) {
+    Zygote* zygote = zygote_fds[fd];
+    pid_t pid;
+    while (zygote->getFd() == fd && zygote->receive(pid)) {
+        std::deque<ZygoteLaunch>& launches = zygote_launches[fd];
+        if (launches.empty()) {
+            killZygoteChild(pid);
+            continue;
+        }
+        ZygoteLaunch launch = launches.front();
+        launches.pop_front();
+        finishZygoteLaunch(launch, pid);
+    }
+    watchZygote(zygote);
+    if (!zygoteLaunchesPending())
+        unclaimed_exits.clear();
+}
+
+// pid is -1 when the zygote did not fork the child: it is spawned directly
+// then, in the slot the launch holds.
+void Server::finishZygoteLaunch(ZygoteLaunch& launch, pid_t pid) {
+    timers.cancel(launch.deadline);
+    std::map<int, Client*>::iterator it = clients.find(launch.client_fd);
+    if (it == clients.end() || it->second->getState() != Client::CGI_IN_PROGRESS) {
+        killZygoteChild(pid);
+        close(launch.pipeIn[0]); close(launch.pipeIn[1]);
+        close(launch.pipeOut[0]); close(launch.pipeOut[1]);
+        returnCGISlot(launch.slot_key);
+        pumpCGIQueue();
+        return;
+    }
+    if (pid > 0) {
+        close(launch.pipeIn[0]);
+        close(launch.pipeOut[1]);
+        CGIProcess* cgi = trackCGI(it->second, pid, launch.pipeIn[1], launch.pipeOut[0]);
+        std::map<pid_t, int>::iterator exited = unclaimed_exits.find(pid);
+        if (exited != unclaimed_exits.end()) {
+            int status = exited->second;
+            unclaimed_exits.erase(exited);
+            cgi_pids.erase(pid);
+            finishExitedCGI(cgi, status);
+        }
+        return;
+    }
+    returnCGISlot(launch.slot_key);
+    if (!launchCGI(it->second, launch.pipeIn, launch.pipeOut, NULL)) {
+        event_manager.setWriteMonitoring(launch.client_fd, true);
+        pumpCGIQueue();
+    }
+}
+
+// A zygote that leaves a request unanswered this long is wedged: it is
+// restarted, and everything it still owes falls back to posix_spawn.
+void Server::expireZygoteLaunch(int id) {
+    for (std::map<int, std::deque<ZygoteLaunch> >::iterator it = zygote_launches.begin();
+         it != zygote_launches.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            if (it->second[i].id != id)
+                continue;
+            it->second[i].deadline = timers.none();
+            Zygote* zygote = zygote_fds[it->first];
+            std::cerr << RED << "cgi_zygote: no reply in " << ZYGOTE_TIMEOUT_MS << "ms, restarting" << RESET << std::endl;
+            zygote->stop();
+            watchZygote(zygote);
+            return;
+        }
+    }
+}
+
+bool Server::zygoteLaunchesPending() const {
+    for (std::map<int, std::deque<ZygoteLaunch> >::const_iterator it = zygote_launches.begin();
+         it != zygote_launches.end(); ++it)
+        if (!it->second.empty())
+            return true;
+    return false;
+}
+
+// A child nobody waits for; one that already exited was reaped, and its pid
+// may belong to someone else by now.
+void Server::killZygoteChild(pid_t pid) {
+    if (pid <= 0)
+        return;
+    std::map<pid_t, int>::iterator exited = unclaimed_exits.find(pid);
+    if (exited != unclaimed_exits.end())
+        unclaimed_exits.erase(exited);
+    else
+        kill(pid, SIGKILL);
+}
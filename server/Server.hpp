@@ -10,60 +10,243 @@
 #include "EventManager.hpp"
 #include "../parsing/Config.hpp"
 #include "./CGIhelper.hpp"
+#include "Upstream.hpp"
+#include "FastCGI.hpp"
+#include "CGIPool.hpp"
+#include "Zygote.hpp"
+#include "Timers.hpp"
+#include "CGICache.hpp"
+#include "Proxy.hpp"
 #include <vector>
 #include <map>
+#include <deque>
 #include <time.h>
+#include <spawn.h>
 
 struct CGIProcess {
     pid_t pid;
     int pipeIn;
     int pipeOut;
     int client_fd;
-    std::string post_body;
+    bool streaming;
+    bool nph;
+    bool spliced;
+    bool splice_checked;
+    bool pipe_watched;
+    long splice_remaining;
     size_t bytes_written;
     std::string cgi_output;
     time_t start_time;
     bool stdin_closed;
     bool error;
     int error_code;
+    std::string slot_key;
+    Timers::Handle deadline;
+};
+
+// A CGI sent to a zygote whose pid has not come back yet. It holds its CGI
+// slot and all four pipe ends; client_fd is -1 once the client is gone.
+struct ZygoteLaunch {
+    int id;
+    int client_fd;
+    int pipeIn[2];
+    int pipeOut[2];
+    std::string slot_key;
+    Timers::Handle deadline;
+};
+
+// A client waiting for a CGI slot (cgi_max_concurrent), until
+// cgi_queue_timeout.
+struct CGIWaiter {
+    int client_fd;
+    Timers::Handle deadline;
 };
 
 class Server {
 private:
-    std::vector<ServerConfig> configs;
+    std::string config_file;
+    ConfigSnapshot* snapshot;
     std::vector<Socket*> listen_sockets;
     std::map<int, Client*> clients;
-    std::map<int, ServerConfig*> fd_to_config;
+    std::map<int, const ServerConfig*> fd_to_config;
     EventManager event_manager;
     bool running;
+    bool draining;
+    long drain_started_ms;
+    long gauges_updated_ms;
+    // Loop lag detection (loop_lag_warn): when the loop last woke up, and
+    // the warnings printed in the current second.
+    long loop_woke_us;
+    long lag_window_ms;
+    int lag_warnings;
+    int lag_suppressed;
+    std::vector<std::string> exec_args;
+    pid_t upgrade_pid;
+    int upgrade_notify_fd;
+    int child_fd;
+    Timers timers;
 
 public:
-    Server(const std::vector<ServerConfig>& _configs);
+    Server(const Config& config);
     ~Server();
     
     void start();
     void run();
     void stop();
+    bool reloadConfig();
+    void becomeWorker();
+    void beginDrain();
+    void setExecArgs(int argc, char** argv);
+    pid_t spawnUpgrade(int& notify_fd);
+    const GlobalConfig& getGlobalConfig() const { return snapshot->getGlobal(); }
     
 private:
+    void installSignalHandlers();
+    Socket* openListener(const ServerConfig& config);
     void acceptNewClient(int listen_fd);
     void handleClientRead(Client* client);
     void handleClientWrite(Client* client);
+    void sendContinue(Client* client);
     void removeClient(Client* client);
     
     void checkTimeouts();
+    void closeIdleClients();
+    void updateConnectionGauges();
+    void checkHandler(int fd, const char* handler, long began_us);
+    std::string describeFd(int fd);
+    size_t cgiCount() const;
+    void startUpgrade();
+    void handleUpgradeNotify();
+    void watchChildren();
+    void handleChildExit();
+    void handleTimers();
     
-    ServerConfig* getConfigForListenFd(int fd);
+    const ServerConfig* getConfigForListenFd(int fd);
 
     // CGI TOOLS
     std::map<int, CGIProcess*> active_cgis;
+    std::map<pid_t, CGIProcess*> cgi_pids;
+    std::map<int, CGIProcess*> streaming_cgis;
+    std::map<int, CGIProcess*> spliced_cgis;
 
-    void executeCGI(Client* client);
+    bool startCGI(Client* client);
+    bool executeCGI(Client* client);
+    bool launchCGI(Client* client, int pipeIn[2], int pipeOut[2], Zygote* zygote);
+    CGIProcess* trackCGI(Client* client, pid_t pid, int stdin_fd, int stdout_fd);
     void handleGCIEventPipe(int fd, const EventManager::Event& event);
     void readCGIOutput(CGIProcess* cgi);
     void writeCGIInput(CGIProcess* cgi);
+    void closeCGIStdin(CGIProcess* cgi);
+    void readCGIBody(Client* client);
+    void flowCGIBody(CGIProcess* cgi);
+    void startCGISplice(CGIProcess* cgi);
+    void startNPHResponse(CGIProcess* cgi);
+    void spliceCGIRest(CGIProcess* cgi, const std::string& head);
+    void spliceCGIOutput(CGIProcess* cgi);
+    void finishSplicedCGI(CGIProcess* cgi, bool complete);
     void completeCGI(CGIProcess* cgi);
-    void checkCGITimeout();
+    void terminateCGI(CGIProcess* cgi);
+    void finishExitedCGI(CGIProcess* cgi, int status);
+    void expireCGI(pid_t pid);
+    void sendCGIResponse(Client* client, HttpResponse& response);
+    void sendNPHOutput(Client* client, const std::string& output);
+
+    // FASTCGI
+    std::map<std::string, UpstreamPool*> upstream_pools;
+    std::map<int, FastCGIRequest*> fastcgi_requests;
+    // Replaced or dropped by a reload, alive until their last request ends.
+    std::vector<UpstreamPool*> retired_pools;
+
+    bool preparePools(const ConfigSnapshot* snap);
+    bool startFastCGI(Client* client);
+    bool dispatchFastCGI(Client* client, UpstreamPool* pool);
+    void handleFastCGIEvent(FastCGIRequest* req, const EventManager::Event& event);
+    void retryFastCGI(FastCGIRequest* req);
+    void finishFastCGI(FastCGIRequest* req, bool reusable, int error_code);
+    void abortFastCGI(int client_fd);
+    void pumpFastCGIQueue(UpstreamPool* pool);
+    void retirePool(UpstreamPool* pool);
+    void dropRetiredPool(UpstreamPool* pool);
+    void expireFastCGI(int upstream_fd);
+
+    // REVERSE PROXY
+    std::map<std::string, UpstreamGroup*> upstream_groups;
+    std::vector<UpstreamGroup*> retired_groups;
+    std::map<int, ProxyRequest*> proxy_requests;
+    std::map<int, ProxyRequest*> proxy_clients;
+
+    bool startProxy(Client* client);
+    bool connectProxy(ProxyRequest* req);
+    void handleProxyEvent(ProxyRequest* req, const EventManager::Event& event);
+    bool sendProxyRequest(ProxyRequest* req);
+    void readProxyResponse(ProxyRequest* req);
+    void startProxyResponse(ProxyRequest* req, Client* client);
+    void forwardProxyBody(ProxyRequest* req, Client* client, const char* data, size_t length);
+    void flowProxy(ProxyRequest* req);
+    void upstreamFailed(ProxyRequest* req, bool peer_failed);
+    void releaseUpstream(ProxyRequest* req, bool reusable);
+    void finishProxy(ProxyRequest* req, bool complete);
+    void failProxy(ProxyRequest* req, int code);
+    void abortProxy(int client_fd);
+    void expireProxy(int upstream_fd);
+
+    // CGI WORKER POOLS
+    std::map<std::string, CGIPool*> cgi_pools;
+    // Pools a reload replaced or dropped, until their workers are gone.
+    std::vector<CGIPool*> retired_cgi_pools;
+    std::map<int, CGIWorker*> pool_fds;
+
+    CGIPool* findCGIPool(Client* client);
+    bool startPooledCGI(Client* client, CGIPool* pool);
+    void watchWorker(CGIWorker* worker);
+    void handlePoolEvent(CGIWorker* worker, int fd, const EventManager::Event& event);
+    void finishPooledCGI(CGIWorker* worker, int error_code);
+    void retireWorker(CGIWorker* worker, bool kill_now);
+    void abortPooledCGI(int client_fd);
+    void expirePooledCGI(int from_worker);
+    void pumpCGIPoolQueue(CGIPool* pool);
+    void retireCGIPool(CGIPool* pool);
+    void maintainCGIPools();
+
+    // CGI CACHE
+    CGICache cgi_cache;
+    std::map<int, std::string> cache_fills;
+    std::map<int, std::string> cache_waits;
+
+    bool lookupCGICache(Client* client);
+    void serveCached(Client* client, const CacheEntry& entry, const char* status);
+    void endCacheFill(Client* client, HttpResponse* response, bool pass);
+
+    // CGI LIMITS
+    std::deque<CGIWaiter> cgi_queue;
+    std::map<std::string, size_t> cgi_running;
+    size_t cgi_running_total;
+
+    bool cgiSlotFree(Client* client);
+    void takeCGISlot(const std::string& slot_key);
+    void returnCGISlot(const std::string& slot_key);
+    void releaseCGISlot(CGIProcess* cgi);
+    void pumpCGIQueue();
+    void expireCGIQueue(int client_fd);
+
+    // ZYGOTES
+    std::map<std::string, Zygote*> zygotes;
+    // By control socket: the zygote, and its launches in request order.
+    std::map<int, Zygote*> zygote_fds;
+    std::map<int, std::deque<ZygoteLaunch> > zygote_launches;
+    // A zygote's child may exit before its pid is read from the socket: its
+    // status waits here (pid -> status) for the reply, while launches are
+    // pending.
+    std::map<pid_t, int> unclaimed_exits;
+    int next_launch_id;
+
+    Zygote* findZygote(Client* client);
+    void watchZygote(Zygote* zygote);
+    void handleZygoteEvent(int fd);
+    void finishZygoteLaunch(ZygoteLaunch& launch, pid_t pid);
+    void expireZygoteLaunch(int id);
+    bool zygoteLaunchesPending() const;
+    void killZygoteChild(pid_t pid);
 };
 
 #endif
\ No newline at end of file
@@ -16,11 +16,19 @@ Socket::~Socket() {
 }
 
 void Socket::create() {
-    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (fd == -1)
         throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
 }
 
+// Takes over an already bound and listening fd (inherited across a binary
+// upgrade) instead of creating a new one.
+void Socket::adopt(int _fd, const std::string& _host, int _port) {
+    fd = _fd;
+    host = _host;
+    port = _port;
+}
+
 void Socket::bind(const std::string& _host, int _port) {
     host = _host;
     port = _port;
@@ -56,17 +64,12 @@ int Socket::accept() {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     
-    int client_fd = ::accept(fd, (struct sockaddr*)&client_addr, &client_len);
+    // close-on-exec so CGI children never hold on to client connections
+    int client_fd = ::accept4(fd, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     
     if (client_fd == -1)
         return -1;
     
-    int flags = fcntl(client_fd, F_GETFL, 0);
-    if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        ::close(client_fd);
-        return -1;
-    }
-    
     return client_fd;
 }
 
@@ -22,6 +22,7 @@ public:
     ~Socket();
     
     void create();
+    void adopt(int _fd, const std::string& _host, int _port);
     void bind(const std::string& _host, int _port);
     void listen(int backlog = 128);
     int accept();
@@ -0,0 +1,79 @@
+#include "Timers.hpp"
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstring>
+
+Timers::Timers() : fd(-1), armed_for(-1) {}
+
+Timers::~Timers() {
+    if (fd != -1)
+        close(fd);
+}
+
+bool Timers::open() {
+    if (fd != -1)
+        return true;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    armed_for = -1;
+    arm();
+    return fd != -1;
+}
+
+long Timers::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Re-arms only when the earliest deadline changed; an empty set disarms.
+void Timers::arm() {
+    long next = deadlines.empty() ? 0 : deadlines.begin()->first;
+    if (fd == -1 || next == armed_for)
+        return;
+
+    struct itimerspec spec;
+    std::memset(&spec, 0, sizeof(spec));
+    if (next > 0) {
+        spec.it_value.tv_sec = next / 1000;
+        spec.it_value.tv_nsec = (next % 1000) * 1000000L;
+    }
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    armed_for = next;
+}
+
+Timers::Handle Timers::add(long deadline_ms, Kind kind, int id) {
+    Entry entry;
+    entry.kind = kind;
+    entry.id = id;
+    if (deadline_ms <= 0)
+        deadline_ms = 1;
+    Handle handle = deadlines.insert(std::make_pair(deadline_ms, entry));
+    arm();
+    return handle;
+}
+
+void Timers::cancel(Handle& handle) {
+    if (handle == deadlines.end())
+        return;
+    deadlines.erase(handle);
+    handle = deadlines.end();
+    arm();
+}
+
+// Everything due by now_ms, in deadline order. Callers must not cancel the
+// returned entries' handles (they are already gone).
+std::vector<Timers::Entry> Timers::expire(long now_ms) {
+    unsigned long long ticks;
+    while (fd != -1 && read(fd, &ticks, sizeof(ticks)) > 0)
+        ;
+
+    std::vector<Entry> due;
+    while (!deadlines.empty() && deadlines.begin()->first <= now_ms) {
+        due.push_back(deadlines.begin()->second);
+        deadlines.erase(deadlines.begin());
+    }
+    armed_for = -1;
+    arm();
+    return due;
+}
@@ -0,0 +1,55 @@
+#ifndef TIMERS_HPP
+#define TIMERS_HPP
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+// Deadlines for the event loop. They live in a multimap ordered by
+// CLOCK_MONOTONIC milliseconds, and a single timerfd is kept armed for the
+// earliest one, so a deadline fires on time even when nothing else happens.
+class Timers {
+public:
+    enum Kind {
+        CGI_DEADLINE,
+        PROXY_DEADLINE,
+        FASTCGI_DEADLINE,
+        POOL_DEADLINE,
+        CGI_QUEUE_DEADLINE,
+        ZYGOTE_DEADLINE
+    };
+
+    struct Entry {
+        Kind kind;
+        int id;
+    };
+
+    typedef std::multimap<long, Entry>::iterator Handle;
+
+private:
+    int fd;
+    std::multimap<long, Entry> deadlines;
+    long armed_for;
+
+    Timers(const Timers&);
+    Timers& operator=(const Timers&);
+
+    void arm();
+
+public:
+    Timers();
+    ~Timers();
+
+    bool open();
+    int getFd() const { return fd; }
+    size_t size() const { return deadlines.size(); }
+    Handle none() { return deadlines.end(); }
+
+    Handle add(long deadline_ms, Kind kind, int id);
+    void cancel(Handle& handle);
+    std::vector<Entry> expire(long now_ms);
+
+    static long now();
+};
+
+#endif
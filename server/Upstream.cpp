@@ -0,0 +1,283 @@
+#include "Upstream.hpp"
+#include "../parsing/Utils.hpp"
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+UpstreamAddress::UpstreamAddress() : family(AF_UNSPEC), addr_len(0) {
+    std::memset(&addr, 0, sizeof(addr));
+}
+
+bool parseUpstreamAddress(const std::string& spec, UpstreamAddress& out) {
+    out = UpstreamAddress();
+    out.name = spec;
+    
+    if (spec.compare(0, 5, "unix:") == 0) {
+        std::string path = spec.substr(5);
+        struct sockaddr_un* un = reinterpret_cast<struct sockaddr_un*>(&out.addr);
+        if (path.empty() || path.length() >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        std::strcpy(un->sun_path, path.c_str());
+        out.family = AF_UNIX;
+        out.addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+    
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+    std::string host = spec.substr(0, colon);
+    std::string port = spec.substr(colon + 1);
+    if (!Utils::isNumber(port) || std::atoi(port.c_str()) < 1 || std::atoi(port.c_str()) > 65535)
+        return false;
+    if (host == "localhost")
+        host = "127.0.0.1";
+    
+    // Resolved once at config time, never from the event loop.
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+        return false;
+    std::memcpy(&out.addr, res->ai_addr, res->ai_addrlen);
+    out.addr_len = res->ai_addrlen;
+    out.family = AF_INET;
+    freeaddrinfo(res);
+    return true;
+}
+
+UpstreamPool::UpstreamPool(const UpstreamAddress& _address, size_t _max_conns, size_t _max_idle)
+    : address(_address), max_conns(_max_conns), max_idle(_max_idle), active(0) {}
+
+bool UpstreamPool::matches(const UpstreamAddress& _address, size_t _max_conns, size_t _max_idle) const {
+    return address.family == _address.family && address.addr_len == _address.addr_len &&
+           std::memcmp(&address.addr, &_address.addr, address.addr_len) == 0 &&
+           max_conns == _max_conns && max_idle == _max_idle;
+}
+
+UpstreamPool::~UpstreamPool() {
+    for (size_t i = 0; i < idle.size(); i++)
+        ::close(idle[i]);
+}
+
+int UpstreamPool::connectNew() {
+    int fd = ::socket(address.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (::connect(fd, reinterpret_cast<const struct sockaddr*>(&address.addr), address.addr_len) == -1
+        && errno != EINPROGRESS) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// Returns a connected (or connecting) fd, or -1 with errno set: EAGAIN when
+// the pool is at max_conns, the connect error otherwise.
+int UpstreamPool::acquire(bool& reused) {
+    while (!idle.empty()) {
+        int fd = idle.back();
+        idle.pop_back();
+        
+        // The backend may have closed it while it sat idle.
+        char c;
+        ssize_t n = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            active++;
+            reused = true;
+            return fd;
+        }
+        ::close(fd);
+    }
+    
+    if (atLimit()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int fd = connectNew();
+    if (fd != -1) {
+        active++;
+        reused = false;
+    }
+    return fd;
+}
+
+void UpstreamPool::release(int fd, bool reusable) {
+    if (active > 0)
+        active--;
+    if (reusable && idle.size() < max_idle)
+        idle.push_back(fd);
+    else
+        ::close(fd);
+}
+
+// FNV-1a with a murmur3 finalizer, so near-identical strings ("host:port-1",
+// "host:port-2") still land all over the ring.
+static unsigned int hashString(const std::string& str) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < str.length(); i++) {
+        h ^= static_cast<unsigned char>(str[i]);
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Points per unit of weight on the hash ring.
+static const int RING_POINTS = 40;
+
+UpstreamGroup::UpstreamGroup(const std::string& _name, Balance _balance, const std::string& _hash_key)
+    : name(_name), balance(_balance), hash_key(_hash_key) {}
+
+UpstreamGroup::~UpstreamGroup() {
+    for (size_t i = 0; i < peers.size(); i++)
+        delete peers[i].pool;
+}
+
+// Resolves every server up front; NULL if one of them does not resolve.
+UpstreamGroup* UpstreamGroup::create(const UpstreamConfig& config) {
+    Balance balance = ROUND_ROBIN;
+    if (config.balance == "least_conn")
+        balance = LEAST_CONN;
+    else if (config.balance == "hash")
+        balance = HASH;
+    
+    UpstreamGroup* group = new UpstreamGroup(config.name, balance, config.hash_key);
+    group->signature = signatureOf(config);
+    for (size_t i = 0; i < config.servers.size(); i++) {
+        const UpstreamServerConfig& server = config.servers[i];
+        UpstreamAddress address;
+        if (!parseUpstreamAddress(server.address, address)) {
+            delete group;
+            return NULL;
+        }
+        UpstreamPeer peer;
+        peer.pool = new UpstreamPool(address, 0, config.keepalive);
+        peer.weight = server.weight;
+        peer.current_weight = 0;
+        peer.max_fails = server.max_fails;
+        peer.fail_timeout_ms = server.fail_timeout_ms;
+        peer.fails = 0;
+        peer.fails_since_ms = 0;
+        peer.down_until_ms = 0;
+        group->peers.push_back(peer);
+        
+        for (int j = 0; j < server.weight * RING_POINTS; j++) {
+            std::ostringstream point;
+            point << server.address << "-" << j;
+            group->ring.push_back(std::make_pair(hashString(point.str()), i));
+        }
+    }
+    std::sort(group->ring.begin(), group->ring.end());
+    return group;
+}
+
+// Everything that changes how the group behaves; a reload that changes it
+// gets a new group.
+std::string UpstreamGroup::signatureOf(const UpstreamConfig& config) {
+    std::ostringstream sig;
+    sig << config.name << " " << config.balance << " " << config.hash_key << " " << config.keepalive;
+    for (size_t i = 0; i < config.servers.size(); i++) {
+        const UpstreamServerConfig& server = config.servers[i];
+        sig << " " << server.address << "/" << server.weight << "/" << server.max_fails
+            << "/" << server.fail_timeout_ms;
+    }
+    return sig.str();
+}
+
+// A lone server is never taken out of rotation: there is nothing better to
+// send the request to.
+bool UpstreamGroup::available(size_t i, long now_ms, const std::vector<bool>& tried) const {
+    if (i < tried.size() && tried[i])
+        return false;
+    return peers.size() == 1 || peers[i].down_until_ms <= now_ms;
+}
+
+// Returns the peer index, or -1 when every server is down or already tried.
+int UpstreamGroup::select(const std::string& key, long now_ms, const std::vector<bool>& tried) {
+    if (balance == HASH)
+        return pickHash(key, now_ms, tried);
+    return pickRoundRobin(now_ms, tried, balance == LEAST_CONN);
+}
+
+int UpstreamGroup::pickRoundRobin(long now_ms, const std::vector<bool>& tried, bool least_conn) {
+    size_t least_active = 0;
+    int least_weight = 0;
+    if (least_conn) {
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (!available(i, now_ms, tried))
+                continue;
+            size_t active = peers[i].pool->activeCount();
+            if (least_weight == 0 || active * least_weight < least_active * peers[i].weight) {
+                least_active = active;
+                least_weight = peers[i].weight;
+            }
+        }
+    }
+    
+    int best = -1;
+    int total = 0;
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (!available(i, now_ms, tried))
+            continue;
+        if (least_conn && peers[i].pool->activeCount() * least_weight != least_active * peers[i].weight)
+            continue;
+        peers[i].current_weight += peers[i].weight;
+        total += peers[i].weight;
+        if (best == -1 || peers[i].current_weight > peers[best].current_weight)
+            best = i;
+    }
+    if (best != -1)
+        peers[best].current_weight -= total;
+    return best;
+}
+
+int UpstreamGroup::pickHash(const std::string& key, long now_ms, const std::vector<bool>& tried) {
+    if (ring.empty())
+        return -1;
+    std::vector<std::pair<unsigned int, size_t> >::iterator it =
+        std::lower_bound(ring.begin(), ring.end(), std::make_pair(hashString(key), static_cast<size_t>(0)));
+    for (size_t n = 0; n < ring.size(); n++, ++it) {
+        if (it == ring.end())
+            it = ring.begin();
+        if (available(it->second, now_ms, tried))
+            return it->second;
+    }
+    return -1;
+}
+
+// A connect error, reset or timeout. True when it took the server down.
+bool UpstreamGroup::failed(size_t i, long now_ms) {
+    UpstreamPeer& peer = peers[i];
+    if (peer.max_fails == 0)
+        return false;
+    if (now_ms - peer.fails_since_ms > peer.fail_timeout_ms) {
+        peer.fails = 0;
+        peer.fails_since_ms = now_ms;
+    }
+    if (++peer.fails < peer.max_fails)
+        return false;
+    peer.fails = 0;
+    peer.down_until_ms = now_ms + peer.fail_timeout_ms;
+    return true;
+}
+
+void UpstreamGroup::succeeded(size_t i) {
+    peers[i].fails = 0;
+}
@@ -0,0 +1,113 @@
+#ifndef UPSTREAM_HPP
+#define UPSTREAM_HPP
+
+#include "../parsing/Config.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/socket.h>
+
+// Where a backend listens: "unix:/path/to.sock" or "host:port".
+struct UpstreamAddress {
+    int family;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    std::string name;
+    
+    UpstreamAddress();
+};
+
+bool parseUpstreamAddress(const std::string& spec, UpstreamAddress& out);
+
+// Non-blocking connections to one backend address. Connections are kept
+// around (up to max_idle) for reuse, and never more than max_conns exist at
+// once; clients that hit the limit wait in the queue.
+class UpstreamPool {
+private:
+    UpstreamAddress address;
+    size_t max_conns;
+    size_t max_idle;
+    size_t active;
+    std::vector<int> idle;
+    
+    UpstreamPool(const UpstreamPool&);
+    UpstreamPool& operator=(const UpstreamPool&);
+    
+public:
+    std::deque<int> waiting;
+    
+    UpstreamPool(const UpstreamAddress& _address, size_t _max_conns, size_t _max_idle);
+    ~UpstreamPool();
+    
+    int acquire(bool& reused);
+    void release(int fd, bool reusable);
+    bool atLimit() const { return max_conns > 0 && active >= max_conns; }
+    size_t activeCount() const { return active; }
+    size_t idleCount() const { return idle.size(); }
+    const UpstreamAddress& getAddress() const { return address; }
+    // Same resolved address and limits: a reload can keep this pool.
+    bool matches(const UpstreamAddress& _address, size_t _max_conns, size_t _max_idle) const;
+    
+private:
+    int connectNew();
+};
+
+// One backend of an upstream group. Health is passive: max_fails errors or
+// timeouts within fail_timeout take it out of rotation for fail_timeout.
+struct UpstreamPeer {
+    UpstreamPool* pool;
+    int weight;
+    int current_weight;
+    int max_fails;
+    long fail_timeout_ms;
+    int fails;
+    long fails_since_ms;
+    long down_until_ms;
+};
+
+// The backends behind a proxy_pass, and which one gets the next request:
+// smooth weighted round-robin, least connections (per weight, ties going
+// round-robin), or a consistent hash ring so most keys stay put when a
+// server is added, removed or down.
+class UpstreamGroup {
+public:
+    enum Balance {
+        ROUND_ROBIN,
+        LEAST_CONN,
+        HASH
+    };
+
+private:
+    std::string name;
+    std::string signature;
+    Balance balance;
+    std::string hash_key;
+    std::vector<UpstreamPeer> peers;
+    std::vector<std::pair<unsigned int, size_t> > ring;
+
+    UpstreamGroup(const std::string& _name, Balance _balance, const std::string& _hash_key);
+    UpstreamGroup(const UpstreamGroup&);
+    UpstreamGroup& operator=(const UpstreamGroup&);
+
+    bool available(size_t i, long now_ms, const std::vector<bool>& tried) const;
+    int pickRoundRobin(long now_ms, const std::vector<bool>& tried, bool least_conn);
+    int pickHash(const std::string& key, long now_ms, const std::vector<bool>& tried);
+
+public:
+    ~UpstreamGroup();
+
+    static UpstreamGroup* create(const UpstreamConfig& config);
+    static std::string signatureOf(const UpstreamConfig& config);
+
+    int select(const std::string& key, long now_ms, const std::vector<bool>& tried);
+    bool failed(size_t i, long now_ms);
+    void succeeded(size_t i);
+
+    UpstreamPeer& peer(size_t i) { return peers[i]; }
+    size_t size() const { return peers.size(); }
+    const std::string& getName() const { return name; }
+    const std::string& getSignature() const { return signature; }
+    const std::string& getHashKey() const { return hash_key; }
+};
+
+#endif
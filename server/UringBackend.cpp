@@ -0,0 +1,220 @@
+#include "UringBackend.hpp"
+#include "Metrics.hpp"
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+// A poll request is known by its generation and fd; POLL_REMOVE requests
+// carry 0, which no poll request has (generations start at 1).
+static uint64_t pollKey(uint32_t generation, int fd) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+UringBackend::UringBackend()
+    : ring_fd(-1), ring_memory(NULL), ring_size(0), sqes(NULL), sq_entries(0), sq_head(NULL), sq_tail(NULL),
+      sq_mask(NULL), sq_array(NULL), cq_head(NULL), cq_tail(NULL), cq_mask(NULL), cqes(NULL),
+      next_generation(0) {}
+
+UringBackend* UringBackend::create() {
+    UringBackend* backend = new UringBackend();
+    if (!backend->setup(1024)) {
+        delete backend;
+        return NULL;
+    }
+    return backend;
+}
+
+UringBackend::~UringBackend() {
+    if (sqes)
+        munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (ring_memory)
+        munmap(ring_memory, ring_size);
+    if (ring_fd != -1)
+        ::close(ring_fd);
+}
+
+// The completion queue is sized for a poll completing on every watched fd
+// at once; beyond that the kernel keeps the overflow (IORING_FEAT_NODROP).
+bool UringBackend::setup(unsigned entries) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd == -1)
+        return false;
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed)
+        return false;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    void* memory = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (memory == MAP_FAILED)
+        return false;
+    ring_memory = memory;
+    sq_entries = params.sq_entries;
+    memory = mmap(NULL, sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (memory == MAP_FAILED)
+        return false;
+    sqes = static_cast<struct io_uring_sqe*>(memory);
+
+    char* base = static_cast<char*>(ring_memory);
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+    return true;
+}
+
+// Requests pile up until the next wait; a full queue is submitted early.
+struct io_uring_sqe* UringBackend::nextSqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        enter(0, 0);
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            throw std::runtime_error("io_uring submission queue stuck full");
+    }
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    return sqe;
+}
+
+// Submits what is queued and, with min_complete, waits up to timeout_ms
+// for completions. A timeout, a signal or a busy completion queue are not
+// errors: whatever completed is reaped either way.
+int UringBackend::enter(unsigned min_complete, int timeout_ms) {
+    unsigned pending = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec timeout;
+    std::memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uintptr_t>(&timeout);
+        }
+    }
+    Metrics::eventSyscall();
+    long result = syscall(__NR_io_uring_enter, ring_fd, pending, min_complete, flags, &arg, sizeof(arg));
+    if (result == -1 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        throw std::runtime_error("io_uring_enter() failed: " + std::string(strerror(errno)));
+    return static_cast<int>(result);
+}
+
+void UringBackend::arm(int fd) {
+    Watch& watch = watches[fd];
+    if (!watch.watched || watch.armed)
+        return;
+    if (++next_generation == 0)
+        next_generation = 1;
+    watch.generation = next_generation;
+    watch.armed = true;
+
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = watch.events | POLLERR | POLLHUP;
+    sqe->user_data = pollKey(watch.generation, fd);
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+void UringBackend::add(int fd, uint32_t events) {
+    if (static_cast<size_t>(fd) >= watches.size()) {
+        Watch none = { false, false, 0, 0 };
+        watches.resize(fd + 1, none);
+    }
+    Watch& watch = watches[fd];
+    watch.watched = true;
+    watch.armed = false;
+    watch.events = events;
+    unarmed.push_back(fd);
+}
+
+// The armed request is cancelled and a new one made with the next wait.
+void UringBackend::modify(int fd, uint32_t events) {
+    Watch& watch = watches[fd];
+    watch.events = events;
+    if (!watch.armed)
+        return;
+    remove(fd);
+    watch.watched = true;
+    unarmed.push_back(fd);
+}
+
+void UringBackend::remove(int fd) {
+    if (static_cast<size_t>(fd) >= watches.size())
+        return;
+    Watch& watch = watches[fd];
+    if (watch.armed) {
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = pollKey(watch.generation, fd);
+        sqe->user_data = 0;
+        __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    }
+    watch.watched = false;
+    watch.armed = false;
+}
+
+void UringBackend::wait(int timeout_ms, std::vector<Event>& events) {
+    for (size_t i = 0; i < unarmed.size(); i++)
+        arm(unarmed[i]);
+    unarmed.clear();
+
+    // Completions already waiting are taken without a wait; with nothing
+    // queued either, without a syscall at all.
+    bool completed = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+    bool queued = *sq_tail != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (!completed || queued)
+        enter(completed ? 0 : 1, timeout_ms);
+    reap(events);
+}
+
+void UringBackend::reap(std::vector<Event>& events) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe& cqe = cqes[head & *cq_mask];
+        int fd = static_cast<int>(cqe.user_data & 0xffffffffu);
+        uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+        if (generation == 0 || static_cast<size_t>(fd) >= watches.size())
+            continue;
+        Watch& watch = watches[fd];
+        if (!watch.watched || !watch.armed || watch.generation != generation)
+            continue;
+        watch.armed = false;
+        unarmed.push_back(fd);
+
+        Event e;
+        e.fd = fd;
+        if (cqe.res < 0) {
+            e.readable = false;
+            e.writable = false;
+            e.error = true;
+        }
+        else {
+            e.readable = (cqe.res & POLLIN) != 0;
+            e.writable = (cqe.res & POLLOUT) != 0;
+            e.error = (cqe.res & (POLLERR | POLLHUP | POLLRDHUP)) != 0;
+        }
+        events.push_back(e);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
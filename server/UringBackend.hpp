@@ -0,0 +1,68 @@
+#ifndef URINGBACKEND_HPP
+#define URINGBACKEND_HPP
+
+#include "EventBackend.hpp"
+#include <linux/io_uring.h>
+#include <cstddef>
+
+// Readiness through io_uring: every watched fd has a one-shot poll request
+// in the ring, re-armed after it completes (so readiness that was not
+// consumed is reported again, as with level-triggered epoll). Interest
+// changes, re-arms and the wait all go to the kernel in a single
+// io_uring_enter per loop iteration.
+//
+// Needs Linux 5.11 (IORING_FEAT_EXT_ARG for the wait timeout); create()
+// returns NULL where io_uring is missing or too old.
+class UringBackend : public EventBackend {
+private:
+    struct Watch {
+        bool watched;
+        bool armed;
+        uint32_t events;
+        // Identifies the fd's current poll request; completions of older
+        // ones (cancelled, or for an earlier fd with the same number) are
+        // dropped.
+        uint32_t generation;
+    };
+
+    int ring_fd;
+    void* ring_memory;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_queued;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    std::vector<Watch> watches;
+    std::vector<int> unarmed;
+    uint32_t next_generation;
+
+    UringBackend();
+    UringBackend(const UringBackend&);
+    UringBackend& operator=(const UringBackend&);
+
+    bool setup(unsigned entries);
+    struct io_uring_sqe* nextSqe();
+    int enter(unsigned min_complete, int timeout_ms);
+    void arm(int fd);
+    void reap(std::vector<Event>& events);
+
+public:
+    static UringBackend* create();
+    ~UringBackend();
+
+    const char* name() const { return "io_uring"; }
+    void add(int fd, uint32_t events);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+    void wait(int timeout_ms, std::vector<Event>& events);
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "Zygote.hpp"
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+extern char** environ;
+
+Zygote::Zygote(const std::string& interpreter, const std::string& script)
+    : pid(-1), control_fd(-1), started_at(0) {
+    if (!interpreter.empty())
+        argv.push_back(interpreter);
+    argv.push_back(script);
+}
+
+Zygote::~Zygote() {
+    stop();
+}
+
+bool Zygote::start() {
+    started_at = time(NULL);
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return false;
+    if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    // Children of the zygote are orphaned on purpose and must land on us.
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char*> args;
+    for (size_t i = 0; i < argv.size(); i++)
+        args.push_back(const_cast<char*>(argv[i].c_str()));
+    args.push_back(NULL);
+
+    int err = posix_spawn(&pid, args[0], &actions, &attr, &args[0], environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+
+    if (err != 0) {
+        close(sv[0]);
+        pid = -1;
+        errno = err;
+        return false;
+    }
+    control_fd = sv[0];
+    return true;
+}
+
+void Zygote::stop() {
+    if (control_fd != -1)
+        close(control_fd);
+    control_fd = -1;
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    pid = -1;
+}
+
+bool Zygote::isRunning() {
+    if (pid <= 0)
+        return false;
+    // ECHILD: the server's SIGCHLD handler already reaped it.
+    pid_t reaped = waitpid(pid, NULL, WNOHANG);
+    if (reaped == pid || (reaped == -1 && errno == ECHILD)) {
+        pid = -1;
+        stop();
+        return false;
+    }
+    return true;
+}
+
+bool Zygote::childExited(pid_t reaped) {
+    if (reaped <= 0 || reaped != pid)
+        return false;
+    pid = -1;
+    stop();
+    return true;
+}
+
+// Queues a request without waiting for the fork. False when the zygote
+// cannot take it: not running, its socket failed (it is then stopped and
+// restarted later) or full; the caller falls back to posix_spawn.
+bool Zygote::send(const std::string& script, const std::vector<std::string>& env,
+                  int stdin_fd, int stdout_fd) {
+    if (!isRunning())
+        return false;
+
+    std::string message = script;
+    message += '\0';
+    for (size_t i = 0; i < env.size(); i++) {
+        message += env[i];
+        message += '\0';
+    }
+
+    int fds[2] = { stdin_fd, stdout_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    std::memset(control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(message.data());
+    iov.iov_len = message.length();
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(control_fd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            stop();
+        return false;
+    }
+    return true;
+}
+
+// The reply to the oldest request still unanswered: the child's pid, or -1
+// when the zygote could not fork it. False when no reply is waiting; if the
+// socket failed or was closed the zygote is stopped as well.
+bool Zygote::receive(pid_t& child) {
+    if (control_fd == -1)
+        return false;
+    char reply[32];
+    ssize_t n = recv(control_fd, reply, sizeof(reply) - 1, 0);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            stop();
+        return false;
+    }
+    reply[n] = '\0';
+    child = std::atoi(reply);
+    if (child <= 0)
+        child = -1;
+    return true;
+}
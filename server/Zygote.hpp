@@ -0,0 +1,44 @@
+#ifndef ZYGOTE_HPP
+#define ZYGOTE_HPP
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <ctime>
+
+// A pre-initialized interpreter (cgi/zygote.py) that forks a child per CGI
+// request. We send the script path, the environment and the two pipe ends
+// over a SOCK_SEQPACKET socket (the fds as SCM_RIGHTS); it answers with the
+// child's pid. The child is double-forked and reparented to us, so waitpid
+// and kill work on it exactly as on a posix_spawn'ed CGI.
+//
+// The socket is nonblocking: requests are sent without waiting, and the
+// replies, one per request and in the same order, are read once the socket
+// turns readable in the event loop.
+class Zygote {
+private:
+    std::vector<std::string> argv;
+    pid_t pid;
+    int control_fd;
+    time_t started_at;
+
+    Zygote(const Zygote&);
+    Zygote& operator=(const Zygote&);
+
+public:
+    Zygote(const std::string& interpreter, const std::string& script);
+    ~Zygote();
+
+    bool start();
+    void stop();
+    bool isRunning();
+    // The server reaped `reaped`; true (and the zygote is shut) if it was ours.
+    bool childExited(pid_t reaped);
+    bool startedRecently() const { return time(NULL) - started_at < 1; }
+    int getFd() const { return control_fd; }
+    bool send(const std::string& script, const std::vector<std::string>& env,
+              int stdin_fd, int stdout_fd);
+    bool receive(pid_t& child);
+};
+
+#endif